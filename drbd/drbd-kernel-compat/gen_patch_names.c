@@ -514,6 +514,9 @@ int main(int argc, char **argv)
 	patch(1, "bdev_discard_granularity", true, false,
 	      COMPAT_HAVE_BDEV_DISCARD_GRANULARITY, "present");
 
+	patch(1, "bdev_write_cache", true, false,
+	      COMPAT_HAVE_BDEV_WRITE_CACHE, "present");
+
 	patch(1, "bdevname", false, true,
 	      COMPAT_HAVE_BDEVNAME, "present");
 
@@ -544,9 +547,30 @@ int main(int argc, char **argv)
 	patch(1, "sk_use_task_frag", true, false,
 	      COMPAT_HAVE_SK_USE_TASK_FRAG, "present");
 
+	patch(1, "msg_splice_pages", true, false,
+	      COMPAT_HAVE_MSG_SPLICE_PAGES, "present");
+
+	patch(1, "iter_dest", true, false,
+	      COMPAT_HAVE_ITER_DEST, "present");
+
 	patch(1, "timer_shutdown", true, false,
 	      COMPAT_HAVE_TIMER_SHUTDOWN, "present");
 
+	patch(1, "shrinker_alloc", true, false,
+	      COMPAT_HAVE_SHRINKER_ALLOC, "present");
+
+	patch(1, "net_handshake_h", true, false,
+	      COMPAT_HAVE_NET_HANDSHAKE_H, "present");
+
+	patch(1, "mptcp_diag_fill_info", true, false,
+	      COMPAT_HAVE_MPTCP_DIAG_FILL_INFO, "present");
+
+#if !defined(COMPAT_HAVE_SHRINKER_ALLOC)
+	/* after shrinker_alloc, which introduces register_shrinker() */
+	patch(1, "register_shrinker", true, false,
+	      COMPAT_REGISTER_SHRINKER_HAS_NAME, "has_name");
+#endif
+
 /* #define BLKDEV_ISSUE_ZEROOUT_EXPORTED */
 /* #define BLKDEV_ZERO_NOUNMAP */
 
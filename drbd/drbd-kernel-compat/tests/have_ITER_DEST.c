@@ -0,0 +1,8 @@
+/* { "version": "v6.1-rc1", "commit": "de4eda9de2d957ef2d6a8365a01e26a435e958cb", "comment": "READ/WRITE iov_iter directions got the names ITER_DEST/ITER_SOURCE", "author": "Al Viro <viro@zeniv.linux.org.uk>", "date": "Thu Sep 15 20:25:47 2022 -0400" } */
+
+#include <linux/uio.h>
+
+int foo(void)
+{
+	return ITER_DEST;
+}
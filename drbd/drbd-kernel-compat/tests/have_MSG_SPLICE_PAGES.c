@@ -0,0 +1,8 @@
+/* { "version": "v6.5-rc1", "commit": "b841b901c452d92610f739a36e54978453528876", "comment": "MSG_SPLICE_PAGES was introduced to replace sendpage()", "author": "David Howells <dhowells@redhat.com>", "date": "Mon May 22 13:11:10 2023 +0100" } */
+
+#include <linux/socket.h>
+
+int foo(void)
+{
+	return MSG_SPLICE_PAGES;
+}
@@ -0,0 +1,8 @@
+/* { "version": "v5.19-rc1", "comment": "The bdev_write_cache helper was added", "author": "Christoph Hellwig <hch@lst.de>" } */
+
+#include <linux/blkdev.h>
+
+bool foo(struct block_device *bdev)
+{
+	return bdev_write_cache(bdev);
+}
@@ -0,0 +1,8 @@
+/* { "version": "v5.16-rc1", "comment": "mptcp_diag_fill_info() is declared in net/mptcp.h and exported for the MPTCP_INFO getsockopt", "author": "Florian Westphal <fw@strlen.de>" } */
+
+#include <net/mptcp.h>
+
+void foo(struct sock *sk, struct mptcp_info *info)
+{
+	mptcp_diag_fill_info((struct mptcp_sock *)sk, info);
+}
@@ -0,0 +1,8 @@
+/* { "version": "v6.4-rc1", "comment": "net/handshake: in-kernel TLS handshake requests, served by tlshd", "author": "Chuck Lever <chuck.lever@oracle.com>" } */
+
+#include <net/handshake.h>
+
+int foo(struct tls_handshake_args *args)
+{
+	return tls_client_hello_x509(args, GFP_KERNEL);
+}
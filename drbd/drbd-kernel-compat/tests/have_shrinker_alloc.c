@@ -0,0 +1,8 @@
+/* { "version": "v6.7-rc1", "commit": "c42d50aefd17a6bad3ed617769edbbb579137545", "comment": "shrinker_alloc() and shrinker_register() replace register_shrinker()", "author": "Qi Zheng <zhengqi.arch@bytedance.com>", "date": "Mon Sep 11 17:44:01 2023 +0800" } */
+
+#include <linux/shrinker.h>
+
+struct shrinker *foo(void)
+{
+	return shrinker_alloc(0, "foo");
+}
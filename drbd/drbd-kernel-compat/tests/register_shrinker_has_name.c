@@ -0,0 +1,8 @@
+/* { "version": "v6.0-rc1", "commit": "e33c267ab70de4249d22d7eab1cc7d68a889bade", "comment": "register_shrinker() gained a printf style name argument", "author": "Roman Gushchin <roman.gushchin@linux.dev>", "date": "Tue May 31 20:22:24 2022 -0700" } */
+
+#include <linux/shrinker.h>
+
+int foo(struct shrinker *s)
+{
+	return register_shrinker(s, "foo");
+}
@@ -16,9 +16,12 @@
 #include <linux/drbd.h>
 #include <linux/drbd_limits.h>
 #include <linux/dynamic_debug.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
 #include "drbd_int.h"
 #include "drbd_meta_data.h"
 #include "drbd_dax_pmem.h"
+#include "drbd_trace.h"
 
 struct update_peers_work {
        struct drbd_work w;
@@ -26,13 +29,17 @@ struct update_peers_work {
        unsigned int enr;
 };
 
-void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
+/* Each struct drbd_md_io is one buffer. The activity log and the super
+ * block have their own, so a super block write does not wait for an
+ * activity log transaction, and vice versa. */
+void *__drbd_md_get_buffer(struct drbd_device *device, struct drbd_md_io *md_io,
+			   const char *intent)
 {
 	int r;
 	long t;
 
 	t = wait_event_timeout(device->misc_wait,
-			(r = atomic_cmpxchg(&device->md_io.in_use, 0, 1)) == 0 ||
+			(r = atomic_cmpxchg(&md_io->in_use, 0, 1)) == 0 ||
 			device->disk_state[NOW] <= D_FAILED,
 			HZ * 10);
 
@@ -41,20 +48,20 @@ void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
 
 	if (r) {
 		drbd_err(device, "Failed to get md_buffer for %s, currently in use by %s\n",
-			 intent, device->md_io.current_use);
+			 intent, md_io->current_use);
 		return NULL;
 	}
 
-	device->md_io.current_use = intent;
-	device->md_io.start_jif = jiffies;
-	device->md_io.submit_jif = device->md_io.start_jif - 1;
-	return page_address(device->md_io.page);
+	md_io->current_use = intent;
+	md_io->start_jif = jiffies;
+	md_io->submit_jif = md_io->start_jif - 1;
+	return page_address(md_io->page);
 }
 
-void drbd_md_put_buffer(struct drbd_device *device)
+void __drbd_md_put_buffer(struct drbd_md_io *md_io)
 {
-	if (atomic_dec_and_test(&device->md_io.in_use))
-		wake_up(&device->misc_wait);
+	if (atomic_dec_and_test(&md_io->in_use))
+		wake_up(&md_io->device->misc_wait);
 }
 
 void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_backing_dev *bdev,
@@ -77,7 +84,7 @@ void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_b
 	}
 }
 
-static int _drbd_md_sync_page_io(struct drbd_device *device,
+static int _drbd_md_sync_page_io(struct drbd_device *device, struct drbd_md_io *md_io,
 				 struct drbd_backing_dev *bdev,
 				 sector_t sector, enum req_op op)
 {
@@ -87,20 +94,25 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	int err;
 	blk_opf_t op_flags = 0;
 
-	if ((op == REQ_OP_WRITE) && !test_bit(MD_NO_FUA, &device->flags))
+	/* Without a volatile write cache (e.g. NVMe with power loss
+	 * protection), a completed write is already stable.  The block layer
+	 * would strip the flags anyway, but only after the flush machinery
+	 * had a look at the request. */
+	if ((op == REQ_OP_WRITE) && !test_bit(MD_NO_FUA, &device->flags) &&
+	    bdev_write_cache(bdev->md_bdev))
 		op_flags |= REQ_FUA | REQ_PREFLUSH;
 	op_flags |= REQ_META | REQ_SYNC;
 
-	device->md_io.done = 0;
-	device->md_io.error = -ENODEV;
+	md_io->done = 0;
+	md_io->error = -ENODEV;
 
 	bio = bio_alloc_bioset(bdev->md_bdev, 1, op | op_flags,
 		GFP_NOIO, &drbd_md_io_bio_set);
 	bio->bi_iter.bi_sector = sector;
 	err = -EIO;
-	if (bio_add_page(bio, device->md_io.page, size, 0) != size)
+	if (bio_add_page(bio, md_io->page, size, 0) != size)
 		goto out;
-	bio->bi_private = device;
+	bio->bi_private = md_io;
 	bio->bi_end_io = drbd_md_endio;
 
 	if (op != REQ_OP_WRITE && device->disk_state[NOW] == D_DISKLESS && device->ldev == NULL)
@@ -114,26 +126,26 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	}
 
 	bio_get(bio); /* one bio_put() is in the completion handler */
-	atomic_inc(&device->md_io.in_use); /* drbd_md_put_buffer() is in the completion handler */
-	device->md_io.submit_jif = jiffies;
+	atomic_inc(&md_io->in_use); /* drbd_md_put_buffer() is in the completion handler */
+	md_io->submit_jif = jiffies;
 	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
-	} else {
+	} else if (!drbd_delay_bio(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD, bio)) {
 		submit_bio(bio);
 	}
-	wait_until_done_or_force_detached(device, bdev, &device->md_io.done);
-	err = device->md_io.error;
+	wait_until_done_or_force_detached(device, bdev, &md_io->done);
+	err = md_io->error;
  out:
 	bio_put(bio);
 	return err;
 }
 
-int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
-			 sector_t sector, enum req_op op)
+int __drbd_md_sync_page_io(struct drbd_device *device, struct drbd_md_io *md_io,
+			   struct drbd_backing_dev *bdev, sector_t sector, enum req_op op)
 {
 	int err;
-	D_ASSERT(device, atomic_read(&device->md_io.in_use) == 1);
+	D_ASSERT(device, atomic_read(&md_io->in_use) == 1);
 
 	if (!bdev->md_bdev) {
 		if (drbd_ratelimit())
@@ -153,7 +165,7 @@ int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bd
 		     (unsigned long long)sector,
 		     (op == REQ_OP_WRITE) ? "WRITE" : "READ");
 
-	err = _drbd_md_sync_page_io(device, bdev, sector, op);
+	err = _drbd_md_sync_page_io(device, md_io, bdev, sector, op);
 	if (err) {
 		drbd_err(device, "drbd_md_sync_page_io(,%llus,%s) failed with error %d\n",
 		    (unsigned long long)sector,
@@ -172,6 +184,18 @@ struct get_activity_log_ref_ctx {
 	bool wake_up;
 };
 
+/* Every resync extent that blocks application writes holds a reference; an
+ * extent whose refcount dropped to zero has its flags cleared.  Without resync
+ * activity towards this peer, the hash lookup can not find anything of
+ * interest. */
+static struct lc_element *
+find_resync_lru_element(struct drbd_peer_device *peer_device, unsigned int enr)
+{
+	if (likely(peer_device->resync_lru->used == 0))
+		return NULL;
+	return lc_find(peer_device->resync_lru, enr/AL_EXT_PER_BM_SECT);
+}
+
 static struct bm_extent*
 find_active_resync_extent(struct get_activity_log_ref_ctx *al_ctx)
 {
@@ -180,7 +204,7 @@ find_active_resync_extent(struct get_activity_log_ref_ctx *al_ctx)
 
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
+		tmp = find_resync_lru_element(peer_device, al_ctx->enr);
 		if (unlikely(tmp != NULL)) {
 			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
 			if (test_bit(BME_NO_WRITES, &bm_ext->flags)) {
@@ -210,7 +234,7 @@ set_bme_priority(struct get_activity_log_ref_ctx *al_ctx)
 
 	rcu_read_lock();
 	for_each_peer_device_rcu(peer_device, al_ctx->device) {
-		tmp = lc_find(peer_device->resync_lru, al_ctx->enr/AL_EXT_PER_BM_SECT);
+		tmp = find_resync_lru_element(peer_device, al_ctx->enr);
 		if (tmp) {
 			struct bm_extent  *bm_ext = lc_entry(tmp, struct bm_extent, lce);
 			if (test_bit(BME_NO_WRITES, &bm_ext->flags)
@@ -304,24 +328,86 @@ drbd_dax_begin_io_fp(struct drbd_device *device, unsigned int first, unsigned in
 }
 #endif
 
+static bool put_actlog(struct drbd_device *device, unsigned int first, unsigned int last);
+
+unsigned int drbd_al_heat_hash(unsigned int enr, int row)
+{
+	return jhash_1word(enr, row) & ((1 << AL_HEAT_BITS) - 1);
+}
+
+/* Count one in drbd_al_heat_sample writes per activity log extent, into a
+ * count-min sketch (so the memory does not depend on the device size) and
+ * into AL_HEAT_REGIONS exact per region counters. */
+static void al_heat_sample(struct drbd_device *device, unsigned int first, unsigned int last)
+{
+	unsigned int every = READ_ONCE(drbd_al_heat_sample);
+	u64 nr_extents;
+	unsigned int enr;
+	int row;
+
+	if (likely(!every) || ++device->al_heat_seq < every)
+		return;
+	device->al_heat_seq = 0;
+	device->al_heat_samples++;
+
+	nr_extents = (get_capacity(device->vdisk) >> (AL_EXTENT_SHIFT - 9)) + 1;
+	for (enr = first; enr <= last; enr++) {
+		for (row = 0; row < AL_HEAT_DEPTH; row++)
+			device->al_heat[row][drbd_al_heat_hash(enr, row)]++;
+		device->al_heat_region[min_t(u64, AL_HEAT_REGIONS - 1,
+				div64_u64((u64)enr * AL_HEAT_REGIONS, nr_extents))]++;
+	}
+}
+
+/* A sequential writer that got past the middle of its activity log extent
+ * will need the next one soon.  Have the submitter activate it in the
+ * background (drbd_al_prefetch_commit()), so the stream does not have to
+ * wait for a transaction when it gets there. */
+static void al_stream_update(struct drbd_device *device, struct drbd_interval *i, unsigned int last)
+{
+	const sector_t ext_sect = 1ULL << (AL_EXTENT_SHIFT - 9);
+	sector_t end = i->sector + (i->size >> 9);
+	bool sequential = i->size && i->sector == READ_ONCE(device->al_stream_next);
+
+	WRITE_ONCE(device->al_stream_next, end);
+	if (!sequential || !READ_ONCE(drbd_al_prefetch_enabled) ||
+	    end - ((sector_t)last << (AL_EXTENT_SHIFT - 9)) < ext_sect / 2 ||
+	    READ_ONCE(device->al_prefetch_last) == last + 1)
+		return;
+
+	WRITE_ONCE(device->al_prefetch_last, last + 1);
+	WRITE_ONCE(device->al_prefetch_enr, last + 1);
+	queue_work(device->submit.wq, &device->submit.worker);
+}
+
 bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i)
 {
 	/* for bios crossing activity log extent boundaries,
 	 * we may need to activate two extents in one go */
 	unsigned first = i->sector >> (AL_EXTENT_SHIFT-9);
 	unsigned last = i->size == 0 ? first : (i->sector + (i->size >> 9) - 1) >> (AL_EXTENT_SHIFT-9);
+	unsigned enr;
 
 	D_ASSERT(device, first <= last);
 	D_ASSERT(device, atomic_read(&device->local_cnt) > 0);
 
+	al_heat_sample(device, first, last);
+	al_stream_update(device, i, last);
+
 	if (drbd_md_dax_active(device->ldev))
 		return drbd_dax_begin_io_fp(device, first, last);
 
-	/* FIXME figure out a fast path for bios crossing AL extent boundaries */
-	if (first != last)
-		return false;
-
-	return _al_get_nonblock(device, first) != NULL;
+	/* If all covered extents are hot already, no transaction is
+	 * necessary, no matter whether the bio crosses an extent boundary.
+	 * Otherwise give back what we got, and leave it to the submitter. */
+	for (enr = first; enr <= last; enr++) {
+		if (!_al_get_nonblock(device, enr)) {
+			if (enr > first)
+				put_actlog(device, first, enr - 1);
+			return false;
+		}
+	}
+	return true;
 }
 
 #if (PAGE_SHIFT + 3) < (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT)
@@ -445,6 +531,7 @@ static int __al_write_transaction(struct drbd_device *device, struct al_transact
 				device->al_histogram[min_t(unsigned int,
 						device->act_log->pending_changes,
 						AL_UPDATES_PER_TRANSACTION)]++;
+				drbd_al_stats_update(device);
 			}
 			ktime_aggregate_delta(device, start_kt, al_after_sync_page_kt);
 		}
@@ -489,6 +576,62 @@ static int al_write_transaction(struct drbd_device *device)
 	return err;
 }
 
+static void al_stats_new_window(struct drbd_device *device, struct lru_cache *lc)
+{
+	struct drbd_al_stats_window *w = &device->al_stats[device->al_stats_cur];
+
+	memset(w, 0, sizeof(*w));
+	w->start_jif = jiffies;
+	device->al_stats_hits = lc->hits;
+	device->al_stats_misses = lc->misses;
+	device->al_stats_writ_cnt = device->al_writ_cnt;
+}
+
+/**
+ * drbd_al_stats_update() - account activity log usage to the current window
+ * @device:	DRBD device.
+ *
+ * Keeps hits, misses, transactions and the number of extents in use for
+ * the last AL_STATS_WINDOWS windows of AL_STATS_WINDOW_JIF each.  The
+ * largest number of extents in use is the working set that the al-extents
+ * setting needs to cover to keep the transaction rate down.
+ */
+void drbd_al_stats_update(struct drbd_device *device)
+{
+	struct lru_cache *lc;
+	struct drbd_al_stats_window *w;
+	unsigned long flags;
+
+	spin_lock_irqsave(&device->al_lock, flags);
+	lc = device->act_log;
+	if (!lc)
+		goto out;
+
+	if (lc != device->al_stats_lc) {
+		/* first use, or the activity log was resized */
+		memset(device->al_stats, 0, sizeof(device->al_stats));
+		device->al_stats_cur = 0;
+		device->al_stats_lc = lc;
+		al_stats_new_window(device, lc);
+	} else if (time_after_eq(jiffies, device->al_stats[device->al_stats_cur].start_jif +
+				 AL_STATS_WINDOW_JIF)) {
+		device->al_stats_cur = (device->al_stats_cur + 1) % AL_STATS_WINDOWS;
+		al_stats_new_window(device, lc);
+	}
+
+	/* al_writ_cnt gets reset through debugfs */
+	if (device->al_writ_cnt < device->al_stats_writ_cnt)
+		device->al_stats_writ_cnt = 0;
+
+	w = &device->al_stats[device->al_stats_cur];
+	w->hits = lc->hits - device->al_stats_hits;
+	w->misses = lc->misses - device->al_stats_misses;
+	w->transactions = device->al_writ_cnt - device->al_stats_writ_cnt;
+	w->max_used = max(w->max_used, lc->used);
+out:
+	spin_unlock_irqrestore(&device->al_lock, flags);
+}
+
 static int bm_e_weight(struct drbd_peer_device *peer_device, unsigned long enr);
 
 bool drbd_al_try_lock(struct drbd_device *device)
@@ -537,6 +680,7 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 			write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
 			rcu_read_unlock();
 
+			trace_drbd_al_begin_commit(device);
 			if (write_al_updates)
 				al_write_transaction(device);
 			spin_lock_irq(&device->al_lock);
@@ -546,6 +690,7 @@ void drbd_al_begin_io_commit(struct drbd_device *device)
 			*/
 			lc_committed(device->act_log);
 			spin_unlock_irq(&device->al_lock);
+			trace_drbd_al_end_commit(device);
 		}
 		lc_unlock(device->act_log);
 		wake_up(&device->al_wait);
@@ -695,9 +840,54 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		if (!al_ext)
 			drbd_err(device, "LOGIC BUG for enr=%u\n", enr);
 	}
+	al_stream_update(device, i, last);
 	return 0;
 }
 
+/**
+ * drbd_al_prefetch_commit() - activate the extent a sequential writer heads for
+ * @device:	DRBD device.
+ *
+ * Called by the submitter when it has nothing else to do.  If
+ * al_stream_update() asked for an extent that is still cold, activate it
+ * with a transaction of its own, and leave it in the activity log unused.
+ */
+void drbd_al_prefetch_commit(struct drbd_device *device)
+{
+	struct get_activity_log_ref_ctx al_ctx = { .device = device, };
+	struct lru_cache *al;
+	unsigned int enr;
+	bool got = false;
+
+	enr = xchg(&device->al_prefetch_enr, 0);
+	if (!enr || !get_ldev(device))
+		return;
+	if (drbd_md_dax_active(device->ldev) ||
+	    (sector_t)enr << (AL_EXTENT_SHIFT - 9) >= get_capacity(device->vdisk))
+		goto out;
+
+	spin_lock_irq(&device->al_lock);
+	al = device->act_log;
+	/* Never compete with real requests for slots */
+	if (!test_bit(__LC_LOCKED, &al->flags) && !test_bit(__LC_STARVING, &al->flags) &&
+	    al->used < al->nr_elements && al->pending_changes < al->max_pending_changes &&
+	    !lc_find(al, enr)) {
+		al_ctx.enr = enr;
+		if (!find_active_resync_extent(&al_ctx))
+			got = lc_get_cumulative(al, enr) != NULL;
+	}
+	spin_unlock_irq(&device->al_lock);
+	if (al_ctx.wake_up)
+		wake_up(&device->al_wait);
+
+	if (got) {
+		drbd_al_begin_io_commit(device);
+		put_actlog(device, enr, enr);
+	}
+out:
+	put_ldev(device);
+}
+
 /* put activity log extent references corresponding to interval i, return true
  * if at least one extent is now unreferenced. */
 bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i)
@@ -776,38 +966,65 @@ static bool extent_in_sync(struct drbd_peer_device *peer_device, unsigned int rs
 	return false;
 }
 
-static void
-consider_sending_peers_in_sync(struct drbd_peer_device *peer_device, unsigned int rs_enr)
+/* Sets *mask to the nodes that are in sync with us for resync extent rs_enr.
+ * Returns 1 if there is something to announce. The resync extent then stays
+ * locked, so no application write can start in it before the
+ * P_PEERS_IN_SYNC is sent. Returns 0 if there is nothing to announce (yet),
+ * and -EAGAIN if the extent could not be locked. */
+static int peers_in_sync_mask(struct drbd_peer_device *peer_device, unsigned int rs_enr,
+			      u64 *mask)
 {
 	struct drbd_device *device = peer_device->device;
-	u64 mask = NODE_MASK(peer_device->node_id), im;
+	u64 im;
 	struct drbd_peer_device *p;
-	int size_sect;
 	struct bm_extent *bm_ext;
 	struct lc_element *e;
 
-	if (peer_device->connection->agreed_pro_version < 110)
-		return;
-
 	if (drbd_try_rs_begin_io(peer_device, BM_EXT_TO_SECT(rs_enr), false))
-		return;
+		return -EAGAIN;
 
 	e = lc_find(peer_device->resync_lru, rs_enr);
 	bm_ext = lc_entry(e, struct bm_extent, lce);
 	if (bm_ext->rs_left) {
 		drbd_rs_complete_io(peer_device, BM_EXT_TO_SECT(rs_enr));
-		return;
+		return 0;
 	}
 
+	*mask = NODE_MASK(peer_device->node_id);
 	for_each_peer_device_ref(p, im, device) {
 		if (p == peer_device)
 			continue;
 		if (extent_in_sync(p, rs_enr))
-			mask |= NODE_MASK(p->node_id);
+			*mask |= NODE_MASK(p->node_id);
 	}
 
-	size_sect = min(BM_SECT_PER_EXT,
-			get_capacity(device->vdisk) - BM_EXT_TO_SECT(rs_enr));
+	return 1;
+}
+
+/* A run of adjacent resync extents that are in sync for the same nodes.
+ * All of them are locked until the run is sent. The receiver applies a
+ * P_PEERS_IN_SYNC of any size with a single drbd_set_sync() call. Keep
+ * the number of locked extents well below the size of the resync LRU. */
+#define PEERS_IN_SYNC_MAX_EXTENTS	16
+
+struct peers_in_sync_run {
+	unsigned int enr;
+	unsigned int count;
+	u64 mask;
+};
+
+static void send_peers_in_sync_run(struct drbd_peer_device *peer_device,
+				   struct peers_in_sync_run *run)
+{
+	struct drbd_device *device = peer_device->device;
+	sector_t sector = BM_EXT_TO_SECT(run->enr);
+	struct drbd_peer_device *p;
+	sector_t size_sect;
+	unsigned int i;
+	u64 im;
+
+	size_sect = min(BM_EXT_TO_SECT(run->count),
+			get_capacity(device->vdisk) - sector);
 
 	for_each_peer_device_ref(p, im, device) {
 		/* Only send to the peer whose bitmap bits have been cleared if
@@ -818,11 +1035,56 @@ consider_sending_peers_in_sync(struct drbd_peer_device *peer_device, unsigned in
 		if (p == peer_device && p->connection->cstate[NOW] != C_CONNECTED)
 			continue;
 
-		if (mask & NODE_MASK(p->node_id))
-			drbd_send_peers_in_sync(p, mask, BM_EXT_TO_SECT(rs_enr), size_sect << 9);
+		if (run->mask & NODE_MASK(p->node_id))
+			drbd_send_peers_in_sync(p, run->mask, sector, size_sect << 9);
 	}
 
-	drbd_rs_complete_io(peer_device, BM_EXT_TO_SECT(rs_enr));
+	for (i = 0; i < run->count; i++)
+		drbd_rs_complete_io(peer_device, BM_EXT_TO_SECT(run->enr + i));
+	run->count = 0;
+}
+
+/* @enrs must be sorted */
+static void
+consider_sending_peers_in_sync(struct drbd_peer_device *peer_device,
+			       const unsigned int *enrs, unsigned int n)
+{
+	struct peers_in_sync_run run = { .count = 0 };
+	unsigned int i;
+	u64 mask;
+	int rv;
+
+	if (peer_device->connection->agreed_pro_version < 110)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (i && enrs[i] == enrs[i - 1])
+			continue;
+
+		if (run.count &&
+		    (run.enr + run.count != enrs[i] ||
+		     run.count >= PEERS_IN_SYNC_MAX_EXTENTS))
+			send_peers_in_sync_run(peer_device, &run);
+
+		rv = peers_in_sync_mask(peer_device, enrs[i], &mask);
+		if (rv == -EAGAIN && run.count) {
+			/* Maybe we hold too many resync extents ourselves. */
+			send_peers_in_sync_run(peer_device, &run);
+			rv = peers_in_sync_mask(peer_device, enrs[i], &mask);
+		}
+		if (rv <= 0)
+			continue;
+
+		if (run.count && run.mask != mask)
+			send_peers_in_sync_run(peer_device, &run);
+		if (!run.count) {
+			run.enr = enrs[i];
+			run.mask = mask;
+		}
+		run.count++;
+	}
+	if (run.count)
+		send_peers_in_sync_run(peer_device, &run);
 }
 
 int drbd_al_initialize(struct drbd_device *device, void *buffer)
@@ -859,7 +1121,7 @@ static int w_update_peers(struct drbd_work *w, int unused)
        struct drbd_device *device = peer_device->device;
        struct drbd_connection *connection = peer_device->connection;
 
-       consider_sending_peers_in_sync(peer_device, upw->enr);
+       consider_sending_peers_in_sync(peer_device, &upw->enr, 1);
 
        kfree(upw);
 
@@ -872,6 +1134,43 @@ static int w_update_peers(struct drbd_work *w, int unused)
        return 0;
 }
 
+static int cmp_enr(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Resync extents that became clean are collected in
+ * peer_device->update_peers_enr[] and announced to the other peers in one
+ * go, coalescing adjacent extents into a single P_PEERS_IN_SYNC. */
+int w_update_peers_batch(struct drbd_work *w, int unused)
+{
+	struct drbd_peer_device *peer_device =
+		container_of(w, struct drbd_peer_device, update_peers_work);
+	struct drbd_device *device = peer_device->device;
+	struct drbd_connection *connection = peer_device->connection;
+	unsigned int enrs[DRBD_UPDATE_PEERS_BATCH];
+	unsigned int n;
+
+	spin_lock_irq(&device->al_lock);
+	n = peer_device->update_peers_cnt;
+	memcpy(enrs, peer_device->update_peers_enr, n * sizeof(enrs[0]));
+	peer_device->update_peers_cnt = 0;
+	spin_unlock_irq(&device->al_lock);
+
+	sort(enrs, n, sizeof(enrs[0]), cmp_enr, NULL);
+	consider_sending_peers_in_sync(peer_device, enrs, n);
+
+	kref_debug_put(&device->kref_debug, 5);
+	kref_put(&device->kref, drbd_destroy_device);
+
+	kref_debug_put(&connection->kref_debug, 14);
+	kref_put(&connection->kref, drbd_destroy_connection);
+
+	return 0;
+}
+
 /* inherently racy...
  * return value may be already out-of-date when this function returns.
  * but the general usage is that this is only use during a cstate when bits are
@@ -903,8 +1202,8 @@ static const char *drbd_change_sync_fname[] = {
 };
 
 
-/* ATTENTION. The AL's extents are 4MB each, while the extents in the
- * resync LRU-cache are 128MB each.
+/* ATTENTION. The AL's extents are AL_EXTENT_SIZE each, the extents in the
+ * resync LRU-cache are BM_EXT_SIZE each; currently both are 4MB.
  * The caller of this function has to hold an get_ldev() reference.
  *
  * Adjusts the caching members ->rs_left (success) or ->rs_failed (!success),
@@ -994,6 +1293,24 @@ static bool update_rs_extent(struct drbd_peer_device *peer_device,
 
 		if (ext->rs_left <= ext->rs_failed) {
 			struct update_peers_work *upw;
+			unsigned int cnt = peer_device->update_peers_cnt;
+
+			if (cnt < DRBD_UPDATE_PEERS_BATCH) {
+				peer_device->update_peers_enr[cnt] = ext->lce.lc_number;
+				peer_device->update_peers_cnt = cnt + 1;
+				if (cnt == 0) {
+					kref_get(&device->kref);
+					kref_debug_get(&device->kref_debug, 5);
+
+					kref_get(&peer_device->connection->kref);
+					kref_debug_get(&peer_device->connection->kref_debug, 14);
+
+					drbd_queue_work(&device->resource->work,
+							&peer_device->update_peers_work);
+				}
+				ext->rs_failed = 0;
+				return true;
+			}
 
 			upw = kmalloc(sizeof(*upw), GFP_ATOMIC | __GFP_NOWARN);
 			if (upw) {
@@ -1038,8 +1355,11 @@ void drbd_advance_rs_marks(struct drbd_peer_device *peer_device, unsigned long s
 			peer_device->rs_mark_time[next] = now;
 			peer_device->rs_mark_left[next] = still_to_go;
 			peer_device->rs_last_mark = next;
+			/* At most one progress event per DRBD_SYNC_MARK_STEP.
+			 * Without progress, the mark time stays behind, and we
+			 * would otherwise post again on every call. */
+			drbd_peer_device_post_work(peer_device, RS_PROGRESS);
 		}
-		drbd_peer_device_post_work(peer_device, RS_PROGRESS);
 	}
 }
 
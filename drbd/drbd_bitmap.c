@@ -101,8 +101,27 @@ enum bitmap_operations {
 	BM_OP_FIND_ZERO_BIT,
 };
 
+static bool bm_op_locked_out(enum bm_flag flags, enum bitmap_operations op)
+{
+	switch(op) {
+	case BM_OP_CLEAR:
+		return flags & BM_LOCK_CLEAR;
+	case BM_OP_SET:
+	case BM_OP_MERGE:
+		return flags & BM_LOCK_SET;
+	case BM_OP_TEST:
+	case BM_OP_COUNT:
+	case BM_OP_EXTRACT:
+	case BM_OP_FIND_BIT:
+	case BM_OP_FIND_ZERO_BIT:
+		return flags & BM_LOCK_TEST;
+	}
+	return false;
+}
+
 static void
-bm_print_lock_info(struct drbd_device *device, unsigned int bitmap_index, enum bitmap_operations op)
+bm_print_lock_info(struct drbd_device *device, enum bitmap_operations op,
+		   const char *why, const char *task_comm, pid_t task_pid)
 {
 	static const char *op_names[] = {
 		[BM_OP_CLEAR] = "clear",
@@ -115,13 +134,11 @@ bm_print_lock_info(struct drbd_device *device, unsigned int bitmap_index, enum b
 		[BM_OP_FIND_ZERO_BIT] = "find_zero_bit",
 	};
 
-	struct drbd_bitmap *b = device->bitmap;
 	if (!drbd_ratelimit())
 		return;
 	drbd_err(device, "FIXME %s[%d] op %s, bitmap locked for '%s' by %s[%d]\n",
 		 current->comm, task_pid_nr(current),
-		 op_names[op], b->bm_why ?: "?",
-		 b->bm_task_comm, b->bm_task_pid);
+		 op_names[op], why ?: "?", task_comm, task_pid);
 }
 
 /* drbd_bm_lock() was introduced before drbd-9.0 to ensure that access to
@@ -131,15 +148,15 @@ bm_print_lock_info(struct drbd_device *device, unsigned int bitmap_index, enum b
 
    Since drbd-9.0 actions on the bitmap could happen in parallel (e.g. "receive
    bitmap").
-   The cheap solution taken right now, is to completely serialize bitmap
-   operations but do not warn if they operate on different bitmap slots.
-
-   The real solution is to make the locking more fine grained (one lock per
-   bitmap slot) and to allow those operations to happen parallel.
+   Locking the whole bitmap serializes against all other bitmap locks.
+   Locking a single slot only serializes against locks of the same slot and
+   of the whole bitmap, so e.g. receiving the bitmap from one peer does not
+   wait for the handshake with another peer.
+   A slot lock only covers bit operations on that slot. Whole bitmap IO and
+   giving back all-zero sparse pages touch the pages of all slots, bm_rw_range()
+   serializes those on bm_io_mutex, and resize holds the whole bitmap lock.
  */
-static void
-_drbd_bm_lock(struct drbd_device *device, struct drbd_peer_device *peer_device,
-	      char *why, enum bm_flag flags)
+void drbd_bm_lock(struct drbd_device *device, char *why, enum bm_flag flags)
 {
 	struct drbd_bitmap *b = device->bitmap;
 	int trylock_failed;
@@ -151,11 +168,6 @@ _drbd_bm_lock(struct drbd_device *device, struct drbd_peer_device *peer_device,
 
 	trylock_failed = !mutex_trylock(&b->bm_change);
 
-	if (trylock_failed && peer_device && b->bm_locked_peer != peer_device) {
-		mutex_lock(&b->bm_change);
-		trylock_failed = 0;
-	}
-
 	if (trylock_failed) {
 		drbd_warn(device, "%s[%d] going to '%s' but bitmap already locked for '%s' by %s[%d]\n",
 			  current->comm, task_pid_nr(current),
@@ -163,6 +175,7 @@ _drbd_bm_lock(struct drbd_device *device, struct drbd_peer_device *peer_device,
 			  b->bm_task_comm, b->bm_task_pid);
 		mutex_lock(&b->bm_change);
 	}
+	down_write(&b->bm_slots_sem);
 	if (b->bm_flags & BM_LOCK_ALL)
 		drbd_err(device, "FIXME bitmap already locked in bm_lock\n");
 	b->bm_flags |= flags & BM_LOCK_ALL;
@@ -170,17 +183,37 @@ _drbd_bm_lock(struct drbd_device *device, struct drbd_peer_device *peer_device,
 	b->bm_why  = why;
 	strcpy(b->bm_task_comm, current->comm);
 	b->bm_task_pid = task_pid_nr(current);
-	b->bm_locked_peer = peer_device;
-}
-
-void drbd_bm_lock(struct drbd_device *device, char *why, enum bm_flag flags)
-{
-	_drbd_bm_lock(device, NULL, why, flags);
 }
 
 void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_flag flags)
 {
-	_drbd_bm_lock(peer_device->device, peer_device, why, flags);
+	struct drbd_device *device = peer_device->device;
+	struct drbd_bitmap *b = device->bitmap;
+	struct drbd_bm_slot_holder *slot;
+
+	if (!b) {
+		drbd_err(device, "FIXME no bitmap in drbd_bm_slot_lock!?\n");
+		return;
+	}
+	/* without a slot of its own, lock the whole bitmap */
+	if (peer_device->bitmap_index == -1) {
+		drbd_bm_lock(device, why, flags);
+		return;
+	}
+	slot = &b->bm_slot[peer_device->bitmap_index];
+
+	down_read(&b->bm_slots_sem);
+	if (!mutex_trylock(&slot->mutex)) {
+		drbd_warn(peer_device, "%s[%d] going to '%s' but bitmap slot already locked for '%s' by %s[%d]\n",
+			  current->comm, task_pid_nr(current),
+			  why, slot->why ?: "?",
+			  slot->task_comm, slot->task_pid);
+		mutex_lock(&slot->mutex);
+	}
+	slot->flags = flags & BM_LOCK_ALL;
+	slot->why = why;
+	strcpy(slot->task_comm, current->comm);
+	slot->task_pid = task_pid_nr(current);
 }
 
 void drbd_bm_unlock(struct drbd_device *device)
@@ -198,13 +231,35 @@ void drbd_bm_unlock(struct drbd_device *device)
 	b->bm_why  = NULL;
 	b->bm_task_comm[0] = 0;
 	b->bm_task_pid = 0;
-	b->bm_locked_peer = NULL;
+	up_write(&b->bm_slots_sem);
 	mutex_unlock(&b->bm_change);
 }
 
 void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
 {
-	drbd_bm_unlock(peer_device->device);
+	struct drbd_device *device = peer_device->device;
+	struct drbd_bitmap *b = device->bitmap;
+	struct drbd_bm_slot_holder *slot;
+
+	if (!b) {
+		drbd_err(device, "FIXME no bitmap in drbd_bm_slot_unlock!?\n");
+		return;
+	}
+	if (peer_device->bitmap_index == -1) {
+		drbd_bm_unlock(device);
+		return;
+	}
+	slot = &b->bm_slot[peer_device->bitmap_index];
+
+	if (!mutex_is_locked(&slot->mutex))
+		drbd_err(peer_device, "FIXME bitmap slot not locked in bm_slot_unlock\n");
+
+	slot->flags = 0;
+	slot->why = NULL;
+	slot->task_comm[0] = 0;
+	slot->task_pid = 0;
+	mutex_unlock(&slot->mutex);
+	up_read(&b->bm_slots_sem);
 }
 
 /* we store some "meta" info about our pages in page->private */
@@ -230,6 +285,12 @@ void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device)
 /* pages marked with this "HINT" will be considered for writeout
  * on activity log transactions */
 #define BM_PAGE_HINT_WRITEOUT	27
+/* a zeroed copy written out in place of a page that is not allocated,
+ * see the sparse_bitmap module parameter */
+#define BM_PAGE_STAND_IN	26
+/* the page itself is in flight for BM_AIO_COPY_PAGES IO;
+ * whoever modifies it in the meantime modifies a copy, see bm_cow_page() */
+#define BM_PAGE_COW		25
 
 /* store_page_idx uses non-atomic assignment. It is only used directly after
  * allocating the page.  All other bm_set_page_* and bm_clear_page_* need to
@@ -253,8 +314,10 @@ static unsigned long bm_page_to_idx(struct page *page)
 static void bm_page_lock_io(struct drbd_device *device, int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	void *addr = &page_private(b->bm_pages[page_nr]);
-	wait_event(b->bm_io_wait, !test_and_set_bit(BM_PAGE_IO_LOCK, addr));
+	/* look up the page again after each wake up,
+	 * it may have been replaced by bm_cow_page() */
+	wait_event(b->bm_io_wait,
+		   !test_and_set_bit(BM_PAGE_IO_LOCK, &page_private(b->bm_pages[page_nr])));
 }
 
 static void bm_page_unlock_io(struct drbd_device *device, int page_nr)
@@ -307,7 +370,8 @@ static void bm_set_page_lazy_writeout(struct drbd_bitmap *bitmap, unsigned int p
 {
 	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM)) {
 		struct page *page = bitmap->bm_pages[page_nr];
-		set_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page));
+		if (!test_and_set_bit(BM_PAGE_LAZY_WRITEOUT, &page_private(page)))
+			set_bit(page_nr, bitmap->bm_lazy_pages);
 	}
 }
 
@@ -330,20 +394,31 @@ static void bm_free_pages(struct page **pages, unsigned long number)
 		return;
 
 	for (i = 0; i < number; i++) {
-		if (!pages[i]) {
-			pr_alert("bm_free_pages tried to free a NULL pointer; i=%lu n=%lu\n",
-				 i, number);
+		/* all-zero pages of a sparse bitmap are not allocated */
+		if (!pages[i])
 			continue;
-		}
 		__free_page(pages[i]);
 		pages[i] = NULL;
 	}
 }
 
+static struct page *bm_new_page(unsigned int page_nr, gfp_t gfp)
+{
+	struct page *page;
+
+	page = alloc_page(gfp | __GFP_HIGHMEM | __GFP_ZERO | __GFP_NOWARN);
+	/* we want to know which page it is
+	 * from the endio handlers */
+	if (page)
+		bm_store_page_idx(page, page_nr);
+	return page;
+}
+
 /*
  * "have" and "want" are NUMBER OF PAGES.
+ * Without alloc_new, pages beyond "have" are left NULL, for a sparse bitmap.
  */
-static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
+static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want, bool alloc_new)
 {
 	struct page **old_pages = b->bm_pages;
 	struct page **new_pages, *page;
@@ -373,16 +448,13 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	if (want >= have) {
 		for (i = 0; i < have; i++)
 			new_pages[i] = old_pages[i];
-		for (; i < want; i++) {
-			page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+		for (; i < want && alloc_new; i++) {
+			page = bm_new_page(i, GFP_NOIO);
 			if (!page) {
 				bm_free_pages(new_pages + have, i - have);
 				kvfree(new_pages);
 				return NULL;
 			}
-			/* we want to know which page it is
-			 * from the endio handlers */
-			bm_store_page_idx(page, i);
 			new_pages[i] = page;
 		}
 	} else {
@@ -398,6 +470,7 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 struct drbd_bitmap *drbd_bm_alloc(void)
 {
 	struct drbd_bitmap *b;
+	int i;
 
 	b = kzalloc(sizeof(struct drbd_bitmap), GFP_KERNEL);
 	if (!b)
@@ -405,6 +478,10 @@ struct drbd_bitmap *drbd_bm_alloc(void)
 
 	spin_lock_init(&b->bm_lock);
 	mutex_init(&b->bm_change);
+	init_rwsem(&b->bm_slots_sem);
+	mutex_init(&b->bm_io_mutex);
+	for (i = 0; i < DRBD_PEERS_MAX; i++)
+		mutex_init(&b->bm_slot[i].mutex);
 	init_waitqueue_head(&b->bm_io_wait);
 
 	b->bm_max_peers = 1;
@@ -421,6 +498,13 @@ sector_t drbd_bm_capacity(struct drbd_device *device)
 
 void drbd_bm_free(struct drbd_bitmap *bitmap)
 {
+	while (bitmap->bm_nr_spare)
+		__free_page(bitmap->bm_spare_pages[--bitmap->bm_nr_spare]);
+	kvfree(bitmap->bm_summary);
+	bitmap->bm_summary = NULL;
+	kvfree(bitmap->bm_lazy_pages);
+	bitmap->bm_lazy_pages = NULL;
+
 	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
 		return;
 
@@ -462,10 +546,17 @@ static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
 }
 
+static bool bm_page_present(struct drbd_bitmap *bitmap, unsigned int page)
+{
+	return (bitmap->bm_flags & BM_ON_DAX_PMEM) || bitmap->bm_pages[page];
+}
+
+/* Pages that are not allocated read as zeroes.  Callers that modify the
+ * bitmap must bm_materialize_page() first. */
 static void *bm_map(struct drbd_bitmap *bitmap, unsigned int page)
 {
 	if (!(bitmap->bm_flags & BM_ON_DAX_PMEM))
-		return kmap_atomic(bitmap->bm_pages[page]);
+		return kmap_atomic(bitmap->bm_pages[page] ?: ZERO_PAGE(0));
 
 	return ((unsigned char *)bitmap->bm_on_pmem) + (unsigned long)page * PAGE_SIZE;
 }
@@ -476,6 +567,197 @@ static void bm_unmap(struct drbd_bitmap *bitmap, void *addr)
 		kunmap_atomic(addr);
 }
 
+/*
+ * The summary has one bit per bitmap page and slot.  A set bit only means
+ * that the slot may have bits set on that page, a clear bit guarantees that
+ * it has none.  That allows to skip over the clean parts of a sparse bitmap
+ * without mapping and scanning each of its pages.
+ */
+static inline unsigned long bm_summary_bit(unsigned int page, unsigned int bitmap_index)
+{
+	return (unsigned long)page * DRBD_PEERS_MAX + bitmap_index;
+}
+
+static inline size_t bm_summary_bytes(unsigned long number_of_pages)
+{
+	return BITS_TO_LONGS(number_of_pages * DRBD_PEERS_MAX) * sizeof(long);
+}
+
+static inline size_t bm_lazy_bytes(unsigned long number_of_pages)
+{
+	return BITS_TO_LONGS(number_of_pages) * sizeof(long);
+}
+
+static inline bool bm_page_maybe_set(struct drbd_bitmap *bitmap, unsigned int page,
+				     unsigned int bitmap_index)
+{
+	return test_bit(bm_summary_bit(page, bitmap_index), bitmap->bm_summary);
+}
+
+static inline void bm_summary_set(struct drbd_bitmap *bitmap, unsigned int page,
+				  unsigned int bitmap_index)
+{
+	unsigned long nr = bm_summary_bit(page, bitmap_index);
+
+	/* avoid dirtying the cache line if it is already set */
+	if (!test_bit(nr, bitmap->bm_summary))
+		set_bit(nr, bitmap->bm_summary);
+}
+
+static inline void bm_summary_clear(struct drbd_bitmap *bitmap, unsigned int page,
+				    unsigned int bitmap_index)
+{
+	clear_bit(bm_summary_bit(page, bitmap_index), bitmap->bm_summary);
+}
+
+/* Does the mapped page have no bit set for bitmap_index? */
+static noinline bool bm_page_slot_empty(struct drbd_bitmap *bitmap, void *addr,
+					unsigned int page, unsigned int bitmap_index)
+{
+	unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned long first_word = (unsigned long)page << (PAGE_SHIFT - 2);
+	unsigned int w = (bitmap_index + max_peers - first_word % max_peers) % max_peers;
+	__le32 *p = addr;
+
+	for (; w < PAGE_SIZE / sizeof(__le32); w += max_peers) {
+		if (p[w])
+			return false;
+	}
+	return true;
+}
+
+/* Allocate a not yet allocated page of a sparse bitmap, called with bm_lock
+ * held.  If GFP_ATOMIC fails, take a spare page.  Without one, the bits
+ * @start to @end of @bitmap_index can not be set now; remember them for
+ * drbd_bm_alloc_failed(). */
+static noinline bool bm_materialize_page(struct drbd_device *device, unsigned int bitmap_index,
+					 unsigned int page_nr, unsigned long start, unsigned long end)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	struct page *page;
+
+	page = bm_new_page(page_nr, GFP_ATOMIC);
+	if (!page && bitmap->bm_nr_spare) {
+		page = bitmap->bm_spare_pages[--bitmap->bm_nr_spare];
+		bm_store_page_idx(page, page_nr);
+		drbd_device_post_work(device, BM_ALLOC_FAILED);
+	}
+	if (page) {
+		bitmap->bm_pages[page_nr] = page;
+		return true;
+	}
+
+	if (bitmap->bm_nr_lost < BM_LOST_MAX) {
+		struct bm_lost_range *lost = &bitmap->bm_lost[bitmap->bm_nr_lost++];
+
+		lost->bitmap_index = bitmap_index;
+		lost->start = start;
+		lost->end = end;
+	} else {
+		bitmap->bm_lost_all |= 1UL << bitmap_index;
+	}
+	drbd_device_post_work(device, BM_ALLOC_FAILED);
+	return false;
+}
+
+/* Called with bm_lock held before modifying a page.  If the page itself is
+ * in flight (BM_PAGE_COW), the bitmap gets a copy of it, and the completion
+ * frees the original.  Page flags are only changed with bm_lock held or by
+ * the holder of BM_PAGE_IO_LOCK, so the copy inherits them consistently.
+ * Without memory for the copy, the page is modified while in flight; it is
+ * dirty again then, and written again later.
+ * Returns true if the page was replaced. */
+static bool bm_cow_page(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	struct page *page, *copy;
+
+	if (bitmap->bm_flags & BM_ON_DAX_PMEM)
+		return false;
+	page = bitmap->bm_pages[page_nr];
+	if (likely(!page || !test_bit(BM_PAGE_COW, &page_private(page))))
+		return false;
+
+	copy = alloc_page(GFP_ATOMIC | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!copy)
+		return false;
+	copy_highpage(copy, page);
+	set_page_private(copy, page_private(page) & ~(1UL << BM_PAGE_COW));
+	bitmap->bm_pages[page_nr] = copy;
+	return true;
+}
+
+/* Same, from process context, dropping bm_lock (taken with spin_lock_irq())
+ * for the allocation. */
+static void bm_prealloc_page(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	struct page *page;
+
+	spin_unlock_irq(&bitmap->bm_lock);
+	page = bm_new_page(page_nr, GFP_NOIO);
+	spin_lock_irq(&bitmap->bm_lock);
+	if (!page)
+		return;
+	if (page_nr < bitmap->bm_number_of_pages && !bitmap->bm_pages[page_nr])
+		bitmap->bm_pages[page_nr] = page;
+	else
+		__free_page(page);
+}
+
+/* With sparse_bitmap, give back a page that has no bits set and no IO
+ * state, called from process context. */
+static void bm_release_zero_page(struct drbd_bitmap *bitmap, unsigned int page_nr)
+{
+	struct page *page;
+	void *addr;
+
+	if (!drbd_sparse_bitmap || (bitmap->bm_flags & BM_ON_DAX_PMEM))
+		return;
+
+	spin_lock_irq(&bitmap->bm_lock);
+	page = bitmap->bm_pages[page_nr];
+	if (page && !(page_private(page) & ~BM_PAGE_IDX_MASK)) {
+		addr = kmap_atomic(page);
+		if (memchr_inv(addr, 0, PAGE_SIZE))
+			page = NULL;
+		kunmap_atomic(addr);
+	} else {
+		page = NULL;
+	}
+	if (page)
+		bitmap->bm_pages[page_nr] = NULL;
+	spin_unlock_irq(&bitmap->bm_lock);
+
+	if (page)
+		__free_page(page);
+}
+
+/* Number of bits set in words consecutive 32 bit words, 64 bits at a time */
+static unsigned int bm_words32_weight(const __le32 *p, unsigned int words)
+{
+	unsigned int weight = 0;
+
+	if (words && ((unsigned long)p & 7)) {
+		weight += hweight32(*p++);
+		words--;
+	}
+	for (; words >= 2; words -= 2, p += 2)
+		weight += hweight64(*(const u64 *)p);
+	if (words)
+		weight += hweight32(*p);
+	return weight;
+}
+
+static unsigned long *bm_alloc_summary(size_t bytes)
+{
+	unsigned long *summary;
+
+	/* same constraints as in bm_realloc_pages() */
+	summary = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!summary)
+		summary = __vmalloc(bytes, GFP_NOIO | __GFP_ZERO);
+	return summary;
+}
+
 static __always_inline unsigned long
 ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
 	 enum bitmap_operations op, __le32 *buffer)
@@ -497,6 +779,36 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		unsigned int count = 0;
 		void *addr;
 
+		if ((op == BM_OP_FIND_BIT || op == BM_OP_CLEAR) &&
+		    (!bm_page_maybe_set(bitmap, page, bitmap_index) ||
+		     !bm_page_present(bitmap, page))) {
+			/* nothing to find or to clear for this slot on this page */
+			start = last_bit_on_page(bitmap, bitmap_index, start) + 1;
+			word = interleaved_word32(bitmap, bitmap_index, start);
+			bit_in_page = word32_in_page(word) << 5;
+			continue;
+		}
+
+		if ((op == BM_OP_SET || op == BM_OP_MERGE) && !bm_page_present(bitmap, page)) {
+			if (op == BM_OP_MERGE) {
+				unsigned long last = min(end, last_bit_on_page(bitmap, bitmap_index, start));
+				unsigned long words = (last >> 5) - (start >> 5) + 1;
+
+				/* merging zeroes into a page that is not allocated */
+				if (!memchr_inv(buffer, 0, words * sizeof(*buffer))) {
+					buffer += words;
+					start = last + 1;
+					word = interleaved_word32(bitmap, bitmap_index, start);
+					bit_in_page = word32_in_page(word) << 5;
+					continue;
+				}
+			}
+			if (!bm_materialize_page(device, bitmap_index, page, start, end))
+				break;
+		}
+
+		if (op == BM_OP_SET || op == BM_OP_MERGE || op == BM_OP_CLEAR)
+			bm_cow_page(bitmap, page);
 		addr = bm_map(bitmap, page);
 		if (((start & 31) && (start | 31) <= end) || op == BM_OP_TEST) {
 			unsigned int last = bit_in_page | 31;
@@ -550,6 +862,59 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 				goto next_page;
 		}
 
+		/* With a single bitmap slot the bits on a page are not
+		 * interleaved, search all its full words in one go. */
+		if ((op == BM_OP_FIND_BIT || op == BM_OP_FIND_ZERO_BIT) &&
+		    word32_skip == 32 && start + 31 <= end) {
+			unsigned int last = min_t(unsigned long, BITS_PER_PAGE,
+						  bit_in_page + ((end - start + 1) & ~31UL));
+
+			if (op == BM_OP_FIND_BIT)
+				count = find_next_bit_le(addr, last, bit_in_page);
+			else
+				count = find_next_zero_bit_le(addr, last, bit_in_page);
+			if (count < last)
+				goto found;
+			start += last - bit_in_page;
+			bit_in_page = last;
+			if (bit_in_page >= BITS_PER_PAGE)
+				goto next_page;
+		}
+
+		/* Likewise, clear, set, count or extract all full words
+		 * on this page in one go. */
+		if ((op == BM_OP_CLEAR || op == BM_OP_SET || op == BM_OP_COUNT ||
+		     op == BM_OP_EXTRACT) && word32_skip == 32 && start + 31 <= end) {
+			unsigned int last = min_t(unsigned long, BITS_PER_PAGE,
+						  bit_in_page + ((end - start + 1) & ~31UL));
+			unsigned int words = (last - bit_in_page) >> 5;
+			__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
+
+			switch (op) {
+			case BM_OP_CLEAR:
+				count += bm_words32_weight(p, words);
+				memset(p, 0, words * sizeof(*p));
+				break;
+			case BM_OP_SET:
+				count += words * 32 - bm_words32_weight(p, words);
+				memset(p, 0xff, words * sizeof(*p));
+				break;
+			case BM_OP_COUNT:
+				total += bm_words32_weight(p, words);
+				break;
+			case BM_OP_EXTRACT:
+				memcpy(buffer, p, words * sizeof(*p));
+				buffer += words;
+				break;
+			default:
+				break;
+			}
+			start += last - bit_in_page;
+			bit_in_page = last;
+			if (bit_in_page >= BITS_PER_PAGE)
+				goto next_page;
+		}
+
 		while (start + 31 <= end) {
 			__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
 
@@ -661,6 +1026,9 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		}
 
 	    next_page:
+		if (op == BM_OP_CLEAR && count &&
+		    bm_page_slot_empty(bitmap, addr, page, bitmap_index))
+			bm_summary_clear(bitmap, page, bitmap_index);
 		bm_unmap(bitmap, addr);
 		bit_in_page -= BITS_PER_PAGE;
 		switch(op) {
@@ -673,6 +1041,7 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 		case BM_OP_SET:
 		case BM_OP_MERGE:
 			if (count) {
+				bm_summary_set(bitmap, page, bitmap_index);
 				bm_set_page_need_writeout(bitmap, page);
 				total += count;
 			}
@@ -721,27 +1090,15 @@ __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long sta
 	if (!bitmap->bm_bits)
 		return 0;
 
-	if (bitmap->bm_task_pid != task_pid_nr(current)) {
-		switch(op) {
-		case BM_OP_CLEAR:
-			if (bitmap->bm_flags & BM_LOCK_CLEAR)
-				bm_print_lock_info(device, bitmap_index, op);
-			break;
-		case BM_OP_SET:
-		case BM_OP_MERGE:
-			if (bitmap->bm_flags & BM_LOCK_SET)
-				bm_print_lock_info(device, bitmap_index, op);
-			break;
-		case BM_OP_TEST:
-		case BM_OP_COUNT:
-		case BM_OP_EXTRACT:
-		case BM_OP_FIND_BIT:
-		case BM_OP_FIND_ZERO_BIT:
-			if (bitmap->bm_flags & BM_LOCK_TEST)
-				bm_print_lock_info(device, bitmap_index, op);
-			break;
-		}
-	}
+	if (bitmap->bm_task_pid != task_pid_nr(current) &&
+	    bm_op_locked_out(bitmap->bm_flags, op))
+		bm_print_lock_info(device, op, bitmap->bm_why,
+				   bitmap->bm_task_comm, bitmap->bm_task_pid);
+	if (bitmap->bm_slot[bitmap_index].task_pid != task_pid_nr(current) &&
+	    bm_op_locked_out(bitmap->bm_slot[bitmap_index].flags, op))
+		bm_print_lock_info(device, op, bitmap->bm_slot[bitmap_index].why,
+				   bitmap->bm_slot[bitmap_index].task_comm,
+				   bitmap->bm_slot[bitmap_index].task_pid);
 	return ____bm_op(device, bitmap_index, start, end, op, buffer);
 }
 
@@ -790,25 +1147,74 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 	____bm_op(device, bitmap_index, start, end, op, buffer)
 #endif
 
+/* Count the bits set on one bitmap page, for all slots in a single pass.
+ * Bits beyond bm_bits, in the last words of each slot, are not counted. */
+static void bm_count_page(struct drbd_bitmap *bitmap, unsigned int page, unsigned long *counts)
+{
+	unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned long full_words = (bitmap->bm_bits >> 5) * max_peers;
+	unsigned long word = (unsigned long)page << (PAGE_SHIFT - 2);
+	unsigned int slot = word % max_peers;
+	unsigned int w, n = PAGE_SIZE / sizeof(__le32);
+	__le32 *p = bm_map(bitmap, page);
+
+	if (word + n <= full_words) {
+		if (max_peers == 1) {
+			counts[0] += bitmap_weight((unsigned long *)p, BITS_PER_PAGE);
+		} else {
+			for (w = 0; w < n; w++) {
+				counts[slot] += hweight32((__force u32)p[w]);
+				if (++slot == max_peers)
+					slot = 0;
+			}
+		}
+	} else {
+		u32 mask = (1U << (bitmap->bm_bits & 31)) - 1;
+		unsigned long last_word = full_words + (mask ? max_peers : 0);
+
+		for (w = 0; w < n && word + w < last_word; w++) {
+			u32 val = le32_to_cpu(p[w]);
+
+			if (word + w >= full_words)
+				val &= mask;
+			counts[slot] += hweight32(val);
+			if (++slot == max_peers)
+				slot = 0;
+		}
+	}
+	bm_unmap(bitmap, p);
+}
+
 /* you better not modify the bitmap while this is running,
  * or its results will be stale */
 static void bm_count_bits(struct drbd_device *device)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int bitmap_index;
+	unsigned long bits_set[DRBD_PEERS_MAX] = { };
+	unsigned long counts[DRBD_PEERS_MAX];
+	unsigned int bitmap_index, page;
 
-	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
-		unsigned long bit = 0, bits_set = 0;
+	for (page = 0; page < bitmap->bm_number_of_pages; page++) {
+		unsigned long page_bits = 0;
 
-		while (bit < bitmap->bm_bits) {
-			unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
+		memset(counts, 0, bitmap->bm_max_peers * sizeof(counts[0]));
+		bm_count_page(bitmap, page, counts);
 
-			bits_set += ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL);
-			bit = last_bit + 1;
-			cond_resched();
+		for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
+			if (counts[bitmap_index])
+				bm_summary_set(bitmap, page, bitmap_index);
+			else
+				bm_summary_clear(bitmap, page, bitmap_index);
+			bits_set[bitmap_index] += counts[bitmap_index];
+			page_bits += counts[bitmap_index];
 		}
-		bitmap->bm_set[bitmap_index] = bits_set;
+		if (!page_bits)
+			bm_release_zero_page(bitmap, page);
+		cond_resched();
 	}
+
+	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++)
+		bitmap->bm_set[bitmap_index] = bits_set[bitmap_index];
 }
 
 /* For the layout, see comment above drbd_md_set_sector_offsets(). */
@@ -842,6 +1248,8 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
 	struct page **npages = NULL, **opages = NULL;
+	unsigned long *nsummary = NULL, *osummary = NULL;
+	unsigned long *nlazy = NULL, *olazy = NULL;
 	void *bm_on_pmem = NULL;
 	int err = 0;
 	bool growing;
@@ -863,7 +1271,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		spin_lock_irq(&b->bm_lock);
 		opages = b->bm_pages;
 		onpages = b->bm_number_of_pages;
+		osummary = b->bm_summary;
+		olazy = b->bm_lazy_pages;
 		b->bm_pages = NULL;
+		b->bm_summary = NULL;
+		b->bm_lazy_pages = NULL;
 		b->bm_number_of_pages = 0;
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
 			b->bm_set[bitmap_index] = 0;
@@ -871,6 +1283,8 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		b->bm_words = 0;
 		b->bm_dev_capacity = 0;
 		spin_unlock_irq(&b->bm_lock);
+		kvfree(osummary);
+		kvfree(olazy);
 		if (!(b->bm_flags & BM_ON_DAX_PMEM)) {
 			bm_free_pages(opages, onpages);
 			kvfree(opages);
@@ -893,6 +1307,20 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 
 	want = PFN_UP(words * sizeof(long));
 	have = b->bm_number_of_pages;
+	if (want == have && b->bm_summary) {
+		nsummary = b->bm_summary;
+		nlazy = b->bm_lazy_pages;
+	} else {
+		nsummary = bm_alloc_summary(bm_summary_bytes(want));
+		nlazy = bm_alloc_summary(bm_lazy_bytes(want));
+		if (!nsummary || !nlazy) {
+			kvfree(nsummary);
+			kvfree(nlazy);
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
 	if (drbd_md_dax_active(device->ldev)) {
 		bm_on_pmem = drbd_dax_bitmap(device, want);
 	} else {
@@ -903,10 +1331,14 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 			if (drbd_insert_fault(device, DRBD_FAULT_BM_ALLOC))
 				npages = NULL;
 			else
-				npages = bm_realloc_pages(b, want);
+				npages = bm_realloc_pages(b, want, !drbd_sparse_bitmap || set_new_bits);
 		}
 
 		if (!npages) {
+			if (nsummary != b->bm_summary) {
+				kvfree(nsummary);
+				kvfree(nlazy);
+			}
 			err = -ENOMEM;
 			goto out;
 		}
@@ -934,6 +1366,19 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 		opages = b->bm_pages;
 		b->bm_pages = npages;
 	}
+	if (nsummary != b->bm_summary) {
+		osummary = b->bm_summary;
+		if (osummary)
+			memcpy(nsummary, osummary,
+			       min(bm_summary_bytes(want), bm_summary_bytes(have)));
+		b->bm_summary = nsummary;
+
+		olazy = b->bm_lazy_pages;
+		if (olazy)
+			memcpy(nlazy, olazy,
+			       min(bm_lazy_bytes(want), bm_lazy_bytes(have)));
+		b->bm_lazy_pages = nlazy;
+	}
 	b->bm_number_of_pages = want;
 	b->bm_bits  = bits;
 	b->bm_words = words;
@@ -962,6 +1407,8 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, bool set_new_b
 	}
 
 	spin_unlock_irq(&b->bm_lock);
+	kvfree(osummary);
+	kvfree(olazy);
 	if (opages != npages)
 		kvfree(opages);
 	if (!growing)
@@ -1075,39 +1522,65 @@ static void drbd_bm_aio_ctx_destroy(struct kref *kref)
 	kfree(ctx);
 }
 
-/* bv_page may be a copy, or may be the original */
+/* bv_page may be a stand in, or may be the original.  With BM_PAGE_COW,
+ * the bitmap may have got a copy of the original in the meantime.
+ * Lazy writeout puts several adjacent pages into one bio. */
 static void drbd_bm_endio(struct bio *bio)
 {
 	struct drbd_bm_aio_ctx *ctx = bio->bi_private;
 	struct drbd_device *device = ctx->device;
 	struct drbd_bitmap *b = device->bitmap;
-	unsigned int idx = bm_page_to_idx(bio->bi_io_vec[0].bv_page);
-
 	blk_status_t status = bio->bi_status;
+	unsigned int i;
 
-	if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 &&
-	    !bm_test_page_unchanged(b->bm_pages[idx]))
-		drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
-
-	if (status) {
-		/* ctx error will hold the completed-last non-zero error code,
-		 * in case error codes differ. */
+	/* ctx error will hold the completed-last non-zero error code,
+	 * in case error codes differ. */
+	if (status)
 		ctx->error = blk_status_to_errno(status);
-		bm_set_page_io_err(b->bm_pages[idx]);
-		/* Not identical to on disk version of it.
-		 * Is BM_PAGE_IO_ERROR enough? */
-		if (drbd_ratelimit())
-			drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
-				 status, idx);
-	} else {
-		bm_clear_page_io_err(b->bm_pages[idx]);
-		dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
-	}
 
-	bm_page_unlock_io(device, idx);
+	for (i = 0; i < bio->bi_vcnt; i++) {
+		struct page *page = bio->bi_io_vec[i].bv_page;
+		unsigned int idx = bm_page_to_idx(page);
+		bool stand_in = test_bit(BM_PAGE_STAND_IN, &page_private(page));
+		bool replaced = false;
 
-	if (ctx->flags & BM_AIO_COPY_PAGES)
-		mempool_free(bio->bi_io_vec[0].bv_page, &drbd_md_io_page_pool);
+		if (!stand_in && test_bit(BM_PAGE_COW, &page_private(page))) {
+			unsigned long irq_flags;
+
+			spin_lock_irqsave(&b->bm_lock, irq_flags);
+			if (b->bm_pages[idx] == page)
+				clear_bit(BM_PAGE_COW, &page_private(page));
+			else
+				replaced = true;
+			spin_unlock_irqrestore(&b->bm_lock, irq_flags);
+		} else if ((ctx->flags & BM_AIO_COPY_PAGES) == 0 && !stand_in &&
+			   !bm_test_page_unchanged(b->bm_pages[idx])) {
+			drbd_warn(device, "bitmap page idx %u changed during IO!\n", idx);
+		}
+
+		if (status) {
+			if (!stand_in)
+				bm_set_page_io_err(b->bm_pages[idx]);
+			/* Not identical to on disk version of it.
+			 * Is BM_PAGE_IO_ERROR enough? */
+			if (drbd_ratelimit())
+				drbd_err(device, "IO ERROR %d on bitmap page idx %u\n",
+					 status, idx);
+		} else {
+			if (!stand_in)
+				bm_clear_page_io_err(b->bm_pages[idx]);
+			dynamic_drbd_dbg(device, "bitmap page idx %u completed\n", idx);
+		}
+
+		if (!stand_in)
+			bm_page_unlock_io(device, idx);
+		atomic_inc(&ctx->pages_done);
+
+		if (stand_in)
+			mempool_free(page, &drbd_md_io_page_pool);
+		else if (replaced)
+			__free_page(page);
+	}
 
 	bio_put(bio);
 
@@ -1131,38 +1604,82 @@ static inline sector_t drbd_md_last_bitmap_sector(struct drbd_backing_dev *bdev)
 	}
 }
 
-static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_hold(local)
+/* Returns the number of bytes of bitmap page page_nr on disk, and its position
+ * in *on_disk_sector.  Returns 0 if the page is outside of the on-disk bitmap. */
+static unsigned int bm_page_on_disk(struct drbd_device *device, unsigned int page_nr,
+				    sector_t *on_disk_sector) __must_hold(local)
 {
-	struct bio *bio;
-	struct drbd_device *device = ctx->device;
-	struct drbd_bitmap *b = device->bitmap;
-	struct page *page;
 	sector_t last_bm_sect;
 	sector_t first_bm_sect;
-	sector_t on_disk_sector;
-	unsigned int len;
-	enum req_op op = ctx->flags & BM_AIO_READ ? REQ_OP_READ : REQ_OP_WRITE;
 
 	first_bm_sect = device->ldev->md.md_offset + device->ldev->md.bm_offset;
-	on_disk_sector = first_bm_sect + (((sector_t)page_nr) << (PAGE_SHIFT-SECTOR_SHIFT));
+	*on_disk_sector = first_bm_sect + (((sector_t)page_nr) << (PAGE_SHIFT-SECTOR_SHIFT));
 
 	/* this might happen with very small
 	 * flexible external meta data device,
 	 * or with PAGE_SIZE > 4k */
 	last_bm_sect = drbd_md_last_bitmap_sector(device->ldev);
-	if (first_bm_sect <= on_disk_sector && last_bm_sect >= on_disk_sector) {
-		sector_t len_sect = last_bm_sect - on_disk_sector + 1;
+	if (first_bm_sect <= *on_disk_sector && last_bm_sect >= *on_disk_sector) {
+		sector_t len_sect = last_bm_sect - *on_disk_sector + 1;
 		if (len_sect < PAGE_SIZE/SECTOR_SIZE)
-			len = (unsigned int)len_sect*SECTOR_SIZE;
-		else
-			len = PAGE_SIZE;
+			return (unsigned int)len_sect*SECTOR_SIZE;
+		return PAGE_SIZE;
+	}
+	return 0;
+}
+
+static void bm_submit_bio(struct drbd_device *device, struct bio *bio)
+{
+	enum req_op op = bio_op(bio);
+	unsigned int size = bio->bi_iter.bi_size;
+
+	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
+		bio->bi_status = BLK_STS_IOERR;
+		bio_endio(bio);
 	} else {
+		if (!drbd_delay_bio(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD, bio))
+			submit_bio(bio);
+		if (op == REQ_OP_WRITE)
+			device->bm_writ_cnt++;
+		/* this should not count as user activity and cause the
+		 * resync to throttle -- see drbd_rs_should_slow_down(). */
+		atomic_add(size >> 9, &device->rs_sect_ev);
+	}
+}
+
+/* Instead of copying pages for BM_AIO_COPY_PAGES IO, submit the page itself,
+ * and let bm_cow_page() copy it only if it actually gets modified while in
+ * flight.  Called with BM_PAGE_IO_LOCK held. */
+static struct page *bm_page_start_cow(struct drbd_bitmap *b, unsigned int page_nr)
+{
+	struct page *page;
+
+	spin_lock_irq(&b->bm_lock);
+	page = b->bm_pages[page_nr];
+	set_bit(BM_PAGE_COW, &page_private(page));
+	spin_unlock_irq(&b->bm_lock);
+	return page;
+}
+
+static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_hold(local)
+{
+	struct bio *bio;
+	struct drbd_device *device = ctx->device;
+	struct drbd_bitmap *b = device->bitmap;
+	struct page *page;
+	sector_t on_disk_sector;
+	unsigned int len;
+	enum req_op op = ctx->flags & BM_AIO_READ ? REQ_OP_READ : REQ_OP_WRITE;
+
+	len = bm_page_on_disk(device, page_nr, &on_disk_sector);
+	if (!len) {
 		if (drbd_ratelimit()) {
 			drbd_err(device, "Invalid offset during on-disk bitmap access: "
 				 "page idx %u, sector %llu\n", page_nr, (unsigned long long) on_disk_sector);
 		}
 		ctx->error = -EIO;
-		bm_set_page_io_err(b->bm_pages[page_nr]);
+		if (b->bm_pages[page_nr])
+			bm_set_page_io_err(b->bm_pages[page_nr]);
 		if (atomic_dec_and_test(&ctx->in_flight)) {
 			ctx->done = 1;
 			wake_up(&device->misc_wait);
@@ -1171,20 +1688,33 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 		return;
 	}
 
+	if (!b->bm_pages[page_nr]) {
+		/* not allocated, write zeroes.  If bits get set in the meantime,
+		 * the new page is marked for writeout.  The mempool is only the
+		 * fallback, one page per bio, which is submitted right away;
+		 * mempool_free() in drbd_bm_endio() takes either kind. */
+		page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+		if (!page)
+			page = mempool_alloc(&drbd_md_io_page_pool,
+					GFP_NOIO | __GFP_HIGHMEM);
+		clear_highpage(page);
+		bm_store_page_idx(page, page_nr);
+		set_bit(BM_PAGE_STAND_IN, &page_private(page));
+		goto submit;
+	}
+
 	/* serialize IO on this page */
 	bm_page_lock_io(device, page_nr);
-	/* before memcpy and submit,
+	/* before submit,
 	 * so it can be redirtied any time */
 	bm_set_page_unchanged(b->bm_pages[page_nr]);
 
-	if (ctx->flags & BM_AIO_COPY_PAGES) {
-		page = mempool_alloc(&drbd_md_io_page_pool,
-				GFP_NOIO | __GFP_HIGHMEM);
-		copy_highpage(page, b->bm_pages[page_nr]);
-		bm_store_page_idx(page, page_nr);
-	} else
+	if (ctx->flags & BM_AIO_COPY_PAGES)
+		page = bm_page_start_cow(b, page_nr);
+	else
 		page = b->bm_pages[page_nr];
 
+submit:
 	bio = bio_alloc_bioset(device->ldev->md_bdev, 1, op, GFP_NOIO,
 		&drbd_md_io_bio_set);
 	bio->bi_iter.bi_sector = on_disk_sector;
@@ -1193,17 +1723,227 @@ static void bm_page_io_async(struct drbd_bm_aio_ctx *ctx, int page_nr) __must_ho
 	bio_add_page(bio, page, len, 0);
 	bio->bi_private = ctx;
 	bio->bi_end_io = drbd_bm_endio;
+	bm_submit_bio(device, bio);
+}
 
-	if (drbd_insert_fault(device, (op == REQ_OP_WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD)) {
-		bio->bi_status = BLK_STS_IOERR;
-		bio_endio(bio);
-	} else {
-		submit_bio(bio);
-		if (op == REQ_OP_WRITE)
-			device->bm_writ_cnt++;
-		/* this should not count as user activity and cause the
-		 * resync to throttle -- see drbd_rs_should_slow_down(). */
-		atomic_add(len >> 9, &device->rs_sect_ev);
+/* Lazy writeout during resync only visits the pages on bm_lazy_pages, and
+ * writes each run of adjacent pages with one bio.  Returns the number of
+ * pages submitted. */
+static unsigned int bm_write_lazy_pages_async(struct drbd_bm_aio_ctx *ctx,
+		unsigned int first_page, unsigned int last_page) __must_hold(local)
+{
+	struct drbd_device *device = ctx->device;
+	struct drbd_bitmap *b = device->bitmap;
+	unsigned int page_nr = first_page, next_nr = 0, count = 0;
+	struct bio *bio = NULL;
+
+	while ((page_nr = find_next_bit(b->bm_lazy_pages, last_page + 1, page_nr)) <= last_page) {
+		sector_t on_disk_sector;
+		struct page *page;
+		unsigned int len;
+
+		clear_bit(page_nr, b->bm_lazy_pages);
+		/* the flag may have been cleared by a full write in between */
+		if (!b->bm_pages[page_nr] || !bm_test_page_lazy_writeout(b->bm_pages[page_nr])) {
+			dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", page_nr);
+			goto next;
+		}
+
+		if (bio && (page_nr != next_nr || bio->bi_vcnt >= BIO_MAX_VECS)) {
+			bm_submit_bio(device, bio);
+			bio = NULL;
+		}
+
+		len = bm_page_on_disk(device, page_nr, &on_disk_sector);
+		if (!len) {
+			/* bm_page_io_async() deals with out of range pages */
+			atomic_inc(&ctx->in_flight);
+			bm_page_io_async(ctx, page_nr);
+			++count;
+			goto next;
+		}
+
+		bm_page_lock_io(device, page_nr);
+		bm_set_page_unchanged(b->bm_pages[page_nr]);
+		page = bm_page_start_cow(b, page_nr);
+
+		if (!bio) {
+			bio = bio_alloc_bioset(device->ldev->md_bdev, BIO_MAX_VECS,
+					       REQ_OP_WRITE, GFP_NOIO, &drbd_md_io_bio_set);
+			bio->bi_iter.bi_sector = on_disk_sector;
+			bio->bi_private = ctx;
+			bio->bi_end_io = drbd_bm_endio;
+			atomic_inc(&ctx->in_flight);
+		}
+		bio_add_page(bio, page, len, 0);
+		++count;
+		/* a short page is the last one on disk */
+		next_nr = len < PAGE_SIZE ? 0 : page_nr + 1;
+	next:
+		page_nr++;
+		cond_resched();
+	}
+	if (bio)
+		bm_submit_bio(device, bio);
+	return count;
+}
+
+/* Reading the bitmap at attach time is done in chunks of up to BIO_MAX_VECS
+ * pages.  Once the IO of a chunk completed, its pages are counted on a
+ * workqueue, while the IO of the other chunks is still in flight. */
+struct bm_read_chunk {
+	struct work_struct work;
+	struct drbd_bm_aio_ctx *ctx;
+	unsigned int first_page;
+	unsigned int nr_pages;
+};
+
+static void bm_read_chunk_done(struct bm_read_chunk *chunk)
+{
+	struct drbd_bm_aio_ctx *ctx = chunk->ctx;
+	struct drbd_device *device = ctx->device;
+
+	kfree(chunk);
+	if (atomic_dec_and_test(&ctx->in_flight)) {
+		ctx->done = 1;
+		wake_up(&device->misc_wait);
+		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
+	}
+}
+
+static void bm_count_read_chunk(struct work_struct *ws)
+{
+	struct bm_read_chunk *chunk = container_of(ws, struct bm_read_chunk, work);
+	struct drbd_bm_aio_ctx *ctx = chunk->ctx;
+	struct drbd_bitmap *b = ctx->device->bitmap;
+	unsigned long bits_set[DRBD_PEERS_MAX] = { };
+	unsigned long counts[DRBD_PEERS_MAX];
+	unsigned int bitmap_index, page;
+
+	for (page = chunk->first_page; page < chunk->first_page + chunk->nr_pages; page++) {
+		unsigned long page_bits = 0;
+
+		memset(counts, 0, b->bm_max_peers * sizeof(counts[0]));
+		bm_count_page(b, page, counts);
+
+		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+			if (counts[bitmap_index])
+				bm_summary_set(b, page, bitmap_index);
+			else
+				bm_summary_clear(b, page, bitmap_index);
+			bits_set[bitmap_index] += counts[bitmap_index];
+			page_bits += counts[bitmap_index];
+		}
+		if (!page_bits)
+			bm_release_zero_page(b, page);
+		cond_resched();
+	}
+
+	for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+		atomic_long_add(bits_set[bitmap_index], &ctx->bits_set[bitmap_index]);
+	atomic_add(chunk->nr_pages, &ctx->pages_counted);
+	bm_read_chunk_done(chunk);
+}
+
+static void drbd_bm_read_endio(struct bio *bio)
+{
+	struct bm_read_chunk *chunk = bio->bi_private;
+	struct drbd_device *device = chunk->ctx->device;
+	struct drbd_bitmap *b = device->bitmap;
+	blk_status_t status = bio->bi_status;
+	unsigned int i;
+
+	for (i = 0; i < chunk->nr_pages; i++) {
+		unsigned int page_nr = chunk->first_page + i;
+
+		if (status)
+			bm_set_page_io_err(b->bm_pages[page_nr]);
+		else
+			bm_clear_page_io_err(b->bm_pages[page_nr]);
+		bm_page_unlock_io(device, page_nr);
+	}
+	atomic_add(chunk->nr_pages, &chunk->ctx->pages_done);
+	bio_put(bio);
+
+	if (status) {
+		chunk->ctx->error = blk_status_to_errno(status);
+		if (drbd_ratelimit())
+			drbd_err(device, "IO ERROR %d on bitmap page idx %u-%u\n",
+				 status, chunk->first_page,
+				 chunk->first_page + chunk->nr_pages - 1);
+		bm_read_chunk_done(chunk);
+		return;
+	}
+
+	INIT_WORK(&chunk->work, bm_count_read_chunk);
+	queue_work(system_unbound_wq, &chunk->work);
+}
+
+static void bm_read_pages_async(struct drbd_bm_aio_ctx *ctx,
+				unsigned int first_page, unsigned int last_page) __must_hold(local)
+{
+	struct drbd_device *device = ctx->device;
+	struct drbd_bitmap *b = device->bitmap;
+
+	while (first_page <= last_page) {
+		unsigned int nr = min_t(unsigned int, last_page - first_page + 1, BIO_MAX_VECS);
+		struct bm_read_chunk *chunk = NULL;
+		unsigned int i, len, size = 0;
+		sector_t on_disk_sector, sector;
+		struct bio *bio;
+
+		len = bm_page_on_disk(device, first_page, &on_disk_sector);
+		if (len)
+			chunk = kmalloc(sizeof(*chunk), GFP_NOIO);
+		if (!chunk) {
+			/* bm_page_io_async() deals with out of range pages */
+			atomic_inc(&ctx->in_flight);
+			bm_page_io_async(ctx, first_page);
+			first_page++;
+			continue;
+		}
+
+		bio = bio_alloc_bioset(device->ldev->md_bdev, nr, REQ_OP_READ, GFP_NOIO,
+				       &drbd_md_io_bio_set);
+		bio->bi_iter.bi_sector = on_disk_sector;
+		for (i = 0; i < nr; i++) {
+			unsigned int page_nr = first_page + i;
+
+			if (i > 0)
+				len = bm_page_on_disk(device, page_nr, &sector);
+			if (!len)
+				break;
+
+			bm_page_lock_io(device, page_nr);
+			bm_set_page_unchanged(b->bm_pages[page_nr]);
+			bio_add_page(bio, b->bm_pages[page_nr], len, 0);
+			size += len;
+			/* a short page is the last one on disk */
+			if (len < PAGE_SIZE) {
+				i++;
+				break;
+			}
+		}
+
+		chunk->ctx = ctx;
+		chunk->first_page = first_page;
+		chunk->nr_pages = i;
+		bio->bi_private = chunk;
+		bio->bi_end_io = drbd_bm_read_endio;
+		atomic_inc(&ctx->in_flight);
+
+		if (drbd_insert_fault(device, DRBD_FAULT_MD_RD)) {
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+		} else {
+			if (!drbd_delay_bio(device, DRBD_FAULT_MD_RD, bio))
+				submit_bio(bio);
+			/* this should not count as user activity and cause the
+			 * resync to throttle -- see drbd_rs_should_slow_down(). */
+			atomic_add(size >> 9, &device->rs_sect_ev);
+		}
+		first_page += i;
+		cond_resched();
 	}
 }
 
@@ -1229,6 +1969,9 @@ static int bm_rw_range(struct drbd_device *device,
 {
 	struct drbd_bm_aio_ctx *ctx;
 	struct drbd_bitmap *b = device->bitmap;
+	/* hinted and lazy writeout only touch pages with IO state, which are
+	 * never given back, and must not wait for a whole bitmap IO */
+	bool whole = !(flags & (BM_AIO_WRITE_HINTED | BM_AIO_WRITE_LAZY));
 	unsigned int i, count = 0;
 	unsigned long now;
 	int err = 0;
@@ -1244,7 +1987,7 @@ static int bm_rw_range(struct drbd_device *device,
 	 * For read/write, we are protected against changes to the bitmap by
 	 * the bitmap lock (see drbd_bitmap_io).
 	 * For lazy writeout, we don't care for ongoing changes to the bitmap,
-	 * as we submit copies of pages anyways.
+	 * as pages modified while in flight get copied.
 	 */
 
 	/* if we reach this, we should have at least *some* bitmap pages. */
@@ -1276,7 +2019,11 @@ static int bm_rw_range(struct drbd_device *device,
 	 */
 
 	if (0 == (ctx->flags & ~BM_AIO_READ))
-		WARN_ON(!(b->bm_flags & BM_LOCK_ALL));
+		WARN_ON(!(b->bm_flags & BM_LOCK_ALL) && !rwsem_is_locked(&b->bm_slots_sem));
+
+	/* holders of different slot locks may get here concurrently */
+	if (whole)
+		mutex_lock(&b->bm_io_mutex);
 
 	if (end_page >= b->bm_number_of_pages)
 		end_page = b->bm_number_of_pages -1;
@@ -1290,18 +2037,32 @@ static int bm_rw_range(struct drbd_device *device,
 	/* let the layers below us try to merge these bios... */
 
 	if (flags & BM_AIO_READ) {
+		/* a sparse bitmap needs its pages to read into,
+		 * the ones that stay all-zero are given back when counting */
 		for (i = start_page; i <= end_page; i++) {
-			atomic_inc(&ctx->in_flight);
-			bm_page_io_async(ctx, i);
-			++count;
+			if (b->bm_pages[i])
+				continue;
+			spin_lock_irq(&b->bm_lock);
+			bm_prealloc_page(b, i);
+			spin_unlock_irq(&b->bm_lock);
+			if (!b->bm_pages[i]) {
+				drbd_err(device, "Failed to allocate bitmap pages\n");
+				err = -ENOMEM;
+				break;
+			}
 			cond_resched();
 		}
+
+		if (!err) {
+			count = end_page - start_page + 1;
+			bm_read_pages_async(ctx, start_page, end_page);
+		}
 	} else if (flags & BM_AIO_WRITE_HINTED) {
 		/* ASSERT: BM_AIO_WRITE_ALL_PAGES is not set. */
 		unsigned int hint;
 		for (hint = 0; hint < b->n_bitmap_hints; hint++) {
 			i = b->al_bitmap_hints[hint];
-			if (i > end_page)
+			if (i > end_page || !b->bm_pages[i])
 				continue;
 			/* Several AL-extents may point to the same page. */
 			if (!test_and_clear_bit(BM_PAGE_HINT_WRITEOUT,
@@ -1314,22 +2075,17 @@ static int bm_rw_range(struct drbd_device *device,
 			bm_page_io_async(ctx, i);
 			++count;
 		}
+	} else if (flags & BM_AIO_WRITE_LAZY) {
+		count = bm_write_lazy_pages_async(ctx, start_page, end_page);
 	} else {
 		for (i = start_page; i <= end_page; i++) {
 			/* ignore completely unchanged pages,
 			 * unless specifically requested to write ALL pages */
 			if (!(flags & BM_AIO_WRITE_ALL_PAGES) &&
-			    bm_test_page_unchanged(b->bm_pages[i])) {
+			    (!b->bm_pages[i] || bm_test_page_unchanged(b->bm_pages[i]))) {
 				dynamic_drbd_dbg(device, "skipped bm write for idx %u\n", i);
 				continue;
 			}
-			/* during lazy writeout,
-			 * ignore those pages not marked for lazy writeout. */
-			if ((flags & BM_AIO_WRITE_LAZY) &&
-			    !bm_test_page_lazy_writeout(b->bm_pages[i])) {
-				dynamic_drbd_dbg(device, "skipped bm lazy write for idx %u\n", i);
-				continue;
-			}
 			atomic_inc(&ctx->in_flight);
 			bm_page_io_async(ctx, i);
 			++count;
@@ -1351,7 +2107,7 @@ static int bm_rw_range(struct drbd_device *device,
 		kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
 
 	/* summary for global bitmap IO */
-	if (flags == 0 && count) {
+	if ((flags == 0 || flags == BM_AIO_READ) && count) {
 		unsigned int ms = jiffies_to_msecs(jiffies - now);
 		if (ms > 5) {
 			drbd_info(device, "bitmap %s of %u pages took %u ms\n",
@@ -1369,13 +2125,24 @@ static int bm_rw_range(struct drbd_device *device,
 	if (atomic_read(&ctx->in_flight))
 		err = -EIO; /* Disk timeout/force-detach during IO... */
 
-	if (flags & BM_AIO_READ) {
-		now = jiffies;
-		bm_count_bits(device);
-		drbd_info(device, "recounting of set bits took additional %ums\n",
-		     jiffies_to_msecs(jiffies - now));
+	if ((flags & BM_AIO_READ) && count) {
+		/* pages read by bm_page_io_async() have not been counted yet */
+		if (atomic_read(&ctx->pages_counted) == count &&
+		    start_page == 0 && end_page == b->bm_number_of_pages - 1) {
+			unsigned int bitmap_index;
+
+			for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
+				b->bm_set[bitmap_index] = atomic_long_read(&ctx->bits_set[bitmap_index]);
+		} else {
+			now = jiffies;
+			bm_count_bits(device);
+			drbd_info(device, "recounting of set bits took additional %ums\n",
+			     jiffies_to_msecs(jiffies - now));
+		}
 	}
 
+	if (whole)
+		mutex_unlock(&b->bm_io_mutex);
 	kref_put(&ctx->kref, &drbd_bm_aio_ctx_destroy);
 	return err;
 }
@@ -1398,10 +2165,18 @@ int drbd_bm_read(struct drbd_device *device,
 static void push_al_bitmap_hint(struct drbd_device *device, unsigned int page_nr)
 {
 	struct drbd_bitmap *b = device->bitmap;
-	struct page *page = b->bm_pages[page_nr];
-	BUG_ON(b->n_bitmap_hints >= ARRAY_SIZE(b->al_bitmap_hints));
-	if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
-		b->al_bitmap_hints[b->n_bitmap_hints++] = page_nr;
+	struct page *page;
+
+	/* bm_lock, so that bm_cow_page() does not lose the hint */
+	spin_lock_irq(&b->bm_lock);
+	page = b->bm_pages[page_nr];
+	/* not allocated, nothing to write out */
+	if (page) {
+		BUG_ON(b->n_bitmap_hints >= ARRAY_SIZE(b->al_bitmap_hints));
+		if (!test_and_set_bit(BM_PAGE_HINT_WRITEOUT, &page_private(page)))
+			b->al_bitmap_hints[b->n_bitmap_hints++] = page_nr;
+	}
+	spin_unlock_irq(&b->bm_lock);
 }
 
 /**
@@ -1471,8 +2246,8 @@ int drbd_bm_write_lazy(struct drbd_device *device, unsigned upper_idx) __must_ho
  * @device:	DRBD device.
  *
  * Will only write pages that have changed since last IO.
- * In contrast to drbd_bm_write(), this will copy the bitmap pages
- * to temporary writeout pages. It is intended to trigger a full write-out
+ * In contrast to drbd_bm_write(), pages that change while in flight are
+ * copied, see bm_cow_page(). It is intended to trigger a full write-out
  * while still allowing the bitmap to change, for example if a resync or online
  * verify is aborted due to a failed peer disk, while local IO continues, or
  * pending resync acks are still being processed.
@@ -1489,6 +2264,13 @@ int drbd_bm_write_copy_pages(struct drbd_device *device,
  */
 int drbd_bm_write_hinted(struct drbd_device *device) __must_hold(local)
 {
+	struct drbd_bitmap *b = device->bitmap;
+
+	/* Most AL transactions evict no extent that has bitmap pages to
+	 * write out, don't even set up the aio context for them. */
+	if (!b->n_bitmap_hints && !(b->bm_flags & BM_ON_DAX_PMEM))
+		return 0;
+
 	return bm_rw(device, BM_AIO_WRITE_HINTED | BM_AIO_COPY_PAGES);
 }
 
@@ -1534,10 +2316,16 @@ __bm_many_bits_op(struct drbd_device *device, unsigned int bitmap_index, unsigne
 
 	while (bit <= end) {
 		unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
+		unsigned int page = bit_to_page_interleaved(bitmap, bitmap_index, bit);
 
 		if (end < last_bit)
 			last_bit = end;
 
+		/* don't take the atomic allocation path for bulk operations */
+		if (op == BM_OP_SET && bitmap->bm_pages && page < bitmap->bm_number_of_pages &&
+		    !bm_page_present(bitmap, page))
+			bm_prealloc_page(bitmap, page);
+
 		__bm_op(device, bitmap_index, bit, last_bit, op, NULL);
 		bit = last_bit + 1;
 		if (need_resched()) {
@@ -1563,6 +2351,52 @@ void drbd_bm_clear_many_bits(struct drbd_peer_device *peer_device, unsigned long
 	__bm_many_bits_op(peer_device->device, peer_device->bitmap_index, start, end, BM_OP_CLEAR);
 }
 
+/* Called by the worker after bm_materialize_page() took a spare page or
+ * found none.  Refills the spare pages, and sets the bits that could not be
+ * set, now with allocations that may sleep.  Setting all bits of a lost
+ * range over-estimates what is out of sync; that costs resync, but no
+ * out-of-sync block gets lost. */
+void drbd_bm_alloc_failed(struct drbd_device *device)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	struct bm_lost_range lost[BM_LOST_MAX];
+	unsigned int i, nr_lost;
+	unsigned long lost_all;
+
+	spin_lock_irq(&bitmap->bm_lock);
+	while (bitmap->bm_nr_spare < BM_SPARE_PAGES) {
+		struct page *page;
+
+		spin_unlock_irq(&bitmap->bm_lock);
+		page = bm_new_page(0, GFP_NOIO);
+		spin_lock_irq(&bitmap->bm_lock);
+		if (!page)
+			break;
+		if (bitmap->bm_nr_spare < BM_SPARE_PAGES)
+			bitmap->bm_spare_pages[bitmap->bm_nr_spare++] = page;
+		else
+			__free_page(page);
+	}
+	nr_lost = bitmap->bm_nr_lost;
+	memcpy(lost, bitmap->bm_lost, nr_lost * sizeof(*lost));
+	bitmap->bm_nr_lost = 0;
+	lost_all = bitmap->bm_lost_all;
+	bitmap->bm_lost_all = 0;
+	spin_unlock_irq(&bitmap->bm_lock);
+
+	if (!nr_lost && !lost_all)
+		return;
+
+	drbd_warn(device, "Failed to allocate bitmap pages, marking the affected ranges out of sync\n");
+	for (i = 0; i < nr_lost; i++) {
+		if (!(lost_all & (1UL << lost[i].bitmap_index)))
+			__bm_many_bits_op(device, lost[i].bitmap_index,
+					  lost[i].start, lost[i].end, BM_OP_SET);
+	}
+	for_each_set_bit(i, &lost_all, DRBD_PEERS_MAX)
+		__bm_many_bits_op(device, i, 0, -1UL, BM_OP_SET);
+}
+
 void
 _drbd_bm_clear_many_bits(struct drbd_device *device, int bitmap_index, unsigned long start, unsigned long end)
 {
@@ -1641,6 +2475,8 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 	spin_lock_irq(&bitmap->bm_lock);
 
 	bitmap->bm_set[to_index] = 0;
+	for (current_page_nr = 0; current_page_nr < bitmap->bm_number_of_pages; current_page_nr++)
+		bm_summary_clear(bitmap, current_page_nr, to_index);
 	current_page_nr = 0;
 	addr = bm_map(bitmap, current_page_nr);
 	for (word_nr = 0; word_nr < words32_total; word_nr += bitmap->bm_max_peers) {
@@ -1667,9 +2503,28 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 			addr = bm_map(bitmap, current_page_nr);
 		}
 
-		if (addr[word32_in_page(to_word_nr)] != data_word)
-			bm_set_page_need_writeout(bitmap, current_page_nr);
-		addr[word32_in_page(to_word_nr)] = data_word;
+		if (addr[word32_in_page(to_word_nr)] != data_word) {
+			if (!bm_page_present(bitmap, current_page_nr)) {
+				unsigned long bit = word_nr / bitmap->bm_max_peers * 32;
+
+				bm_unmap(bitmap, addr);
+				bm_prealloc_page(bitmap, current_page_nr);
+				if (!bm_page_present(bitmap, current_page_nr))
+					bm_materialize_page(device, to_index, current_page_nr,
+							    bit, bit + 31);
+				addr = bm_map(bitmap, current_page_nr);
+			}
+			if (bm_page_present(bitmap, current_page_nr)) {
+				if (bm_cow_page(bitmap, current_page_nr)) {
+					bm_unmap(bitmap, addr);
+					addr = bm_map(bitmap, current_page_nr);
+				}
+				bm_set_page_need_writeout(bitmap, current_page_nr);
+				addr[word32_in_page(to_word_nr)] = data_word;
+			}
+		}
+		if (data_word)
+			bm_summary_set(bitmap, current_page_nr, to_index);
 		bitmap->bm_set[to_index] += hweight32(data_word);
 	}
 	bm_unmap(bitmap, addr);
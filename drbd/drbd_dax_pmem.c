@@ -29,10 +29,21 @@
 #include "drbd_dax_pmem.h"
 #include "drbd_meta_data.h"
 
+/*
+ * The meta data may live on a partition, or on an external meta data device
+ * that supports DAX while the backing device does not.  dax_direct_access()
+ * works on offsets relative to the start of the whole dax device, so add the
+ * start of the partition that holds the meta data.
+ */
+static pgoff_t md_sector_to_pgoff(struct drbd_backing_dev *bdev, sector_t sector)
+{
+	return (get_start_sect(bdev->md_bdev) + sector) >> (PAGE_SHIFT - SECTOR_SHIFT);
+}
+
 static int map_superblock_for_dax(struct drbd_backing_dev *bdev, struct dax_device *dax_dev)
 {
 	long want = 1;
-	pgoff_t pgoff = bdev->md.md_offset >> (PAGE_SHIFT - SECTOR_SHIFT);
+	pgoff_t pgoff = md_sector_to_pgoff(bdev, bdev->md.md_offset);
 	void *kaddr;
 	long len;
 	pfn_t pfn_unused; /* before 4.18 it is required to pass in non-NULL */
@@ -60,6 +71,10 @@ int drbd_dax_open(struct drbd_backing_dev *bdev)
 	int err;
 	u64 part_off;
 
+	/* Partitions that do not start page aligned can not be mapped. */
+	if (get_start_sect(bdev->md_bdev) & ((PAGE_SIZE >> SECTOR_SHIFT) - 1))
+		return -ENODEV;
+
 	dax_dev = fs_dax_get_by_bdev(bdev->md_bdev, &part_off, NULL, NULL);
 	if (!dax_dev)
 		return -ENODEV;
@@ -88,7 +103,7 @@ int drbd_dax_map(struct drbd_backing_dev *bdev)
 	sector_t first_sector = drbd_md_first_sector(bdev);
 	sector_t al_sector = bdev->md.md_offset + bdev->md.al_offset;
 	long want = (drbd_md_last_sector(bdev) + 1 - first_sector) >> (PAGE_SHIFT - SECTOR_SHIFT);
-	pgoff_t pgoff = first_sector >> (PAGE_SHIFT - SECTOR_SHIFT);
+	pgoff_t pgoff = md_sector_to_pgoff(bdev, first_sector);
 	long md_offset_byte = (bdev->md.md_offset - first_sector) << SECTOR_SHIFT;
 	long al_offset_byte = (al_sector - first_sector) << SECTOR_SHIFT;
 	void *kaddr;
@@ -1,12 +1,14 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #define pr_fmt(fmt)	KBUILD_MODNAME " debugfs: " fmt
 #include <linux/kernel.h>
+#include <linux/ctype.h>
 #include <linux/module.h>
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
 #include <linux/stat.h>
 #include <linux/jiffies.h>
 #include <linux/list.h>
+#include <linux/random.h>
 #include <generated/utsrelease.h>
 
 #include "drbd_int.h"
@@ -167,6 +169,27 @@ static void seq_print_minor_vnr_req(struct seq_file *m, struct drbd_request *req
 	seq_print_one_request(m, req, now, jif);
 }
 
+static void seq_print_pending_md_io(struct seq_file *m, struct drbd_device *device,
+				    struct drbd_md_io *md_io, unsigned long jif)
+{
+	struct drbd_md_io tmp;
+	/* In theory this is racy,
+	 * in the sense that there could have been a
+	 * drbd_md_put_buffer(); drbd_md_get_buffer();
+	 * between accessing these members here.  */
+	tmp = *md_io;
+	if (atomic_read(&tmp.in_use)) {
+		seq_printf(m, "%u\t%u\t%d\t",
+			device->minor, device->vnr,
+			jiffies_to_msecs(jif - tmp.start_jif));
+		if (time_before(tmp.submit_jif, tmp.start_jif))
+			seq_puts(m, "-\t");
+		else
+			seq_printf(m, "%d\t", jiffies_to_msecs(jif - tmp.submit_jif));
+		seq_printf(m, "%s\n", tmp.current_use);
+	}
+}
+
 static void seq_print_resource_pending_meta_io(struct seq_file *m, struct drbd_resource *resource, unsigned long jif)
 {
 	struct drbd_device *device;
@@ -175,22 +198,8 @@ static void seq_print_resource_pending_meta_io(struct seq_file *m, struct drbd_r
 	seq_puts(m, "minor\tvnr\tstart\tsubmit\tintent\n");
 	rcu_read_lock();
 	idr_for_each_entry(&resource->devices, device, i) {
-		struct drbd_md_io tmp;
-		/* In theory this is racy,
-		 * in the sense that there could have been a
-		 * drbd_md_put_buffer(); drbd_md_get_buffer();
-		 * between accessing these members here.  */
-		tmp = device->md_io;
-		if (atomic_read(&tmp.in_use)) {
-			seq_printf(m, "%u\t%u\t%d\t",
-				device->minor, device->vnr,
-				jiffies_to_msecs(jif - tmp.start_jif));
-			if (time_before(tmp.submit_jif, tmp.start_jif))
-				seq_puts(m, "-\t");
-			else
-				seq_printf(m, "%d\t", jiffies_to_msecs(jif - tmp.submit_jif));
-			seq_printf(m, "%s\n", tmp.current_use);
-		}
+		seq_print_pending_md_io(m, device, &device->md_io, jif);
+		seq_print_pending_md_io(m, device, &device->md_sb_io, jif);
 	}
 	rcu_read_unlock();
 }
@@ -236,6 +245,7 @@ static void seq_print_device_bitmap_io(struct seq_file *m, struct drbd_device *d
 	struct drbd_bm_aio_ctx *ctx;
 	unsigned long start_jif;
 	unsigned int in_flight;
+	unsigned int pages_done;
 	unsigned int flags;
 	spin_lock_irq(&device->pending_bmio_lock);
 	ctx = list_first_entry_or_null(&device->pending_bitmap_io, struct drbd_bm_aio_ctx, list);
@@ -244,15 +254,16 @@ static void seq_print_device_bitmap_io(struct seq_file *m, struct drbd_device *d
 	if (ctx) {
 		start_jif = ctx->start_jif;
 		in_flight = atomic_read(&ctx->in_flight);
+		pages_done = atomic_read(&ctx->pages_done);
 		flags = ctx->flags;
 	}
 	spin_unlock_irq(&device->pending_bmio_lock);
 	if (ctx) {
-		seq_printf(m, "%u\t%u\t%c\t%u\t%u\n",
+		seq_printf(m, "%u\t%u\t%c\t%u\t%u\t%u\n",
 			device->minor, device->vnr,
 			(flags & BM_AIO_READ) ? 'R' : 'W',
 			jiffies_to_msecs(jif - start_jif),
-			in_flight);
+			in_flight, pages_done);
 	}
 }
 
@@ -261,7 +272,7 @@ static void seq_print_resource_pending_bitmap_io(struct seq_file *m, struct drbd
 	struct drbd_device *device;
 	int i;
 
-	seq_puts(m, "minor\tvnr\trw\tage\t#in-flight\n");
+	seq_puts(m, "minor\tvnr\trw\tage\t#in-flight\t#pages-done\n");
 	rcu_read_lock();
 	idr_for_each_entry(&resource->devices, device, i) {
 		seq_print_device_bitmap_io(m, device, jif);
@@ -285,6 +296,8 @@ static void seq_print_peer_request_flags(struct seq_file *m, struct drbd_peer_re
 	seq_print_rq_state_bit(m, f & EE_TRIM, &sep, "trim");
 	seq_print_rq_state_bit(m, f & EE_ZEROOUT, &sep, "zero-out");
 	seq_print_rq_state_bit(m, f & EE_WRITE_SAME, &sep, "write-same");
+	seq_print_rq_state_bit(m, f & EE_RS_SHARE_LEADER, &sep, "rs-share-leader");
+	seq_print_rq_state_bit(m, f & EE_RS_SHARED, &sep, "rs-shared");
 	seq_putc(m, '\n');
 }
 
@@ -578,6 +591,55 @@ static int resource_members_show(struct seq_file *m, void *pos)
 	return 0;
 }
 
+static int resource_page_pool_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_connection *connection;
+
+	seq_printf(m, "vacant: %d\n", READ_ONCE(resource->pp_vacant));
+	seq_printf(m, "magazines: %d\n", atomic_read(&resource->pp_magazine_pages));
+	seq_printf(m, "req_mem_wait: %d\n", atomic_read(&resource->req_mem_wait));
+
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		seq_printf(m, "%s: in_use: %d in_use_by_net: %d reserve: %u/%u"
+			   " reserve_hits: %d mem_wait: %d\n",
+			   rcu_dereference(connection->transport.net_conf)->name,
+			   atomic_read(&connection->pp_in_use),
+			   atomic_read(&connection->pp_in_use_by_net),
+			   READ_ONCE(connection->pp_reserve_vacant),
+			   READ_ONCE(connection->pp_reserve_target),
+			   atomic_read(&connection->pp_reserve_hits),
+			   atomic_read(&connection->pp_mem_wait));
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int resource_promote_timing_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_promote_timing pt;
+
+	/* drbd_set_role() writes it under state_sem, also for auto-promote */
+	if (down_interruptible(&resource->state_sem))
+		return -EINTR;
+	pt = resource->promote_timing;
+	up(&resource->state_sem);
+
+	if (!pt.when) {
+		seq_puts(m, "not promoted yet\n");
+		return 0;
+	}
+	seq_printf(m, "when: %lld\n", (long long)pt.when);
+	seq_printf(m, "tries: %u\n", pt.tries);
+	seq_printf(m, "check_peers_us: %lld\n", ktime_to_us(pt.check_peers));
+	seq_printf(m, "wait_up_to_date_us: %lld\n", ktime_to_us(pt.wait_up_to_date));
+	seq_printf(m, "state_change_us: %lld\n", ktime_to_us(pt.state_change));
+	seq_printf(m, "finish_us: %lld\n", ktime_to_us(pt.finish));
+	return 0;
+}
+
 /* make sure at *open* time that the respective object won't go away. */
 static int drbd_single_open(struct file *file, int (*show)(struct seq_file *, void *),
 		                void *data, struct kref *kref,
@@ -634,6 +696,8 @@ drbd_debugfs_resource_attr(in_flight_summary)
 drbd_debugfs_resource_attr(state_twopc)
 drbd_debugfs_resource_attr(worker_pid)
 drbd_debugfs_resource_attr(members)
+drbd_debugfs_resource_attr(page_pool)
+drbd_debugfs_resource_attr(promote_timing)
 
 #define drbd_dcf(top, obj, attr, perm) do {			\
 	dentry = debugfs_create_file(#attr, perm,		\
@@ -671,6 +735,8 @@ void drbd_debugfs_resource_add(struct drbd_resource *resource)
 	res_dcf(state_twopc);
 	res_dcf(worker_pid);
 	res_dcf(members);
+	res_dcf(page_pool);
+	res_dcf(promote_timing);
 }
 
 static void drbd_debugfs_remove(struct dentry **dp)
@@ -689,6 +755,8 @@ void drbd_debugfs_resource_cleanup(struct drbd_resource *resource)
 	 * and call debugfs_remove on all of them separately.
 	 */
 	/* it is ok to call debugfs_remove(NULL) */
+	drbd_debugfs_remove(&resource->debugfs_res_promote_timing);
+	drbd_debugfs_remove(&resource->debugfs_res_page_pool);
 	drbd_debugfs_remove(&resource->debugfs_res_members);
 	drbd_debugfs_remove(&resource->debugfs_res_worker_pid);
 	drbd_debugfs_remove(&resource->debugfs_res_state_twopc);
@@ -798,14 +866,41 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 	struct drbd_transport_ops *tr_ops = transport->ops;
 	enum drbd_stream i;
 
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
+
+	if (connection->ping_rtt_count)
+		seq_printf(m, "ping rtt: %uus (min %uus, avg %uus, dev %uus, max %uus, %u samples)\n\n",
+			   connection->ping_rtt_us, connection->ping_rtt_min_us,
+			   connection->ping_rtt_avg_us, connection->ping_rtt_dev_us,
+			   connection->ping_rtt_max_us, connection->ping_rtt_count);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+		int j, spares = 0, busy = 0;
+
+		for (j = 0; j < DRBD_SEND_BUFFER_SPARES; j++) {
+			struct page *page = READ_ONCE(sbuf->spare[j]);
+
+			if (!page)
+				continue;
+			spares++;
+			if (page_count(page) > 1)
+				busy++;
+		}
 		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
 		seq_printf(m, "  corked: %d\n", test_bit(CORKED + i, &connection->flags));
 		seq_printf(m, "  unsent: %ld bytes\n", (long)(sbuf->pos - sbuf->unsent));
 		seq_printf(m, "  allocated: %d bytes\n", sbuf->allocated_size);
+		seq_printf(m, "  spare pages: %d (%d in flight)\n", spares, busy);
+		for (j = 0; j < DRBD_SEND_CMD_STATS; j++) {
+			u64 packets = READ_ONCE(sbuf->cmd_stats[j].packets);
+
+			if (!packets)
+				continue;
+			seq_printf(m, "  %-20s %12llu packets %16llu bytes\n",
+				   j == DRBD_SEND_CMD_STATS - 1 ? "other" : drbd_packet_name(j),
+				   packets, READ_ONCE(sbuf->cmd_stats[j].bytes));
+		}
 	}
 
 	seq_printf(m, "\ntransport_type: %s\n", transport->class->name);
@@ -922,7 +1017,7 @@ static int connection_attr_release(struct inode *inode, struct file *file)
 	return single_release(inode, file);
 }
 
-#define drbd_debugfs_connection_attr(name)				\
+#define __drbd_debugfs_connection_attr(name, write_fn)			\
 static int connection_ ## name ## _open(struct inode *inode, struct file *file) \
 {									\
 	struct drbd_connection *connection = inode->i_private;		\
@@ -933,10 +1028,12 @@ static int connection_ ## name ## _open(struct inode *inode, struct file *file)
 static const struct file_operations connection_ ## name ## _fops = {	\
 	.owner		= THIS_MODULE,				      	\
 	.open		= connection_ ## name ##_open,			\
+	.write		= write_fn,					\
 	.read		= seq_read,					\
 	.llseek		= seq_lseek,					\
 	.release	= connection_attr_release,			\
 };
+#define drbd_debugfs_connection_attr(name) __drbd_debugfs_connection_attr(name, NULL)
 
 drbd_debugfs_connection_attr(oldest_requests)
 drbd_debugfs_connection_attr(callback_history)
@@ -946,6 +1043,40 @@ drbd_debugfs_connection_attr(receiver_pid)
 drbd_debugfs_connection_attr(ack_receiver_pid)
 drbd_debugfs_connection_attr(sender_pid)
 
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+static int connection_send_delay_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_connection *connection = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "kib_per_sec: %u\n", READ_ONCE(connection->send_delay.kib_per_sec));
+	return 0;
+}
+
+/* "<kib_per_sec>", limits the data stream; 0 to turn it off */
+static ssize_t connection_send_delay_write(struct file *file, const char __user *ubuf,
+					   size_t cnt, loff_t *ppos)
+{
+	struct drbd_connection *connection = file_inode(file)->i_private;
+	unsigned int kib_per_sec;
+	int err;
+
+	err = kstrtouint_from_user(ubuf, cnt, 0, &kib_per_sec);
+	if (err)
+		return err;
+
+	mutex_lock(&connection->mutex[DATA_STREAM]);
+	connection->send_delay.kib_per_sec = kib_per_sec;
+	connection->send_delay.busy_until_kt = 0;
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
+
+	*ppos += cnt;
+	return cnt;
+}
+__drbd_debugfs_connection_attr(send_delay, connection_send_delay_write)
+#endif
+
 void drbd_debugfs_connection_add(struct drbd_connection *connection)
 {
 	struct dentry *conns_dir = connection->resource->debugfs_res_connections;
@@ -969,6 +1100,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 	conn_dcf(receiver_pid);
 	conn_dcf(ack_receiver_pid);
 	conn_dcf(sender_pid);
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	drbd_dcf(connection->debugfs_conn, connection, send_delay, 0600);
+#endif
 
 	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 		if (!peer_device->debugfs_peer_dev)
@@ -978,6 +1112,9 @@ void drbd_debugfs_connection_add(struct drbd_connection *connection)
 
 void drbd_debugfs_connection_cleanup(struct drbd_connection *connection)
 {
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	drbd_debugfs_remove(&connection->debugfs_conn_send_delay);
+#endif
 	drbd_debugfs_remove(&connection->debugfs_conn_sender_pid);
 	drbd_debugfs_remove(&connection->debugfs_conn_ack_receiver_pid);
 	drbd_debugfs_remove(&connection->debugfs_conn_receiver_pid);
@@ -1030,6 +1167,573 @@ static int device_act_log_histogram_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_act_log_stats_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_al_stats_window windows[AL_STATS_WINDOWS];
+	unsigned long now = jiffies;
+	unsigned int cur, nr_elements = 0, i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	if (!get_ldev_if_state(device, D_FAILED))
+		return 0;
+
+	drbd_al_stats_update(device);
+	spin_lock_irq(&device->al_lock);
+	memcpy(windows, device->al_stats, sizeof(windows));
+	cur = device->al_stats_cur;
+	if (device->act_log)
+		nr_elements = device->act_log->nr_elements;
+	spin_unlock_irq(&device->al_lock);
+
+	seq_printf(m, "al-extents: %u\nring-buffer-4k: %u\n\n",
+		   nr_elements, device->ldev->md.al_size_4k);
+	seq_puts(m, "age_ms\thits\tmisses\ttransactions\tmax-in-use\n");
+	/* newest window first */
+	for (i = 0; i < AL_STATS_WINDOWS; i++) {
+		struct drbd_al_stats_window *w =
+			&windows[(cur + AL_STATS_WINDOWS - i) % AL_STATS_WINDOWS];
+
+		if (!w->start_jif)
+			break;
+		seq_printf(m, "%u\t%lu\t%lu\t%u\t%u\n",
+			   jiffies_to_msecs(now - w->start_jif),
+			   w->hits, w->misses, w->transactions, w->max_used);
+	}
+	put_ldev(device);
+	return 0;
+}
+
+#define AL_HEAT_TOP 32
+
+static unsigned int al_heat_estimate(struct drbd_device *device, unsigned int enr)
+{
+	unsigned int est = UINT_MAX;
+	int row;
+
+	for (row = 0; row < AL_HEAT_DEPTH; row++)
+		est = min(est, READ_ONCE(device->al_heat[row][drbd_al_heat_hash(enr, row)]));
+	return est;
+}
+
+static int device_act_log_heat_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	unsigned int top_enr[AL_HEAT_TOP], top_cnt[AL_HEAT_TOP];
+	unsigned int nr_top = 0, enr, nr_extents, i;
+	sector_t capacity = get_capacity(device->vdisk);
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "samples: %lu (one in %u writes)\n\n",
+		   device->al_heat_samples, drbd_al_heat_sample);
+
+	seq_puts(m, "region\tstart_sector\tsamples\n");
+	for (i = 0; i < AL_HEAT_REGIONS; i++)
+		seq_printf(m, "%u\t%llu\t%u\n", i,
+			   (unsigned long long)div_u64((u64)capacity * i, AL_HEAT_REGIONS),
+			   READ_ONCE(device->al_heat_region[i]));
+
+	/* The sketch over-estimates, by up to about 1% of the samples, see
+	 * AL_HEAT_DEPTH. Good enough to find extents far hotter than the rest. */
+	nr_extents = (capacity >> (AL_EXTENT_SHIFT - 9)) + 1;
+	for (enr = 0; enr < nr_extents; enr++) {
+		unsigned int cnt = al_heat_estimate(device, enr);
+
+		if (!(enr & 4095))
+			cond_resched();
+		if (!cnt || (nr_top == AL_HEAT_TOP && cnt <= top_cnt[nr_top - 1]))
+			continue;
+		if (nr_top < AL_HEAT_TOP)
+			nr_top++;
+		for (i = nr_top - 1; i > 0 && top_cnt[i - 1] < cnt; i--) {
+			top_cnt[i] = top_cnt[i - 1];
+			top_enr[i] = top_enr[i - 1];
+		}
+		top_cnt[i] = cnt;
+		top_enr[i] = enr;
+	}
+
+	seq_puts(m, "\nal_extent\tstart_sector\tsamples(max)\n");
+	for (i = 0; i < nr_top; i++)
+		seq_printf(m, "%u\t%llu\t%u\n", top_enr[i],
+			   (unsigned long long)top_enr[i] << (AL_EXTENT_SHIFT - 9), top_cnt[i]);
+	return 0;
+}
+
+static ssize_t device_act_log_heat_write(struct file *file, const char __user *ubuf,
+					 size_t cnt, loff_t *ppos)
+{
+	struct drbd_device *device = file_inode(file)->i_private;
+	char buffer;
+
+	if (copy_from_user(&buffer, ubuf, 1))
+		return -EFAULT;
+
+	if (buffer == 'r' || buffer == 'R') {
+		memset(device->al_heat, 0, sizeof(device->al_heat));
+		memset(device->al_heat_region, 0, sizeof(device->al_heat_region));
+		device->al_heat_samples = 0;
+	}
+
+	*ppos += cnt;
+	return cnt;
+}
+
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+/* Caller holds io_delay_lock */
+static void io_delay_update_active(struct drbd_device *device)
+{
+	bool active = device->io_null;
+	int i;
+
+	for (i = 0; i < DRBD_DELAY_CLASSES; i++)
+		active |= device->io_delay[i].delay_us || device->io_delay[i].jitter_us ||
+			device->io_delay[i].kib_per_sec;
+	WRITE_ONCE(device->io_delay_active, active);
+}
+
+static const char * const io_delay_class_names[DRBD_DELAY_CLASSES] = {
+	[DRBD_DELAY_DATA] = "data",
+	[DRBD_DELAY_RESYNC] = "resync",
+	[DRBD_DELAY_META] = "meta",
+};
+
+static int device_io_delay_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_io_delay io_delay[DRBD_DELAY_CLASSES];
+	int i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	spin_lock_irq(&device->io_delay_lock);
+	memcpy(io_delay, device->io_delay, sizeof(io_delay));
+	spin_unlock_irq(&device->io_delay_lock);
+
+	seq_puts(m, "class\tdelay_us\tjitter_us\tkib_per_sec\n");
+	for (i = 0; i < DRBD_DELAY_CLASSES; i++)
+		seq_printf(m, "%s\t%u\t%u\t%u\n", io_delay_class_names[i],
+			   io_delay[i].delay_us, io_delay[i].jitter_us, io_delay[i].kib_per_sec);
+	return 0;
+}
+
+/* "<class> <delay_us> <jitter_us> <kib_per_sec>", all zero turns it off */
+static ssize_t device_io_delay_write(struct file *file, const char __user *ubuf,
+				     size_t cnt, loff_t *ppos)
+{
+	struct drbd_device *device = file_inode(file)->i_private;
+	unsigned int delay_us, jitter_us, kib_per_sec;
+	char buffer[64], name[8];
+	int i;
+
+	if (cnt >= sizeof(buffer))
+		return -EINVAL;
+	if (copy_from_user(buffer, ubuf, cnt))
+		return -EFAULT;
+	buffer[cnt] = 0;
+
+	if (sscanf(buffer, "%7s %u %u %u", name, &delay_us, &jitter_us, &kib_per_sec) != 4)
+		return -EINVAL;
+	for (i = 0; i < DRBD_DELAY_CLASSES; i++)
+		if (!strcmp(name, io_delay_class_names[i]))
+			break;
+	if (i == DRBD_DELAY_CLASSES)
+		return -EINVAL;
+
+	spin_lock_irq(&device->io_delay_lock);
+	device->io_delay[i].delay_us = delay_us;
+	device->io_delay[i].jitter_us = jitter_us;
+	device->io_delay[i].kib_per_sec = kib_per_sec;
+	device->io_delay[i].busy_until_kt = 0;
+	io_delay_update_active(device);
+	spin_unlock_irq(&device->io_delay_lock);
+
+	*ppos += cnt;
+	return cnt;
+}
+
+/*
+ * Synthetic load generator.  Submits bios straight to the DRBD block
+ * device, so that DRBD can be measured without a file system, the page
+ * cache or a userspace benchmark in the way.  All bios share the same
+ * pages, the data written is meaningless.
+ * With "null=1", data I/O of this device (including that of applications
+ * and peers) bypasses the backing device while the generator runs.
+ */
+#define LOADGEN_MAX_PAGES 32
+
+struct drbd_loadgen {
+	struct work_struct work;
+	struct drbd_device *device;
+	wait_queue_head_t wait;
+	bool stop;
+
+	/* parameters of the current or last run */
+	unsigned int size;		/* bytes per bio */
+	unsigned int depth;		/* bios in flight */
+	unsigned int write_pct;
+	bool random;			/* random or sequential offsets */
+	bool null;			/* set io_null while running */
+	u64 count;			/* bios to submit, 0: until stopped */
+
+	struct page *pages[LOADGEN_MAX_PAGES];
+
+	spinlock_t lock;		/* protects everything below */
+	bool running;
+	unsigned int in_flight;
+	u64 reads, writes, errors;
+	ktime_t start_kt, end_kt;
+	unsigned int hist[DRBD_LAT_HIST_BUCKETS];	/* submit to completion */
+};
+
+struct loadgen_bio {
+	struct drbd_loadgen *lg;
+	ktime_t start_kt;
+};
+
+static DEFINE_MUTEX(loadgen_mutex);
+
+static void loadgen_endio(struct bio *bio)
+{
+	struct loadgen_bio *lb = bio->bi_private;
+	struct drbd_loadgen *lg = lb->lg;
+	unsigned int bucket = drbd_lat_hist_bucket(ktime_sub(ktime_get(), lb->start_kt));
+	unsigned long flags;
+
+	spin_lock_irqsave(&lg->lock, flags);
+	if (bio->bi_status)
+		lg->errors++;
+	else if (op_is_write(bio_op(bio)))
+		lg->writes++;
+	else
+		lg->reads++;
+	lg->hist[bucket]++;
+	lg->in_flight--;
+	wake_up(&lg->wait);
+	spin_unlock_irqrestore(&lg->lock, flags);
+
+	kfree(lb);
+	bio_put(bio);
+}
+
+static bool loadgen_may_submit(struct drbd_loadgen *lg)
+{
+	bool rv;
+
+	spin_lock_irq(&lg->lock);
+	rv = lg->in_flight < lg->depth;
+	spin_unlock_irq(&lg->lock);
+	return rv || READ_ONCE(lg->stop);
+}
+
+static bool loadgen_idle(struct drbd_loadgen *lg)
+{
+	bool rv;
+
+	spin_lock_irq(&lg->lock);
+	rv = !lg->in_flight;
+	spin_unlock_irq(&lg->lock);
+	return rv;
+}
+
+static void loadgen_set_null(struct drbd_device *device, bool null)
+{
+	spin_lock_irq(&device->io_delay_lock);
+	device->io_null = null;
+	io_delay_update_active(device);
+	spin_unlock_irq(&device->io_delay_lock);
+}
+
+static void loadgen_work(struct work_struct *ws)
+{
+	struct drbd_loadgen *lg = container_of(ws, struct drbd_loadgen, work);
+	struct drbd_device *device = lg->device;
+	unsigned int nr_pages = DIV_ROUND_UP(lg->size, PAGE_SIZE);
+	sector_t nr_sectors = lg->size >> SECTOR_SHIFT;
+	sector_t capacity = get_capacity(device->vdisk);
+	u64 slots = div_u64(capacity, nr_sectors);
+	sector_t sector = 0;
+	u64 submitted = 0;
+
+	if (lg->null) {
+		drbd_warn(device, "load generator: data I/O bypasses the backing device\n");
+		loadgen_set_null(device, true);
+	}
+
+	while (slots && !READ_ONCE(lg->stop) && (!lg->count || submitted < lg->count)) {
+		struct loadgen_bio *lb;
+		struct bio *bio;
+		blk_opf_t opf;
+		unsigned int i, len;
+
+		wait_event(lg->wait, loadgen_may_submit(lg));
+		if (READ_ONCE(lg->stop))
+			break;
+
+		lb = kmalloc(sizeof(*lb), GFP_NOIO);
+		if (!lb)
+			break;
+		if (lg->random) {
+			u64 slot;
+
+			div64_u64_rem(get_random_u64(), slots, &slot);
+			sector = slot * nr_sectors;
+		} else if (sector + nr_sectors > capacity) {
+			sector = 0;
+		}
+		opf = get_random_u32_below(100) < lg->write_pct ? REQ_OP_WRITE : REQ_OP_READ;
+
+		bio = bio_alloc(device->vdisk->part0, nr_pages, opf, GFP_NOIO);
+		bio->bi_iter.bi_sector = sector;
+		for (i = 0; i < nr_pages; i++) {
+			len = min_t(unsigned int, lg->size - i * PAGE_SIZE, PAGE_SIZE);
+			bio_add_page(bio, lg->pages[i], len, 0);
+		}
+		bio->bi_private = lb;
+		bio->bi_end_io = loadgen_endio;
+		lb->lg = lg;
+
+		spin_lock_irq(&lg->lock);
+		lg->in_flight++;
+		spin_unlock_irq(&lg->lock);
+
+		lb->start_kt = ktime_get();
+		submit_bio(bio);
+		submitted++;
+		sector += nr_sectors;
+	}
+
+	wait_event(lg->wait, loadgen_idle(lg));
+
+	if (lg->null)
+		loadgen_set_null(device, false);
+
+	spin_lock_irq(&lg->lock);
+	lg->end_kt = ktime_get();
+	lg->running = false;
+	spin_unlock_irq(&lg->lock);
+}
+
+static void loadgen_stop(struct drbd_loadgen *lg)
+{
+	WRITE_ONCE(lg->stop, true);
+	wake_up(&lg->wait);
+	flush_work(&lg->work);
+}
+
+static void loadgen_free(struct drbd_device *device)
+{
+	struct drbd_loadgen *lg = device->loadgen;
+	int i;
+
+	if (!lg)
+		return;
+	loadgen_stop(lg);
+	/* the last loadgen_endio() may still be in wake_up() */
+	spin_lock_irq(&lg->lock);
+	spin_unlock_irq(&lg->lock);
+	for (i = 0; i < LOADGEN_MAX_PAGES; i++)
+		if (lg->pages[i])
+			__free_page(lg->pages[i]);
+	kfree(lg);
+	device->loadgen = NULL;
+}
+
+static struct drbd_loadgen *loadgen_get(struct drbd_device *device)
+{
+	struct drbd_loadgen *lg = device->loadgen;
+	int i;
+
+	if (lg)
+		return lg;
+	lg = kzalloc(sizeof(*lg), GFP_KERNEL);
+	if (!lg)
+		return NULL;
+	for (i = 0; i < LOADGEN_MAX_PAGES; i++) {
+		lg->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!lg->pages[i])
+			goto fail;
+	}
+	INIT_WORK(&lg->work, loadgen_work);
+	init_waitqueue_head(&lg->wait);
+	spin_lock_init(&lg->lock);
+	lg->device = device;
+	lg->size = 4096;
+	lg->depth = 32;
+	device->loadgen = lg;
+	return lg;
+
+fail:
+	while (i--)
+		__free_page(lg->pages[i]);
+	kfree(lg);
+	return NULL;
+}
+
+static int device_load_generator_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	struct drbd_loadgen *lg;
+	unsigned int hist[DRBD_LAT_HIST_BUCKETS];
+	u64 reads, writes, errors, elapsed_us;
+	unsigned int size;
+	bool running;
+	int i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	mutex_lock(&loadgen_mutex);
+	lg = device->loadgen;
+	if (!lg) {
+		mutex_unlock(&loadgen_mutex);
+		seq_puts(m, "idle; write \"start [size=B] [depth=N] [write=PCT] [random=0|1] "
+			 "[count=N] [null=0|1]\" or \"stop\"\n");
+		return 0;
+	}
+
+	spin_lock_irq(&lg->lock);
+	running = lg->running;
+	reads = lg->reads;
+	writes = lg->writes;
+	errors = lg->errors;
+	elapsed_us = ktime_us_delta(running ? ktime_get() : lg->end_kt, lg->start_kt);
+	memcpy(hist, lg->hist, sizeof(hist));
+	spin_unlock_irq(&lg->lock);
+
+	size = lg->size;
+	seq_printf(m, "state\t%s\nsize\t%u\ndepth\t%u\nwrite\t%u\nrandom\t%d\n"
+		   "count\t%llu\nnull\t%d\n\n",
+		   running ? "running" : "idle", size, lg->depth, lg->write_pct,
+		   lg->random, (unsigned long long)lg->count, lg->null);
+	mutex_unlock(&loadgen_mutex);
+
+	seq_printf(m, "reads\t%llu\nwrites\t%llu\nerrors\t%llu\nelapsed_us\t%llu\n",
+		   (unsigned long long)reads, (unsigned long long)writes,
+		   (unsigned long long)errors, (unsigned long long)elapsed_us);
+	if (elapsed_us)
+		seq_printf(m, "iops\t%llu\nkib_per_sec\t%llu\n",
+			   div64_u64((reads + writes) * USEC_PER_SEC, elapsed_us),
+			   div64_u64((reads + writes) * size / 1024 * USEC_PER_SEC,
+				     elapsed_us));
+
+	seq_puts(m, "\nbios by latency, microseconds\nbelow\tbios\n");
+	for (i = 0; i < DRBD_LAT_HIST_BUCKETS; i++) {
+		if (i < DRBD_LAT_HIST_BUCKETS - 1)
+			seq_printf(m, "%lu", 1UL << i);
+		else
+			seq_puts(m, "more");
+		seq_printf(m, "\t%u\n", hist[i]);
+	}
+	return 0;
+}
+
+static int loadgen_parse(struct drbd_loadgen *lg, char *args)
+{
+	unsigned int size = 4096, depth = 32, write_pct = 0;
+	bool random = false, null = false;
+	u64 count = 0;
+	char *tok, *val;
+	int err;
+
+	while ((tok = strsep(&args, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+		val = strchr(tok, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = 0;
+		if (!strcmp(tok, "size"))
+			err = kstrtouint(val, 0, &size);
+		else if (!strcmp(tok, "depth"))
+			err = kstrtouint(val, 0, &depth);
+		else if (!strcmp(tok, "write"))
+			err = kstrtouint(val, 0, &write_pct);
+		else if (!strcmp(tok, "random"))
+			err = kstrtobool(val, &random);
+		else if (!strcmp(tok, "count"))
+			err = kstrtou64(val, 0, &count);
+		else if (!strcmp(tok, "null"))
+			err = kstrtobool(val, &null);
+		else
+			err = -EINVAL;
+		if (err)
+			return err;
+	}
+
+	if (size < SECTOR_SIZE || size > LOADGEN_MAX_PAGES * PAGE_SIZE ||
+	    size % SECTOR_SIZE || !depth || depth > 1024 || write_pct > 100)
+		return -EINVAL;
+
+	lg->size = size;
+	lg->depth = depth;
+	lg->write_pct = write_pct;
+	lg->random = random;
+	lg->count = count;
+	lg->null = null;
+	return 0;
+}
+
+/* "start [size=B] [depth=N] [write=PCT] [random=0|1] [count=N] [null=0|1]" or "stop" */
+static ssize_t device_load_generator_write(struct file *file, const char __user *ubuf,
+					   size_t cnt, loff_t *ppos)
+{
+	struct drbd_device *device = file_inode(file)->i_private;
+	struct drbd_loadgen *lg;
+	char buffer[128], *args;
+	int err = 0;
+
+	if (cnt >= sizeof(buffer))
+		return -EINVAL;
+	if (copy_from_user(buffer, ubuf, cnt))
+		return -EFAULT;
+	buffer[cnt] = 0;
+	args = strim(buffer);
+
+	mutex_lock(&loadgen_mutex);
+	if (!strcmp(args, "stop")) {
+		if (device->loadgen)
+			loadgen_stop(device->loadgen);
+	} else if (!strncmp(args, "start", 5) && (!args[5] || isspace(args[5]))) {
+		lg = loadgen_get(device);
+		if (!lg) {
+			err = -ENOMEM;
+			goto out;
+		}
+		if (READ_ONCE(lg->running)) {
+			err = -EBUSY;
+			goto out;
+		}
+		err = loadgen_parse(lg, args + 5);
+		if (err)
+			goto out;
+
+		spin_lock_irq(&lg->lock);
+		lg->running = true;
+		lg->reads = lg->writes = lg->errors = 0;
+		memset(lg->hist, 0, sizeof(lg->hist));
+		lg->start_kt = ktime_get();
+		spin_unlock_irq(&lg->lock);
+		lg->stop = false;
+		queue_work(system_long_wq, &lg->work);
+	} else {
+		err = -EINVAL;
+	}
+out:
+	mutex_unlock(&loadgen_mutex);
+	if (err)
+		return err;
+
+	*ppos += cnt;
+	return cnt;
+}
+#endif
+
 static int device_act_log_extents_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -1185,6 +1889,38 @@ static int device_io_frozen_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_discards_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "discarded_kib: %llu\n",
+		   (unsigned long long)atomic64_read(&device->discarded_sectors) >> 1);
+	seq_printf(m, "zeroed_kib: %llu\n",
+		   (unsigned long long)atomic64_read(&device->zeroed_sectors) >> 1);
+	seq_printf(m, "merged_peer_requests: %llu\n",
+		   (unsigned long long)atomic64_read(&device->merged_discards));
+	return 0;
+}
+
+static int device_write_conflicts_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_printf(m, "peer_seq_waits: %llu\n",
+		   (unsigned long long)atomic64_read(&device->peer_seq_waits));
+	seq_printf(m, "peer_write_conflicts: %llu\n",
+		   (unsigned long long)atomic64_read(&device->peer_write_conflicts));
+	seq_printf(m, "local_write_waits: %llu\n",
+		   (unsigned long long)atomic64_read(&device->local_write_waits));
+	return 0;
+}
+
 static int device_ed_gen_id_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
@@ -1205,6 +1941,7 @@ static int device_req_timing_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_device *device = m->private;
 	struct drbd_peer_device *peer_device;
+	int i;
 
 	seq_printf(m,
 		   "timing values are nanoseconds; write an 'r' to reset all to 0\n\n"
@@ -1237,6 +1974,24 @@ static int device_req_timing_show(struct seq_file *m, void *ignored)
 	show_per_peer(acked_kt);
 	show_per_peer(net_done_kt);
 
+	seq_printf(m, "\nrequests by latency, microseconds; acked per peer\n%-12s %12s %12s",
+		   "below", "in_actlog", "pre_submit");
+	for_each_peer_device(peer_device, device) {
+		struct drbd_connection *connection = peer_device->connection;
+		seq_printf(m, " %12.12s", rcu_dereference(connection->transport.net_conf)->name);
+	}
+	seq_puts(m, "\n");
+	for (i = 0; i < DRBD_LAT_HIST_BUCKETS; i++) {
+		if (i < DRBD_LAT_HIST_BUCKETS - 1)
+			seq_printf(m, "%-12lu", 1UL << i);
+		else
+			seq_printf(m, "%-12s", "more");
+		seq_printf(m, " %12u %12u", device->in_actlog_hist[i], device->pre_submit_hist[i]);
+		for_each_peer_device(peer_device, device)
+			seq_printf(m, " %12u", peer_device->acked_hist[i]);
+		seq_puts(m, "\n");
+	}
+
 	return 0;
 }
 
@@ -1264,11 +2019,14 @@ static ssize_t device_req_timing_write(struct file *file, const char __user *ubu
 		device->al_before_bm_write_hinted_kt = ns_to_ktime(0);
 		device->al_mid_kt = ns_to_ktime(0);
 		device->al_after_sync_page_kt = ns_to_ktime(0);
+		memset(device->in_actlog_hist, 0, sizeof(device->in_actlog_hist));
+		memset(device->pre_submit_hist, 0, sizeof(device->pre_submit_hist));
 
 		for_each_peer_device(peer_device, device) {
 			peer_device->pre_send_kt = ns_to_ktime(0);
 			peer_device->acked_kt = ns_to_ktime(0);
 			peer_device->net_done_kt = ns_to_ktime(0);
+			memset(peer_device->acked_hist, 0, sizeof(peer_device->acked_hist));
 		}
 		spin_unlock_irqrestore(&device->timing_lock, flags);
 	}
@@ -1305,15 +2063,23 @@ static const struct file_operations device_ ## name ## _fops = {		\
 drbd_debugfs_device_attr(oldest_requests)
 drbd_debugfs_device_attr(act_log_extents)
 drbd_debugfs_device_attr(act_log_histogram)
+drbd_debugfs_device_attr(act_log_stats)
+__drbd_debugfs_device_attr(act_log_heat, device_act_log_heat_write)
 drbd_debugfs_device_attr(data_gen_id)
 drbd_debugfs_device_attr(io_frozen)
+drbd_debugfs_device_attr(discards)
 drbd_debugfs_device_attr(ed_gen_id)
 drbd_debugfs_device_attr(openers)
 drbd_debugfs_device_attr(md_io)
 drbd_debugfs_device_attr(interval_tree)
+drbd_debugfs_device_attr(write_conflicts)
 #ifdef CONFIG_DRBD_TIMING_STATS
 __drbd_debugfs_device_attr(req_timing, device_req_timing_write)
 #endif
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+__drbd_debugfs_device_attr(io_delay, device_io_delay_write)
+__drbd_debugfs_device_attr(load_generator, device_load_generator_write)
+#endif
 
 void drbd_debugfs_device_add(struct drbd_device *device)
 {
@@ -1345,15 +2111,23 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(oldest_requests);
 	vol_dcf(act_log_extents);
 	vol_dcf(act_log_histogram);
+	vol_dcf(act_log_stats);
+	drbd_dcf(device->debugfs_vol, device, act_log_heat, 0600);
 	vol_dcf(data_gen_id);
 	vol_dcf(io_frozen);
+	vol_dcf(discards);
 	vol_dcf(ed_gen_id);
 	vol_dcf(openers);
 	vol_dcf(md_io);
 	vol_dcf(interval_tree);
+	vol_dcf(write_conflicts);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_dcf(device->debugfs_vol, device, req_timing, 0600);
 #endif
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	drbd_dcf(device->debugfs_vol, device, io_delay, 0600);
+	drbd_dcf(device->debugfs_vol, device, load_generator, 0600);
+#endif
 
 	/* Caller holds conf_update */
 	for_each_peer_device(peer_device, device) {
@@ -1374,14 +2148,24 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_oldest_requests);
 	drbd_debugfs_remove(&device->debugfs_vol_act_log_extents);
 	drbd_debugfs_remove(&device->debugfs_vol_act_log_histogram);
+	drbd_debugfs_remove(&device->debugfs_vol_act_log_stats);
+	drbd_debugfs_remove(&device->debugfs_vol_act_log_heat);
 	drbd_debugfs_remove(&device->debugfs_vol_data_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_io_frozen);
+	drbd_debugfs_remove(&device->debugfs_vol_discards);
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_openers);
 	drbd_debugfs_remove(&device->debugfs_vol_md_io);
 	drbd_debugfs_remove(&device->debugfs_vol_interval_tree);
+	drbd_debugfs_remove(&device->debugfs_vol_write_conflicts);
 #ifdef CONFIG_DRBD_TIMING_STATS
 	drbd_debugfs_remove(&device->debugfs_vol_req_timing);
+#endif
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	drbd_debugfs_remove(&device->debugfs_vol_io_delay);
+	drbd_debugfs_remove(&device->debugfs_vol_load_generator);
+	/* no more writers, stop it before the disk goes away */
+	loadgen_free(device);
 #endif
 	drbd_debugfs_remove(&device->debugfs_vol);
 }
@@ -1639,6 +2423,7 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 {
 	struct drbd_peer_device *peer_device = m->private;
 	struct drbd_device *device = peer_device->device;
+	struct drbd_io_cnt io_cnt = drbd_device_io_cnt(device);
 	union drbd_state state;
 	const char *sn;
 	struct net_conf *nc;
@@ -1680,8 +2465,8 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 		   test_bit(AL_SUSPENDED, &device->flags) ? 's' : '-',
 		   peer_device->send_cnt/2,
 		   peer_device->recv_cnt/2,
-		   device->writ_cnt/2,
-		   device->read_cnt/2,
+		   io_cnt.writ_cnt/2,
+		   io_cnt.read_cnt/2,
 		   device->al_writ_cnt,
 		   device->bm_writ_cnt,
 		   atomic_read(&device->local_cnt),
@@ -1720,6 +2505,49 @@ static int peer_device_proc_drbd_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+/* Oldest sample first. Rates are per second of the sample; "req" is what
+ * was requested, derived from what came in and how in flight changed. */
+static int peer_device_resync_telemetry_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+	struct drbd_rs_telemetry *t = &peer_device->rs_tele;
+	struct drbd_rs_sample *samples, *s;
+	unsigned int nr, pos, prev_in_flight_kib = 0;
+	unsigned long now = jiffies;
+	int i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	samples = kmalloc_array(DRBD_RS_SAMPLES, sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+	spin_lock(&t->lock);
+	nr = t->nr;
+	pos = t->pos;
+	memcpy(samples, t->samples, sizeof(t->samples));
+	spin_unlock(&t->lock);
+
+	seq_puts(m, "age_ms\tms\tin_kib_s\treq_kib_s\tin_flight_kib\twant_kib_s\tthrottled\tapp_kib_s\n");
+	for (i = 0; i < nr; i++) {
+		unsigned int req_kib, ms;
+
+		s = &samples[(pos + DRBD_RS_SAMPLES - nr + i) % DRBD_RS_SAMPLES];
+		ms = max(s->ms, 1U);
+		req_kib = i && s->in_kib + s->in_flight_kib > prev_in_flight_kib ?
+			s->in_kib + s->in_flight_kib - prev_in_flight_kib : s->in_kib;
+		seq_printf(m, "%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\n",
+			   jiffies_to_msecs(now - s->jif), s->ms,
+			   (unsigned int)div_u64((u64)s->in_kib * MSEC_PER_SEC, ms),
+			   (unsigned int)div_u64((u64)req_kib * MSEC_PER_SEC, ms),
+			   s->in_flight_kib, s->want_kib_s, s->throttled,
+			   (unsigned int)div_u64((u64)s->app_kib * MSEC_PER_SEC, ms));
+		prev_in_flight_kib = s->in_flight_kib;
+	}
+	kfree(samples);
+	return 0;
+}
+
 #define drbd_debugfs_peer_device_attr(name)					\
 static int peer_device_ ## name ## _open(struct inode *inode, struct file *file)\
 {										\
@@ -1745,6 +2573,7 @@ static const struct file_operations peer_device_ ## name ## _fops = {		\
 
 drbd_debugfs_peer_device_attr(resync_extents)
 drbd_debugfs_peer_device_attr(proc_drbd)
+drbd_debugfs_peer_device_attr(resync_telemetry)
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1759,10 +2588,12 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
 	peer_dev_dcf(proc_drbd);
+	peer_dev_dcf(resync_telemetry);
 }
 
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_telemetry);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_proc_drbd);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
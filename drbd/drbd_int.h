@@ -19,6 +19,7 @@
 #include <linux/types.h>
 #include <linux/version.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/bitops.h>
@@ -46,6 +47,23 @@
 /* module parameter, defined in drbd_main.c */
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
+extern bool drbd_sparse_bitmap;
+extern unsigned int drbd_pull_ahead_delay_ms;
+extern bool drbd_recv_detect_zeroes;
+extern bool drbd_resync_model_controller;
+extern unsigned int drbd_resync_rate_budget;
+extern unsigned int drbd_resync_bridge_gap;
+extern unsigned int drbd_verify_busy_threshold;
+extern bool drbd_offload_peer_submit;
+extern unsigned int drbd_resync_latency_target_us;
+extern bool drbd_read_balance_latency;
+extern unsigned int drbd_read_slow_local_us;
+extern bool drbd_numa_placement;
+extern bool drbd_resize_zero_new_space;
+extern unsigned int drbd_al_heat_sample;
+extern unsigned int drbd_fast_ping_min_ms;
+extern bool drbd_resync_write_low_prio;
+extern bool drbd_al_prefetch_enabled;
 
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
@@ -62,6 +80,16 @@ enum {
 # define DRBD_MAJOR 147
 #endif
 
+/* Node ids this module accepts.  The per-peer arrays in struct drbd_request
+ * are indexed by node id; build with e.g. "make DRBD_MAX_NODES=4" to shrink
+ * them for small clusters.  Meta data and protocol keep DRBD_NODE_ID_MAX. */
+#ifndef DRBD_MAX_NODES
+# define DRBD_MAX_NODES DRBD_NODE_ID_MAX
+#endif
+#if DRBD_MAX_NODES < 2 || DRBD_MAX_NODES > DRBD_NODE_ID_MAX
+# error "DRBD_MAX_NODES must be between 2 and DRBD_NODE_ID_MAX"
+#endif
+
 /* This is used to stop/restart our threads.
  * Cannot use SIGTERM nor SIGKILL, since these
  * are sent out by init on runlevel changes
@@ -193,7 +221,10 @@ static inline enum drbd_thread_state get_t_state(struct drbd_thread *thi)
 }
 
 struct drbd_work {
-	struct list_head list;
+	union {
+		struct list_head list;
+		struct llist_node node;	/* while on drbd_work_queue.q */
+	};
 	int (*cb)(struct drbd_work *, int cancel);
 };
 
@@ -293,7 +324,7 @@ struct drbd_request {
 
 	/* for request_timer_fn() */
 	unsigned long pre_submit_jif;
-	unsigned long pre_send_jif[DRBD_PEERS_MAX];
+	unsigned long pre_send_jif[DRBD_MAX_NODES];
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	/* for DRBD internal statistics */
@@ -306,9 +337,9 @@ struct drbd_request {
 	ktime_t pre_submit_kt;
 
 	/* per connection */
-	ktime_t pre_send_kt[DRBD_PEERS_MAX];
-	ktime_t acked_kt[DRBD_PEERS_MAX];
-	ktime_t net_done_kt[DRBD_PEERS_MAX];
+	ktime_t pre_send_kt[DRBD_MAX_NODES];
+	ktime_t acked_kt[DRBD_MAX_NODES];
+	ktime_t net_done_kt[DRBD_MAX_NODES];
 #endif
 	/* Possibly even more detail to track each phase:
 	 *  master_completion_kt
@@ -359,12 +390,23 @@ struct drbd_request {
 	/* lock to protect state flags */
 	spinlock_t rq_lock;
 	unsigned int local_rq_state;
-	u16 net_rq_state[DRBD_NODE_ID_MAX];
+	u16 net_rq_state[DRBD_MAX_NODES];
 
 	/* for reclaim from transfer log */
 	struct rcu_head rcu;
 };
 
+struct drbd_io_cnt {
+	unsigned int read_cnt;
+	unsigned int writ_cnt;
+	/* Where application requests spend their time, in jiffies, for
+	 * the drbd_latency attribute of the block device.  Unlike the
+	 * sector counts these are never reset, like the block layer's stat. */
+	unsigned long al_wait_cnt, al_wait_jif;	/* writes, until in the activity log */
+	unsigned long local_cnt, local_jif;	/* submit to local completion */
+	unsigned long net_cnt, net_jif;		/* send to ack, summed over peers */
+};
+
 /* Used to multicast peer acks. */
 struct drbd_peer_ack {
 	struct drbd_resource *resource;
@@ -407,6 +449,10 @@ struct drbd_peer_request {
 	/* writes only, blocked on activity log;
 	 * FIXME merge with rcv_order or w.list? */
 	struct list_head wait_for_actlog;
+	/* resync reads only, see drbd_rs_share_read():
+	 * on device->rs_share_reads, or on the leader's rs_share_followers */
+	struct list_head rs_share;
+	struct list_head rs_share_followers;
 
 	struct drbd_page_chain_head page_chain;
 	blk_opf_t opf; /* to be used as bi_opf */
@@ -493,6 +539,12 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* resync read others may piggyback on, see drbd_rs_share_read() */
+	__EE_RS_SHARE_LEADER,
+
+	/* resync read served from the read of a leader, not from disk */
+	__EE_RS_SHARED,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -508,6 +560,8 @@ enum {
 #define EE_WRITE_SAME		(1<<__EE_WRITE_SAME)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_RS_SHARE_LEADER	(1<<__EE_RS_SHARE_LEADER)
+#define EE_RS_SHARED		(1<<__EE_RS_SHARED)
 
 /* flag bits per device */
 enum device_flag {
@@ -533,6 +587,7 @@ enum device_flag {
         GO_DISKLESS,            /* tell worker to schedule cleanup before detach */
 	MD_SYNC,		/* tell worker to call drbd_md_sync() */
 	MAKE_NEW_CUR_UUID,	/* tell worker to ping peers and eventually write new current uuid */
+	BM_ALLOC_FAILED,	/* tell worker that a sparse bitmap needs pages, see drbd_bm_alloc_failed() */
 
 	STABLE_RESYNC,		/* One peer_device finished the resync stable! */
 	READ_BALANCE_RR,
@@ -552,6 +607,7 @@ enum peer_device_flag {
 	RS_PROGRESS,		/* tell worker that resync made significant progress */
 	RS_LAZY_BM_WRITE,	/*  -"- and bitmap writeout should be efficient now */
 	RS_DONE,		/* tell worker that resync is done */
+	RS_REFILLED,		/* resync_work queued early since the last resync_timer tick */
 	B_RS_H_DONE,		/* Before resync handler done (already executed) */
 	DISCARD_MY_DATA,	/* discard_my_data flag per volume */
 	USE_DEGR_WFC_T,		/* degr-wfc-timeout instead of wfc-timeout. */
@@ -574,6 +630,7 @@ enum peer_device_flag {
 	UUIDS_RECEIVED,		/* Have recent UUIDs from the peer */
 	CURRENT_UUID_RECEIVED,	/* Got a p_current_uuid packet */
 	PEER_QUORATE,		/* Peer has quorum */
+	UNFLUSHED_WRITES,	/* Peer writes completed since drbd_flush_after_epoch() last flushed */
 };
 
 /* We could make these currently hardcoded constants configurable
@@ -617,6 +674,24 @@ enum bm_flag {
 	BM_ON_DAX_PMEM = 0x10000,
 };
 
+/* who holds a lock on one bitmap slot, see drbd_bm_slot_lock() */
+struct drbd_bm_slot_holder {
+	struct mutex mutex;
+	enum bm_flag flags;
+	char *why;
+	char task_comm[TASK_COMM_LEN];
+	pid_t task_pid;
+};
+
+#define BM_SPARE_PAGES	4
+#define BM_LOST_MAX	8
+
+/* bits of a sparse bitmap that could not be set for lack of a page */
+struct bm_lost_range {
+	unsigned int bitmap_index;
+	unsigned long start, end;
+};
+
 struct drbd_bitmap {
 	union {
 		struct page **bm_pages;
@@ -628,8 +703,29 @@ struct drbd_bitmap {
 	unsigned long bm_bits;  /* bits per peer */
 	size_t   bm_words; /* platform specitif word size; not 32bit!! */
 	size_t   bm_number_of_pages;
+	/* one bit per bitmap page and slot, page * DRBD_PEERS_MAX + slot;
+	 * clear only if that slot has no bit set on that page */
+	unsigned long *bm_summary;
+	/* one bit per bitmap page, set together with BM_PAGE_LAZY_WRITEOUT,
+	 * so lazy writeout does not need to look at every page */
+	unsigned long *bm_lazy_pages;
+	/* sparse bitmap: zeroed pages allocated in process context, for when
+	 * GFP_ATOMIC fails; and what could not be set without them.  Slots in
+	 * bm_lost_all lost more ranges than bm_lost holds. */
+	struct page *bm_spare_pages[BM_SPARE_PAGES];
+	unsigned int bm_nr_spare;
+	struct bm_lost_range bm_lost[BM_LOST_MAX];
+	unsigned int bm_nr_lost;
+	unsigned long bm_lost_all;
 	sector_t bm_dev_capacity;
 	struct mutex bm_change; /* serializes resize operations */
+	/* drbd_bm_lock() takes it for writing, drbd_bm_slot_lock() for reading
+	 * and then the mutex of its slot, so different slots lock in parallel */
+	struct rw_semaphore bm_slots_sem;
+	struct drbd_bm_slot_holder bm_slot[DRBD_PEERS_MAX];
+	/* whole bitmap IO works on the pages shared by all slots, so it is
+	 * serialized even between holders of different slot locks */
+	struct mutex bm_io_mutex;
 
 	wait_queue_head_t bm_io_wait; /* used to serialize IO of single pages */
 
@@ -651,12 +747,13 @@ struct drbd_bitmap {
 	char          *bm_why;
 	char          bm_task_comm[TASK_COMM_LEN];
 	pid_t         bm_task_pid;
-	struct drbd_peer_device *bm_locked_peer;
 };
 
+/* Multi producer, single consumer. Producers only llist_add(), the
+ * consumer takes everything at once with llist_del_all(). */
 struct drbd_work_queue {
-	struct list_head q;
-	spinlock_t q_lock;  /* to protect the list. */
+	struct llist_head q;
+	spinlock_t q_lock;  /* serializes drbd_queue_work_if_unqueued() */
 	wait_queue_head_t q_wait;
 };
 
@@ -706,7 +803,9 @@ struct drbd_backing_dev {
 #endif
 };
 
+/* One meta data buffer, with at most one bio in flight. */
 struct drbd_md_io {
+	struct drbd_device *device;
 	struct page *page;
 	unsigned long start_jif;	/* last call to drbd_md_get_buffer */
 	unsigned long submit_jif;	/* last _drbd_md_sync_page_io() submit */
@@ -716,6 +815,74 @@ struct drbd_md_io {
 	int error;
 };
 
+/* activity log working set statistics, see drbd_al_stats_update() */
+#define AL_STATS_WINDOWS	6
+#define AL_STATS_WINDOW_JIF	(10 * HZ)
+struct drbd_al_stats_window {
+	unsigned long start_jif;
+	unsigned long hits;		/* activity log hits of this window */
+	unsigned long misses;
+	unsigned int transactions;	/* activity log transactions written */
+	unsigned int max_used;		/* largest number of extents in use */
+};
+
+/* Injected latency and throughput limits, set through debugfs */
+enum drbd_io_delay_class {
+	DRBD_DELAY_DATA,
+	DRBD_DELAY_RESYNC,
+	DRBD_DELAY_META,
+	DRBD_DELAY_CLASSES,
+};
+
+struct drbd_io_delay {
+	unsigned int delay_us;
+	unsigned int jitter_us;		/* uniformly distributed, on top of delay_us */
+	unsigned int kib_per_sec;	/* 0 = unlimited */
+	ktime_t busy_until_kt;		/* throughput limit: end of the previous I/O */
+};
+
+#define DRBD_LAT_HIST_BUCKETS 24 /* up to 2^23 us, about 8 seconds */
+
+/* sampled write heat per activity log extent, see al_heat_sample().
+ * The sketch has a fixed size of 4 KiB per device.  With 256 counters per
+ * row, an estimate exceeds the true count by at most e/256 (about 1%) of
+ * all samples, except with probability e^-4 (about 2%).  Only extents
+ * that got clearly more than 1% of the samples are reliably found; on a
+ * device with many thousand extents (tens of GiB) that is a hot spot, not
+ * a ranking of the whole device.  AL_HEAT_REGIONS gives the exact, coarse
+ * picture. */
+#define AL_HEAT_DEPTH		4	/* rows of the count-min sketch */
+#define AL_HEAT_BITS		8	/* log2 of counters per row */
+#define AL_HEAT_REGIONS		64	/* exact counts for equal parts of the device */
+
+/* One second samples of the resync as seen by a peer device, see
+ * drbd_rs_telemetry_tick() */
+#define DRBD_RS_SAMPLES 60
+
+struct drbd_rs_sample {
+	unsigned long jif;		/* end of the sample */
+	unsigned int ms;		/* length of the sample */
+	unsigned int in_kib;		/* resync data received */
+	unsigned int in_flight_kib;	/* requested and not received yet, at the end */
+	unsigned int want_kib_s;	/* c_sync_rate, what the controller aims for */
+	unsigned int throttled;		/* drbd_rs_should_slow_down() said so */
+	unsigned int app_kib;		/* application I/O of the device */
+};
+
+struct drbd_rs_telemetry {
+	spinlock_t lock;		/* closing a sample, and the samples */
+	unsigned long start_jif;	/* of the current sample, 0: none yet */
+	u64 in_sect;			/* cumulative */
+	atomic_t throttled;		/* cumulative */
+	/* the cumulative values at start_jif */
+	u64 start_in_sect;
+	unsigned int start_throttled;
+	unsigned int start_app_sect;
+	unsigned int pos;		/* next sample to write */
+	unsigned int nr;		/* valid samples */
+	struct drbd_rs_sample samples[DRBD_RS_SAMPLES];
+};
+
 struct bm_io_work {
 	struct drbd_work w;
 	struct drbd_device *device;
@@ -839,15 +1006,47 @@ struct drbd_thread_timing_details {
 };
 #define DRBD_THREAD_DETAILS_HIST	16
 
+/* Where the time of the last promotion went, see drbd_set_role() */
+struct drbd_promote_timing {
+	time64_t when;			/* wall clock seconds at completion */
+	ktime_t check_peers;		/* pinging the connected peers */
+	ktime_t wait_up_to_date;	/* waiting for events after a lost primary to settle */
+	ktime_t state_change;		/* the (two phase commit) state change, incl. fencing and retries */
+	ktime_t finish;			/* sending state and UUIDs, meta data writes */
+	unsigned int tries;
+};
+
+/* Previously filled send buffer pages the transport may still hold a
+ * reference to; they get reused once it lets go of them */
+#define DRBD_SEND_BUFFER_SPARES 3
+
+/* Packets sent per packet type; types beyond that share the last slot */
+#define DRBD_SEND_CMD_STATS 64
+
 struct drbd_send_buffer {
 	struct page *page;  /* current buffer page for sending data */
 	char *unsent;  /* start of unsent area != pos if corked... */
 	char *pos; /* position within that page */
 	int allocated_size; /* currently allocated space */
 	int additional_size;  /* additional space to be added to next packet's size */
+	struct page *spare[DRBD_SEND_BUFFER_SPARES];
+	struct {
+		u64 packets;
+		u64 bytes; /* payload, without header */
+	} cmd_stats[DRBD_SEND_CMD_STATS]; /* protected by the mutex of the stream */
 };
 
 
+/* Up to DRBD_PP_MAGAZINE_PAGES pages, linked as a page chain like pp_pool */
+struct drbd_page_magazine {
+	struct page *pages;
+	unsigned int count;
+	/* queued on its CPU to move its pages back to pp_pool, holding a
+	 * reference on the resource */
+	struct work_struct drain_work;
+	struct drbd_resource *resource;
+};
+
 struct drbd_resource {
 	char *name;
 #ifdef CONFIG_DEBUG_FS
@@ -858,6 +1057,8 @@ struct drbd_resource {
 	struct dentry *debugfs_res_state_twopc;
 	struct dentry *debugfs_res_worker_pid;
 	struct dentry *debugfs_res_members;
+	struct dentry *debugfs_res_page_pool;
+	struct dentry *debugfs_res_promote_timing;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -898,11 +1099,13 @@ struct drbd_resource {
 	wait_queue_head_t state_wait;  /* upon each state change. */
 	enum chg_state_flags state_change_flags;
 	const char **state_change_err_str;
+	struct drbd_state_change *spare_state_change; /* a forgotten one, for reuse */
 	bool remote_state_change;  /* remote state change in progress */
 	enum drbd_packet twopc_prepare_reply_cmd; /* this node's answer to the prepare phase or 0 */
 	u64 twopc_parent_nodes;
 	struct twopc_reply twopc_reply;
 	struct timer_list twopc_timer;
+	struct drbd_promote_timing promote_timing; /* protected by state_sem */
 	struct drbd_work twopc_work;
 	wait_queue_head_t twopc_wait;
 	struct {
@@ -941,6 +1144,7 @@ struct drbd_resource {
 	unsigned cached_min_aggreed_protocol_version;
 
 	cpumask_var_t cpu_mask;
+	bool cpu_mask_auto;		/* no cpu-mask configured */
 
 	struct drbd_work_queue work;
 	struct drbd_thread worker;
@@ -978,6 +1182,13 @@ struct drbd_resource {
 	spinlock_t pp_lock;
 	int pp_vacant;
 	wait_queue_head_t pp_wait;
+
+	/* Per CPU caches in front of pp_pool, see drbd_alloc_pages().
+	 * Accessed with preemption disabled, without holding pp_lock. */
+	struct drbd_page_magazine __percpu *pp_magazine;
+	atomic_t pp_magazine_pages;	/* sum over all magazines */
+
+	atomic_t req_mem_wait;	/* drbd_req_new() slept for a request object */
 };
 
 struct drbd_connection {
@@ -992,6 +1203,9 @@ struct drbd_connection {
 	struct dentry *debugfs_conn_receiver_pid;
 	struct dentry *debugfs_conn_ack_receiver_pid;
 	struct dentry *debugfs_conn_sender_pid;
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	struct dentry *debugfs_conn_send_delay;
+#endif
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -1005,7 +1219,17 @@ struct drbd_connection {
 
 	struct drbd_send_buffer send_buffer[2];
 	struct mutex mutex[2]; /* Protect assembling of new packet until sending it (in send_buffer) */
-	/* scratch buffers for use while "owning" the DATA_STREAM send_buffer,
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	struct drbd_io_delay send_delay; /* DATA_STREAM, protected by mutex[DATA_STREAM] */
+#endif
+	/* Held by drbd_send_dblock() while computing data integrity digests,
+	 * so that it does not need to hold mutex[DATA_STREAM] for that.
+	 * Changing integrity_tfm needs both, take this one first. */
+	struct mutex integrity_mutex;
+	/* Serializes drbd_flush_after_epoch(), so that a flush skipped
+	 * because of a previous one knows that one has completed. */
+	struct mutex flush_mutex;
+	/* scratch buffers for use while holding integrity_mutex,
 	 * to avoid larger on-stack temporary variables,
 	 * introduced for holding digests in drbd_send_dblock() */
 	union {
@@ -1019,6 +1243,11 @@ struct drbd_connection {
 	int agreed_pro_version;		/* actually used protocol version */
 	u32 agreed_features;
 	unsigned long last_received;	/* in jiffies, either socket */
+	/* Round trip times of DRBD pings, as seen by the ack receiver */
+	ktime_t ping_sent_kt;
+	unsigned int ping_rtt_us, ping_rtt_min_us, ping_rtt_max_us, ping_rtt_avg_us;
+	unsigned int ping_rtt_dev_us;	/* mean deviation, as TCP's rttvar */
+	unsigned int ping_rtt_count;
 	atomic_t ap_in_flight; /* App sectors in flight (waiting for ack) */
 	atomic_t rs_in_flight; /* Resync sectors in flight */
 
@@ -1045,8 +1274,12 @@ struct drbd_connection {
 	struct drbd_thread receiver;
 	struct drbd_thread sender;
 	struct drbd_thread ack_receiver;
+	int numa_node;		/* of the NIC the established path uses */
 	struct workqueue_struct *ack_sender;
 	struct work_struct peer_ack_work;
+	/* first entry of resource->peer_ack_list not yet looked at by
+	 * process_peer_ack_list(), NULL if none; under peer_ack_lock */
+	struct drbd_peer_ack *peer_ack_next;
 	atomic64_t last_dagtag_sector;
 
 	atomic_t active_ee_cnt;
@@ -1063,6 +1296,15 @@ struct drbd_connection {
 
 	atomic_t pp_in_use;		/* allocated from page pool */
 	atomic_t pp_in_use_by_net;	/* sendpage()d, still referenced by transport */
+	/* Pages only this connection may use once the kernel refuses to give
+	 * us more, so writeback through DRBD keeps making progress under
+	 * memory pressure. Refilled by drbd_free_pages(), released on
+	 * disconnect and by the shrinker, protected by resource->pp_lock. */
+	struct page *pp_reserve;
+	unsigned int pp_reserve_vacant;
+	unsigned int pp_reserve_target;
+	atomic_t pp_reserve_hits;	/* allocations served from pp_reserve */
+	atomic_t pp_mem_wait;		/* drbd_alloc_pages() slept for memory */
 	/* sender side */
 	struct drbd_work_queue sender_work;
 
@@ -1106,6 +1348,9 @@ struct drbd_connection {
 		 * is suspended.
 		 */
 		struct drbd_request *req_next;
+
+		/* its todo.oos_sector and todo.oos_size are not sent yet */
+		struct drbd_peer_device *oos_peer_device;
 	} todo;
 
 	/* cached pointers,
@@ -1189,6 +1434,9 @@ struct drbd_peer_device {
 	int node_id;
 
 	unsigned long flags;
+	/* when the congestion thresholds were first exceeded, 0 if they
+	 * are not; protected by the HANDLING_CONGESTION flag bit */
+	unsigned long congestion_start_jif;
 
 	enum drbd_repl_state start_resync_side;
 	enum drbd_repl_state last_repl_state; /* What we received from the peer */
@@ -1197,6 +1445,13 @@ struct drbd_peer_device {
 	struct timer_list resync_timer;
 	struct drbd_work propagate_uuids_work;
 
+	/* Resync extents that became clean, to be announced to the other
+	 * peers by w_update_peers_batch(). Protected by device->al_lock. */
+#define DRBD_UPDATE_PEERS_BATCH 64
+	struct drbd_work update_peers_work;
+	unsigned int update_peers_cnt;
+	unsigned int update_peers_enr[DRBD_UPDATE_PEERS_BATCH];
+
 	/* Used to track operations of resync... */
 	struct lru_cache *resync_lru;
 	/* Number of locked elements in resync LRU */
@@ -1208,6 +1463,9 @@ struct drbd_peer_device {
 	unsigned long resync_next_bit; /* bitmap bit to search from for next resync request */
 	unsigned long last_resync_next_bit; /* value of resync_next_bit before last set of resync requests */
 	struct mutex resync_next_bit_mutex;
+	unsigned long rs_hot_bit; /* out-of-sync bit an application read had to fetch remotely */
+	unsigned long rs_hot_start, rs_hot_end; /* bits requested ahead of the scan for rs_hot_bit */
+	unsigned int read_lat_us; /* average latency of reads served by this peer */
 
 	atomic_t ap_pending_cnt; /* AP data packets on the wire, ack expected (RQ_NET_PENDING set) */
 	atomic_t unacked_cnt;	 /* Need to send replies for */
@@ -1256,6 +1514,14 @@ struct drbd_peer_device {
 			      * on the lower level device when we last looked. */
 	int rs_in_flight; /* resync sectors in flight (to proxy, in proxy and from proxy) */
 	ktime_t rs_last_mk_req_kt;
+	/* model controller, see drbd_rs_model_controller() */
+	u64 rs_bw_est; /* resync bandwidth estimate in sectors per second */
+	u64 rs_min_rtt_ns; /* minimal resync request round trip time ... */
+	ktime_t rs_min_rtt_kt; /* ... seen since then */
+	sector_t rs_rtt_probe_sector; /* the one resync request being timed ... */
+	ktime_t rs_rtt_probe_kt; /* ... sent then, 0 if none */
+	unsigned int rs_model_turn;
+	struct drbd_rs_telemetry rs_tele;
 	atomic64_t ov_left; /* in bits */
 	unsigned long ov_skipped; /* in bits */
 	u64 rs_start_uuid;
@@ -1277,13 +1543,20 @@ struct drbd_peer_device {
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
 	struct dentry *debugfs_peer_dev_proc_drbd;
+	struct dentry *debugfs_peer_dev_resync_telemetry;
 #endif
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
 	ktime_t net_done_kt;
+#ifdef CONFIG_DRBD_TIMING_STATS
+	unsigned int acked_hist[DRBD_LAT_HIST_BUCKETS];
+#endif
 
 	struct {/* sender todo per peer_device */
 		bool was_ahead;
+		/* merged out-of-sync range, see queue_out_of_sync() */
+		sector_t oos_sector;
+		unsigned int oos_size;
 	} todo;
 	union drbd_state connect_state;
 	struct {
@@ -1303,6 +1576,20 @@ struct submit_worker {
 	spinlock_t lock;
 	struct list_head writes;
 	struct list_head peer_writes;
+
+	/* peer writes already in the activity log, submitted by peer_worker
+	 * on drbd_peer_submit_wq instead of by the receiver */
+	struct list_head peer_writes_ready;
+	struct work_struct peer_worker;
+
+	/* peer discards and zero-outs, merged and issued by discard_worker */
+	struct list_head peer_discards;
+	struct work_struct discard_worker;
+	/* Range covered by discards queued or issued by discard_worker.
+	 * Without two-primaries peer writes are not in the interval tree,
+	 * so overlapping peer writes wait for them here instead. */
+	unsigned int peer_discards_pending;
+	sector_t peer_discards_lo, peer_discards_hi;
 };
 
 struct opener {
@@ -1328,15 +1615,23 @@ struct drbd_device {
 	struct dentry *debugfs_vol_oldest_requests;
 	struct dentry *debugfs_vol_act_log_extents;
 	struct dentry *debugfs_vol_act_log_histogram;
+	struct dentry *debugfs_vol_act_log_stats;
+	struct dentry *debugfs_vol_act_log_heat;
 	struct dentry *debugfs_vol_data_gen_id;
 	struct dentry *debugfs_vol_io_frozen;
+	struct dentry *debugfs_vol_discards;
 	struct dentry *debugfs_vol_ed_gen_id;
 	struct dentry *debugfs_vol_openers;
 	struct dentry *debugfs_vol_md_io;
 	struct dentry *debugfs_vol_interval_tree;
+	struct dentry *debugfs_vol_write_conflicts;
 #ifdef CONFIG_DRBD_TIMING_STATS
 	struct dentry *debugfs_vol_req_timing;
 #endif
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	struct dentry *debugfs_vol_io_delay;
+	struct dentry *debugfs_vol_load_generator;
+#endif
 #endif
 
 	unsigned int vnr;	/* volume number within the resource */
@@ -1359,12 +1654,18 @@ struct drbd_device {
 
 	unsigned long last_reattach_jif;
 	struct timer_list md_sync_timer;
+	/* concurrent drbd_md_sync() calls share one super block write */
+	struct mutex md_sync_mutex;
+	atomic_t md_sync_seq;		/* bumped by each drbd_md_sync() */
+	unsigned int md_synced_seq;	/* md_sync_seq sampled before the last write */
+	int md_sync_err;		/* result of that write */
 	struct timer_list request_timer;
 
 	enum drbd_disk_state disk_state[2];
 	wait_queue_head_t misc_wait;
-	unsigned int read_cnt;
-	unsigned int writ_cnt;
+	/* sectors read/written, bumped on whatever CPU completes the IO;
+	 * see drbd_device_io_cnt() */
+	struct drbd_io_cnt __percpu *io_cnt;
 	unsigned int al_writ_cnt;
 	unsigned int bm_writ_cnt;
 	atomic_t ap_bio_cnt[2];	 /* Requests we need to complete. [READ] and [WRITE] */
@@ -1395,18 +1696,53 @@ struct drbd_device {
 	 * members are protected by what */
 
 	int next_barrier_nr;
-	struct drbd_md_io md_io;
+	struct drbd_md_io md_io;	/* activity log and everything else */
+	struct drbd_md_io md_sb_io;	/* super block writes, see drbd_md_write() */
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
 	unsigned al_histogram[AL_UPDATES_PER_TRANSACTION+1];
 	unsigned int al_tr_number;
 	int al_tr_cycle;
+	/* protected by al_lock */
+	struct drbd_al_stats_window al_stats[AL_STATS_WINDOWS];
+	unsigned int al_stats_cur;
+	struct lru_cache *al_stats_lc;	/* act_log the counters below refer to */
+	unsigned long al_stats_hits, al_stats_misses; /* at start of current window */
+	unsigned int al_stats_writ_cnt;
+	/* updated without locking; lost increments only blur the sample */
+	unsigned int al_heat[AL_HEAT_DEPTH][1 << AL_HEAT_BITS];
+	unsigned int al_heat_region[AL_HEAT_REGIONS];
+	unsigned int al_heat_seq;
+	unsigned long al_heat_samples;
+	/* sequential writer detection, see al_stream_update(); hints only */
+	sector_t al_stream_next;	/* where the last write ended */
+	unsigned int al_prefetch_enr;	/* extent a stream is heading for, or 0 */
+	unsigned int al_prefetch_last;	/* last extent asked for */
+	/* by drbd_issue_discard_or_zero_out(), see the "discards" debugfs file */
+	atomic64_t discarded_sectors;
+	atomic64_t zeroed_sectors;
+	atomic64_t merged_discards;	/* peer requests that did not need their own */
+	/* dual primary write ordering, see the "write_conflicts" debugfs file */
+	atomic64_t peer_seq_waits;	/* peer writes that waited for earlier acks */
+	atomic64_t peer_write_conflicts; /* peer writes overlapping a pending local one */
+	atomic64_t local_write_waits;	/* local writes that waited for an overlapping one */
 	wait_queue_head_t seq_wait;
 	u64 exposed_data_uuid; /* UUID of the exposed data */
 	u64 next_exposed_data_uuid;
 	struct rw_semaphore uuid_sem;
 	atomic_t rs_sect_ev; /* for submitted resync data rate, both */
+	/* in flight resync reads that peers resyncing the same range may share */
+	spinlock_t rs_share_lock;
+	struct list_head rs_share_reads;
+	/* decaying peak of application write latency, and when it was last updated */
+	unsigned int ap_write_lat_peak_us;
+	unsigned long ap_write_lat_jif;
+	unsigned int local_read_lat_us; /* average latency of reads served locally */
+	atomic_t read_slow_local_cnt; /* see drbd_local_read_slow() */
+	/* where the last remote read ended, and which peer served it */
+	sector_t read_next_sector;
+	int read_last_node_id;
 	struct pending_bitmap_work_s {
 		atomic_t n;		/* inc when queued here, */
 		spinlock_t q_lock;	/* dec only once finished. */
@@ -1422,6 +1758,14 @@ struct drbd_device {
 	bool cached_state_unstable; /* updates with each state change */
 	bool cached_err_io; /* complete all IOs with error */
 
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	spinlock_t io_delay_lock;
+	bool io_delay_active;	/* any of io_delay[] set, or io_null */
+	bool io_null;		/* complete data I/O without the backing device */
+	struct drbd_io_delay io_delay[DRBD_DELAY_CLASSES];
+	struct drbd_loadgen *loadgen;	/* see drbd_debugfs.c */
+#endif
+
 #ifdef CONFIG_DRBD_TIMING_STATS
 	spinlock_t timing_lock;
 	unsigned long reqs;
@@ -1434,6 +1778,10 @@ struct drbd_device {
 	ktime_t al_before_bm_write_hinted_kt; /* sum over all al_writ_cnt */
 	ktime_t al_mid_kt;
 	ktime_t al_after_sync_page_kt;
+
+	/* same phases as in_actlog_kt and pre_submit_kt, as histograms */
+	unsigned int in_actlog_hist[DRBD_LAT_HIST_BUCKETS];
+	unsigned int pre_submit_hist[DRBD_LAT_HIST_BUCKETS];
 #endif
 	struct list_head openers;
 	spinlock_t openers_lock;
@@ -1456,6 +1804,10 @@ struct drbd_bm_aio_ctx {
 #define BM_AIO_WRITE_LAZY      16
 	int error;
 	struct kref kref;
+	atomic_t pages_done; /* progress, for debugfs */
+	/* BM_AIO_READ: bits counted per slot as the pages come in */
+	atomic_t pages_counted;
+	atomic_long_t bits_set[DRBD_PEERS_MAX];
 };
 
 struct drbd_config_context {
@@ -1591,6 +1943,8 @@ extern int drbd_send_peer_dagtag(struct drbd_connection *connection, struct drbd
 extern int drbd_send_current_uuid(struct drbd_peer_device *peer_device, u64 current_uuid, u64 weak_nodes);
 extern void drbd_backing_dev_free(struct drbd_device *device, struct drbd_backing_dev *ldev);
 extern void drbd_cleanup_device(struct drbd_device *device);
+extern struct drbd_io_cnt drbd_device_io_cnt(struct drbd_device *device);
+extern void drbd_reset_io_cnt(struct drbd_device *device);
 extern void drbd_print_uuids(struct drbd_peer_device *peer_device, const char *text);
 extern void drbd_queue_unplug(struct drbd_device *device);
 
@@ -1698,17 +2052,24 @@ extern sector_t drbd_get_max_capacity(
 
 #define RS_MAKE_REQS_INTV    (HZ/10)
 #define RS_MAKE_REQS_INTV_NS (NSEC_PER_SEC/10)
+#define RS_MIN_RTT_WINDOW_NS (10 * NSEC_PER_SEC)
 
 /* We do bitmap IO in units of 4k blocks.
  * We also still have a hardcoded 4k per bit relation. */
 #define BM_BLOCK_SHIFT	12			 /* 4k per bit */
 #define BM_BLOCK_SIZE	 (1<<BM_BLOCK_SHIFT)
-/* mostly arbitrarily set the represented size of one bitmap extent,
- * aka resync extent, to 128 MiB (which is also 4096 Byte worth of bitmap
- * at 4k per bit resolution) */
-#define BM_EXT_SHIFT	 27	/* 128 MiB per resync extent */
+/* The represented size of one bitmap extent, aka resync extent, is that of
+ * one activity log extent. Resync locks whole resync extents against
+ * application writes, and waits for all activity log extents in it to
+ * become idle; at 4 MiB resync and a hot working set only meet on the
+ * extents they really share. The size is not visible on the wire. */
+#define BM_EXT_SHIFT	 AL_EXTENT_SHIFT	/* 4 MiB per resync extent */
 #define BM_EXT_SIZE	 (1<<BM_EXT_SHIFT)
 
+/* Elements of the resync LRU.  drbd_try_rs_begin_io() locks up to half of
+ * them; keep that at 61/2 of the former 128 MiB extents, about 3.8 GiB. */
+#define DRBD_RS_LRU_ELEMENTS	(61 << (27 - BM_EXT_SHIFT))
+
 #if (BM_BLOCK_SHIFT != 12)
 #error "HAVE YOU FIXED drbdmeta AS WELL??"
 #endif
@@ -1825,14 +2186,35 @@ extern void drbd_bm_unlock(struct drbd_device *device);
 extern void drbd_bm_slot_lock(struct drbd_peer_device *peer_device, char *why, enum bm_flag flags);
 extern void drbd_bm_slot_unlock(struct drbd_peer_device *peer_device);
 extern void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsigned int to_index);
+extern void drbd_bm_alloc_failed(struct drbd_device *device);
 /* drbd_main.c */
 
 extern struct kmem_cache *drbd_request_cache;
 extern struct kmem_cache *drbd_ee_cache;	/* peer requests */
 extern struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
+extern struct kmem_cache *drbd_epoch_cache;	/* receiver side write epochs */
 extern mempool_t drbd_request_mempool;
 extern mempool_t drbd_ee_mempool;
+extern mempool_t drbd_epoch_mempool;
+
+/* With a gfp mask allowing direct reclaim this never fails, it waits for
+ * an epoch to be returned to the pool instead. */
+static inline struct drbd_epoch *drbd_alloc_epoch(gfp_t gfp_mask)
+{
+	struct drbd_epoch *epoch = mempool_alloc(&drbd_epoch_mempool, gfp_mask);
+
+	if (epoch) {
+		memset(epoch, 0, sizeof(*epoch));
+		INIT_LIST_HEAD(&epoch->list);
+	}
+	return epoch;
+}
+
+static inline void drbd_free_epoch(struct drbd_epoch *epoch)
+{
+	mempool_free(epoch, &drbd_epoch_mempool);
+}
 
 /* We also need a standard (emergency-reserve backed) page pool
  * for meta data IO (activity log, bitmap).
@@ -1875,6 +2257,9 @@ extern void conn_free_crypto(struct drbd_connection *connection);
 
 /* drbd_req */
 extern void do_submit(struct work_struct *ws);
+extern void do_submit_ready_peer_writes(struct work_struct *ws);
+extern struct workqueue_struct *drbd_peer_submit_wq;
+extern void do_submit_peer_discards(struct work_struct *ws);
 #ifndef CONFIG_DRBD_TIMING_STATS
 #define __drbd_make_request(d,b,k,j) __drbd_make_request(d,b,j)
 #endif
@@ -1941,15 +2326,32 @@ extern void drbd_resync_finished(struct drbd_peer_device *, enum drbd_disk_state
 extern void verify_progress(struct drbd_peer_device *peer_device,
 		const sector_t sector, const unsigned int size);
 /* maybe rather drbd_main.c ? */
-extern void *drbd_md_get_buffer(struct drbd_device *device, const char *intent);
-extern void drbd_md_put_buffer(struct drbd_device *device);
-extern int drbd_md_sync_page_io(struct drbd_device *device,
+extern void *__drbd_md_get_buffer(struct drbd_device *device, struct drbd_md_io *md_io,
+		const char *intent);
+extern void __drbd_md_put_buffer(struct drbd_md_io *md_io);
+extern int __drbd_md_sync_page_io(struct drbd_device *device, struct drbd_md_io *md_io,
 		struct drbd_backing_dev *bdev, sector_t sector, enum req_op op);
+static inline void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
+{
+	return __drbd_md_get_buffer(device, &device->md_io, intent);
+}
+static inline void drbd_md_put_buffer(struct drbd_device *device)
+{
+	__drbd_md_put_buffer(&device->md_io);
+}
+static inline int drbd_md_sync_page_io(struct drbd_device *device,
+		struct drbd_backing_dev *bdev, sector_t sector, enum req_op op)
+{
+	return __drbd_md_sync_page_io(device, &device->md_io, bdev, sector, op);
+}
 extern void drbd_ov_out_of_sync_found(struct drbd_peer_device *, sector_t, int);
 extern void wait_until_done_or_force_detached(struct drbd_device *device,
 		struct drbd_backing_dev *bdev, unsigned int *done);
 extern void drbd_rs_controller_reset(struct drbd_peer_device *);
+extern void drbd_rs_half_in_flight_came_back(struct drbd_peer_device *peer_device);
+extern void drbd_rs_rtt_sample(struct drbd_peer_device *peer_device, sector_t sector);
 extern void drbd_rs_all_in_flight_came_back(struct drbd_peer_device *, int);
+extern void drbd_rs_telemetry_tick(struct drbd_peer_device *peer_device);
 extern void drbd_check_peers(struct drbd_resource *resource);
 extern void drbd_check_peers_new_current_uuid(struct drbd_device *);
 extern void drbd_ping_peer(struct drbd_connection *connection);
@@ -1978,6 +2380,8 @@ static inline void ov_skipped_print(struct drbd_peer_device *peer_device)
 
 extern void drbd_csum_bio(struct crypto_shash *, struct bio *, void *);
 extern void drbd_csum_pages(struct crypto_shash *, struct page *, void *);
+extern bool drbd_peer_req_all_zero(struct drbd_peer_request *);
+extern void drbd_rs_share_read_done(struct drbd_peer_request *);
 /* worker callbacks */
 extern int w_e_end_data_req(struct drbd_work *, int);
 extern int w_e_end_rsdata_req(struct drbd_work *, int);
@@ -2055,6 +2459,7 @@ extern bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *);
 extern bool drbd_rs_should_slow_down(struct drbd_peer_device *, sector_t,
 				     bool throttle_if_app_is_waiting);
 extern int drbd_submit_peer_request(struct drbd_peer_request *);
+extern bool drbd_rs_share_read(struct drbd_peer_request *);
 extern void drbd_cleanup_after_failed_submit_peer_write(struct drbd_peer_request *peer_req);
 extern void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head *cleanup);
 extern int drbd_free_peer_reqs(struct drbd_connection *, struct list_head *, bool is_net_ee);
@@ -2062,6 +2467,12 @@ extern struct drbd_peer_request *drbd_alloc_peer_req(struct drbd_peer_device *,
 extern void __drbd_free_peer_req(struct drbd_peer_request *, int);
 #define drbd_free_peer_req(pr) __drbd_free_peer_req(pr, 0)
 #define drbd_free_net_peer_req(pr) __drbd_free_peer_req(pr, 1)
+extern void drbd_magazine_drain_work(struct work_struct *ws);
+extern int drbd_pp_shrinker_register(void);
+extern void drbd_pp_shrinker_unregister(void);
+extern int drbd_pp_cpuhp_register(void);
+extern void drbd_pp_cpuhp_unregister(void);
+extern void drbd_pp_reserve_free(struct drbd_connection *connection);
 extern void _drbd_clear_done_ee(struct drbd_device *device, struct list_head *to_be_freed);
 extern int drbd_connected(struct drbd_peer_device *);
 extern void conn_connect2(struct drbd_connection *);
@@ -2084,6 +2495,38 @@ static inline sector_t drbd_get_capacity(struct block_device *bdev)
 /* sets the number of 512 byte sectors of our virtual device */
 void drbd_set_my_capacity(struct drbd_device *device, sector_t size);
 
+/* policy hooks for BPF, see drbd_main.c */
+extern bool drbd_policy_read_remote(struct drbd_peer_device *peer_device, sector_t sector,
+				    unsigned int size, bool builtin);
+extern bool drbd_policy_pull_ahead(struct drbd_peer_device *peer_device, bool builtin);
+extern bool drbd_policy_rs_slow_down(struct drbd_peer_device *peer_device, sector_t sector,
+				     bool builtin);
+
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+extern bool _drbd_delay_bio(struct drbd_device *device, int fault_type, struct bio *bio);
+extern void _drbd_delay_send(struct drbd_connection *connection, size_t size);
+#endif
+
+/* Returns true if the bio got queued for a delayed submit, or completed */
+static inline bool drbd_delay_bio(struct drbd_device *device, int fault_type, struct bio *bio)
+{
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	return unlikely(READ_ONCE(device->io_delay_active)) &&
+		_drbd_delay_bio(device, fault_type, bio);
+#else
+	return false;
+#endif
+}
+
+/* Caller holds mutex[DATA_STREAM] */
+static inline void drbd_delay_send(struct drbd_connection *connection, size_t size)
+{
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	if (unlikely(connection->send_delay.kib_per_sec))
+		_drbd_delay_send(connection, size);
+#endif
+}
+
 /*
  * used to submit our private bio
  */
@@ -2095,7 +2538,7 @@ static inline void drbd_submit_bio_noacct(struct drbd_device *device,
 	if (drbd_insert_fault(device, fault_type)) {
 		bio->bi_status = BLK_STS_IOERR;
 		bio_endio(bio);
-	} else {
+	} else if (!drbd_delay_bio(device, fault_type, bio)) {
 		submit_bio_noacct(bio);
 	}
 }
@@ -2111,10 +2554,12 @@ extern struct proc_dir_entry *drbd_proc;
 int drbd_seq_show(struct seq_file *seq, void *v);
 
 /* drbd_actlog.c */
+extern int w_update_peers_batch(struct drbd_work *w, int unused);
 extern bool drbd_al_try_lock(struct drbd_device *device);
 extern bool drbd_al_try_lock_for_transaction(struct drbd_device *device);
 extern int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_al_begin_io_commit(struct drbd_device *device);
+extern void drbd_al_prefetch_commit(struct drbd_device *device);
 extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i);
 extern int drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern bool drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
@@ -2137,6 +2582,8 @@ extern int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sec
 #define drbd_rs_failed_io(peer_device, sector, size) \
 	__drbd_change_sync(peer_device, sector, size, RECORD_RS_FAILED)
 extern void drbd_al_shrink(struct drbd_device *device);
+extern void drbd_al_stats_update(struct drbd_device *device);
+extern unsigned int drbd_al_heat_hash(unsigned int enr, int row);
 extern bool drbd_sector_has_priority(struct drbd_peer_device *, sector_t);
 extern int drbd_al_initialize(struct drbd_device *, void *);
 
@@ -2270,11 +2717,16 @@ static inline void
 drbd_queue_work_if_unqueued(struct drbd_work_queue *q, struct drbd_work *w)
 {
 	unsigned long flags;
+	bool was_empty = false;
+
+	/* Once on q, w->node.next no longer points to w, so w->list
+	 * appears non-empty until the consumer did its list_del_init(). */
 	spin_lock_irqsave(&q->q_lock, flags);
 	if (list_empty_careful(&w->list))
-		list_add_tail(&w->list, &q->q);
+		was_empty = llist_add(&w->node, &q->q);
 	spin_unlock_irqrestore(&q->q_lock, flags);
-	wake_up(&q->q_wait);
+	if (was_empty)
+		wake_up(&q->q_wait);
 }
 
 static inline void
@@ -2310,6 +2762,7 @@ drbd_post_work(struct drbd_resource *resource, int work_bit)
 }
 
 extern void drbd_flush_workqueue(struct drbd_work_queue *work_queue);
+extern void drbd_connection_update_numa_node(struct drbd_connection *connection);
 
 /* To get the ack_receiver out of the blocking network stack,
  * so it can change its sk_rcvtimeo from idle- to ping-timeout,
@@ -2358,6 +2811,21 @@ static inline void drbd_thread_restart_nowait(struct drbd_thread *thi)
 	_drbd_thread_stop(thi, true, false);
 }
 
+static inline void drbd_count_read(struct drbd_device *device, unsigned int sectors)
+{
+	this_cpu_add(device->io_cnt->read_cnt, sectors);
+}
+
+static inline void drbd_count_write(struct drbd_device *device, unsigned int sectors)
+{
+	this_cpu_add(device->io_cnt->writ_cnt, sectors);
+}
+
+#define drbd_count_latency(device, what, since) do {				\
+	this_cpu_inc((device)->io_cnt->what ## _cnt);				\
+	this_cpu_add((device)->io_cnt->what ## _jif, jiffies - (since));	\
+} while (0)
+
 static inline void inc_ap_pending(struct drbd_peer_device *peer_device)
 {
 	atomic_inc(&peer_device->ap_pending_cnt);
@@ -2546,7 +3014,10 @@ static inline void dec_ap_bio(struct drbd_device *device, int rw)
 	if (ap_bio == 0 && rw == WRITE && !list_empty(&device->pending_bitmap_work.q))
 		drbd_queue_pending_bitmap_work(device);
 
-	if (ap_bio == 0 || ap_bio == nr_requests-1)
+	/* atomic_dec_return() implies a full barrier, pairing with the one in
+	 * prepare_to_wait(); so skip taking the waitqueue lock if nobody waits.
+	 * With a low queue depth, ap_bio drops to 0 on nearly every completion. */
+	if ((ap_bio == 0 || ap_bio == nr_requests-1) && waitqueue_active(&device->misc_wait))
 		wake_up(&device->misc_wait);
 }
 
@@ -2591,6 +3062,15 @@ static inline u64 drbd_current_uuid(struct drbd_device *device)
 	return device->ldev->md.current_uuid;
 }
 
+/* Bits in [rs_hot_start, rs_hot_end) were requested ahead of the regular
+ * resync scan; the scan skips them. Call with resync_next_bit_mutex held
+ * when the scan is moved back to @bit to request it again. */
+static inline void drbd_rs_hot_rewind(struct drbd_peer_device *peer_device, unsigned long bit)
+{
+	if (bit >= peer_device->rs_hot_start && bit < peer_device->rs_hot_end)
+		peer_device->rs_hot_end = bit;
+}
+
 static inline bool verify_can_do_stop_sector(struct drbd_peer_device *peer_device)
 {
 	return peer_device->connection->agreed_pro_version >= 97 &&
@@ -2628,7 +3108,7 @@ static inline int drbd_queue_order_type(struct drbd_device *device)
 }
 
 /* resync bitmap */
-/* 128MB sized 'bitmap extent' to track syncer usage */
+/* BM_EXT_SIZE sized 'bitmap extent' to track syncer usage */
 struct bm_extent {
 	int rs_left; /* number of bits set (out of sync) in this extent. */
 	int rs_failed; /* number of failed resync requests in this extent. */
@@ -2648,7 +3128,18 @@ static inline struct drbd_connection *first_connection(struct drbd_resource *res
 
 #define NODE_MASK(id) ((u64)1 << (id))
 
+/* Bucket i counts latencies of less than 2^i microseconds (and at least half
+ * that), the last one everything above. */
+static inline unsigned int drbd_lat_hist_bucket(ktime_t kt)
+{
+	s64 us = ktime_to_us(kt);
+
+	return us <= 0 ? 0 : min_t(unsigned int, fls64(us), DRBD_LAT_HIST_BUCKETS - 1);
+}
+
 #ifdef CONFIG_DRBD_TIMING_STATS
+#define ktime_histogram(H, R, M) H[drbd_lat_hist_bucket(ktime_sub(R->M, R->start_kt))]++
+#define ktime_histogram_pd(H, N, R, M) H[drbd_lat_hist_bucket(ktime_sub(R->M[N], R->start_kt))]++
 #define ktime_aggregate_delta(D, ST, M) D->M = ktime_add(D->M, ktime_sub(ktime_get(), ST))
 #define ktime_aggregate(D, R, M) D->M = ktime_add(D->M, ktime_sub(R->M, R->start_kt))
 #define ktime_aggregate_pd(P, N, R, M) P->M = ktime_add(P->M, ktime_sub(R->M[N], R->start_kt))
@@ -23,12 +23,16 @@ enum drbd_interval_flags {
 	INTERVAL_COMPLETED,
 };
 
+/* Tree walks only look at the rb pointers, the augmented end and the
+ * start/size of the nodes they pass; keep those first and together, so a
+ * walk touches as few cache lines of the (large) containing request as
+ * possible. */
 struct drbd_interval {
 	struct rb_node rb;
+	sector_t end;			/* highest interval end in subtree */
 	sector_t sector;		/* start sector of the interval */
 	unsigned int size;		/* size in bytes */
 	enum drbd_interval_type type;	/* what type of interval this is */
-	sector_t end;			/* highest interval end in subtree */
 	unsigned long flags;
 };
 
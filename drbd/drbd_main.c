@@ -22,6 +22,7 @@
 #include <linux/uaccess.h>
 #include <asm/types.h>
 #include <net/sock.h>
+#include <linux/inetdevice.h>
 #include <linux/ctype.h>
 #include <linux/fs.h>
 #include <linux/file.h>
@@ -43,6 +44,7 @@
 #include <linux/dynamic_debug.h>
 #include <linux/libnvdimm.h>
 #include <linux/swab.h>
+#include <linux/error-injection.h>
 
 #include <linux/drbd_limits.h>
 #include "drbd_int.h"
@@ -53,6 +55,9 @@
 #include "drbd_meta_data.h"
 #include "drbd_dax_pmem.h"
 
+#define CREATE_TRACE_POINTS
+#include "drbd_trace.h"
+
 static int drbd_open(struct block_device *bdev, fmode_t mode);
 static void drbd_release(struct gendisk *gd, fmode_t mode);
 static void md_sync_timer_fn(struct timer_list *t);
@@ -129,6 +134,122 @@ static const struct kernel_param_ops param_ops_drbd_protocol_version = {
 unsigned int drbd_protocol_version_min = PRO_VERSION_MIN;
 module_param_named(protocol_version_min, drbd_protocol_version_min, drbd_protocol_version, 0644);
 
+/* all-zero bitmap pages are not allocated, but materialized when bits get set */
+bool drbd_sparse_bitmap;
+MODULE_PARM_DESC(sparse_bitmap, "Allocate in-core bitmap pages only once bits get set in them");
+module_param_named(sparse_bitmap, drbd_sparse_bitmap, bool, 0644);
+
+/* congestion has to last that long before a peer device goes Ahead */
+unsigned int drbd_pull_ahead_delay_ms;
+MODULE_PARM_DESC(pull_ahead_delay_ms, "With on-congestion pull-ahead, keep replicating (blocking) "
+		 "until congestion lasted this many milliseconds (0 = pull ahead immediately)");
+module_param_named(pull_ahead_delay_ms, drbd_pull_ahead_delay_ms, uint, 0644);
+
+/* Data writes consisting of zeroes only are sent as P_ZEROES, without payload */
+static bool drbd_detect_zeroes;
+MODULE_PARM_DESC(detect_zeroes, "Replicate all-zero data writes as zero-out requests, "
+		 "without payload, if the peer supports that");
+module_param_named(detect_zeroes, drbd_detect_zeroes, bool, 0644);
+
+/* Received data writes consisting of zeroes only are submitted as write-zeroes */
+bool drbd_recv_detect_zeroes;
+MODULE_PARM_DESC(recv_detect_zeroes, "Submit received all-zero data writes as zero-out "
+		 "(unmap allowed), if the backing device supports write-zeroes");
+module_param_named(recv_detect_zeroes, drbd_recv_detect_zeroes, bool, 0644);
+
+/* The second data integrity digest in drbd_send_dblock() only serves to
+ * warn about upper layers modifying pages during write-out; the receiver
+ * verifies the digest that is on the wire in any case. */
+static bool drbd_integrity_recheck = true;
+MODULE_PARM_DESC(integrity_recheck, "Re-compute the data integrity digest after sending, "
+		 "to detect buffers modified in flight");
+module_param_named(integrity_recheck, drbd_integrity_recheck, bool, 0644);
+
+/* with c-plan-ahead > 0, choose between the plan-ahead and the model based resync controller */
+bool drbd_resync_model_controller;
+MODULE_PARM_DESC(resync_model_controller, "Size resync requests in flight from the measured "
+		 "bandwidth and round trip time, instead of c-fill-target/c-delay-target");
+module_param_named(resync_model_controller, drbd_resync_model_controller, bool, 0644);
+
+/* resync bandwidth of a resource, shared by all its resyncing peer devices */
+unsigned int drbd_resync_rate_budget;
+MODULE_PARM_DESC(resync_rate_budget, "Limit the combined resync/verify rate of all volumes and "
+		 "peers of a resource to this many KiB/s, shared evenly (0 = no limit)");
+module_param_named(resync_rate_budget, drbd_resync_rate_budget, uint, 0644);
+
+/* resync requests may include this many in-sync blocks between out-of-sync ones */
+unsigned int drbd_resync_bridge_gap;
+MODULE_PARM_DESC(resync_bridge_gap, "Let a resync request span gaps of up to this many "
+		 "in-sync 4KiB blocks, to need fewer requests for fragmented bitmaps");
+module_param_named(resync_bridge_gap, drbd_resync_bridge_gap, uint, 0644);
+
+/* online verify only proceeds while the application keeps fewer requests in flight */
+unsigned int drbd_verify_busy_threshold;
+MODULE_PARM_DESC(verify_busy_threshold, "Pause online verify while this many or more application "
+		 "requests are in flight on the volume (0 = never pause)");
+module_param_named(verify_busy_threshold, drbd_verify_busy_threshold, uint, 0644);
+
+/* the receiver only parses and checks peer writes, a worker per volume submits them */
+bool drbd_offload_peer_submit;
+MODULE_PARM_DESC(offload_peer_submit, "Submit received writes to the backing device from a "
+		 "per-volume worker instead of the receiver thread");
+module_param_named(offload_peer_submit, drbd_offload_peer_submit, bool, 0644);
+
+/* resync throttles when application writes take longer than this */
+unsigned int drbd_resync_latency_target_us;
+MODULE_PARM_DESC(resync_latency_target_us, "Slow down resync (down to c-min-rate) while recent "
+		 "application writes took longer than this many microseconds (0 = use disk activity)");
+module_param_named(resync_latency_target_us, drbd_resync_latency_target_us, uint, 0644);
+
+/* read-balancing least-pending weighs the queue depths with observed read latency */
+bool drbd_read_balance_latency;
+MODULE_PARM_DESC(read_balance_latency, "With read-balancing least-pending, send a read where "
+		 "queue depth times average read latency is lowest");
+module_param_named(read_balance_latency, drbd_read_balance_latency, bool, 0644);
+
+/* read-balancing prefer-local, unless the local disk got slow */
+unsigned int drbd_read_slow_local_us;
+MODULE_PARM_DESC(read_slow_local_us, "With read-balancing prefer-local, send reads to an UpToDate "
+		 "peer while the average local read latency exceeds this many us (0 = off)");
+module_param_named(read_slow_local_us, drbd_read_slow_local_us, uint, 0644);
+
+/* feed one in this many writes into the act_log_heat debugfs map */
+unsigned int drbd_al_heat_sample;
+MODULE_PARM_DESC(al_heat_sample, "Sample one in this many writes into the per activity log "
+		 "extent heat map in debugfs (0 = off)");
+module_param_named(al_heat_sample, drbd_al_heat_sample, uint, 0644);
+
+/* without a configured cpu-mask, run threads on the NUMA node of their NIC or disk */
+bool drbd_numa_placement = true;
+MODULE_PARM_DESC(numa_placement, "Without cpu-mask, let the threads of a connection run on "
+		 "the CPUs local to its NIC, and the worker on those local to the backing disk");
+module_param_named(numa_placement, drbd_numa_placement, bool, 0644);
+
+/* resize --assume-clean: zero the new space instead of leaving it as it is */
+bool drbd_resize_zero_new_space;
+MODULE_PARM_DESC(resize_zero_new_space, "When growing without resync, zero (unmap on thin "
+		 "backing devices) the new area, so that all nodes agree on its content");
+module_param_named(resize_zero_new_space, drbd_resize_zero_new_space, bool, 0644);
+
+/* while application requests are in flight, probe the peer on RTT based timeouts */
+unsigned int drbd_fast_ping_min_ms;
+MODULE_PARM_DESC(fast_ping_min_ms, "While application requests are in flight, send a ping after, "
+		 "and expect the PingAck within, the ping round trip average plus four times "
+		 "its deviation, but at least this many ms and at most ping-timeout (0 = off)");
+module_param_named(fast_ping_min_ms, drbd_fast_ping_min_ms, uint, 0644);
+
+/* on the SyncTarget, let application writes of the peer go first */
+bool drbd_resync_write_low_prio = true;
+MODULE_PARM_DESC(resync_write_low_prio, "Submit resync writes with the lowest best-effort I/O "
+		 "priority, so that replicated application writes are served first");
+module_param_named(resync_write_low_prio, drbd_resync_write_low_prio, bool, 0644);
+
+/* activate the next activity log extent of a sequential writer early */
+bool drbd_al_prefetch_enabled = true;
+MODULE_PARM_DESC(al_prefetch, "When a sequential write stream passed the middle of its activity "
+		 "log extent, activate the next one in the background");
+module_param_named(al_prefetch, drbd_al_prefetch_enabled, bool, 0644);
+
 
 /* in 2.6.x, our device mapping and config info contains our virtual gendisks
  * as member "struct gendisk *vdisk;"
@@ -142,8 +263,10 @@ struct kmem_cache *drbd_request_cache;
 struct kmem_cache *drbd_ee_cache;	/* peer requests */
 struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
+struct kmem_cache *drbd_epoch_cache;	/* receiver side write epochs */
 mempool_t drbd_request_mempool;
 mempool_t drbd_ee_mempool;
+mempool_t drbd_epoch_mempool;
 mempool_t drbd_md_io_page_pool;
 struct bio_set drbd_md_io_bio_set;
 struct bio_set drbd_io_bio_set;
@@ -751,6 +874,41 @@ static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
 	cpumask_set_cpu(min_index, *cpu_mask);
 }
 
+static int drbd_resource_disk_numa_node(struct drbd_resource *resource)
+{
+	struct drbd_device *device;
+	int vnr, node = NUMA_NO_NODE;
+
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		if (get_ldev_if_state(device, D_NEGOTIATING)) {
+			node = dev_to_node(disk_to_dev(device->ldev->backing_bdev->bd_disk));
+			put_ldev(device);
+		}
+		if (node != NUMA_NO_NODE)
+			break;
+	}
+	rcu_read_unlock();
+	return node;
+}
+
+/* The node the threads should run on, or NUMA_NO_NODE to use resource->cpu_mask */
+static int drbd_thread_numa_node(struct drbd_thread *thi)
+{
+	struct drbd_resource *resource = thi->resource;
+	int node;
+
+	if (!drbd_numa_placement || !resource->cpu_mask_auto)
+		return NUMA_NO_NODE;
+	if (thi->connection)
+		node = READ_ONCE(thi->connection->numa_node);
+	else
+		node = drbd_resource_disk_numa_node(resource);
+	if (node == NUMA_NO_NODE || !cpumask_intersects(cpumask_of_node(node), cpu_online_mask))
+		return NUMA_NO_NODE;
+	return node;
+}
+
 /**
  * drbd_thread_current_set_cpu() - modifies the cpu mask of the _current_ thread
  * @thi:	drbd_thread object
@@ -762,16 +920,63 @@ void drbd_thread_current_set_cpu(struct drbd_thread *thi)
 {
 	struct drbd_resource *resource = thi->resource;
 	struct task_struct *p = current;
+	int node;
 
 	if (!thi->reset_cpu_mask)
 		return;
 	thi->reset_cpu_mask = 0;
-	set_cpus_allowed_ptr(p, resource->cpu_mask);
+	node = drbd_thread_numa_node(thi);
+	set_cpus_allowed_ptr(p, node != NUMA_NO_NODE ? cpumask_of_node(node) : resource->cpu_mask);
 }
 #else
 #define drbd_calc_cpu_mask(A) ({})
 #endif
 
+/* Only IPv4 addresses are resolved to their interface, an IPv6 or
+ * wildcard address leaves it to resource->cpu_mask. */
+static int drbd_addr_numa_node(struct sockaddr_storage *addr)
+{
+	struct net_device *dev = NULL;
+	int node = NUMA_NO_NODE;
+
+	if (addr->ss_family == AF_INET)
+		dev = ip_dev_find(&init_net, ((struct sockaddr_in *)addr)->sin_addr.s_addr);
+	if (dev) {
+		node = dev_to_node(dev->dev.parent ?: &dev->dev);
+		dev_put(dev);
+	}
+	return node;
+}
+
+/**
+ * drbd_connection_update_numa_node() - Note where the NIC of the connection is
+ * @connection:	DRBD connection, with an established path
+ *
+ * Called by the receiver once connected. If the node changed, the receiver,
+ * ack_receiver and sender move there with their next drbd_thread_current_set_cpu().
+ */
+void drbd_connection_update_numa_node(struct drbd_connection *connection)
+{
+	struct drbd_path *path;
+	int node = NUMA_NO_NODE;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(path, &connection->transport.paths, list) {
+		if (path->established) {
+			node = drbd_addr_numa_node(&path->my_addr);
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	if (node == connection->numa_node)
+		return;
+	WRITE_ONCE(connection->numa_node, node);
+	connection->receiver.reset_cpu_mask = 1;
+	connection->ack_receiver.reset_cpu_mask = 1;
+	connection->sender.reset_cpu_mask = 1;
+}
+
 static bool drbd_all_neighbor_secondary(struct drbd_device *device, u64 *authoritative_ptr)
 {
 	struct drbd_peer_device *peer_device;
@@ -868,6 +1073,37 @@ static void prepare_header(struct drbd_connection *connection, int vnr,
 		prepare_header80(buffer, cmd, size);
 }
 
+/* The transport is done with a spare page once we hold the only reference.
+ * Swap such a page in for the current one, which may still be in flight. */
+static bool recycle_spare_send_buffer_page(struct drbd_send_buffer *sbuf)
+{
+	int i;
+
+	for (i = 0; i < DRBD_SEND_BUFFER_SPARES; i++) {
+		struct page *page = sbuf->spare[i];
+
+		if (page && page_count(page) == 1) {
+			sbuf->spare[i] = sbuf->page;
+			sbuf->page = page;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void retire_send_buffer_page(struct drbd_send_buffer *sbuf)
+{
+	int i;
+
+	for (i = 0; i < DRBD_SEND_BUFFER_SPARES; i++) {
+		if (!sbuf->spare[i]) {
+			sbuf->spare[i] = sbuf->page;
+			return;
+		}
+	}
+	put_page(sbuf->page);
+}
+
 static void new_or_recycle_send_buffer_page(struct drbd_send_buffer *sbuf)
 {
 	while (1) {
@@ -878,9 +1114,12 @@ static void new_or_recycle_send_buffer_page(struct drbd_send_buffer *sbuf)
 		if (count == 1)
 			goto have_page;
 
+		if (recycle_spare_send_buffer_page(sbuf))
+			goto have_page;
+
 		page = alloc_page(GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
 		if (page) {
-			put_page(sbuf->page);
+			retire_send_buffer_page(sbuf);
 			sbuf->page = page;
 			goto have_page;
 		}
@@ -1001,6 +1240,8 @@ static int flush_send_buffer(struct drbd_connection *connection, enum drbd_strea
 	flags = (connection->cstate[NOW] < C_CONNECTING ? MSG_DONTWAIT : 0) |
 		(sbuf->additional_size ? MSG_MORE : 0);
 	offset = sbuf->unsent - (char *)page_address(sbuf->page);
+	if (drbd_stream == DATA_STREAM)
+		drbd_delay_send(connection, size);
 	err = tr_ops->send_page(transport, drbd_stream, sbuf->page, offset, size, flags);
 	if (!err) {
 		sbuf->unsent =
@@ -1048,6 +1289,9 @@ int __send_command(struct drbd_connection *connection, int vnr,
 		return -EIO;
 	prepare_header(connection, vnr, sbuf->pos, cmd,
 		       sbuf->allocated_size + sbuf->additional_size);
+	sbuf->cmd_stats[min_t(unsigned int, cmd, DRBD_SEND_CMD_STATS - 1)].packets++;
+	sbuf->cmd_stats[min_t(unsigned int, cmd, DRBD_SEND_CMD_STATS - 1)].bytes +=
+		sbuf->allocated_size + sbuf->additional_size;
 
 	if (corked && !flush) {
 		sbuf->pos += sbuf->allocated_size;
@@ -1117,6 +1361,7 @@ int drbd_send_ping(struct drbd_connection *connection)
 {
 	if (!conn_prepare_command(connection, 0, CONTROL_STREAM))
 		return -EIO;
+	connection->ping_sent_kt = ktime_get();
 	return send_command(connection, -1, P_PING, CONTROL_STREAM | SFLAG_FLUSH);
 }
 
@@ -1527,7 +1772,7 @@ int drbd_attach_peer_device(struct drbd_peer_device *const peer_device) __must_h
 	int err = -ENOMEM;
 
 	resync_lru = lc_create("resync", drbd_bm_ext_cache,
-	                       1, 61, sizeof(struct bm_extent),
+	                       1, DRBD_RS_LRU_ELEMENTS, sizeof(struct bm_extent),
 	                       offsetof(struct bm_extent, lce));
 	if (resync_lru != NULL) {
 		peer_device->resync_lru = resync_lru;
@@ -2069,6 +2314,7 @@ int drbd_send_drequest(struct drbd_peer_device *peer_device, int cmd,
 	p->block_id = block_id;
 	p->pad = 0;
 	p->blksize = cpu_to_be32(size);
+	trace_drbd_resync_request(peer_device, cmd, sector, size);
 	return drbd_send_command(peer_device, cmd, DATA_STREAM);
 }
 
@@ -2130,6 +2376,7 @@ static int _drbd_send_page(struct drbd_peer_device *peer_device, struct page *pa
 	struct drbd_transport_ops *tr_ops = transport->ops;
 	int err;
 
+	drbd_delay_send(connection, size);
 	err = tr_ops->send_page(transport, DATA_STREAM, page, offset, size, msg_flags);
 	if (!err)
 		peer_device->send_cnt += size >> 9;
@@ -2151,7 +2398,11 @@ static int _drbd_no_send_page(struct drbd_peer_device *peer_device, struct page
 	memcpy(buffer2, from_base + offset, size);
 	kunmap_atomic(from_base);
 
-	if (msg_flags & MSG_MORE) {
+	/* While corked, leave the copied payload in the send buffer, like
+	 * __send_command() does with headers.  Small writes queued back to
+	 * back then go out together with the following packets, with one
+	 * send_page() call per filled page instead of one per write. */
+	if ((msg_flags & MSG_MORE) || test_bit(CORKED + DATA_STREAM, &connection->flags)) {
 		sbuf->pos += sbuf->allocated_size;
 		sbuf->allocated_size = 0;
 		err = 0;
@@ -2168,9 +2419,12 @@ static int _drbd_send_bio(struct drbd_peer_device *peer_device, struct bio *bio)
 	struct bio_vec bvec;
 	struct bvec_iter iter;
 
-	/* Flush send buffer and make sure PAGE_SIZE is available... */
-	alloc_send_buffer(connection, PAGE_SIZE, DATA_STREAM);
-	connection->send_buffer[DATA_STREAM].allocated_size = 0;
+	/* Flush send buffer and make sure PAGE_SIZE is available...
+	 * unless corked, then keep filling the current page. */
+	if (!test_bit(CORKED + DATA_STREAM, &connection->flags)) {
+		alloc_send_buffer(connection, PAGE_SIZE, DATA_STREAM);
+		connection->send_buffer[DATA_STREAM].allocated_size = 0;
+	}
 
 	/* hint all but last page with MSG_MORE */
 	bio_for_each_segment(bvec, bio, iter) {
@@ -2219,6 +2473,7 @@ static int _drbd_send_zc_bio(struct drbd_peer_device *peer_device, struct bio *b
 
 		flush_send_buffer(connection, DATA_STREAM);
 
+		drbd_delay_send(connection, bio->bi_iter.bi_size);
 		err = tr_ops->send_zc_bio(transport, bio);
 		if (!err)
 			peer_device->send_cnt += bio->bi_iter.bi_size >> 9;
@@ -2271,23 +2526,57 @@ static u32 bio_flags_to_wire(struct drbd_connection *connection, struct bio *bio
 	return bio->bi_opf & REQ_SYNC ? DP_RW_SYNC : 0;
 }
 
+static bool bio_is_all_zeroes(struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		void *addr = bvec_kmap_local(&bvec);
+		bool zeroes = !memchr_inv(addr, 0, bvec.bv_len);
+
+		kunmap_local(addr);
+		if (!zeroes)
+			return false;
+	}
+	return true;
+}
+
+/* The peer does a zero-out for P_ZEROES, which neither knows about
+ * FUA nor flushes; leave those writes alone. */
+static bool may_send_as_zeroes(struct drbd_connection *connection, struct drbd_request *req)
+{
+	struct bio *bio = req->master_bio;
+
+	return READ_ONCE(drbd_detect_zeroes) &&
+		(connection->agreed_features & DRBD_FF_WZEROES) &&
+		req->i.size != 0 &&
+		!(bio->bi_opf & (REQ_FUA | REQ_PREFLUSH)) &&
+		bio_is_all_zeroes(bio);
+}
+
 /* Used to send write or TRIM aka REQ_OP_DISCARD requests
- * R_PRIMARY -> Peer	(P_DATA, P_TRIM)
+ * R_PRIMARY -> Peer	(P_DATA, P_TRIM, P_ZEROES)
  */
 int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *req)
 {
 	struct drbd_device *device = peer_device->device;
-	char *const before = peer_device->connection->scratch_buffer.d.before;
-	char *const after = peer_device->connection->scratch_buffer.d.after;
+	struct drbd_connection *connection = peer_device->connection;
+	char *const before = connection->scratch_buffer.d.before;
+	char *const after = connection->scratch_buffer.d.after;
+	struct crypto_shash *integrity_tfm = NULL;
 	struct p_trim *trim = NULL;
 	struct p_data *p;
 	void *digest_out = NULL;
 	unsigned int dp_flags = 0;
 	int digest_size = 0;
+	bool zeroes = false;
 	int err;
 	const unsigned s = req->net_rq_state[peer_device->node_id];
 	const int op = bio_op(req->master_bio);
 
+	trace_drbd_send_dblock(peer_device, req);
+
 	if (op == REQ_OP_DISCARD || op == REQ_OP_WRITE_ZEROES) {
 		trim = drbd_prepare_command(peer_device, sizeof(*trim), DATA_STREAM);
 		if (!trim)
@@ -2295,13 +2584,35 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		p = &trim->p_data;
 		trim->size = cpu_to_be32(req->i.size);
 	} else {
-		if (peer_device->connection->integrity_tfm)
-			digest_size = crypto_shash_digestsize(peer_device->connection->integrity_tfm);
+		/* Compute the digest before we take the data stream mutex,
+		 * others may want to send on that stream meanwhile. */
+		mutex_lock(&connection->integrity_mutex);
+		integrity_tfm = connection->integrity_tfm;
+		if (integrity_tfm) {
+			digest_size = crypto_shash_digestsize(integrity_tfm);
+			BUG_ON(digest_size > sizeof(connection->scratch_buffer.d.before));
+			drbd_csum_bio(integrity_tfm, req->master_bio, before);
+		} else if (op == REQ_OP_WRITE) {
+			zeroes = may_send_as_zeroes(connection, req);
+		}
 
-		p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
-		if (!p)
+		if (zeroes) {
+			trim = drbd_prepare_command(peer_device, sizeof(*trim), DATA_STREAM);
+			if (trim) {
+				p = &trim->p_data;
+				trim->size = cpu_to_be32(req->i.size);
+			} else {
+				p = NULL;
+			}
+		} else {
+			p = drbd_prepare_command(peer_device, sizeof(*p) + digest_size, DATA_STREAM);
+		}
+		if (!p) {
+			mutex_unlock(&connection->integrity_mutex);
 			return -EIO;
-		digest_out = p + 1;
+		}
+		if (!zeroes)
+			digest_out = p + 1;
 	}
 
 	p->sector = cpu_to_be64(req->i.sector);
@@ -2316,6 +2627,8 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		if (s & RQ_EXP_WRITE_ACK || dp_flags & DP_MAY_SET_IN_SYNC)
 			dp_flags |= DP_SEND_WRITE_ACK;
 	}
+	if (zeroes)
+		dp_flags |= DP_ZEROES;
 	p->dp_flags = cpu_to_be32(dp_flags);
 
 	if (trim) {
@@ -2324,11 +2637,8 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 		goto out;
 	}
 
-	if (digest_size && digest_out) {
-		BUG_ON(digest_size > sizeof(peer_device->connection->scratch_buffer.d.before));
-		drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, before);
+	if (digest_size && digest_out)
 		memcpy(digest_out, before, digest_size);
-	}
 
 	additional_size_command(peer_device->connection, DATA_STREAM, req->i.size);
 	err = __send_command(peer_device->connection, device->vnr, P_DATA, DATA_STREAM);
@@ -2348,19 +2658,21 @@ int drbd_send_dblock(struct drbd_peer_device *peer_device, struct drbd_request *
 			err = _drbd_send_bio(peer_device, req->master_bio);
 		else
 			err = _drbd_send_zc_bio(peer_device, req->master_bio);
+	}
+out:
+	mutex_unlock(&connection->mutex[DATA_STREAM]);
 
-		/* double check digest, sometimes buffers have been modified in flight. */
-		if (digest_size > 0) {
-			drbd_csum_bio(peer_device->connection->integrity_tfm, req->master_bio, after);
-			if (memcmp(before, after, digest_size)) {
-				drbd_warn(device,
-					"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
-					(unsigned long long)req->i.sector, req->i.size);
-			}
+	/* double check digest, sometimes buffers have been modified in flight. */
+	if (!err && digest_size > 0 && READ_ONCE(drbd_integrity_recheck)) {
+		drbd_csum_bio(integrity_tfm, req->master_bio, after);
+		if (memcmp(before, after, digest_size)) {
+			drbd_warn(device,
+				"Digest mismatch, buffer modified by upper layers during write: %llus +%u\n",
+				(unsigned long long)req->i.sector, req->i.size);
 		}
 	}
-out:
-	mutex_unlock(&peer_device->connection->mutex[DATA_STREAM]);
+	if (op != REQ_OP_DISCARD && op != REQ_OP_WRITE_ZEROES)
+		mutex_unlock(&connection->integrity_mutex);
 
 	return err;
 }
@@ -2902,12 +3214,76 @@ static void drbd_set_defaults(struct drbd_device *device)
 	device->disk_state[NOW] = D_DISKLESS;
 }
 
+/* Sum of the per CPU counters. Like the plain counters they replace, they are
+ * statistics only, and may be off by whatever is completing right now. */
+struct drbd_io_cnt drbd_device_io_cnt(struct drbd_device *device)
+{
+	struct drbd_io_cnt sum = {};
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_io_cnt *c = per_cpu_ptr(device->io_cnt, cpu);
+
+		sum.read_cnt += READ_ONCE(c->read_cnt);
+		sum.writ_cnt += READ_ONCE(c->writ_cnt);
+		sum.al_wait_cnt += READ_ONCE(c->al_wait_cnt);
+		sum.al_wait_jif += READ_ONCE(c->al_wait_jif);
+		sum.local_cnt += READ_ONCE(c->local_cnt);
+		sum.local_jif += READ_ONCE(c->local_jif);
+		sum.net_cnt += READ_ONCE(c->net_cnt);
+		sum.net_jif += READ_ONCE(c->net_jif);
+	}
+	return sum;
+}
+
+void drbd_reset_io_cnt(struct drbd_device *device)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct drbd_io_cnt *c = per_cpu_ptr(device->io_cnt, cpu);
+
+		WRITE_ONCE(c->read_cnt, 0);
+		WRITE_ONCE(c->writ_cnt, 0);
+	}
+}
+
+static u64 drbd_jif_to_msecs(unsigned long jif)
+{
+	return div_u64((u64)jif * MSEC_PER_SEC, HZ);
+}
+
+/* /sys/block/drbdX/drbd_latency, next to the block layer's stat: number of,
+ * and total milliseconds spent in, activity log waits, local disk I/O and
+ * waiting for peer acks.  Jiffy resolution, but cheap enough to be always on;
+ * see req_timing in debugfs for more detail. */
+static ssize_t drbd_latency_show(struct device *dev, struct device_attribute *attr,
+				 char *buf)
+{
+	struct drbd_device *device = dev_to_disk(dev)->private_data;
+	struct drbd_io_cnt c = drbd_device_io_cnt(device);
+
+	return sysfs_emit(buf, "%8lu %8llu %8lu %8llu %8lu %8llu\n",
+			  c.al_wait_cnt, drbd_jif_to_msecs(c.al_wait_jif),
+			  c.local_cnt, drbd_jif_to_msecs(c.local_jif),
+			  c.net_cnt, drbd_jif_to_msecs(c.net_jif));
+}
+static DEVICE_ATTR(drbd_latency, 0444, drbd_latency_show, NULL);
+
+static struct attribute *drbd_disk_attrs[] = {
+	&dev_attr_drbd_latency.attr,
+	NULL,
+};
+
+static const struct attribute_group drbd_disk_attr_group = {
+	.attrs = drbd_disk_attrs,
+};
+
 void drbd_cleanup_device(struct drbd_device *device)
 {
 	device->al_writ_cnt = 0;
 	device->bm_writ_cnt = 0;
-	device->read_cnt = 0;
-	device->writ_cnt = 0;
+	drbd_reset_io_cnt(device);
 
 	if (device->bitmap) {
 		/* maybe never allocated. */
@@ -2926,8 +3302,11 @@ static void drbd_destroy_mempools(void)
 	bioset_exit(&drbd_io_bio_set);
 	bioset_exit(&drbd_md_io_bio_set);
 	mempool_exit(&drbd_md_io_page_pool);
+	mempool_exit(&drbd_epoch_mempool);
 	mempool_exit(&drbd_ee_mempool);
 	mempool_exit(&drbd_request_mempool);
+	if (drbd_epoch_cache)
+		kmem_cache_destroy(drbd_epoch_cache);
 	if (drbd_ee_cache)
 		kmem_cache_destroy(drbd_ee_cache);
 	if (drbd_request_cache)
@@ -2937,6 +3316,7 @@ static void drbd_destroy_mempools(void)
 	if (drbd_al_ext_cache)
 		kmem_cache_destroy(drbd_al_ext_cache);
 
+	drbd_epoch_cache     = NULL;
 	drbd_ee_cache        = NULL;
 	drbd_request_cache   = NULL;
 	drbd_bm_ext_cache    = NULL;
@@ -2951,13 +3331,17 @@ static int drbd_create_mempools(void)
 	int ret;
 
 	/* caches */
+	/* Requests are touched by the submitting CPU, the completion
+	 * context and the sender/receiver threads, often on different nodes.
+	 * Do not let two of them share a cache line, and keep the start of
+	 * each object (including the interval tree node) in one line. */
 	drbd_request_cache = kmem_cache_create(
-		"drbd_req", sizeof(struct drbd_request), 0, 0, NULL);
+		"drbd_req", sizeof(struct drbd_request), 0, SLAB_HWCACHE_ALIGN, NULL);
 	if (drbd_request_cache == NULL)
 		goto Enomem;
 
 	drbd_ee_cache = kmem_cache_create(
-		"drbd_ee", sizeof(struct drbd_peer_request), 0, 0, NULL);
+		"drbd_ee", sizeof(struct drbd_peer_request), 0, SLAB_HWCACHE_ALIGN, NULL);
 	if (drbd_ee_cache == NULL)
 		goto Enomem;
 
@@ -2971,6 +3355,11 @@ static int drbd_create_mempools(void)
 	if (drbd_al_ext_cache == NULL)
 		goto Enomem;
 
+	drbd_epoch_cache = kmem_cache_create(
+		"drbd_epoch", sizeof(struct drbd_epoch), 0, 0, NULL);
+	if (drbd_epoch_cache == NULL)
+		goto Enomem;
+
 	/* mempools */
 	ret = bioset_init(&drbd_io_bio_set, BIO_POOL_SIZE, 0, 0);
 	if (ret)
@@ -2994,6 +3383,13 @@ static int drbd_create_mempools(void)
 	if (ret)
 		goto Enomem;
 
+	/* One epoch is opened per P_BARRIER; fsync heavy peers can keep
+	 * many of them in flight per connection. */
+	ret = mempool_init_slab_pool(&drbd_epoch_mempool, DRBD_MIN_POOL_PAGES,
+				     drbd_epoch_cache);
+	if (ret)
+		goto Enomem;
+
 	return 0;
 
 Enomem:
@@ -3024,6 +3420,7 @@ static void drbd_device_finalize_work_fn(struct work_struct *work)
 
 	put_disk(device->vdisk);
 
+	free_percpu(device->io_cnt);
 	kfree(device);
 
 	kref_debug_put(&resource->kref_debug, 4);
@@ -3049,6 +3446,7 @@ void drbd_destroy_device(struct kref *kref)
 	}
 
 	__free_page(device->md_io.page);
+	__free_page(device->md_sb_io.page);
 	kref_debug_destroy(&device->kref_debug);
 
 	INIT_WORK(&device->finalize_work, drbd_device_finalize_work_fn);
@@ -3058,6 +3456,7 @@ void drbd_destroy_device(struct kref *kref)
 static void free_page_pool(struct drbd_resource *resource)
 {
 	struct page *page;
+	int cpu;
 
 	while (resource->pp_pool) {
 		page = resource->pp_pool;
@@ -3065,6 +3464,24 @@ static void free_page_pool(struct drbd_resource *resource)
 		__free_page(page);
 		resource->pp_vacant--;
 	}
+
+	if (!resource->pp_magazine)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct drbd_page_magazine *mag = per_cpu_ptr(resource->pp_magazine, cpu);
+
+		/* No drain_work is pending, a queued one holds a reference
+		 * on the resource. We may be called from an RCU callback
+		 * here, so we could not wait for one anyway. */
+		while (mag->pages) {
+			page = mag->pages;
+			mag->pages = page_chain_next(page);
+			__free_page(page);
+			mag->count--;
+		}
+	}
+	free_percpu(resource->pp_magazine);
+	resource->pp_magazine = NULL;
 }
 
 void drbd_destroy_resource(struct kref *kref)
@@ -3072,6 +3489,7 @@ void drbd_destroy_resource(struct kref *kref)
 	struct drbd_resource *resource = container_of(kref, struct drbd_resource, kref);
 
 	free_page_pool(resource);
+	kfree(resource->spare_state_change);
 	idr_destroy(&resource->devices);
 	free_cpumask_var(resource->cpu_mask);
 	kfree(resource->name);
@@ -3198,9 +3616,14 @@ static void drbd_cleanup(void)
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
 
+	if (drbd_peer_submit_wq)
+		destroy_workqueue(drbd_peer_submit_wq);
+
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
 
+	drbd_pp_cpuhp_unregister();
+	drbd_pp_shrinker_unregister();
 	drbd_destroy_mempools();
 	unregister_blkdev(DRBD_MAJOR, "drbd");
 
@@ -3212,7 +3635,7 @@ static void drbd_cleanup(void)
 static void drbd_init_workqueue(struct drbd_work_queue* wq)
 {
 	spin_lock_init(&wq->q_lock);
-	INIT_LIST_HEAD(&wq->q);
+	init_llist_head(&wq->q);
 	init_waitqueue_head(&wq->q_wait);
 }
 
@@ -3232,12 +3655,10 @@ static int w_complete(struct drbd_work *w, int cancel)
 
 void drbd_queue_work(struct drbd_work_queue *q, struct drbd_work *w)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&q->q_lock, flags);
-	list_add_tail(&w->list, &q->q);
-	spin_unlock_irqrestore(&q->q_lock, flags);
-	wake_up(&q->q_wait);
+	/* Only the first item needs to wake the consumer. As long as q is
+	 * not empty, the consumer has yet to come around to dequeue it. */
+	if (llist_add(&w->node, &q->q))
+		wake_up(&q->q_wait);
 }
 
 void drbd_flush_workqueue(struct drbd_work_queue *work_queue)
@@ -3275,9 +3696,18 @@ static void drbd_put_send_buffers(struct drbd_connection *connection)
 	unsigned int i;
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
-		if (connection->send_buffer[i].page) {
-			put_page(connection->send_buffer[i].page);
-			connection->send_buffer[i].page = NULL;
+		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
+		int j;
+
+		if (sbuf->page) {
+			put_page(sbuf->page);
+			sbuf->page = NULL;
+		}
+		for (j = 0; j < DRBD_SEND_BUFFER_SPARES; j++) {
+			if (sbuf->spare[j]) {
+				put_page(sbuf->spare[j]);
+				sbuf->spare[j] = NULL;
+			}
 		}
 	}
 }
@@ -3397,7 +3827,8 @@ int set_resource_options(struct drbd_resource *resource, struct res_opts *res_op
 		wake_device_misc = true;
 
 	resource->res_opts = *res_opts;
-	if (cpumask_empty(new_cpu_mask))
+	resource->cpu_mask_auto = cpumask_empty(new_cpu_mask);
+	if (resource->cpu_mask_auto)
 		drbd_calc_cpu_mask(&new_cpu_mask);
 	if (!cpumask_equal(resource->cpu_mask, new_cpu_mask)) {
 		cpumask_copy(resource->cpu_mask, new_cpu_mask);
@@ -3432,7 +3863,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	struct drbd_resource *resource;
 	struct page *page;
 	const int page_pool_count = DRBD_MAX_BIO_SIZE/PAGE_SIZE;
-	int i;
+	int i, cpu;
 
 	resource = kzalloc(sizeof(struct drbd_resource), GFP_KERNEL);
 	if (!resource)
@@ -3481,6 +3912,15 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	init_waitqueue_head(&resource->pp_wait);
 
 	spin_lock_init(&resource->pp_lock);
+	resource->pp_magazine = alloc_percpu(struct drbd_page_magazine);
+	if (!resource->pp_magazine)
+		goto fail_free_pages;
+	for_each_possible_cpu(cpu) {
+		struct drbd_page_magazine *mag = per_cpu_ptr(resource->pp_magazine, cpu);
+
+		INIT_WORK(&mag->drain_work, drbd_magazine_drain_work);
+		mag->resource = resource;
+	}
 
 	for (i = 0; i < page_pool_count; i++) {
 		page = alloc_page(GFP_HIGHUSER);
@@ -3523,11 +3963,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	if (drbd_alloc_send_buffers(connection))
 		goto fail;
 
-	connection->current_epoch = kzalloc(sizeof(struct drbd_epoch), GFP_KERNEL);
-	if (!connection->current_epoch)
-		goto fail;
-
-	INIT_LIST_HEAD(&connection->current_epoch->list);
+	connection->current_epoch = drbd_alloc_epoch(GFP_KERNEL);
 	connection->epochs = 1;
 	spin_lock_init(&connection->epoch_lock);
 
@@ -3542,12 +3978,15 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	connection->send.current_dagtag_sector = 0;
 
 	connection->cstate[NOW] = C_STANDALONE;
+	connection->numa_node = NUMA_NO_NODE;
 	connection->peer_role[NOW] = R_UNKNOWN;
 	idr_init(&connection->peer_devices);
 
 	drbd_init_workqueue(&connection->sender_work);
 	mutex_init(&connection->mutex[DATA_STREAM]);
 	mutex_init(&connection->mutex[CONTROL_STREAM]);
+	mutex_init(&connection->integrity_mutex);
+	mutex_init(&connection->flush_mutex);
 
 	INIT_LIST_HEAD(&connection->connect_timer_work.list);
 	timer_setup(&connection->connect_timer, connect_timer_fn, 0);
@@ -3588,7 +4027,8 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 
 fail:
 	drbd_put_send_buffers(connection);
-	kfree(connection->current_epoch);
+	if (connection->current_epoch)
+		drbd_free_epoch(connection->current_epoch);
 	kfree(connection);
 
 	return NULL;
@@ -3627,7 +4067,7 @@ void drbd_destroy_connection(struct kref *kref)
 
 	if (atomic_read(&connection->current_epoch->epoch_size) !=  0)
 		drbd_err(connection, "epoch_size:%d\n", atomic_read(&connection->current_epoch->epoch_size));
-	kfree(connection->current_epoch);
+	drbd_free_epoch(connection->current_epoch);
 
 	idr_for_each_entry(&connection->peer_devices, peer_device, vnr) {
 		struct drbd_device *device = peer_device->device;
@@ -3637,6 +4077,7 @@ void drbd_destroy_connection(struct kref *kref)
 	}
 	idr_destroy(&connection->peer_devices);
 
+	drbd_pp_reserve_free(connection);
 	kfree(connection->transport.net_conf);
 	kref_debug_destroy(&connection->kref_debug);
 	kfree(connection);
@@ -3658,6 +4099,7 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	peer_device->disk_state[NOW] = D_UNKNOWN;
 	peer_device->repl_state[NOW] = L_OFF;
 	spin_lock_init(&peer_device->peer_seq_lock);
+	spin_lock_init(&peer_device->rs_tele.lock);
 
 	err = drbd_create_peer_device_default_config(peer_device);
 	if (err) {
@@ -3674,6 +4116,9 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 	INIT_LIST_HEAD(&peer_device->propagate_uuids_work.list);
 	peer_device->propagate_uuids_work.cb = w_send_uuids;
 
+	INIT_LIST_HEAD(&peer_device->update_peers_work.list);
+	peer_device->update_peers_work.cb = w_update_peers_batch;
+
 	mutex_init(&peer_device->resync_next_bit_mutex);
 
 	atomic_set(&peer_device->ap_pending_cnt, 0);
@@ -3727,8 +4172,12 @@ static int init_submitter(struct drbd_device *device)
 	if (!device->submit.wq)
 		return -ENOMEM;
 	INIT_WORK(&device->submit.worker, do_submit);
+	INIT_WORK(&device->submit.peer_worker, do_submit_ready_peer_writes);
+	INIT_WORK(&device->submit.discard_worker, do_submit_peer_discards);
 	INIT_LIST_HEAD(&device->submit.writes);
 	INIT_LIST_HEAD(&device->submit.peer_writes);
+	INIT_LIST_HEAD(&device->submit.peer_writes_ready);
+	INIT_LIST_HEAD(&device->submit.peer_discards);
 	spin_lock_init(&device->submit.lock);
 	return 0;
 }
@@ -3778,11 +4227,19 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	atomic_set(&device->local_cnt, 0);
 	atomic_set(&device->rs_sect_ev, 0);
 	atomic_set(&device->md_io.in_use, 0);
+	atomic_set(&device->md_sb_io.in_use, 0);
+	device->md_io.device = device;
+	device->md_sb_io.device = device;
 
 #ifdef CONFIG_DRBD_TIMING_STATS
 	spin_lock_init(&device->timing_lock);
+#endif
+#ifdef CONFIG_DRBD_FAULT_INJECTION
+	spin_lock_init(&device->io_delay_lock);
 #endif
 	spin_lock_init(&device->al_lock);
+	spin_lock_init(&device->rs_share_lock);
+	INIT_LIST_HEAD(&device->rs_share_reads);
 
 	spin_lock_init(&device->pending_completion_lock);
 	INIT_LIST_HEAD(&device->pending_master_completion[0]);
@@ -3797,6 +4254,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	INIT_LIST_HEAD(&device->pending_bitmap_work.q);
 
 	timer_setup(&device->md_sync_timer, md_sync_timer_fn, 0);
+	mutex_init(&device->md_sync_mutex);
 	timer_setup(&device->request_timer, request_timer_fn, 0);
 
 	init_waitqueue_head(&device->misc_wait);
@@ -3828,6 +4286,12 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	device->md_io.page = alloc_page(GFP_KERNEL);
 	if (!device->md_io.page)
 		goto out_no_io_page;
+	device->md_sb_io.page = alloc_page(GFP_KERNEL);
+	if (!device->md_sb_io.page)
+		goto out_no_sb_io_page;
+	device->io_cnt = alloc_percpu(struct drbd_io_cnt);
+	if (!device->io_cnt)
+		goto out_no_io_cnt;
 
 	device->bitmap = drbd_bm_alloc();
 	if (!device->bitmap)
@@ -3903,6 +4367,9 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	err = add_disk(disk);
 	if (err)
 		goto out_destroy_submitter;
+	/* Not worth failing the device over; removed in drbd_unregister_device(). */
+	if (sysfs_create_group(&disk_to_dev(disk)->kobj, &drbd_disk_attr_group))
+		drbd_warn(device, "could not create sysfs attribute drbd_latency\n");
 	device->have_quorum[OLD] =
 	device->have_quorum[NEW] =
 		(resource->res_opts.quorum == QOU_OFF);
@@ -3955,6 +4422,10 @@ out_no_peer_device:
 
 	drbd_bm_free(device->bitmap);
 out_no_bitmap:
+	free_percpu(device->io_cnt);
+out_no_io_cnt:
+	__free_page(device->md_sb_io.page);
+out_no_sb_io_page:
 	__free_page(device->md_io.page);
 out_no_io_page:
 	put_disk(disk);
@@ -3994,8 +4465,11 @@ void drbd_unregister_device(struct drbd_device *device)
 	for_each_peer_device(peer_device, device)
 		drbd_debugfs_peer_device_cleanup(peer_device);
 	drbd_debugfs_device_cleanup(device);
+	sysfs_remove_group(&disk_to_dev(device->vdisk)->kobj, &drbd_disk_attr_group);
 	del_gendisk(device->vdisk);
 
+	flush_work(&device->submit.peer_worker);
+	flush_work(&device->submit.discard_worker);
 	destroy_workqueue(device->submit.wq);
 	device->submit.wq = NULL;
 	timer_shutdown_sync(&device->request_timer);
@@ -4130,6 +4604,14 @@ static int __init drbd_init(void)
 	if (err)
 		goto fail;
 
+	err = drbd_pp_shrinker_register();
+	if (err)
+		goto fail;
+
+	err = drbd_pp_cpuhp_register();
+	if (err)
+		goto fail;
+
 	err = -ENOMEM;
 	drbd_proc = proc_create_single("drbd", S_IFREG | 0444 , NULL,
 			drbd_seq_show);
@@ -4148,6 +4630,13 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	/* unbound, so that the volumes' peer_workers run in parallel */
+	drbd_peer_submit_wq = alloc_workqueue("drbd_peer_submit", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_peer_submit_wq) {
+		pr_err("unable to create peer submit workqueue\n");
+		goto fail;
+	}
+
 	drbd_debugfs_init();
 
 	pr_info("initialized. "
@@ -4204,6 +4693,7 @@ void drbd_md_encode(struct drbd_device *device, struct meta_data_on_disk_9 *buff
 	buffer->al_stripe_size_4k = cpu_to_be32(device->ldev->md.al_stripe_size_4k);
 }
 
+/* buffer must be the one of device->md_sb_io */
 int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer)
 {
 	sector_t sector;
@@ -4223,7 +4713,7 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 	D_ASSERT(device, drbd_md_ss(device->ldev) == device->ldev->md.md_offset);
 	sector = device->ldev->md.md_offset;
 
-	err = drbd_md_sync_page_io(device, device->ldev, sector, REQ_OP_WRITE);
+	err = __drbd_md_sync_page_io(device, &device->md_sb_io, device->ldev, sector, REQ_OP_WRITE);
 	if (err) {
 		drbd_err(device, "meta data update failed!\n");
 		drbd_handle_io_error(device, DRBD_META_IO_ERROR);
@@ -4240,6 +4730,7 @@ int drbd_md_write(struct drbd_device *device, struct meta_data_on_disk_9 *buffer
 static int __drbd_md_sync(struct drbd_device *device, bool maybe)
 {
 	struct meta_data_on_disk_9 *buffer;
+	unsigned int seq, start;
 	int err = -EIO;
 
 	/* Don't accidentally change the DRBD meta data layout. */
@@ -4250,21 +4741,37 @@ static int __drbd_md_sync(struct drbd_device *device, bool maybe)
 	if (!get_ldev_if_state(device, D_DETACHING))
 		return -EIO;
 
-	buffer = drbd_md_get_buffer(device, __func__);
+	/* Whatever the caller changed is in memory before seq is taken.
+	 * A write that sampled md_sync_seq at or after seq, before it
+	 * encoded the super block, has it on disk already. So while one
+	 * write is in flight, all callers queueing up behind it get served
+	 * by the next single write. */
+	seq = atomic_inc_return(&device->md_sync_seq);
+	mutex_lock(&device->md_sync_mutex);
+	if ((int)(device->md_synced_seq - seq) >= 0) {
+		err = device->md_sync_err;
+		goto out_unlock;
+	}
+
+	buffer = __drbd_md_get_buffer(device, &device->md_sb_io, __func__);
 	if (!buffer)
-		goto out;
+		goto out_unlock;
 
 	del_timer(&device->md_sync_timer);
 	/* timer may be rearmed by drbd_md_mark_dirty() now. */
 
+	start = atomic_read(&device->md_sync_seq);
 	if (test_and_clear_bit(MD_DIRTY, &device->flags) || !maybe) {
 		err = drbd_md_write(device, buffer);
 		if (err)
 			set_bit(MD_DIRTY, &device->flags);
+		device->md_synced_seq = start;
+		device->md_sync_err = err;
 	}
 
-	drbd_md_put_buffer(device);
-out:
+	__drbd_md_put_buffer(&device->md_sb_io);
+out_unlock:
+	mutex_unlock(&device->md_sync_mutex);
 	put_ldev(device);
 
 	return err;
@@ -5264,12 +5771,13 @@ static int w_bitmap_io(struct drbd_work *w, int unused)
 
 void drbd_queue_pending_bitmap_work(struct drbd_device *device)
 {
+	struct drbd_work *w, *tmp;
 	unsigned long flags;
 
 	spin_lock_irqsave(&device->pending_bitmap_work.q_lock, flags);
-	spin_lock(&device->resource->work.q_lock);
-	list_splice_tail_init(&device->pending_bitmap_work.q, &device->resource->work.q);
-	spin_unlock(&device->resource->work.q_lock);
+	list_for_each_entry_safe(w, tmp, &device->pending_bitmap_work.q, list)
+		llist_add(&w->node, &device->resource->work.q);
+	INIT_LIST_HEAD(&device->pending_bitmap_work.q);
 	spin_unlock_irqrestore(&device->pending_bitmap_work.q_lock, flags);
 	wake_up(&device->resource->work.q_wait);
 }
@@ -5638,8 +6146,146 @@ _drbd_insert_fault(struct drbd_device *device, unsigned int type)
 
 	return ret;
 }
+
+/* When the I/O (or the send) should be done: after the previous one at
+ * kib_per_sec, plus delay_us and a random part of jitter_us. */
+static ktime_t drbd_io_delay_deadline(struct drbd_io_delay *d, size_t size)
+{
+	ktime_t now = ktime_get(), start = now;
+	u64 delay_ns = (u64)d->delay_us * NSEC_PER_USEC;
+
+	if (d->jitter_us)
+		delay_ns += (u64)get_random_u32_below(d->jitter_us + 1) * NSEC_PER_USEC;
+	if (d->kib_per_sec) {
+		if (ktime_after(d->busy_until_kt, now))
+			start = d->busy_until_kt;
+		d->busy_until_kt = ktime_add_ns(start,
+			div_u64((u64)size * NSEC_PER_SEC, (u64)d->kib_per_sec << 10));
+		start = d->busy_until_kt;
+	}
+	return ktime_add_ns(start, delay_ns);
+}
+
+static int drbd_io_delay_class(int fault_type)
+{
+	switch (fault_type) {
+	case DRBD_FAULT_MD_WR:
+	case DRBD_FAULT_MD_RD:
+		return DRBD_DELAY_META;
+	case DRBD_FAULT_RS_WR:
+	case DRBD_FAULT_RS_RD:
+		return DRBD_DELAY_RESYNC;
+	case DRBD_FAULT_DT_WR:
+	case DRBD_FAULT_DT_RD:
+	case DRBD_FAULT_DT_RA:
+		return DRBD_DELAY_DATA;
+	default:
+		return -1;
+	}
+}
+
+struct drbd_delayed_bio {
+	struct delayed_work dwork;
+	struct bio *bio;
+};
+
+static void drbd_delayed_bio_workfn(struct work_struct *work)
+{
+	struct drbd_delayed_bio *db =
+		container_of(to_delayed_work(work), struct drbd_delayed_bio, dwork);
+
+	submit_bio_noacct(db->bio);
+	kfree(db);
+}
+
+/* Holds a bio back according to the io_delay of its class. The delay has
+ * jiffy resolution. If memory is short, the bio goes through undelayed.
+ * With io_null, data bios complete right away, successfully, and never
+ * reach the backing device. */
+bool _drbd_delay_bio(struct drbd_device *device, int fault_type, struct bio *bio)
+{
+	int cls = drbd_io_delay_class(fault_type);
+	struct drbd_delayed_bio *db;
+	struct drbd_io_delay *d;
+	unsigned long flags;
+	ktime_t deadline;
+	s64 delay_us;
+
+	if (cls < 0)
+		return false;
+
+	if (cls == DRBD_DELAY_DATA && READ_ONCE(device->io_null)) {
+		bio_endio(bio);
+		return true;
+	}
+
+	spin_lock_irqsave(&device->io_delay_lock, flags);
+	d = &device->io_delay[cls];
+	if (!d->delay_us && !d->jitter_us && !d->kib_per_sec) {
+		spin_unlock_irqrestore(&device->io_delay_lock, flags);
+		return false;
+	}
+	deadline = drbd_io_delay_deadline(d, bio->bi_iter.bi_size);
+	spin_unlock_irqrestore(&device->io_delay_lock, flags);
+
+	delay_us = ktime_us_delta(deadline, ktime_get());
+	if (delay_us <= 0)
+		return false;
+
+	db = kmalloc(sizeof(*db), GFP_NOWAIT | __GFP_NOWARN);
+	if (!db)
+		return false;
+	db->bio = bio;
+	INIT_DELAYED_WORK(&db->dwork, drbd_delayed_bio_workfn);
+	queue_delayed_work(system_unbound_wq, &db->dwork, usecs_to_jiffies(delay_us));
+	return true;
+}
+
+/* Limits the DATA_STREAM of a connection to send_delay.kib_per_sec, by
+ * making the sender wait as if the link were that slow. */
+void _drbd_delay_send(struct drbd_connection *connection, size_t size)
+{
+	s64 delay_us = ktime_us_delta(drbd_io_delay_deadline(&connection->send_delay, size),
+				      ktime_get());
+
+	if (delay_us <= 0)
+		return;
+	if (delay_us < 20000)
+		usleep_range(delay_us, delay_us + delay_us / 8 + 1);
+	else
+		msleep(div_s64(delay_us, 1000));
+}
 #endif
 
+/*
+ * Policy hooks.  Each is called where DRBD has just made a decision, with
+ * that built-in decision as its last argument, and returns the decision to
+ * go with: true for "yes", false for "no".  They do nothing but return the
+ * built-in decision; they are there for BPF to override their return
+ * value (fmod_ret programs, or bpf_override_return() from kprobes), which
+ * requires them to be on the error injection list.  As "yes" is the
+ * injected value, they are listed with the TRUE type.
+ */
+noinline bool drbd_policy_read_remote(struct drbd_peer_device *peer_device, sector_t sector,
+				      unsigned int size, bool builtin)
+{
+	return builtin;
+}
+ALLOW_ERROR_INJECTION(drbd_policy_read_remote, TRUE);
+
+noinline bool drbd_policy_pull_ahead(struct drbd_peer_device *peer_device, bool builtin)
+{
+	return builtin;
+}
+ALLOW_ERROR_INJECTION(drbd_policy_pull_ahead, TRUE);
+
+noinline bool drbd_policy_rs_slow_down(struct drbd_peer_device *peer_device, sector_t sector,
+				       bool builtin)
+{
+	return builtin;
+}
+ALLOW_ERROR_INJECTION(drbd_policy_rs_slow_down, TRUE);
+
 module_init(drbd_init)
 module_exit(drbd_cleanup)
 
@@ -308,7 +308,7 @@ static int drbd_adm_prepare(struct drbd_config_context *adm_ctx,
 	}
 	if (adm_ctx->peer_node_id != PEER_NODE_ID_UNSPECIFIED) {
 		/* peer_node_id is unsigned int */
-		if (adm_ctx->peer_node_id >= DRBD_NODE_ID_MAX) {
+		if (adm_ctx->peer_node_id >= DRBD_MAX_NODES) {
 			drbd_msg_put_info(adm_ctx->reply_skb, "peer node id out of range");
 			err = ERR_INVALID_REQUEST;
 			goto finish;
@@ -992,6 +992,30 @@ static bool wait_up_to_date(struct drbd_resource *resource)
 	return up_to_date > initial_up_to_date;
 }
 
+/* Add the time since *kt to *phase, and start the next phase */
+static void promote_phase_end(ktime_t *phase, ktime_t *kt)
+{
+	ktime_t now = ktime_get();
+
+	*phase = ktime_add(*phase, ktime_sub(now, *kt));
+	*kt = now;
+}
+
+static void promote_timing_done(struct drbd_resource *resource, struct drbd_promote_timing *pt)
+{
+	ktime_t total = ktime_add(ktime_add(pt->check_peers, pt->wait_up_to_date),
+				  ktime_add(pt->state_change, pt->finish));
+
+	pt->when = ktime_get_real_seconds();
+	resource->promote_timing = *pt;
+	/* auto-promote does this on every first open */
+	dynamic_drbd_dbg(resource, "promoted in %lld ms (check peers %lld, wait up-to-date %lld, "
+			 "state change %lld, finish %lld ms, %u tries)\n",
+			 ktime_to_ms(total), ktime_to_ms(pt->check_peers),
+			 ktime_to_ms(pt->wait_up_to_date), ktime_to_ms(pt->state_change),
+			 ktime_to_ms(pt->finish), pt->tries);
+}
+
 enum drbd_state_rv
 drbd_set_role(struct drbd_resource *resource, enum drbd_role role, bool force, struct sk_buff *reply_skb)
 {
@@ -1003,18 +1027,25 @@ drbd_set_role(struct drbd_resource *resource, enum drbd_role role, bool force, s
 	const char *err_str = NULL;
 	enum chg_state_flags flags = CS_ALREADY_SERIALIZED | CS_DONT_RETRY | CS_WAIT_COMPLETE;
 	bool fenced_peers = false;
+	struct drbd_promote_timing pt = {};
+	ktime_t kt = ktime_get();
 
 retry:
+	/* time spent before a retry belongs to the state change */
+	promote_phase_end(&pt.state_change, &kt);
 
 	if (role == R_PRIMARY) {
 		drbd_check_peers(resource);
+		promote_phase_end(&pt.check_peers, &kt);
 		wait_up_to_date(resource);
+		promote_phase_end(&pt.wait_up_to_date, &kt);
 	}
 	down(&resource->state_sem);
 
 	while (try++ < max_tries) {
 		if (try == max_tries - 1)
 			flags |= CS_VERBOSE;
+		pt.tries++;
 
 		if (err_str) {
 			kfree(err_str);
@@ -1163,6 +1194,7 @@ retry:
 
 	if (rv < SS_SUCCESS)
 		goto out;
+	promote_phase_end(&pt.state_change, &kt);
 
 	if (force) {
 		if (flags & CS_FP_LOCAL_UP_TO_DATE)
@@ -1219,6 +1251,11 @@ retry:
 			kobject_uevent(&disk_to_dev(device->vdisk)->kobj, KOBJ_CHANGE);
 	}
 
+	if (role == R_PRIMARY) {
+		promote_phase_end(&pt.finish, &kt);
+		promote_timing_done(resource, &pt);
+	}
+
 out:
 	up(&resource->state_sem);
 	if (err_str) {
@@ -1531,7 +1568,7 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 	sector_t u_size, size;
 	struct drbd_md *md = &device->ldev->md;
 	char ppb[10];
-	void *buffer;
+	void *buffer, *sb_buffer;
 
 	int md_moved, la_size_changed;
 	enum determine_dev_size rv = DS_UNCHANGED;
@@ -1550,6 +1587,12 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 		drbd_resume_io(device);
 		return DS_ERROR;
 	}
+	sb_buffer = __drbd_md_get_buffer(device, &device->md_sb_io, __func__);
+	if (!sb_buffer) {
+		drbd_md_put_buffer(device);
+		drbd_resume_io(device);
+		return DS_ERROR;
+	}
 
 	/* remember current offset and sizes */
 	prev.effective_size = md->effective_size;
@@ -1654,11 +1697,14 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 			else
 				md->peers[i].flags |= MDF_PEER_FULL_SYNC;
 		}
-		drbd_md_write(device, buffer);
+		drbd_md_write(device, sb_buffer);
 
 		drbd_al_initialize(device, buffer);
 
-		drbd_info(device, "Writing the whole bitmap, %s\n",
+		/* Growing in place only dirtied the pages covering the new
+		 * bits, drbd_bm_write() skips all others. */
+		drbd_info(device, "Writing the %s bitmap, %s\n",
+			 md_moved ? "whole" : "changed part of the",
 			 la_size_changed && md_moved ? "size changed and md moved" :
 			 la_size_changed ? "size changed" : "md moved");
 		/* next line implicitly does drbd_suspend_io()+drbd_resume_io() */
@@ -1673,7 +1719,7 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 			if (0 == (prev_peer_full_sync & (1 << i)))
 				md->peers[i].flags &= ~MDF_PEER_FULL_SYNC;
 		}
-		drbd_md_write(device, buffer);
+		drbd_md_write(device, sb_buffer);
 
 		if (rs)
 			drbd_info(device, "Changed AL layout to al-stripes = %d, al-stripe-size-kB = %d\n",
@@ -1683,6 +1729,19 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 		wake_up(&device->al_wait);
 	}
 
+	/* Without resync, the new area would keep whatever each backing
+	 * device had there. Zeroing it, while I/O is still suspended, makes
+	 * the nodes agree; on thin devices that only unmaps. */
+	if (drbd_resize_zero_new_space && (flags & DDSF_NO_RESYNC) &&
+	    prev.effective_size && size > prev.effective_size) {
+		int err = blkdev_issue_zeroout(device->ldev->backing_bdev, prev.effective_size,
+					       size - prev.effective_size, GFP_NOIO,
+					       BLKDEV_ZERO_NOFALLBACK);
+		if (err)
+			drbd_warn(device, "Could not zero the new area (%d), "
+				  "its content may differ between nodes\n", err);
+	}
+
 	if (size > prev.effective_size)
 		rv = prev.effective_size ? DS_GREW : DS_GREW_FROM_ZERO;
 	if (size < prev.effective_size)
@@ -1700,6 +1759,7 @@ drbd_determine_dev_size(struct drbd_device *device, sector_t peer_current_size,
 		md->al_stripe_size_4k = prev.al_stripe_size_4k;
 		md->al_size_4k = (u64)prev.al_stripes * prev.al_stripe_size_4k;
 	}
+	__drbd_md_put_buffer(&device->md_sb_io);
 	drbd_md_put_buffer(device);
 	drbd_resume_io(device);
 
@@ -2959,6 +3019,15 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 		goto fail;
 	}
 
+	/* Replication, resync and the meta data (activity log, bitmap) all
+	 * write in place, which sequential write required zones do not allow. */
+	if (bdev_is_zoned(nbc->backing_bdev) || bdev_is_zoned(nbc->md_bdev)) {
+		drbd_err_and_skb_info(&adm_ctx,
+			"Zoned block devices are not supported as backing or meta data device\n");
+		retcode = ERR_INVALID_REQUEST;
+		goto fail;
+	}
+
 	/* if you want to reconfigure, please tear down first */
 	if (device->disk_state[NOW] > D_DISKLESS) {
 		retcode = ERR_DISK_CONFIGURED;
@@ -3228,8 +3297,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	    !device->have_quorum[NOW])
 		set_bit(PRIMARY_LOST_QUORUM, &device->flags);
 
-	device->read_cnt = 0;
-	device->writ_cnt = 0;
+	drbd_reset_io_cnt(device);
 
 	drbd_reconsider_queue_parameters(device, device->ldev);
 
@@ -3327,6 +3395,9 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 
 	drbd_md_sync(device);
 
+	/* numa_placement: the worker may move next to the new backing disk */
+	resource->worker.reset_cpu_mask = 1;
+
 	kobject_uevent(&disk_to_dev(device->vdisk)->kobj, KOBJ_CHANGE);
 	put_ldev(device);
 	mutex_unlock(&resource->adm_mutex);
@@ -3657,6 +3728,7 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	drbd_flush_workqueue(&connection->sender_work);
 
 	mutex_lock(&connection->resource->conf_update);
+	mutex_lock(&connection->integrity_mutex);
 	mutex_lock(&connection->mutex[DATA_STREAM]);
 	transport = &connection->transport;
 	old_net_conf = transport->net_conf;
@@ -3728,6 +3800,7 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	connection->cram_hmac_tfm = crypto.cram_hmac_tfm;
 
 	mutex_unlock(&connection->mutex[DATA_STREAM]);
+	mutex_unlock(&connection->integrity_mutex);
 	mutex_unlock(&connection->resource->conf_update);
 	kvfree_rcu_mightsleep(old_net_conf);
 
@@ -3743,6 +3816,7 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 
  fail:
 	mutex_unlock(&connection->mutex[DATA_STREAM]);
+	mutex_unlock(&connection->integrity_mutex);
 	mutex_unlock(&connection->resource->conf_update);
 	free_crypto(&crypto);
 	kfree(new_net_conf);
@@ -5360,61 +5434,73 @@ static struct nlattr *find_cfg_context_attr(const struct nlmsghdr *nlh, int attr
 
 static void resource_to_info(struct resource_info *, struct drbd_resource *);
 
-int drbd_adm_dump_resources(struct sk_buff *skb, struct netlink_callback *cb)
+static int dump_resource_to_skb(struct sk_buff *skb, struct netlink_callback *cb,
+				struct drbd_resource *resource)
 {
 	struct drbd_genlmsghdr *dh;
-	struct drbd_resource *resource;
 	struct resource_info resource_info;
 	struct resource_statistics resource_statistics;
 	int err;
 
-	rcu_read_lock();
-	if (cb->args[0]) {
-		for_each_resource_rcu(resource, &drbd_resources)
-			if (resource == (struct drbd_resource *)cb->args[0])
-				goto found_resource;
-		err = 0;  /* resource was probably deleted */
-		goto out;
-	}
-	resource = list_entry(&drbd_resources,
-			      struct drbd_resource, resources);
-
-found_resource:
-	list_for_each_entry_continue_rcu(resource, &drbd_resources, resources) {
-		goto put_result;
-	}
-	err = 0;
-	goto out;
-
-put_result:
 	dh = genlmsg_put(skb, NETLINK_CB(cb->skb).portid,
 			cb->nlh->nlmsg_seq, &drbd_genl_family,
 			NLM_F_MULTI, DRBD_ADM_GET_RESOURCES);
-	err = -ENOMEM;
 	if (!dh)
-		goto out;
+		return -ENOMEM;
 	dh->minor = -1U;
 	dh->ret_code = NO_ERROR;
 	err = nla_put_drbd_cfg_context(skb, resource, NULL, NULL, NULL);
 	if (err)
-		goto out;
+		goto cancel;
 	err = res_opts_to_skb(skb, &resource->res_opts, !capable(CAP_SYS_ADMIN));
 	if (err)
-		goto out;
+		goto cancel;
 	resource_to_info(&resource_info, resource);
 	err = resource_info_to_skb(skb, &resource_info, !capable(CAP_SYS_ADMIN));
 	if (err)
-		goto out;
+		goto cancel;
 	resource_statistics.res_stat_write_ordering = resource->write_ordering;
 	err = resource_statistics_to_skb(skb, &resource_statistics, !capable(CAP_SYS_ADMIN));
 	if (err)
-		goto out;
-	cb->args[0] = (long)resource;
+		goto cancel;
 	genlmsg_end(skb, dh);
-	err = 0;
+	return 0;
+
+cancel:
+	genlmsg_cancel(skb, dh);
+	return err;
+}
+
+/* Fills the skb with as many resources as fit, so that the cursor lookup in
+ * cb->args[0] is not repeated once per resource. */
+int drbd_adm_dump_resources(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct drbd_resource *resource;
+	int err = 0;
+
+	rcu_read_lock();
+	if (cb->args[0]) {
+		for_each_resource_rcu(resource, &drbd_resources)
+			if (resource == (struct drbd_resource *)cb->args[0])
+				goto found_resource;
+		goto out;  /* resource was probably deleted */
+	}
+	resource = list_entry(&drbd_resources,
+			      struct drbd_resource, resources);
+
+found_resource:
+	list_for_each_entry_continue_rcu(resource, &drbd_resources, resources) {
+		err = dump_resource_to_skb(skb, cb, resource);
+		if (err)
+			break;
+		cb->args[0] = (long)resource;
+	}
 
 out:
 	rcu_read_unlock();
+	/* the skb is full; continue with the next resource in the next call */
+	if (err && skb->len)
+		err = 0;
 	if (err)
 		return err;
 	return skb->len;
@@ -5423,6 +5509,8 @@ out:
 static void device_to_statistics(struct device_statistics *s,
 				 struct drbd_device *device)
 {
+	struct drbd_io_cnt io_cnt;
+
 	memset(s, 0, sizeof(*s));
 	s->dev_upper_blocked = !may_inc_ap_bio(device);
 	if (get_ldev(device)) {
@@ -5446,8 +5534,9 @@ static void device_to_statistics(struct device_statistics *s,
 		put_ldev(device);
 	}
 	s->dev_size = get_capacity(device->vdisk);
-	s->dev_read = device->read_cnt;
-	s->dev_write = device->writ_cnt;
+	io_cnt = drbd_device_io_cnt(device);
+	s->dev_read = io_cnt.read_cnt;
+	s->dev_write = io_cnt.writ_cnt;
 	s->dev_al_writes = device->al_writ_cnt;
 	s->dev_bm_writes = device->bm_writ_cnt;
 	s->dev_upper_pending = atomic_read(&device->ap_bio_cnt[READ]) +
@@ -6170,7 +6259,7 @@ int drbd_adm_new_resource(struct sk_buff *skb, struct genl_info *info)
 	if (adm_ctx.resource)
 		goto out;
 
-	if (res_opts.node_id >= DRBD_NODE_ID_MAX) {
+	if (res_opts.node_id >= DRBD_MAX_NODES) {
 		pr_err("drbd: invalid node id (%d)\n", res_opts.node_id);
 		retcode = ERR_INVALID_REQUEST;
 		goto out;
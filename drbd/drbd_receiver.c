@@ -24,6 +24,8 @@
 #include <linux/memcontrol.h>
 #include <linux/mm_inline.h>
 #include <linux/slab.h>
+#include <linux/shrinker.h>
+#include <linux/cpuhotplug.h>
 #include <linux/pkt_sched.h>
 #include <uapi/linux/sched/types.h>
 #define __KERNEL_SYSCALLS__
@@ -33,11 +35,13 @@
 #include <net/ipv6.h>
 #include <linux/scatterlist.h>
 #include <linux/part_stat.h>
+#include <linux/ioprio.h>
 
 #include "drbd_int.h"
 #include "drbd_protocol.h"
 #include "drbd_req.h"
 #include "drbd_vli.h"
+#include "drbd_trace.h"
 
 #define PRO_FEATURES (DRBD_FF_TRIM | DRBD_FF_THIN_RESYNC | DRBD_FF_WSAME | DRBD_FF_WZEROES | \
 		      DRBD_FF_2PC_V2)
@@ -253,6 +257,7 @@ static void conn_disconnect(struct drbd_connection *connection);
 
 static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *, struct drbd_epoch *, enum epoch_event);
 static int e_end_block(struct drbd_work *, int);
+static int e_end_resync_block(struct drbd_work *, int);
 static void cleanup_unacked_peer_requests(struct drbd_connection *connection);
 static void cleanup_peer_ack_list(struct drbd_connection *connection);
 static u64 node_ids_to_bitmap(struct drbd_device *device, u64 node_ids);
@@ -382,20 +387,313 @@ static void page_chain_add(struct page **head,
 	*head = chain_first;
 }
 
+/* Each CPU keeps up to DRBD_PP_MAGAZINE_PAGES pages of its own in front of
+ * the shared pp_pool. Allocations and frees that fit are served from it with
+ * preemption disabled only. A miss takes the requested pages plus
+ * DRBD_PP_REFILL_PAGES from pp_pool in one go; chains that do not fit into
+ * the magazine on free go to pp_pool as a whole.
+ * pp_vacant plus all magazines together are limited like pp_vacant alone
+ * was before, see drbd_free_pages(). Magazines of other CPUs are drained
+ * into pp_pool before drbd_alloc_pages() sleeps, and the magazine of a CPU
+ * that goes offline is drained by drbd_pp_cpu_dead(). */
+#define DRBD_PP_MAGAZINE_PAGES (DRBD_MAX_BIO_SIZE/PAGE_SIZE)
+#define DRBD_PP_REFILL_PAGES 32
+
+static struct page *drbd_magazine_get(struct drbd_resource *resource, unsigned int number)
+{
+	struct drbd_page_magazine *mag;
+	struct page *page = NULL;
+
+	mag = get_cpu_ptr(resource->pp_magazine);
+	if (mag->count >= number) {
+		page = page_chain_del(&mag->pages, number);
+		if (page) {
+			mag->count -= number;
+			atomic_sub(number, &resource->pp_magazine_pages);
+		}
+	}
+	put_cpu_ptr(resource->pp_magazine);
+
+	return page;
+}
+
+static bool drbd_magazine_put(struct drbd_resource *resource, struct page *page,
+			      struct page *tail, unsigned int number)
+{
+	struct drbd_page_magazine *mag;
+	bool done = false;
+
+	mag = get_cpu_ptr(resource->pp_magazine);
+	if (mag->count + number <= DRBD_PP_MAGAZINE_PAGES) {
+		page_chain_add(&mag->pages, page, tail);
+		mag->count += number;
+		atomic_add(number, &resource->pp_magazine_pages);
+		done = true;
+	}
+	put_cpu_ptr(resource->pp_magazine);
+
+	return done;
+}
+
+/* The caller makes sure nobody else accesses the magazine. */
+static void drbd_magazine_to_pool(struct drbd_resource *resource,
+				  struct drbd_page_magazine *mag)
+{
+	struct page *page = mag->pages;
+	unsigned int count = mag->count;
+	struct page *tail;
+
+	if (!page)
+		return;
+	mag->pages = NULL;
+	mag->count = 0;
+	atomic_sub(count, &resource->pp_magazine_pages);
+
+	tail = page_chain_tail(page, NULL);
+	spin_lock(&resource->pp_lock);
+	page_chain_add(&resource->pp_pool, page, tail);
+	resource->pp_vacant += count;
+	spin_unlock(&resource->pp_lock);
+	wake_up(&resource->pp_wait);
+}
+
+/* Runs on the CPU that owns the magazine, see drbd_magazines_drain(). */
+void drbd_magazine_drain_work(struct work_struct *ws)
+{
+	struct drbd_page_magazine *mag =
+		container_of(ws, struct drbd_page_magazine, drain_work);
+	struct drbd_resource *resource = mag->resource;
+
+	/* if that CPU went offline meanwhile, drbd_pp_cpu_dead() did it */
+	if (get_cpu_ptr(resource->pp_magazine) == mag)
+		drbd_magazine_to_pool(resource, mag);
+	put_cpu_ptr(resource->pp_magazine);
+
+	kref_debug_put(&resource->kref_debug, 10);
+	kref_put(&resource->kref, drbd_destroy_resource);
+}
+
+/* Asynchronously move the pages of all magazines to pp_pool. The caller
+ * holds a reference on the resource, or is in an RCU read side critical
+ * section while the resource is on drbd_resources. */
+static void drbd_magazines_drain(struct drbd_resource *resource)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		struct drbd_page_magazine *mag = per_cpu_ptr(resource->pp_magazine, cpu);
+
+		if (!READ_ONCE(mag->count))
+			continue;
+		kref_get(&resource->kref);
+		kref_debug_get(&resource->kref_debug, 10);
+		if (!schedule_work_on(cpu, &mag->drain_work)) {
+			kref_debug_put(&resource->kref_debug, 10);
+			kref_put(&resource->kref, drbd_destroy_resource);
+		}
+	}
+}
+
+static enum cpuhp_state drbd_pp_cpuhp_state;
+
+/* Runs after @cpu is dead, nobody touches its magazines anymore. */
+static int drbd_pp_cpu_dead(unsigned int cpu)
+{
+	struct drbd_resource *resource;
+
+	rcu_read_lock();
+	for_each_resource_rcu(resource, &drbd_resources)
+		drbd_magazine_to_pool(resource, per_cpu_ptr(resource->pp_magazine, cpu));
+	rcu_read_unlock();
+	return 0;
+}
+
+int drbd_pp_cpuhp_register(void)
+{
+	int ret;
+
+	ret = cpuhp_setup_state_nocalls(CPUHP_BP_PREPARE_DYN, "block/drbd:pp_dead",
+					NULL, drbd_pp_cpu_dead);
+	if (ret < 0)
+		return ret;
+	drbd_pp_cpuhp_state = ret;
+	return 0;
+}
+
+void drbd_pp_cpuhp_unregister(void)
+{
+	if (drbd_pp_cpuhp_state > 0)
+		cpuhp_remove_state_nocalls(drbd_pp_cpuhp_state);
+	drbd_pp_cpuhp_state = 0;
+}
+
+/* Give the pages of the connection's reserve above @target back to the
+ * system. Returns the number of pages freed. */
+static unsigned long drbd_pp_reserve_trim(struct drbd_connection *connection, unsigned int target)
+{
+	struct drbd_resource *resource = connection->resource;
+	struct page *page = NULL;
+	unsigned int n = 0;
+
+	spin_lock(&resource->pp_lock);
+	if (connection->pp_reserve_vacant > target) {
+		n = connection->pp_reserve_vacant - target;
+		page = page_chain_del(&connection->pp_reserve, n);
+		if (page)
+			connection->pp_reserve_vacant -= n;
+	}
+	spin_unlock(&resource->pp_lock);
+
+	return page ? page_chain_free(page) : 0;
+}
+
+/* An idle connection has no pages of the pool in use. */
+static bool drbd_pp_connection_idle(struct drbd_connection *connection)
+{
+	return !atomic_read(&connection->pp_in_use) &&
+		!atomic_read(&connection->pp_in_use_by_net);
+}
+
+/* No connection of an idle resource has pages of the pool in use. */
+static bool drbd_pp_resource_idle(struct drbd_resource *resource)
+{
+	struct drbd_connection *connection;
+
+	for_each_connection_rcu(connection, resource) {
+		if (!drbd_pp_connection_idle(connection))
+			return false;
+	}
+	return true;
+}
+
+/* With thousands of mostly idle resources, the pre-allocated pools, the
+ * per CPU magazines and the connection reserves add up.  Under memory
+ * pressure, give back the pools of idle resources and the reserves of
+ * idle connections.  An idle connection has no request in progress that
+ * would depend on its reserve; the pool fills again from the system on
+ * demand through __drbd_alloc_pages(). */
+static unsigned long drbd_pp_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct drbd_resource *resource;
+	struct drbd_connection *connection;
+	unsigned long count = 0;
+
+	rcu_read_lock();
+	for_each_resource_rcu(resource, &drbd_resources) {
+		if (drbd_pp_resource_idle(resource))
+			count += READ_ONCE(resource->pp_vacant) +
+				atomic_read(&resource->pp_magazine_pages);
+		for_each_connection_rcu(connection, resource) {
+			if (drbd_pp_connection_idle(connection))
+				count += READ_ONCE(connection->pp_reserve_vacant);
+		}
+	}
+	rcu_read_unlock();
+
+	return count ?: SHRINK_EMPTY;
+}
+
+static unsigned long drbd_pp_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct drbd_resource *resource;
+	unsigned long freed = 0;
+
+	rcu_read_lock();
+	for_each_resource_rcu(resource, &drbd_resources) {
+		struct drbd_connection *connection;
+		struct page *page = NULL;
+		int n;
+
+		if (freed >= sc->nr_to_scan)
+			break;
+
+		/* until its next allocation miss, drbd_free_pages() does not
+		 * refill the reserve of an idle connection */
+		for_each_connection_rcu(connection, resource) {
+			if (freed >= sc->nr_to_scan)
+				break;
+			if (!drbd_pp_connection_idle(connection))
+				continue;
+			WRITE_ONCE(connection->pp_reserve_target, 0);
+			freed += drbd_pp_reserve_trim(connection, 0);
+		}
+
+		if (freed >= sc->nr_to_scan || !drbd_pp_resource_idle(resource))
+			continue;
+
+		spin_lock(&resource->pp_lock);
+		n = min_t(unsigned long, resource->pp_vacant, sc->nr_to_scan - freed);
+		if (n > 0)
+			page = page_chain_del(&resource->pp_pool, n);
+		if (page)
+			resource->pp_vacant -= n;
+		spin_unlock(&resource->pp_lock);
+		if (page)
+			freed += page_chain_free(page);
+
+		/* magazines are only touched from their own CPU; their pages
+		 * go to pp_pool, and are freed by a later scan */
+		drbd_magazines_drain(resource);
+	}
+	rcu_read_unlock();
+
+	return freed ?: SHRINK_STOP;
+}
+
+static struct shrinker *drbd_pp_shrinker;
+
+int drbd_pp_shrinker_register(void)
+{
+	drbd_pp_shrinker = shrinker_alloc(0, "drbd-pp");
+	if (!drbd_pp_shrinker)
+		return -ENOMEM;
+	drbd_pp_shrinker->count_objects = drbd_pp_shrink_count;
+	drbd_pp_shrinker->scan_objects = drbd_pp_shrink_scan;
+	shrinker_register(drbd_pp_shrinker);
+	return 0;
+}
+
+void drbd_pp_shrinker_unregister(void)
+{
+	if (drbd_pp_shrinker)
+		shrinker_free(drbd_pp_shrinker);
+	drbd_pp_shrinker = NULL;
+}
+
 static struct page *__drbd_alloc_pages(struct drbd_resource *resource, unsigned int number, gfp_t gfp_mask)
 {
 	struct page *page = NULL;
 	struct page *tmp = NULL;
+	struct page *refill = NULL;
 	unsigned int i = 0;
 
+	page = drbd_magazine_get(resource, number);
+	if (page)
+		return page;
+
 	/* Yes, testing drbd_pp_vacant outside the lock is racy.
 	 * So what. It saves a spin_lock. */
 	if (resource->pp_vacant >= number) {
 		spin_lock(&resource->pp_lock);
 		page = page_chain_del(&resource->pp_pool, number);
-		if (page)
+		if (page) {
 			resource->pp_vacant -= number;
+			if (resource->pp_vacant >= DRBD_PP_REFILL_PAGES) {
+				refill = page_chain_del(&resource->pp_pool, DRBD_PP_REFILL_PAGES);
+				if (refill)
+					resource->pp_vacant -= DRBD_PP_REFILL_PAGES;
+			}
+		}
 		spin_unlock(&resource->pp_lock);
+		if (refill) {
+			tmp = page_chain_tail(refill, NULL);
+			if (!drbd_magazine_put(resource, refill, tmp, DRBD_PP_REFILL_PAGES)) {
+				spin_lock(&resource->pp_lock);
+				page_chain_add(&resource->pp_pool, refill, tmp);
+				resource->pp_vacant += DRBD_PP_REFILL_PAGES;
+				spin_unlock(&resource->pp_lock);
+			}
+		}
 		if (page)
 			return page;
 	}
@@ -424,14 +722,52 @@ static struct page *__drbd_alloc_pages(struct drbd_resource *resource, unsigned
 	return NULL;
 }
 
-static void rs_sectors_came_in(struct drbd_peer_device *peer_device, int size)
+/* The per connection reserve holds enough pages for a few maximum sized
+ * requests, more with a larger max-buffers setting. */
+static unsigned int drbd_pp_reserve_target(unsigned int mxb)
+{
+	const unsigned int bio_pages = DRBD_MAX_BIO_SIZE / PAGE_SIZE;
+
+	return clamp(mxb / 8, bio_pages, 4 * bio_pages);
+}
+
+static struct page *drbd_pp_reserve_get(struct drbd_connection *connection, unsigned int number)
+{
+	struct drbd_resource *resource = connection->resource;
+	struct page *page;
+
+	if (READ_ONCE(connection->pp_reserve_vacant) < number)
+		return NULL;
+
+	spin_lock(&resource->pp_lock);
+	page = page_chain_del(&connection->pp_reserve, number);
+	if (page)
+		connection->pp_reserve_vacant -= number;
+	spin_unlock(&resource->pp_lock);
+
+	return page;
+}
+
+/* Until the next allocation miss sets the target again, drbd_free_pages()
+ * does not refill the reserve. */
+void drbd_pp_reserve_free(struct drbd_connection *connection)
+{
+	WRITE_ONCE(connection->pp_reserve_target, 0);
+	drbd_pp_reserve_trim(connection, 0);
+}
+
+static void rs_sectors_came_in(struct drbd_peer_device *peer_device, sector_t sector, int size)
 {
 	int rs_sect_in = atomic_add_return(size >> 9, &peer_device->rs_sect_in);
 
+	drbd_rs_rtt_sample(peer_device, sector);
+
 	/* When resync runs faster than anticipated, consider running the
 	 * resync_work early. */
 	if (rs_sect_in >= peer_device->rs_in_flight)
 		drbd_rs_all_in_flight_came_back(peer_device, rs_sect_in);
+	else if (rs_sect_in >= peer_device->rs_in_flight / 2)
+		drbd_rs_half_in_flight_came_back(peer_device);
 }
 
 static void reclaim_finished_net_peer_reqs(struct drbd_connection *connection,
@@ -477,11 +813,21 @@ static void drbd_reclaim_net_peer_reqs(struct drbd_connection *connection)
  * If this allocation would exceed the max_buffers setting, we throttle
  * allocation (schedule_timeout) to give the system some room to breathe.
  *
+ * max-buffers counts pages, which is bytes in PAGE_SIZE granularity;
+ * a request is admitted as a whole while below the limit, so a large
+ * request is not starved by small ones.
+ *
  * We do not use max-buffers as hard limit, because it could lead to
  * congestion and further to a distributed deadlock during online-verify or
  * (checksum based) resync, if the max-buffers, socket buffer sizes and
  * resync-rate settings are mis-configured.
  *
+ * When the kernel does not give us pages even with direct reclaim, fall
+ * back to the connection's own reserve before going to sleep. The reserve
+ * is only set up once an allocation missed the fast path; from then on,
+ * pages freed by this connection refill it after the pool, so each
+ * connection keeps making progress no matter what other users of memory do.
+ *
  * Returns a page chain linked via (struct drbd_page_chain*)&page->lru.
  */
 struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int number,
@@ -491,8 +837,9 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 		container_of(transport, struct drbd_connection, transport);
 	struct drbd_resource *resource = connection->resource;
 	struct page *page = NULL;
+	bool waited = false;
 	DEFINE_WAIT(wait);
-	unsigned int mxb;
+	unsigned int mxb, target;
 
 	rcu_read_lock();
 	mxb = rcu_dereference(transport->net_conf)->max_buffers;
@@ -506,6 +853,15 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 	if (page && atomic_read(&connection->pp_in_use_by_net) > 512)
 		drbd_reclaim_net_peer_reqs(connection);
 
+	/* Only a connection that missed the fast path keeps a reserve. */
+	if (!page) {
+		target = drbd_pp_reserve_target(mxb);
+		if (target != READ_ONCE(connection->pp_reserve_target)) {
+			WRITE_ONCE(connection->pp_reserve_target, target);
+			drbd_pp_reserve_trim(connection, target);
+		}
+	}
+
 	while (page == NULL) {
 		prepare_to_wait(&resource->pp_wait, &wait, TASK_INTERRUPTIBLE);
 
@@ -515,6 +871,17 @@ struct page *drbd_alloc_pages(struct drbd_transport *transport, unsigned int num
 			page = __drbd_alloc_pages(resource, number, gfp_mask);
 			if (page)
 				break;
+			page = drbd_pp_reserve_get(connection, number);
+			if (page) {
+				atomic_inc(&connection->pp_reserve_hits);
+				break;
+			}
+			if (!waited && (gfp_mask & __GFP_RECLAIM)) {
+				atomic_inc(&connection->pp_mem_wait);
+				/* pages may sit in the magazines of other CPUs */
+				drbd_magazines_drain(resource);
+				waited = true;
+			}
 		}
 
 		if (!(gfp_mask & __GFP_RECLAIM))
@@ -544,26 +911,40 @@ void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is
 		container_of(transport, struct drbd_connection, transport);
 	struct drbd_resource *resource = connection->resource;
 	atomic_t *a = is_net ? &connection->pp_in_use_by_net : &connection->pp_in_use;
+	struct page *tmp;
 	int i;
 
 	if (page == NULL)
 		return;
 
-	if (resource->pp_vacant > DRBD_MAX_BIO_SIZE/PAGE_SIZE)
-		i = page_chain_free(page);
-	else {
-		struct page *tmp;
-		tmp = page_chain_tail(page, &i);
+	tmp = page_chain_tail(page, &i);
+	if (READ_ONCE(resource->pp_vacant) + atomic_read(&resource->pp_magazine_pages) <=
+	    DRBD_MAX_BIO_SIZE/PAGE_SIZE) {
+		if (!drbd_magazine_put(resource, page, tmp, i)) {
+			spin_lock(&resource->pp_lock);
+			page_chain_add(&resource->pp_pool, page, tmp);
+			resource->pp_vacant += i;
+			spin_unlock(&resource->pp_lock);
+		}
+	} else if (READ_ONCE(connection->pp_reserve_vacant) <
+		   READ_ONCE(connection->pp_reserve_target)) {
 		spin_lock(&resource->pp_lock);
-		page_chain_add(&resource->pp_pool, page, tmp);
-		resource->pp_vacant += i;
+		page_chain_add(&connection->pp_reserve, page, tmp);
+		connection->pp_reserve_vacant += i;
 		spin_unlock(&resource->pp_lock);
+	} else {
+		page_chain_free(page);
 	}
 	i = atomic_sub_return(i, a);
 	if (i < 0)
 		drbd_warn(connection, "ASSERTION FAILED: %s: %d < 0\n",
 			is_net ? "pp_in_use_by_net" : "pp_in_use", i);
-	wake_up(&resource->pp_wait);
+	/* Pages are freed for every peer request, but only rarely does
+	 * a receiver wait in drbd_alloc_pages() for max-buffers.  Pairs
+	 * with the barrier in prepare_to_wait() there. */
+	smp_mb();
+	if (waitqueue_active(&resource->pp_wait))
+		wake_up(&resource->pp_wait);
 }
 
 /* normal: payload_size == request size (bi_size)
@@ -590,6 +971,8 @@ drbd_alloc_peer_req(struct drbd_peer_device *peer_device, gfp_t gfp_mask) __must
 	drbd_clear_interval(&peer_req->i);
 	INIT_LIST_HEAD(&peer_req->recv_order);
 	INIT_LIST_HEAD(&peer_req->wait_for_actlog);
+	INIT_LIST_HEAD(&peer_req->rs_share);
+	INIT_LIST_HEAD(&peer_req->rs_share_followers);
 	peer_req->submit_jif = jiffies;
 	peer_req->peer_device = peer_device;
 
@@ -1342,8 +1725,16 @@ static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connecti
 		ctx.error = 0;
 		init_completion(&ctx.done);
 
+		mutex_lock(&connection->flush_mutex);
 		rcu_read_lock();
 		idr_for_each_entry(&resource->devices, device, vnr) {
+			struct drbd_peer_device *peer_device = conn_peer_device(connection, vnr);
+
+			/* No write from this peer completed on this volume since
+			 * we flushed it last, and that flush has completed: with
+			 * many volumes, or back to back epochs, skip the flush. */
+			if (peer_device && !test_and_clear_bit(UNFLUSHED_WRITES, &peer_device->flags))
+				continue;
 			if (!get_ldev(device))
 				continue;
 			kref_get(&device->kref);
@@ -1360,6 +1751,7 @@ static enum finish_epoch drbd_flush_after_epoch(struct drbd_connection *connecti
 		 * if disk-timeout is set? */
 		if (!atomic_dec_and_test(&ctx.pending))
 			wait_for_completion(&ctx.done);
+		mutex_unlock(&connection->flush_mutex);
 
 		if (ctx.error) {
 			/* would rather check on EOPNOTSUPP, but that is not reliable.
@@ -1531,7 +1923,7 @@ static enum finish_epoch drbd_may_finish_epoch(struct drbd_connection *connectio
 				list_del(&epoch->list);
 				ev = EV_BECAME_LAST | (ev & EV_CLEANUP);
 				connection->epochs--;
-				kfree(epoch);
+				drbd_free_epoch(epoch);
 
 				if (rv == FE_STILL_LIVE)
 					rv = FE_DESTROYED;
@@ -1689,11 +2081,13 @@ int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, u
 		/* don't flag BLKDEV_ZERO_NOUNMAP, we don't know how many
 		 * layers are below us, some may have smaller granularity */
 		err |= blkdev_issue_zeroout(bdev, start, nr, GFP_NOIO, 0);
+		atomic64_add(nr, &device->zeroed_sectors);
 		nr_sectors -= nr;
 		start = tmp;
 	}
 	while (nr_sectors >= max_discard_sectors) {
 		err |= blkdev_issue_discard(bdev, start, max_discard_sectors, GFP_NOIO);
+		atomic64_add(max_discard_sectors, &device->discarded_sectors);
 		nr_sectors -= max_discard_sectors;
 		start += max_discard_sectors;
 	}
@@ -1706,6 +2100,7 @@ int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, u
 		nr -= (unsigned int)nr % granularity;
 		if (nr) {
 			err |= blkdev_issue_discard(bdev, start, nr, GFP_NOIO);
+			atomic64_add(nr, &device->discarded_sectors);
 			nr_sectors -= nr;
 			start += nr;
 		}
@@ -1714,6 +2109,7 @@ int drbd_issue_discard_or_zero_out(struct drbd_device *device, sector_t start, u
 	if (nr_sectors) {
 		err |= blkdev_issue_zeroout(bdev, start, nr_sectors, GFP_NOIO,
 				(flags & EE_TRIM) ? 0 : BLKDEV_ZERO_NOUNMAP);
+		atomic64_add(nr_sectors, &device->zeroed_sectors);
 	}
 	return err != 0;
 }
@@ -1742,10 +2138,101 @@ static void drbd_issue_peer_discard_or_zero_out(struct drbd_device *device, stru
 	if (!can_do_reliable_discards(device))
 		peer_req->flags |= EE_ZEROOUT;
 
-	if (drbd_issue_discard_or_zero_out(device, peer_req->i.sector,
-	    peer_req->i.size >> 9, peer_req->flags & (EE_ZEROOUT|EE_TRIM)))
-		peer_req->flags |= EE_WAS_ERROR;
-	drbd_endio_write_sec_final(peer_req);
+	/* Issued by discard_worker, so that the receiver goes on with the
+	 * next requests.  The peer request stays in its epoch until
+	 * drbd_endio_write_sec_final().  Later peer writes that overlap it
+	 * wait in drbd_wait_for_peer_discards(), or in
+	 * handle_write_conflicts() with two-primaries. */
+	spin_lock(&device->submit.lock);
+	if (device->submit.peer_discards_pending++ == 0) {
+		device->submit.peer_discards_lo = peer_req->i.sector;
+		device->submit.peer_discards_hi = peer_req->i.sector + (peer_req->i.size >> 9);
+	} else {
+		device->submit.peer_discards_lo =
+			min(device->submit.peer_discards_lo, peer_req->i.sector);
+		device->submit.peer_discards_hi =
+			max(device->submit.peer_discards_hi,
+			    peer_req->i.sector + (peer_req->i.size >> 9));
+	}
+	list_add_tail(&peer_req->wait_for_actlog, &device->submit.peer_discards);
+	spin_unlock(&device->submit.lock);
+	queue_work(drbd_peer_submit_wq, &device->submit.discard_worker);
+}
+
+/* keeps a merged range within the unsigned int nr_sectors */
+#define DRBD_MAX_MERGED_DISCARD_SECTORS (1U << 23)
+
+/* fstrim sends plenty of small discards in ascending order.  Issue each run
+ * of adjacent ones with the same flags as one range. */
+void do_submit_peer_discards(struct work_struct *ws)
+{
+	struct drbd_device *device = container_of(ws, struct drbd_device, submit.discard_worker);
+	struct drbd_peer_request *peer_req, *tmp;
+	LIST_HEAD(todo);
+
+	spin_lock(&device->submit.lock);
+	list_splice_init(&device->submit.peer_discards, &todo);
+	spin_unlock(&device->submit.lock);
+
+	while (!list_empty(&todo)) {
+		struct drbd_peer_request *first =
+			list_first_entry(&todo, struct drbd_peer_request, wait_for_actlog);
+		int flags = first->flags & (EE_ZEROOUT|EE_TRIM);
+		sector_t start = first->i.sector;
+		sector_t end = start + (first->i.size >> 9);
+		unsigned int n = 1;
+		LIST_HEAD(batch);
+		int err;
+
+		list_move_tail(&first->wait_for_actlog, &batch);
+		list_for_each_entry_safe(peer_req, tmp, &todo, wait_for_actlog) {
+			if (peer_req->i.sector != end ||
+			    (peer_req->flags & (EE_ZEROOUT|EE_TRIM)) != flags ||
+			    end - start + (peer_req->i.size >> 9) > DRBD_MAX_MERGED_DISCARD_SECTORS)
+				break;
+			end += peer_req->i.size >> 9;
+			list_move_tail(&peer_req->wait_for_actlog, &batch);
+			atomic64_inc(&device->merged_discards);
+			n++;
+		}
+
+		err = drbd_issue_discard_or_zero_out(device, start, end - start, flags);
+		list_for_each_entry_safe(peer_req, tmp, &batch, wait_for_actlog) {
+			list_del_init(&peer_req->wait_for_actlog);
+			if (err)
+				peer_req->flags |= EE_WAS_ERROR;
+			drbd_endio_write_sec_final(peer_req);
+		}
+
+		spin_lock(&device->submit.lock);
+		device->submit.peer_discards_pending -= n;
+		spin_unlock(&device->submit.lock);
+		wake_up(&device->misc_wait);
+	}
+}
+
+static bool peer_discards_overlap(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	bool overlap;
+
+	spin_lock(&device->submit.lock);
+	overlap = device->submit.peer_discards_pending &&
+		sector < device->submit.peer_discards_hi &&
+		sector + (size >> 9) > device->submit.peer_discards_lo;
+	spin_unlock(&device->submit.lock);
+	return overlap;
+}
+
+/* A peer write must not overtake a discard received before it, or the
+ * delayed discard would destroy the newer data. */
+static void drbd_wait_for_peer_discards(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+
+	if (peer_req->flags & (EE_TRIM|EE_ZEROOUT))
+		return;
+	wait_event(device->misc_wait,
+		   !peer_discards_overlap(device, peer_req->i.sector, peer_req->i.size));
 }
 
 static bool conn_wait_ee_cond(struct drbd_connection *connection, struct list_head *head)
@@ -1808,15 +2295,16 @@ int drbd_submit_peer_request(struct drbd_peer_request *peer_req)
 	unsigned nr_pages = peer_req->page_chain.nr_pages;
 	int err;
 
+	trace_drbd_submit_peer_request(peer_req);
+
 	if (peer_req->flags & EE_SET_OUT_OF_SYNC)
 		drbd_set_out_of_sync(peer_req->peer_device,
 				peer_req->i.sector, peer_req->i.size);
 
-	/* TRIM/DISCARD: for now, always use the helper function
+	/* TRIM/DISCARD: always use the helper function
 	 * blkdev_issue_zeroout(..., discard=true).
 	 * It's synchronous, but it does the right thing wrt. bio splitting.
-	 * Correctness first, performance later.  Next step is to code an
-	 * asynchronous variant of the same.
+	 * It runs from discard_worker, which also merges adjacent ranges.
 	 */
 	if (peer_req->flags & (EE_TRIM|EE_ZEROOUT)) {
 		peer_req->submit_jif = jiffies;
@@ -1855,6 +2343,9 @@ next_bio:
 	bio->bi_iter.bi_sector = sector;
 	bio->bi_private = peer_req;
 	bio->bi_end_io = drbd_peer_request_endio;
+	/* with an ioprio aware scheduler, replication writes overtake resync writes */
+	if (drbd_resync_write_low_prio && peer_req->w.cb == e_end_resync_block)
+		bio->bi_ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_BE_NR - 1);
 
 	bio->bi_next = bios;
 	bios = bio;
@@ -2025,7 +2516,7 @@ static void conn_wait_active_ee_empty_or_disconnect(struct drbd_connection *conn
 static int receive_Barrier(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_transport_ops *tr_ops = connection->transport.ops;
-	int rv, issue_flush;
+	int rv;
 	struct p_barrier *p = pi->data;
 	struct drbd_epoch *epoch;
 
@@ -2068,22 +2559,9 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 	}
 
 	/* receiver context, in the writeout path of the other node.
-	 * avoid potential distributed deadlock */
-	epoch = kzalloc(sizeof(struct drbd_epoch), GFP_NOIO);
-	if (!epoch) {
-		drbd_warn(connection, "Allocation of an epoch failed, slowing down\n");
-		issue_flush = !test_and_set_bit(DE_BARRIER_IN_NEXT_EPOCH_ISSUED, &connection->current_epoch->flags);
-		conn_wait_active_ee_empty_or_disconnect(connection);
-		if (issue_flush) {
-			rv = drbd_flush_after_epoch(connection, connection->current_epoch);
-			if (rv == FE_RECYCLED)
-				return 0;
-		}
-
-		conn_wait_done_ee_empty_or_disconnect(connection);
-
-		return 0;
-	}
+	 * avoid potential distributed deadlock: GFP_NOIO, and backed by a
+	 * mempool, so we wait for completed epochs instead of draining. */
+	epoch = drbd_alloc_epoch(GFP_NOIO);
 
 	spin_lock(&connection->epoch_lock);
 	if (atomic_read(&connection->current_epoch->epoch_size)) {
@@ -2092,7 +2570,7 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 		connection->epochs++;
 	} else {
 		/* The current_epoch got recycled while we allocated this one... */
-		kfree(epoch);
+		drbd_free_epoch(epoch);
 	}
 	spin_unlock(&connection->epoch_lock);
 
@@ -2322,6 +2800,7 @@ static int recv_resync_read(struct drbd_peer_device *peer_device,
 	peer_req = read_in_block(peer_device, d);
 	if (!peer_req)
 		return -EIO;
+	trace_drbd_receive_resync_data(peer_req);
 
 	if (test_bit(UNSTABLE_RESYNC, &peer_device->flags))
 		clear_bit(STABLE_RESYNC, &device->flags);
@@ -2519,7 +2998,7 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 		drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
 	}
 
-	rs_sectors_came_in(peer_device, d.bi_size);
+	rs_sectors_came_in(peer_device, d.sector, d.bi_size);
 
 	return err;
 }
@@ -2644,6 +3123,7 @@ static int wait_for_and_update_peer_seq(struct drbd_peer_device *peer_device, co
 	DEFINE_WAIT(wait);
 	long timeout;
 	int ret = 0, tp;
+	bool waited = false;
 
 	if (!test_bit(RESOLVE_CONFLICTS, &connection->transport.flags))
 		return 0;
@@ -2668,6 +3148,10 @@ static int wait_for_and_update_peer_seq(struct drbd_peer_device *peer_device, co
 			break;
 
 		/* Only need to wait if two_primaries is enabled */
+		if (!waited) {
+			atomic64_inc(&peer_device->device->peer_seq_waits);
+			waited = true;
+		}
 		prepare_to_wait(&peer_device->device->seq_wait, &wait, TASK_INTERRUPTIBLE);
 		spin_unlock(&peer_device->peer_seq_lock);
 		rcu_read_lock();
@@ -2738,6 +3222,7 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 				"local=%llus +%u, remote=%llus +%u\n",
 				(unsigned long long) i->sector, i->size,
 				(unsigned long long) sector, size);
+		atomic64_inc(&device->peer_write_conflicts);
 		err = -EBUSY;
 		break;
 	}
@@ -2752,8 +3237,14 @@ static void drbd_queue_peer_request(struct drbd_device *device, struct drbd_peer
 	list_add_tail(&peer_req->wait_for_actlog, &device->submit.peer_writes);
 	spin_unlock(&device->submit.lock);
 	queue_work(device->submit.wq, &device->submit.worker);
-	/* do_submit() may sleep internally on al_wait, too */
-	wake_up(&device->al_wait);
+	/* do_submit() may sleep internally on al_wait, too.
+	 * Most of the time nobody sleeps there; avoid taking the wait queue
+	 * lock for every single write.  The barrier pairs with the one in
+	 * prepare_to_wait() in do_submit(), which looks at the lists only
+	 * after it put itself on the wait queue. */
+	smp_mb();
+	if (waitqueue_active(&device->al_wait))
+		wake_up(&device->al_wait);
 }
 
 /* FIXME
@@ -2827,6 +3318,38 @@ prepare_activity_log(struct drbd_peer_request *peer_req)
 	return ret;
 }
 
+struct workqueue_struct *drbd_peer_submit_wq;
+
+void do_submit_ready_peer_writes(struct work_struct *ws)
+{
+	struct drbd_device *device = container_of(ws, struct drbd_device, submit.peer_worker);
+	struct drbd_peer_request *peer_req, *tmp;
+	struct blk_plug plug;
+	LIST_HEAD(ready);
+
+	spin_lock(&device->submit.lock);
+	list_splice_init(&device->submit.peer_writes_ready, &ready);
+	spin_unlock(&device->submit.lock);
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe(peer_req, tmp, &ready, wait_for_actlog) {
+		list_del_init(&peer_req->wait_for_actlog);
+		if (drbd_submit_peer_request(peer_req))
+			drbd_cleanup_after_failed_submit_peer_write(peer_req);
+	}
+	blk_finish_plug(&plug);
+}
+
+/* Peer writes are already accounted in active_ee_cnt, so barriers still
+ * wait for them.  Within one volume, they are submitted in receive order. */
+static void drbd_queue_ready_peer_request(struct drbd_device *device, struct drbd_peer_request *peer_req)
+{
+	spin_lock(&device->submit.lock);
+	list_add_tail(&peer_req->wait_for_actlog, &device->submit.peer_writes_ready);
+	spin_unlock(&device->submit.lock);
+	queue_work(drbd_peer_submit_wq, &device->submit.peer_worker);
+}
+
 static void submit_peer_request_activity_log(struct drbd_peer_request *peer_req)
 {
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
@@ -2845,6 +3368,11 @@ static void submit_peer_request_activity_log(struct drbd_peer_request *peer_req)
 		return;
 	}
 
+	if (READ_ONCE(drbd_offload_peer_submit)) {
+		drbd_queue_ready_peer_request(device, peer_req);
+		return;
+	}
+
 	err = drbd_submit_peer_request(peer_req);
 	if (!err)
 		return;
@@ -2897,6 +3425,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 		put_ldev(device);
 		return -EIO;
 	}
+	trace_drbd_receive_data(peer_req);
 	if (pi->cmd == P_TRIM)
 		peer_req->flags |= EE_TRIM;
 	else if (pi->cmd == P_ZEROES)
@@ -2938,6 +3467,14 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 	} else {
 		D_ASSERT(peer_device, peer_req->i.size > 0);
 		D_ASSERT(peer_device, peer_req_op(peer_req) == REQ_OP_WRITE);
+		/* Let thin backing devices unmap instead of storing zeroes.
+		 * Only if the device can write-zeroes itself, zero-out would
+		 * fall back to writing zero pages otherwise. */
+		if (READ_ONCE(drbd_recv_detect_zeroes) &&
+		    !(peer_req->opf & (REQ_FUA | REQ_PREFLUSH)) &&
+		    bdev_write_zeroes_sectors(device->ldev->backing_bdev) &&
+		    drbd_peer_req_all_zero(peer_req))
+			peer_req->flags |= EE_ZEROOUT | EE_TRIM;
 	}
 
 	if (d.dp_flags & DP_MAY_SET_IN_SYNC)
@@ -3013,6 +3550,7 @@ static int receive_Data(struct drbd_connection *connection, struct packet_info *
 			goto out_remove_interval;
 	} else {
 		update_peer_seq(peer_device, d.peer_seq);
+		drbd_wait_for_peer_discards(peer_req);
 	}
 	spin_lock_irq(&connection->peer_reqs_lock);
 	/* Added to list here already, so debugfs can find it.
@@ -3127,6 +3665,8 @@ void drbd_cleanup_peer_requests_wfa(struct drbd_device *device, struct list_head
  * to MD RAID is_mddev_idle(): if the partition stats reveal "significant"
  * (more than 64 sectors) of activity we cannot account for with our own resync
  * activity, it obviously is "busy".
+ * With the resync_latency_target_us module parameter set, it is "busy"
+ * instead while recent application writes took longer than that.
  *
  * The current sync rate used here uses only the most recent two step marks,
  * to have a short time average so we can react faster.
@@ -3136,32 +3676,46 @@ bool drbd_rs_should_slow_down(struct drbd_peer_device *peer_device, sector_t sec
 {
 	bool throttle = drbd_rs_c_min_rate_throttle(peer_device);
 
-	if (!throttle || throttle_if_app_is_waiting)
-		return throttle;
+	if (throttle && !throttle_if_app_is_waiting)
+		throttle = !drbd_sector_has_priority(peer_device, sector);
+	throttle = drbd_policy_rs_slow_down(peer_device, sector, throttle);
+	if (throttle)
+		atomic_inc(&peer_device->rs_tele.throttled);
+	drbd_rs_telemetry_tick(peer_device);
 
-	return !drbd_sector_has_priority(peer_device, sector);
+	return throttle;
 }
 
 bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *peer_device)
 {
 	struct drbd_device *device = peer_device->device;
 	struct gendisk *disk = device->ldev->backing_bdev->bd_disk;
+	unsigned int lat_target_us = READ_ONCE(drbd_resync_latency_target_us);
 	unsigned long db, dt, dbdt;
 	unsigned int c_min_rate;
 	int curr_events;
+	bool busy;
 
 	rcu_read_lock();
 	c_min_rate = rcu_dereference(peer_device->conf)->c_min_rate;
 	rcu_read_unlock();
 
 	/* feature disabled? */
-	if (c_min_rate == 0)
+	if (c_min_rate == 0 && !lat_target_us)
 		return false;
 
 	curr_events = (int)part_stat_read_accum(disk->part0, sectors)
 		- atomic_read(&device->rs_sect_ev);
 
-	if (atomic_read(&device->ap_actlog_cnt) || curr_events - peer_device->rs_last_events > 64) {
+	if (lat_target_us)
+		/* application writes are slower than they should be */
+		busy = time_before(jiffies, READ_ONCE(device->ap_write_lat_jif) + HZ) &&
+			READ_ONCE(device->ap_write_lat_peak_us) > lat_target_us;
+	else
+		busy = atomic_read(&device->ap_actlog_cnt) ||
+			curr_events - peer_device->rs_last_events > 64;
+
+	if (busy) {
 		unsigned long rs_left;
 		int i;
 
@@ -3218,6 +3772,46 @@ static int receive_digest(struct drbd_peer_request *peer_req, int digest_size)
 	return drbd_recv_into(peer_req->peer_device->connection, di->digest, digest_size);
 }
 
+/*
+ * Several peers resyncing from us at the same time (a node coming back to a
+ * mesh, or two new replicas being built) tend to request the same ranges
+ * shortly after each other.  Serve such a request from the in flight read of
+ * another peer instead of reading the same data from disk again.
+ *
+ * Both requests hold their resync extent (drbd_try_rs_begin_io()), which
+ * keeps application writes out until the leader's pages were copied over in
+ * drbd_rs_share_read_done().
+ *
+ * Returns true if peer_req was attached to a leader, and must not be
+ * submitted.  Otherwise it becomes a leader itself.
+ */
+bool drbd_rs_share_read(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	struct drbd_peer_request *leader;
+	bool shared = false;
+
+	spin_lock_irq(&device->rs_share_lock);
+	list_for_each_entry(leader, &device->rs_share_reads, rs_share) {
+		if (leader->peer_device != peer_req->peer_device &&
+		    leader->i.sector == peer_req->i.sector &&
+		    leader->i.size == peer_req->i.size) {
+			list_add_tail(&peer_req->rs_share, &leader->rs_share_followers);
+			peer_req->flags |= EE_RS_SHARED | EE_SUBMITTED;
+			peer_req->submit_jif = jiffies;
+			shared = true;
+			break;
+		}
+	}
+	if (!shared) {
+		peer_req->flags |= EE_RS_SHARE_LEADER;
+		list_add_tail(&peer_req->rs_share, &device->rs_share_reads);
+	}
+	spin_unlock_irq(&device->rs_share_lock);
+
+	return shared;
+}
+
 static int receive_DataRequest(struct drbd_connection *connection, struct packet_info *pi)
 {
 	struct drbd_peer_device *peer_device;
@@ -3457,12 +4051,19 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 submit:
 	update_receiver_timing_details(connection, drbd_submit_peer_request);
 	inc_unacked(peer_device);
+	if (peer_req->w.cb == w_e_end_rsdata_req && drbd_rs_share_read(peer_req))
+		return 0;
 	if (drbd_submit_peer_request(peer_req) == 0)
 		return 0;
 
 	/* don't care for the reason here */
 	drbd_err(device, "submit failed, triggering re-connect\n");
 	err = -EIO;
+	if (peer_req->flags & EE_RS_SHARE_LEADER) {
+		/* whoever attached meanwhile gets a P_NEG_RS_DREPLY */
+		set_bit(__EE_WAS_ERROR, &peer_req->flags);
+		drbd_rs_share_read_done(peer_req);
+	}
 
 fail3:
 	spin_lock_irq(&connection->peer_reqs_lock);
@@ -3537,7 +4138,7 @@ static int receive_ov_reply(struct drbd_connection *connection, struct packet_in
 		goto fail2;
 
 	/* track progress, we may need to throttle */
-	rs_sectors_came_in(peer_device, size);
+	rs_sectors_came_in(peer_device, sector, size);
 	peer_req->w.cb = w_e_end_ov_reply;
 	dec_rs_pending(peer_device);
 	/* drbd_rs_begin_io done when we sent this request,
@@ -7941,6 +8542,7 @@ static int receive_out_of_sync(struct drbd_connection *connection, struct packet
 		unsigned long bit = BM_SECT_TO_BIT(sector);
 		if (bit < peer_device->resync_next_bit)
 			peer_device->resync_next_bit = bit;
+		drbd_rs_hot_rewind(peer_device, bit);
 	}
 
 	drbd_set_out_of_sync(peer_device, sector, be32_to_cpu(p->blksize));
@@ -8210,7 +8812,7 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 		drbd_send_ack_ex(peer_device, P_NEG_ACK, sector, size, ID_SYNCER);
 	}
 
-	rs_sectors_came_in(peer_device, size);
+	rs_sectors_came_in(peer_device, sector, size);
 
 	return err;
 }
@@ -8566,6 +9168,7 @@ static void conn_disconnect(struct drbd_connection *connection)
 	i = atomic_read(&connection->pp_in_use_by_net);
 	if (i)
 		drbd_info(connection, "pp_in_use_by_net = %d, expected 0\n", i);
+	drbd_pp_reserve_free(connection);
 
 	if (!list_empty(&connection->current_epoch->list))
 		drbd_err(connection, "ASSERTION FAILED: connection->current_epoch->list not empty\n");
@@ -8932,6 +9535,7 @@ int drbd_receiver(struct drbd_thread *thi)
 	struct drbd_connection *connection = thi->connection;
 
 	if (conn_connect(connection)) {
+		drbd_connection_update_numa_node(connection);
 		blk_start_plug(&connection->receiver_plug);
 		drbdd(connection);
 		blk_finish_plug(&connection->receiver_plug);
@@ -8946,17 +9550,18 @@ int drbd_receiver(struct drbd_thread *thi)
 static int process_peer_ack_list(struct drbd_connection *connection)
 {
 	struct drbd_resource *resource = connection->resource;
-	struct drbd_peer_ack *peer_ack, *tmp;
+	struct drbd_peer_ack *peer_ack;
 	u64 node_id_mask;
 	int err = 0;
 
 	node_id_mask = NODE_MASK(connection->peer_node_id);
 
+	/* Entries before peer_ack_next have been sent already, start there
+	 * instead of stepping over what other (slower) peers still wait for. */
 	spin_lock_irq(&resource->peer_ack_lock);
-	peer_ack = list_first_entry(&resource->peer_ack_list, struct drbd_peer_ack, list);
-	while (&peer_ack->list != &resource->peer_ack_list) {
+	while ((peer_ack = connection->peer_ack_next)) {
 		if (!(peer_ack->pending_mask & node_id_mask)) {
-			peer_ack = list_next_entry(peer_ack, list);
+			connection->peer_ack_next = drbd_next_peer_ack(resource, peer_ack);
 			continue;
 		}
 		spin_unlock_irq(&resource->peer_ack_lock);
@@ -8964,12 +9569,11 @@ static int process_peer_ack_list(struct drbd_connection *connection)
 		err = drbd_send_peer_ack(connection, peer_ack);
 
 		spin_lock_irq(&resource->peer_ack_lock);
-		tmp = list_next_entry(peer_ack, list);
+		connection->peer_ack_next = drbd_next_peer_ack(resource, peer_ack);
 		peer_ack->pending_mask &= ~node_id_mask;
 		drbd_destroy_peer_ack_if_done(peer_ack);
 		if (err)
 			break;
-		peer_ack = tmp;
 	}
 	spin_unlock_irq(&resource->peer_ack_lock);
 	return err;
@@ -9123,8 +9727,35 @@ static int got_Ping(struct drbd_connection *connection, struct packet_info *pi)
 
 }
 
+static void update_ping_rtt(struct drbd_connection *connection)
+{
+	unsigned int rtt_us;
+
+	if (!connection->ping_sent_kt)
+		return;
+	rtt_us = ktime_us_delta(ktime_get(), connection->ping_sent_kt);
+	connection->ping_sent_kt = 0;
+
+	connection->ping_rtt_us = rtt_us;
+	if (!connection->ping_rtt_count++) {
+		connection->ping_rtt_min_us = rtt_us;
+		connection->ping_rtt_max_us = rtt_us;
+		connection->ping_rtt_avg_us = rtt_us;
+		connection->ping_rtt_dev_us = rtt_us / 2;
+		return;
+	}
+	connection->ping_rtt_min_us = min(connection->ping_rtt_min_us, rtt_us);
+	connection->ping_rtt_max_us = max(connection->ping_rtt_max_us, rtt_us);
+	connection->ping_rtt_dev_us +=
+		((int)abs((int)rtt_us - (int)connection->ping_rtt_avg_us) -
+		 (int)connection->ping_rtt_dev_us) / 4;
+	connection->ping_rtt_avg_us += ((int)rtt_us - (int)connection->ping_rtt_avg_us) / 8;
+}
+
 static int got_PingAck(struct drbd_connection *connection, struct packet_info *pi)
 {
+	update_ping_rtt(connection);
+
 	if (!test_bit(GOT_PING_ACK, &connection->flags)) {
 		set_bit(GOT_PING_ACK, &connection->flags);
 		wake_up_all(&connection->resource->state_wait);
@@ -9158,7 +9789,7 @@ static int got_IsInSync(struct drbd_connection *connection, struct packet_info *
 		put_ldev(device);
 	}
 	dec_rs_pending(peer_device);
-	rs_sectors_came_in(peer_device, blksize);
+	rs_sectors_came_in(peer_device, sector, blksize);
 
 	return 0;
 }
@@ -9196,6 +9827,7 @@ static int got_BlockAck(struct drbd_connection *connection, struct packet_info *
 	device = peer_device->device;
 
 	update_peer_seq(peer_device, be32_to_cpu(p->seq_num));
+	trace_drbd_request_ack(peer_device, pi->cmd, p->block_id, sector);
 
 	if (p->block_id == ID_SYNCER) {
 		drbd_set_in_sync(peer_device, sector, blksize);
@@ -9322,6 +9954,7 @@ static int got_NegRSDReply(struct drbd_connection *connection, struct packet_inf
 				bit = BM_SECT_TO_BIT(sector);
 				mutex_lock(&peer_device->resync_next_bit_mutex);
 				peer_device->resync_next_bit = min(peer_device->resync_next_bit, bit);
+				drbd_rs_hot_rewind(peer_device, bit);
 				mutex_unlock(&peer_device->resync_next_bit_mutex);
 			}
 
@@ -9329,7 +9962,7 @@ static int got_NegRSDReply(struct drbd_connection *connection, struct packet_inf
 		default:
 			BUG();
 		}
-		rs_sectors_came_in(peer_device, size);
+		rs_sectors_came_in(peer_device, sector, size);
 		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
 		put_ldev(device);
 	}
@@ -9578,6 +10211,7 @@ static void cleanup_peer_ack_list(struct drbd_connection *connection)
 		peer_ack->pending_mask &= ~node_id_mask;
 		drbd_destroy_peer_ack_if_done(peer_ack);
 	}
+	connection->peer_ack_next = NULL;
 	req = resource->peer_ack_req;
 	if (req)
 		req->net_rq_state[idx] &= ~RQ_NET_SENT;
@@ -9589,7 +10223,30 @@ struct meta_sock_cmd {
 	int (*fn)(struct drbd_connection *connection, struct packet_info *);
 };
 
-static void set_rcvtimeo(struct drbd_connection *connection, bool ping_timeout)
+/* Minimum number of ping round trips before we trust their statistics */
+#define FAST_PING_MIN_SAMPLES 8
+
+/* While application requests wait for acks from this peer, a dead peer
+ * stalls them until ping-int and ping-timeout have passed. With
+ * fast_ping_min_ms, the ack receiver instead uses a timeout derived from
+ * the observed ping round trips, in the same way TCP derives its RTO.
+ * Any packet on either socket counts as a sign of life, so on a busy link
+ * that timeout rarely expires, and no ping is sent at all.
+ * Returns 0 if the configured timeouts apply. */
+static long fast_ping_timeout(struct drbd_connection *connection)
+{
+	unsigned int min_ms = READ_ONCE(drbd_fast_ping_min_ms);
+	unsigned int us;
+
+	if (!min_ms || connection->ping_rtt_count < FAST_PING_MIN_SAMPLES ||
+	    !atomic_read(&connection->ap_in_flight))
+		return 0;
+
+	us = connection->ping_rtt_avg_us + 4 * connection->ping_rtt_dev_us;
+	return max(usecs_to_jiffies(us), msecs_to_jiffies(min_ms));
+}
+
+static void set_rcvtimeo(struct drbd_connection *connection, bool ping_timeout, long fast_t)
 {
 	long t;
 	struct net_conf *nc;
@@ -9605,18 +10262,20 @@ static void set_rcvtimeo(struct drbd_connection *connection, bool ping_timeout)
 	t *= HZ;
 	if (ping_timeout)
 		t /= 10;
+	if (fast_t)
+		t = min(t, fast_t);
 
 	tr_ops->set_rcvtimeo(transport, CONTROL_STREAM, t);
 }
 
 static void set_ping_timeout(struct drbd_connection *connection)
 {
-	set_rcvtimeo(connection, 1);
+	set_rcvtimeo(connection, 1, fast_ping_timeout(connection));
 }
 
-static void set_idle_timeout(struct drbd_connection *connection)
+static void set_idle_timeout(struct drbd_connection *connection, long fast_t)
 {
-	set_rcvtimeo(connection, 0);
+	set_rcvtimeo(connection, 0, fast_t);
 }
 
 static struct meta_sock_cmd ack_receiver_tbl[] = {
@@ -9656,6 +10315,7 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 	unsigned int header_size = drbd_header_size(connection);
 	int expect   = header_size;
 	bool ping_timeout_active = false;
+	long idle_t = 0;
 	struct drbd_transport *transport = &connection->transport;
 	struct drbd_transport_ops *tr_ops = transport->ops;
 
@@ -9666,6 +10326,15 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 
 		drbd_reclaim_net_peer_reqs(connection);
 
+		if (!ping_timeout_active) {
+			long t = fast_ping_timeout(connection);
+
+			if (t != idle_t) {
+				idle_t = t;
+				set_idle_timeout(connection, idle_t);
+			}
+		}
+
 		if (test_bit(SEND_PING, &connection->flags)) {
 			clear_bit(SEND_PING, &connection->flags);
 			if (drbd_send_ping(connection)) {
@@ -9764,7 +10433,8 @@ int drbd_ack_receiver(struct drbd_thread *thi)
 			connection->last_received = jiffies;
 
 			if (cmd == &ack_receiver_tbl[P_PING_ACK]) {
-				set_idle_timeout(connection);
+				idle_t = fast_ping_timeout(connection);
+				set_idle_timeout(connection, idle_t);
 				ping_timeout_active = false;
 			}
 
@@ -9802,8 +10472,12 @@ void drbd_send_acks_wf(struct work_struct *ws)
 	tcp_cork = nc->tcp_cork;
 	rcu_read_unlock();
 
-	/* TODO: conditionally cork; it may hurt latency if we cork without
-	   much to send */
+	/* Corking only pays off if there is more than one ack to send.
+	 * done_ee_cnt may grow while we are in here, those late arrivals
+	 * are sent uncorked, which is what we would do for them anyway. */
+	if (tcp_cork && atomic_read(&connection->done_ee_cnt) < 2)
+		tcp_cork = false;
+
 	if (tcp_cork)
 		drbd_cork(connection, CONTROL_STREAM);
 	err = drbd_finish_peer_reqs(connection);
@@ -17,6 +17,7 @@
 #include <linux/drbd.h>
 #include "drbd_int.h"
 #include "drbd_req.h"
+#include "drbd_trace.h"
 
 static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector, int size);
 
@@ -24,9 +25,14 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device, struct bio
 {
 	struct drbd_request *req;
 
-	req = mempool_alloc(&drbd_request_mempool, GFP_NOIO);
-	if (!req)
-		return NULL;
+	req = mempool_alloc(&drbd_request_mempool, GFP_NOWAIT | __GFP_NOWARN);
+	if (!req) {
+		/* Slab and the mempool reserve are both exhausted. */
+		atomic_inc(&device->resource->req_mem_wait);
+		req = mempool_alloc(&drbd_request_mempool, GFP_NOIO);
+		if (!req)
+			return NULL;
+	}
 
 	memset(req, 0, sizeof(*req));
 
@@ -103,6 +109,8 @@ static void queue_peer_ack_send(struct drbd_resource *resource,
 			continue;
 
 		peer_ack->pending_mask |= NODE_MASK(node_id);
+		if (!connection->peer_ack_next)
+			connection->peer_ack_next = peer_ack;
 		queue_work(connection->ack_sender, &connection->peer_ack_work);
 	}
 	rcu_read_unlock();
@@ -111,12 +119,22 @@ static void queue_peer_ack_send(struct drbd_resource *resource,
 void drbd_destroy_peer_ack_if_done(struct drbd_peer_ack *peer_ack)
 {
 	struct drbd_resource *resource = peer_ack->resource;
+	struct drbd_connection *connection;
 
 	lockdep_assert_held(&resource->peer_ack_lock);
 
 	if (peer_ack->pending_mask)
 		return;
 
+	/* A connection may still have to step over it; but nobody waits
+	 * for it anymore, so the entry after it is just as good. */
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		if (connection->peer_ack_next == peer_ack)
+			connection->peer_ack_next = drbd_next_peer_ack(resource, peer_ack);
+	}
+	rcu_read_unlock();
+
 	list_del(&peer_ack->list);
 	kfree(peer_ack);
 }
@@ -220,6 +238,8 @@ void drbd_req_destroy(struct kref *kref)
 		device->reqs++;
 		ktime_aggregate(device, req, in_actlog_kt);
 		ktime_aggregate(device, req, pre_submit_kt);
+		ktime_histogram(device->in_actlog_hist, req, in_actlog_kt);
+		ktime_histogram(device->pre_submit_hist, req, pre_submit_kt);
 		for_each_peer_device(peer_device, device) {
 			int node_id = peer_device->node_id;
 			unsigned ns = req->net_rq_state[node_id];
@@ -228,6 +248,7 @@ void drbd_req_destroy(struct kref *kref)
 			ktime_aggregate_pd(peer_device, node_id, req, pre_send_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, acked_kt);
 			ktime_aggregate_pd(peer_device, node_id, req, net_done_kt);
+			ktime_histogram_pd(peer_device->acked_hist, node_id, req, acked_kt);
 		}
 		spin_unlock(&device->timing_lock);
 	}
@@ -353,8 +374,14 @@ void drbd_req_destroy(struct kref *kref)
 			resource->last_peer_acked_dagtag = req->dagtag_sector;
 		spin_unlock(&resource->peer_ack_lock);
 
-		mod_timer(&resource->peer_ack_timer,
-			  jiffies + resource->res_opts.peer_ack_delay * HZ / 1000);
+		/* Arm the timer only for the first request of a new group:
+		 * the peer ack goes out at most peer_ack_delay after that,
+		 * even if writes keep trickling in at a low rate without ever
+		 * filling the window.  At high rates the window closes the
+		 * group long before, and we do not mod_timer() every write. */
+		if (!peer_ack_req)
+			mod_timer(&resource->peer_ack_timer,
+				  jiffies + resource->res_opts.peer_ack_delay * HZ / 1000);
 	} else
 		call_rcu(&req->rcu, drbd_reclaim_req);
 
@@ -416,6 +443,56 @@ void complete_master_bio(struct drbd_device *device,
 }
 
 
+/* Track a decaying peak of the application write latency for the latency
+ * based resync throttle, see drbd_rs_c_min_rate_throttle().  The peak gives
+ * way by 1/64 with every write, so it follows the slowest writes out of the
+ * last few hundred; a high percentile rather than the average. */
+static unsigned int drbd_req_latency_us(struct drbd_request *req)
+{
+#ifdef CONFIG_DRBD_TIMING_STATS
+	return ktime_us_delta(ktime_get(), req->start_kt);
+#else
+	return jiffies_to_usecs(jiffies - req->start_jif);
+#endif
+}
+
+static void drbd_account_write_latency(struct drbd_device *device, struct drbd_request *req)
+{
+	unsigned int lat_us = drbd_req_latency_us(req), peak_us;
+
+	peak_us = READ_ONCE(device->ap_write_lat_peak_us);
+	WRITE_ONCE(device->ap_write_lat_peak_us, max(lat_us, peak_us - (peak_us >> 6)));
+	WRITE_ONCE(device->ap_write_lat_jif, jiffies);
+}
+
+/* Moving average over the last few reads, with weight 1/8 for the newest one */
+static void drbd_update_read_latency(unsigned int *avg_us, unsigned int lat_us)
+{
+	unsigned int avg = READ_ONCE(*avg_us);
+
+	WRITE_ONCE(*avg_us, avg ? avg - (avg >> 3) + (lat_us >> 3) : max(lat_us, 1U));
+}
+
+/* Account a successful read to the local disk or the peer that served it,
+ * for the latency aware read balancing, see remote_due_to_read_balancing(). */
+static void drbd_account_read_latency(struct drbd_device *device, struct drbd_request *req)
+{
+	unsigned int lat_us = drbd_req_latency_us(req);
+	struct drbd_peer_device *peer_device;
+
+	if (req->local_rq_state & RQ_LOCAL_OK) {
+		drbd_update_read_latency(&device->local_read_lat_us, lat_us);
+		return;
+	}
+
+	for_each_peer_device(peer_device, device) {
+		if (req->net_rq_state[peer_device->node_id] & RQ_NET_OK) {
+			drbd_update_read_latency(&peer_device->read_lat_us, lat_us);
+			return;
+		}
+	}
+}
+
 /* Helper for __req_mod().
  * Set m->bio to the master bio, if it is fit to be completed,
  * or leave it alone (it is initialized to NULL in __req_mod),
@@ -507,6 +584,15 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 
 	/* Update disk stats */
 	bio_end_io_acct(req->master_bio, req->start_jif);
+	trace_drbd_request_complete(req);
+
+	if (READ_ONCE(drbd_resync_latency_target_us) &&
+	    bio_data_dir(req->master_bio) == WRITE && req->i.size != 0)
+		drbd_account_write_latency(device, req);
+
+	if ((READ_ONCE(drbd_read_balance_latency) || READ_ONCE(drbd_read_slow_local_us)) && ok &&
+	    bio_data_dir(req->master_bio) == READ && req->i.size != 0)
+		drbd_account_read_latency(device, req);
 
 	if (device->cached_err_io) {
 		ok = 0;
@@ -542,15 +628,23 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 		m->bio = req->master_bio;
 		req->master_bio = NULL;
 
-		spin_lock_irqsave(&device->interval_lock, flags);
-		/* We leave it in the tree, to be able to verify later
-		 * write-acks in protocol != C during resync.
-		 * But we mark it as "complete", so it won't be counted as
-		 * conflict in a multi-primary setup. */
-		set_bit(INTERVAL_COMPLETED, &req->i.flags);
-		if (test_bit(INTERVAL_WAITING, &req->i.flags))
-			wake_up(&device->misc_wait);
-		spin_unlock_irqrestore(&device->interval_lock, flags);
+		if (drbd_interval_empty(&req->i)) {
+			/* Never made it into one of the trees (local reads,
+			 * writes without any peer to replicate to): nobody
+			 * can be waiting for it, no need for the interval_lock
+			 * that all submitters contend on. */
+			set_bit(INTERVAL_COMPLETED, &req->i.flags);
+		} else {
+			spin_lock_irqsave(&device->interval_lock, flags);
+			/* We leave it in the tree, to be able to verify later
+			 * write-acks in protocol != C during resync.
+			 * But we mark it as "complete", so it won't be counted as
+			 * conflict in a multi-primary setup. */
+			set_bit(INTERVAL_COMPLETED, &req->i.flags);
+			if (test_bit(INTERVAL_WAITING, &req->i.flags))
+				wake_up(&device->misc_wait);
+			spin_unlock_irqrestore(&device->interval_lock, flags);
+		}
 	}
 
 	/* Either we are about to complete to upper layers,
@@ -772,8 +866,14 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 
 	if (!(old_net & RQ_NET_SENT) && (set & RQ_NET_SENT)) {
 		/* potentially already completed in the ack_receiver thread */
-		if (!(old_net & RQ_NET_DONE))
-			atomic_add(req_payload_sectors(req), &peer_device->connection->ap_in_flight);
+		if (!(old_net & RQ_NET_DONE)) {
+			int sectors = req_payload_sectors(req);
+
+			/* let the ack receiver switch to fast_ping_min_ms timeouts */
+			if (atomic_add_return(sectors, &connection->ap_in_flight) == sectors &&
+			    sectors && drbd_fast_ping_min_ms)
+				wake_ack_receiver(connection);
+		}
 		if (req->net_rq_state[idx] & RQ_NET_PENDING)
 			set_cache_ptr_if_null(&connection->req_ack_pending, req);
 	}
@@ -800,6 +900,7 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 			kref_put(&req->kref, drbd_req_destroy);
 		else
 			++c_put;
+		drbd_count_latency(device, local, req->pre_submit_jif);
 		spin_lock(&device->pending_completion_lock); /* local irq already disabled */
 		list_del_init(&req->req_pending_local);
 		spin_unlock(&device->pending_completion_lock);
@@ -809,6 +910,9 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 		dec_ap_pending(peer_device);
 		++c_put;
 		ktime_get_accounting(req->acked_kt[peer_device->node_id]);
+		if (old_net & RQ_NET_SENT)
+			drbd_count_latency(req->device, net,
+					   req->pre_send_jif[peer_device->node_id]);
 		advance_cache_ptr(connection, &connection->req_ack_pending,
 				  req, RQ_NET_SENT | RQ_NET_PENDING, 0);
 	}
@@ -951,9 +1055,9 @@ void __req_mod(struct drbd_request *req, enum drbd_req_event what,
 
 	case COMPLETED_OK:
 		if (req->local_rq_state & RQ_WRITE)
-			device->writ_cnt += req->i.size >> 9;
+			drbd_count_write(device, req->i.size >> 9);
 		else
-			device->read_cnt += req->i.size >> 9;
+			drbd_count_read(device, req->i.size >> 9);
 
 		mod_rq_state(req, m, peer_device, RQ_LOCAL_PENDING,
 				RQ_LOCAL_COMPLETED|RQ_LOCAL_OK);
@@ -1265,7 +1369,7 @@ static bool drbd_may_do_local_read(struct drbd_device *device, sector_t sector,
 
 /* TODO improve for more than one peer.
  * also take into account the drbd protocol. */
-static bool remote_due_to_read_balancing(struct drbd_device *device,
+static bool __remote_due_to_read_balancing(struct drbd_device *device,
 		struct drbd_peer_device *peer_device, sector_t sector,
 		enum drbd_read_balancing rbm)
 {
@@ -1278,6 +1382,18 @@ static bool remote_due_to_read_balancing(struct drbd_device *device,
 		 * so just never report the lower device as congested. */
 		return false;
 	case RB_LEAST_PENDING:
+		if (READ_ONCE(drbd_read_balance_latency)) {
+			unsigned int local_lat = READ_ONCE(device->local_read_lat_us);
+			unsigned int peer_lat = READ_ONCE(peer_device->read_lat_us);
+
+			/* Expected completion time: the request waits for those
+			 * already queued, then takes one average latency itself.
+			 * Until both paths served a read, fall back to plain counts. */
+			if (local_lat && peer_lat)
+				return (u64)(atomic_read(&device->local_cnt) + 1) * local_lat >
+					(u64)(atomic_read(&peer_device->ap_pending_cnt) +
+					      atomic_read(&peer_device->rs_pending_cnt) + 1) * peer_lat;
+		}
 		return atomic_read(&device->local_cnt) >
 			atomic_read(&peer_device->ap_pending_cnt) + atomic_read(&peer_device->rs_pending_cnt);
 	case RB_32K_STRIPING:  /* stripe_shift = 15 */
@@ -1298,6 +1414,15 @@ static bool remote_due_to_read_balancing(struct drbd_device *device,
 	}
 }
 
+static bool remote_due_to_read_balancing(struct drbd_device *device,
+		struct drbd_peer_device *peer_device, struct drbd_request *req,
+		enum drbd_read_balancing rbm)
+{
+	bool remote = __remote_due_to_read_balancing(device, peer_device, req->i.sector, rbm);
+
+	return drbd_policy_read_remote(peer_device, req->i.sector, req->i.size, remote);
+}
+
 /*
  * complete_conflicting_writes  -  wait for any conflicting write requests
  *
@@ -1315,6 +1440,7 @@ static void complete_conflicting_writes(struct drbd_request *req)
 	struct drbd_interval *i;
 	sector_t sector = req->i.sector;
 	int size = req->i.size;
+	bool waited = false;
 
 	for (;;) {
 		drbd_for_each_overlap(i, &device->write_requests, sector, size) {
@@ -1327,6 +1453,10 @@ static void complete_conflicting_writes(struct drbd_request *req)
 		}
 		if (!i)	/* if any */
 			break;
+		if (!waited) {
+			atomic64_inc(&device->local_write_waits);
+			waited = true;
+		}
 
 		/* Indicate to wake up device->misc_wait on progress.  */
 		prepare_to_wait(&device->misc_wait, &wait, TASK_UNINTERRUPTIBLE);
@@ -1380,22 +1510,48 @@ static void __maybe_pull_ahead(struct drbd_device *device, struct drbd_connectio
 	/* if an other volume already found that we are congested, short circuit. */
 	congested = test_bit(CONN_CONGESTED, &connection->flags);
 
-	if (!congested && cong_fill) {
-		int n = atomic_read(&connection->ap_in_flight) +
-			atomic_read(&connection->rs_in_flight);
-		if (n >= cong_fill) {
-			drbd_info(device, "Congestion-fill threshold reached (%d >= %d)\n", n, cong_fill);
-			congested = true;
+	if (!congested) {
+		/* Only report the first time we see the thresholds exceeded,
+		 * not for every write while waiting for pull_ahead_delay_ms. */
+		bool report = !peer_device->congestion_start_jif;
+		bool over = false;
+
+		if (cong_fill) {
+			int n = atomic_read(&connection->ap_in_flight) +
+				atomic_read(&connection->rs_in_flight);
+			if (n >= cong_fill) {
+				if (report)
+					drbd_info(device, "Congestion-fill threshold reached (%d >= %d)\n",
+						  n, cong_fill);
+				over = true;
+			}
 		}
-	}
 
-	if (!congested && device->act_log->used >= cong_extents) {
-		drbd_info(device, "Congestion-extents threshold reached (%d >= %d)\n",
-			device->act_log->used, cong_extents);
-		congested = true;
+		if (!over && device->act_log->used >= cong_extents) {
+			if (report)
+				drbd_info(device, "Congestion-extents threshold reached (%d >= %d)\n",
+					  device->act_log->used, cong_extents);
+			over = true;
+		}
+
+		if (!over) {
+			peer_device->congestion_start_jif = 0;
+		} else {
+			unsigned int delay_ms = READ_ONCE(drbd_pull_ahead_delay_ms);
+
+			if (report)
+				peer_device->congestion_start_jif = jiffies ?: 1;
+			/* A short spike is cheaper to ride out by blocking
+			 * than by going Ahead and resyncing afterwards. */
+			congested = !delay_ms ||
+				time_after_eq(jiffies, peer_device->congestion_start_jif +
+					      msecs_to_jiffies(delay_ms));
+		}
 	}
 
+	congested = drbd_policy_pull_ahead(peer_device, congested);
 	if (congested) {
+		peer_device->congestion_start_jif = 0;
 		set_bit(CONN_CONGESTED, &connection->flags);
 		drbd_peer_device_post_work(peer_device, HANDLE_CONGESTION);
 	} else {
@@ -1472,6 +1628,73 @@ static u64 calc_nodes_to_read_from(struct drbd_device *device)
 	return 0;
 }
 
+/* Make the resync of this area jump the queue, see make_resync_request() */
+static void note_hot_resync_area(struct drbd_device *device, sector_t sector)
+{
+	struct drbd_peer_device *peer_device;
+
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		if (peer_device->repl_state[NOW] == L_SYNC_TARGET)
+			WRITE_ONCE(peer_device->rs_hot_bit, BM_SECT_TO_BIT(sector));
+	}
+	rcu_read_unlock();
+}
+
+/* Without a local disk, and with read_balance_latency set: choose the peer with
+ * the lowest expected completion time, see remote_due_to_read_balancing().  A
+ * peer that has not served a read yet is tried first, to learn its latency.  A
+ * read that continues where the previous one ended goes to the same peer, so
+ * that its read-ahead keeps working for sequential streams. */
+static struct drbd_peer_device *find_peer_device_by_read_latency(struct drbd_request *req)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_peer_device *peer_device, *best = NULL;
+	u64 nodes = calc_nodes_to_read_from(device);
+	u64 cost, best_cost = U64_MAX;
+	int node_id;
+
+	for_each_set_bit(node_id, (unsigned long *)&nodes, DRBD_NODE_ID_MAX) {
+		peer_device = peer_device_by_node_id(device, node_id);
+		if (!peer_device || peer_device->disk_state[NOW] != D_UP_TO_DATE)
+			continue;
+		if (node_id == device->read_last_node_id &&
+		    req->i.sector == device->read_next_sector) {
+			best = peer_device;
+			break;
+		}
+		cost = (u64)(atomic_read(&peer_device->ap_pending_cnt) +
+			     atomic_read(&peer_device->rs_pending_cnt) + 1) *
+			READ_ONCE(peer_device->read_lat_us);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = peer_device;
+		}
+	}
+
+	if (best) {
+		device->read_last_node_id = best->node_id;
+		device->read_next_sector = req->i.sector + (req->i.size >> 9);
+	}
+	return best;
+}
+
+/* One in this many reads still goes to a slow local disk,
+ * so that its average latency notices when it recovers. */
+#define DRBD_SLOW_LOCAL_PROBE 16
+
+/* A degraded RAID below us may hold reads for a long time.  While the average
+ * local read latency is above read_slow_local_us, prefer-local reads go to a
+ * peer instead. */
+static bool drbd_local_read_slow(struct drbd_device *device)
+{
+	unsigned int slow_us = READ_ONCE(drbd_read_slow_local_us);
+
+	if (!slow_us || READ_ONCE(device->local_read_lat_us) <= slow_us)
+		return false;
+	return atomic_inc_return(&device->read_slow_local_cnt) % DRBD_SLOW_LOCAL_PROBE != 0;
+}
+
 /* If this returns NULL, and req->private_bio is still set,
  * the request should be submitted locally.
  *
@@ -1493,6 +1716,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 			bio_put(req->private_bio);
 			req->private_bio = NULL;
 			put_ldev(device);
+			note_hot_resync_area(device, req->i.sector);
 		}
 	}
 
@@ -1501,10 +1725,15 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		rbm = rcu_dereference(device->ldev->disk_conf)->read_balancing;
 		rcu_read_unlock();
 		if (rbm == RB_PREFER_LOCAL && req->private_bio) {
-			return NULL; /* submit locally */
+			if (!drbd_local_read_slow(device))
+				return NULL; /* submit locally */
+			rbm = RB_PREFER_REMOTE;
 		}
 	}
 
+	if (!req->private_bio && READ_ONCE(drbd_read_balance_latency))
+		return find_peer_device_by_read_latency(req);
+
 	/* TODO: improve read balancing decisions, allow user to configure node weights */
 	while (true) {
 		if (!device->read_nodes)
@@ -1518,7 +1747,7 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 			if (peer_device->disk_state[NOW] != D_UP_TO_DATE)
 				continue;
 			if (req->private_bio &&
-			    !remote_due_to_read_balancing(device, peer_device, req->i.sector, rbm))
+			    !remote_due_to_read_balancing(device, peer_device, req, rbm))
 				peer_device = NULL;
 		} else {
 			peer_device = NULL;
@@ -1652,7 +1881,7 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 			    ((bio->bi_opf & REQ_NOUNMAP) ? 0 : EE_TRIM));
 		} else if (bio_op(bio) == REQ_OP_DISCARD) {
 			drbd_process_discard_or_zeroes_req(req, EE_TRIM);
-		} else {
+		} else if (!drbd_delay_bio(device, type, bio)) {
 			submit_bio_noacct(bio);
 		}
 		put_ldev(device);
@@ -1674,14 +1903,21 @@ static void drbd_queue_write(struct drbd_device *device, struct drbd_request *re
 	list_add_tail(&req->list, &device->submit.writes);
 	spin_unlock(&device->submit.lock);
 	queue_work(device->submit.wq, &device->submit.worker);
-	/* do_submit() may sleep internally on al_wait, too */
-	wake_up(&device->al_wait);
+	/* do_submit() may sleep internally on al_wait, too.
+	 * Most of the time nobody sleeps there; avoid taking the wait queue
+	 * lock for every single write.  The barrier pairs with the one in
+	 * prepare_to_wait() in do_submit(), which looks at the lists only
+	 * after it put itself on the wait queue. */
+	smp_mb();
+	if (waitqueue_active(&device->al_wait))
+		wake_up(&device->al_wait);
 }
 
 static void drbd_req_in_actlog(struct drbd_request *req)
 {
 	req->local_rq_state |= RQ_IN_ACT_LOG;
 	ktime_get_accounting(req->in_actlog_kt);
+	drbd_count_latency(req->device, al_wait, req->start_jif);
 	atomic_sub(interval_to_al_extents(&req->i), &req->device->wait_for_actlog_ecnt);
 }
 
@@ -2021,7 +2257,7 @@ out:
 
 static bool inc_ap_bio_cond(struct drbd_device *device, int rw)
 {
-	int ap_bio_cnt;
+	unsigned int nr_requests;
 	bool rv;
 
 	read_lock_irq(&device->resource->state_rwlock);
@@ -2038,13 +2274,15 @@ static bool inc_ap_bio_cond(struct drbd_device *device, int rw)
 		return false;
 	}
 
-	do {
-		unsigned int nr_requests = device->resource->res_opts.nr_requests;
-
-		ap_bio_cnt = atomic_read(&device->ap_bio_cnt[rw]);
-		if (ap_bio_cnt >= nr_requests)
-			return false;
-	} while (atomic_cmpxchg(&device->ap_bio_cnt[rw], ap_bio_cnt, ap_bio_cnt + 1) != ap_bio_cnt);
+	/* Increment first, and back off if that exceeded the limit.  One atomic
+	 * op in the common case, instead of a cmpxchg loop that retries while
+	 * other CPUs submit or complete.  Whoever brings the count back below
+	 * nr_requests wakes the waiters, see dec_ap_bio(). */
+	nr_requests = device->resource->res_opts.nr_requests;
+	if (atomic_inc_return(&device->ap_bio_cnt[rw]) > nr_requests) {
+		dec_ap_bio(device, rw);
+		return false;
+	}
 
 	return true;
 }
@@ -2072,6 +2310,7 @@ void __drbd_make_request(struct drbd_device *device, struct bio *bio,
 	req = drbd_request_prepare(device, bio, start_kt, start_jif);
 	if (IS_ERR_OR_NULL(req))
 		return;
+	trace_drbd_request_submit(req);
 	drbd_send_and_submit(device, req);
 }
 
@@ -2290,8 +2529,10 @@ void do_submit(struct work_struct *ws)
 		/* move used-to-be-postponed back to front of incoming */
 		wfa_splice_init(&wfa, later, incoming);
 		submit_fast_path(device, &wfa);
-		if (wfa_lists_empty(&wfa, incoming))
+		if (wfa_lists_empty(&wfa, incoming)) {
+			drbd_al_prefetch_commit(device);
 			break;
+		}
 
 		for (;;) {
 			/*
@@ -2562,7 +2803,6 @@ void request_timer_fn(struct timer_list *t)
 	}
 	rcu_read_unlock();
 
-	/* FIXME right now, this basically does a full transfer log walk *every time* */
 	read_lock_irq(&resource->state_rwlock);
 	if (disk_timeout) {
 		unsigned long write_pre_submit_jif = 0, read_pre_submit_jif = 0;
@@ -287,6 +287,14 @@ extern void __tl_walk(struct drbd_resource *const resource,
 		struct drbd_request **from_req,
 		const enum drbd_req_event what);
 extern void drbd_destroy_peer_ack_if_done(struct drbd_peer_ack *peer_ack);
+
+/* peer_ack_lock held */
+static inline struct drbd_peer_ack *
+drbd_next_peer_ack(struct drbd_resource *resource, struct drbd_peer_ack *peer_ack)
+{
+	return list_is_last(&peer_ack->list, &resource->peer_ack_list) ?
+		NULL : list_next_entry(peer_ack, list);
+}
 extern int w_queue_peer_ack(struct drbd_work *w, int cancel);
 extern void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *req);
 extern bool drbd_should_do_remote(struct drbd_peer_device *, enum which_state);
@@ -24,6 +24,8 @@
 #include <linux/scatterlist.h>
 #include <linux/overflow.h>
 #include <linux/part_stat.h>
+#include <linux/crc32c.h>
+#include <asm/unaligned.h>
 
 #include "drbd_int.h"
 #include "drbd_protocol.h"
@@ -36,6 +38,7 @@ static int make_resync_request(struct drbd_peer_device *, int);
 static bool should_send_barrier(struct drbd_connection *, unsigned int epoch);
 static void maybe_send_barrier(struct drbd_connection *, unsigned int);
 static unsigned long get_work_bits(const unsigned long mask, unsigned long *flags);
+static void rs_rtt_probe_start(struct drbd_peer_device *, sector_t);
 
 /* endio handlers:
  *   drbd_md_endio (defined here)
@@ -55,12 +58,12 @@ static unsigned long get_work_bits(const unsigned long mask, unsigned long *flag
  */
 void drbd_md_endio(struct bio *bio)
 {
-	struct drbd_device *device;
+	struct drbd_md_io *md_io = bio->bi_private;
+	struct drbd_device *device = md_io->device;
 
 	blk_status_t status = bio->bi_status;
 
-	device = bio->bi_private;
-	device->md_io.error = blk_status_to_errno(status);
+	md_io->error = blk_status_to_errno(status);
 
 	/* special case: drbd_md_read() during drbd_adm_attach() */
 	if (device->ldev)
@@ -78,8 +81,8 @@ void drbd_md_endio(struct bio *bio)
 	 * next drbd_md_sync_page_io(), that we trigger the
 	 * ASSERT(atomic_read(&mdev->md_io_in_use) == 1) there.
 	 */
-	drbd_md_put_buffer(device);
-	device->md_io.done = 1;
+	__drbd_md_put_buffer(md_io);
+	md_io->done = 1;
 	wake_up(&device->misc_wait);
 }
 
@@ -94,8 +97,9 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	struct drbd_connection *connection = peer_device->connection;
 	bool io_error;
 
+	if (!(peer_req->flags & EE_RS_SHARED))
+		drbd_count_read(device, peer_req->i.size >> 9);
 	spin_lock_irqsave(&connection->peer_reqs_lock, flags);
-	device->read_cnt += peer_req->i.size >> 9;
 	list_del(&peer_req->w.list);
 	if (list_empty(&connection->read_ee))
 		wake_up(&connection->ee_wait);
@@ -163,8 +167,13 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 		drbd_handle_io_error(device, DRBD_WRITE_ERROR);
 	}
 
+	/* completed, so covered by the next flush submitted from now on;
+	 * a completed FUA write is on stable storage already */
+	if (!(peer_req->opf & REQ_FUA) || (peer_req->flags & (EE_TRIM|EE_ZEROOUT)))
+		set_bit(UNFLUSHED_WRITES, &peer_device->flags);
+
+	drbd_count_write(device, peer_req->i.size >> 9);
 	spin_lock_irqsave(&connection->peer_reqs_lock, flags);
-	device->writ_cnt += peer_req->i.size >> 9;
 	atomic_inc(&connection->done_ee_cnt);
 	list_move_tail(&peer_req->w.list, &connection->done_ee);
 
@@ -180,10 +189,12 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 		do_wake = list_empty(&connection->sync_ee);
 	else
 		do_wake = atomic_dec_and_test(&connection->active_ee_cnt);
+	spin_unlock_irqrestore(&connection->peer_reqs_lock, flags);
 
+	/* Outside of peer_reqs_lock, waking the ack sender can take a while.
+	 * It finds peer_req on done_ee anyways, or has taken it already. */
 	if (connection->cstate[NOW] == C_CONNECTED)
 		queue_work(connection->ack_sender, &connection->send_acks_work);
-	spin_unlock_irqrestore(&connection->peer_reqs_lock, flags);
 
 	if (block_id == ID_SYNCER)
 		drbd_rs_complete_io(peer_device, sector);
@@ -225,6 +236,57 @@ void drbd_peer_request_endio(struct bio *bio)
 	}
 }
 
+static void rs_share_copy_pages(struct drbd_peer_request *peer_req,
+				struct drbd_peer_request *leader)
+{
+	struct page *src = leader->page_chain.head;
+	struct page *page = peer_req->page_chain.head;
+	unsigned int data_size = peer_req->i.size;
+
+	page_chain_for_each(page) {
+		unsigned int len = min_t(unsigned int, data_size, PAGE_SIZE);
+		u8 *s, *d;
+
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		s = kmap_local_page(src);
+		d = kmap_local_page(page);
+		memcpy(d, s, len);
+		kunmap_local(d);
+		kunmap_local(s);
+		data_size -= len;
+		src = page_chain_next(src);
+	}
+}
+
+/* Hand the data of a completed resync read to the requests of other peers
+ * that attached to it in drbd_rs_share_read(), and complete those as if
+ * they had been read from disk themselves. */
+void drbd_rs_share_read_done(struct drbd_peer_request *leader)
+{
+	struct drbd_device *device = leader->peer_device->device;
+	struct drbd_peer_request *peer_req, *tmp;
+	bool io_error = test_bit(__EE_WAS_ERROR, &leader->flags);
+
+	if (!(leader->flags & EE_RS_SHARE_LEADER))
+		return;
+
+	/* Nobody attaches once it is off the list */
+	spin_lock_irq(&device->rs_share_lock);
+	list_del_init(&leader->rs_share);
+	spin_unlock_irq(&device->rs_share_lock);
+	leader->flags &= ~EE_RS_SHARE_LEADER;
+
+	list_for_each_entry_safe(peer_req, tmp, &leader->rs_share_followers, rs_share) {
+		list_del_init(&peer_req->rs_share);
+		if (io_error)
+			set_bit(__EE_WAS_ERROR, &peer_req->flags);
+		else
+			rs_share_copy_pages(peer_req, leader);
+		drbd_endio_read_sec_final(peer_req);
+	}
+}
+
 /* Not static to increase the likelyhood that it will show up in a stack trace */
 void drbd_panic_after_delayed_completion_of_aborted_request(struct drbd_device *device)
 {
@@ -320,10 +382,37 @@ void drbd_request_endio(struct bio *bio)
 		complete_master_bio(device, &m);
 }
 
+/* crc32c is the common choice for data-integrity-alg and csums-alg. The
+ * library function uses the CPU's crc instructions as the crypto driver does,
+ * without an indirect call per page. Same seed and final inversion as the
+ * "crc32c" shash, so the digest on the wire is the same. */
+static bool tfm_is_crc32c(struct crypto_shash *tfm)
+{
+	return !strcmp(crypto_shash_alg_name(tfm), "crc32c");
+}
+
+static void crc32c_final(u32 crc, void *digest)
+{
+	put_unaligned_le32(~crc, digest);
+}
+
 void drbd_csum_pages(struct crypto_shash *tfm, struct page *page, void *digest)
 {
 	SHASH_DESC_ON_STACK(desc, tfm);
 
+	if (tfm_is_crc32c(tfm)) {
+		u32 crc = ~0;
+
+		page_chain_for_each(page) {
+			u8 *src = kmap_local_page(page);
+
+			crc = crc32c(crc, src + page_chain_offset(page), page_chain_size(page));
+			kunmap_local(src);
+		}
+		crc32c_final(crc, digest);
+		return;
+	}
+
 	desc->tfm = tfm;
 
 	crypto_shash_init(desc);
@@ -346,6 +435,19 @@ void drbd_csum_bio(struct crypto_shash *tfm, struct bio *bio, void *digest)
 	struct bvec_iter iter;
 	SHASH_DESC_ON_STACK(desc, tfm);
 
+	if (tfm_is_crc32c(tfm)) {
+		u32 crc = ~0;
+
+		bio_for_each_segment(bvec, bio, iter) {
+			u8 *src = bvec_kmap_local(&bvec);
+
+			crc = crc32c(crc, src, bvec.bv_len);
+			kunmap_local(src);
+		}
+		crc32c_final(crc, digest);
+		return;
+	}
+
 	desc->tfm = tfm;
 
 	crypto_shash_init(desc);
@@ -365,6 +467,7 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 {
 	struct drbd_peer_request *peer_req = container_of(w, struct drbd_peer_request, w);
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
+	sector_t sector = peer_req->i.sector;
 	int digest_size;
 	void *digest;
 	int err = 0;
@@ -387,6 +490,7 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 		drbd_free_peer_req(peer_req);
 		peer_req = NULL;
 		inc_rs_pending(peer_device);
+		rs_rtt_probe_start(peer_device, sector);
 		err = drbd_send_command(peer_device, P_CSUM_RS_REQUEST, DATA_STREAM);
 	} else {
 		drbd_err(peer_device, "kmalloc() of digest failed.\n");
@@ -498,6 +602,7 @@ void resync_timer_fn(struct timer_list *t)
 {
 	struct drbd_peer_device *peer_device = from_timer(peer_device, t, resync_timer);
 
+	clear_bit(RS_REFILLED, &peer_device->flags);
 	drbd_queue_work_if_unqueued(
 		&peer_device->connection->sender_work,
 		&peer_device->resync_work);
@@ -629,15 +734,184 @@ static int drbd_rs_controller(struct drbd_peer_device *peer_device, u64 sect_in,
 	return req_sect;
 }
 
+/* The model controller times one resync request at a time.  A request
+ * whose reply got lost is given up after RS_MIN_RTT_WINDOW_NS. */
+static void rs_rtt_probe_start(struct drbd_peer_device *peer_device, sector_t sector)
+{
+	ktime_t now, kt = READ_ONCE(peer_device->rs_rtt_probe_kt);
+
+	if (!READ_ONCE(drbd_resync_model_controller))
+		return;
+	now = ktime_get();
+	if (kt && ktime_to_ns(ktime_sub(now, kt)) < RS_MIN_RTT_WINDOW_NS)
+		return;
+	peer_device->rs_rtt_probe_sector = sector;
+	smp_wmb(); /* pairs with smp_rmb() in drbd_rs_rtt_sample() */
+	WRITE_ONCE(peer_device->rs_rtt_probe_kt, now);
+}
+
+/* Called for every resync reply.  Keeps the minimum of the timed round
+ * trips over RS_MIN_RTT_WINDOW_NS, so an estimate that includes queueing
+ * is replaced once the queues drained, and a changed path is noticed. */
+void drbd_rs_rtt_sample(struct drbd_peer_device *peer_device, sector_t sector)
+{
+	ktime_t now, kt = READ_ONCE(peer_device->rs_rtt_probe_kt);
+	u64 rtt_ns;
+
+	if (!kt)
+		return;
+	smp_rmb();
+	if (peer_device->rs_rtt_probe_sector != sector)
+		return;
+	WRITE_ONCE(peer_device->rs_rtt_probe_kt, 0);
+
+	now = ktime_get();
+	rtt_ns = ktime_to_ns(ktime_sub(now, kt));
+	if (!peer_device->rs_min_rtt_ns || rtt_ns <= peer_device->rs_min_rtt_ns ||
+	    ktime_to_ns(ktime_sub(now, peer_device->rs_min_rtt_kt)) > RS_MIN_RTT_WINDOW_NS) {
+		WRITE_ONCE(peer_device->rs_min_rtt_ns, rtt_ns);
+		peer_device->rs_min_rtt_kt = now;
+	}
+}
+
+/* Alternative to drbd_rs_controller(): estimate the bottleneck bandwidth
+ * from the resync replies and the minimal round trip time from timed
+ * requests, and keep their product in flight.  One turn in eight asks for
+ * a quarter more, to probe for more bandwidth; the queue that builds up if
+ * there is none drains in the following turns.  When the SyncSource gets
+ * busy with application I/O, the replies slow down, the bandwidth estimate
+ * decays within a few turns, and so does the amount we request.
+ */
+static int drbd_rs_model_controller(struct drbd_peer_device *peer_device, u64 sect_in, u64 duration_ns)
+{
+	struct peer_device_conf *pdc;
+	u64 bw = 0, min_rtt_ns, want, max_sect, req_sect, in_flight;
+
+	if (duration_ns == 0)
+		duration_ns = 1;
+
+	pdc = rcu_dereference(peer_device->conf);
+
+	if (sect_in) {
+		bw = sect_in * NSEC_PER_SEC;
+		do_div(bw, duration_ns);
+	}
+
+	/* Decaying maximum, to notice competing application I/O */
+	peer_device->rs_bw_est = max(bw, peer_device->rs_bw_est - (peer_device->rs_bw_est >> 3));
+
+	min_rtt_ns = READ_ONCE(peer_device->rs_min_rtt_ns);
+	if (!peer_device->rs_bw_est || !min_rtt_ns) {
+		/* Nothing came back yet, start with resync-rate */
+		want = (pdc->resync_rate * 2 * RS_MAKE_REQS_INTV) / HZ;
+	} else {
+		want = peer_device->rs_bw_est * min_rtt_ns;
+		do_div(want, NSEC_PER_SEC);
+		if (++peer_device->rs_model_turn % 8 == 0)
+			want += want >> 2;
+	}
+
+	in_flight = max(peer_device->rs_in_flight, 0);
+	req_sect = want > in_flight ? want - in_flight : 0;
+
+	if (pdc->c_max_rate == 0) {
+		/* No rate limiting. */
+		max_sect = ~0ULL;
+	} else {
+		/* turns may be shorter than RS_MAKE_REQS_INTV,
+		 * see drbd_rs_half_in_flight_came_back() */
+		max_sect = (u64)pdc->c_max_rate * 2 * min_t(u64, duration_ns, RS_MAKE_REQS_INTV_NS);
+		do_div(max_sect, NSEC_PER_SEC);
+	}
+
+	dynamic_drbd_dbg(peer_device, "dur=%lluns sect_in=%llu in_flight=%d bw=%llu rtt=%lluns wa=%llu rs=%llu mx=%llu\n",
+		 duration_ns, sect_in, peer_device->rs_in_flight, peer_device->rs_bw_est,
+		 min_rtt_ns, want, req_sect, max_sect);
+
+	/* the caller counts in int */
+	return min3(req_sect, max_sect, (u64)INT_MAX);
+}
+
+/* Number of peer devices of the resource that currently request resync or
+ * verify data, for sharing drbd_resync_rate_budget.  Caller holds RCU. */
+static int resync_requesters(struct drbd_resource *resource)
+{
+	struct drbd_peer_device *peer_device;
+	struct drbd_device *device;
+	int vnr, n = 0;
+
+	idr_for_each_entry(&resource->devices, device, vnr) {
+		for_each_peer_device_rcu(peer_device, device) {
+			enum drbd_repl_state repl_state = peer_device->repl_state[NOW];
+
+			if (repl_state == L_SYNC_TARGET || repl_state == L_VERIFY_S)
+				n++;
+		}
+	}
+
+	return max(n, 1);
+}
+
+/* Closes the current sample of the resync telemetry once it is a second old.
+ * Called by the SyncTarget when it plans resync requests, and by either side
+ * when it checks whether to throttle.  A gap of more than two seconds (no
+ * resync) starts over without a sample. */
+void drbd_rs_telemetry_tick(struct drbd_peer_device *peer_device)
+{
+	struct drbd_rs_telemetry *t = &peer_device->rs_tele;
+	unsigned long now = jiffies, start = READ_ONCE(t->start_jif);
+	struct drbd_rs_sample *sample;
+	unsigned int app_sect, throttled;
+	struct drbd_io_cnt io_cnt;
+	u64 in_sect;
+
+	if (start && time_before(now, start + HZ))
+		return;
+	if (!spin_trylock(&t->lock))
+		return;
+	if (t->start_jif != start) {
+		spin_unlock(&t->lock);
+		return;
+	}
+
+	io_cnt = drbd_device_io_cnt(peer_device->device);
+	app_sect = io_cnt.read_cnt + io_cnt.writ_cnt;
+	in_sect = READ_ONCE(t->in_sect);
+	throttled = atomic_read(&t->throttled);
+
+	if (start && time_before(now, start + 2 * HZ)) {
+		sample = &t->samples[t->pos];
+		sample->jif = now;
+		sample->ms = jiffies_to_msecs(now - start);
+		sample->in_kib = (in_sect - t->start_in_sect) >> 1;
+		sample->in_flight_kib = max(READ_ONCE(peer_device->rs_in_flight), 0) >> 1;
+		sample->want_kib_s = READ_ONCE(peer_device->c_sync_rate);
+		sample->throttled = throttled - t->start_throttled;
+		sample->app_kib = (app_sect - t->start_app_sect) >> 1;
+		t->pos = (t->pos + 1) % DRBD_RS_SAMPLES;
+		if (t->nr < DRBD_RS_SAMPLES)
+			t->nr++;
+	}
+
+	t->start_in_sect = in_sect;
+	t->start_throttled = throttled;
+	t->start_app_sect = app_sect;
+	WRITE_ONCE(t->start_jif, now ?: 1);
+	spin_unlock(&t->lock);
+}
+
 static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 {
 	struct net_conf *nc;
 	ktime_t duration, now;
 	unsigned int sect_in;  /* Number of sectors that came in since the last turn */
+	unsigned int budget;
 	int number, mxb;
 
 	sect_in = atomic_xchg(&peer_device->rs_sect_in, 0);
 	peer_device->rs_in_flight -= sect_in;
+	WRITE_ONCE(peer_device->rs_tele.in_sect, peer_device->rs_tele.in_sect + sect_in);
+	drbd_rs_telemetry_tick(peer_device);
 
 	now = ktime_get();
 	duration = ktime_sub(now, peer_device->rs_last_mk_req_kt);
@@ -647,12 +921,28 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	nc = rcu_dereference(peer_device->connection->transport.net_conf);
 	mxb = nc ? nc->max_buffers : 0;
 	if (rcu_dereference(peer_device->rs_plan_s)->size) {
-		number = drbd_rs_controller(peer_device, sect_in, ktime_to_ns(duration)) >> (BM_BLOCK_SHIFT - 9);
+		if (READ_ONCE(drbd_resync_model_controller))
+			number = drbd_rs_model_controller(peer_device, sect_in, ktime_to_ns(duration));
+		else
+			number = drbd_rs_controller(peer_device, sect_in, ktime_to_ns(duration));
+		number >>= BM_BLOCK_SHIFT - 9;
 		peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / RS_MAKE_REQS_INTV;
 	} else {
 		peer_device->c_sync_rate = rcu_dereference(peer_device->conf)->resync_rate;
 		number = RS_MAKE_REQS_INTV * peer_device->c_sync_rate  / ((BM_BLOCK_SIZE / 1024) * HZ);
 	}
+	budget = READ_ONCE(drbd_resync_rate_budget);
+	if (budget) {
+		int share = budget / resync_requesters(peer_device->device->resource);
+
+		if (peer_device->c_sync_rate > share) {
+			u64 turn_ns = min_t(u64, ktime_to_ns(duration), RS_MAKE_REQS_INTV_NS);
+
+			peer_device->c_sync_rate = share;
+			number = RS_MAKE_REQS_INTV * share / ((BM_BLOCK_SIZE / 1024) * HZ);
+			number = div_u64((u64)number * turn_ns, RS_MAKE_REQS_INTV_NS);
+		}
+	}
 	rcu_read_unlock();
 
 	/* Don't have more than "max-buffers"/2 in-flight.
@@ -683,6 +973,47 @@ static int resync_delay(int number, int done)
 	return RS_MAKE_REQS_INTV;
 }
 
+/* Only run resync_work early if we are definitely making progress.
+ * Otherwise we might continually lock a resync extent even when all the
+ * requests are canceled. This can cause application IO to be blocked for
+ * an indefinitely long time. */
+static bool rs_making_progress(struct drbd_peer_device *peer_device)
+{
+	bool progress = true;
+
+	if (peer_device->repl_state[NOW] == L_SYNC_TARGET) {
+		mutex_lock(&peer_device->resync_next_bit_mutex);
+		progress = peer_device->resync_next_bit > peer_device->last_resync_next_bit;
+		mutex_unlock(&peer_device->resync_next_bit_mutex);
+	}
+	return progress;
+}
+
+/* The model based controller keeps what it wants in flight at any time
+ * and scales its limits to the length of a turn. So do not wait for the
+ * timer with half of it back already, refill.  Once per resync_timer tick
+ * at most, so there are no more than two turns per RS_MAKE_REQS_INTV, and
+ * the following replies of the tick return here right away. */
+void drbd_rs_half_in_flight_came_back(struct drbd_peer_device *peer_device)
+{
+	bool plan_ahead;
+
+	if (!READ_ONCE(drbd_resync_model_controller) ||
+	    test_bit(RS_REFILLED, &peer_device->flags))
+		return;
+	rcu_read_lock();
+	plan_ahead = rcu_dereference(peer_device->rs_plan_s)->size;
+	rcu_read_unlock();
+	if (!plan_ahead || test_and_set_bit(RS_REFILLED, &peer_device->flags))
+		return;
+	if (!rs_making_progress(peer_device))
+		return;
+
+	drbd_queue_work_if_unqueued(
+		&peer_device->connection->sender_work,
+		&peer_device->resync_work);
+}
+
 void drbd_rs_all_in_flight_came_back(struct drbd_peer_device *peer_device, int rs_sect_in)
 {
 	unsigned int max_bio_size_kb = DRBD_MAX_BIO_SIZE / 1024;
@@ -711,19 +1042,8 @@ void drbd_rs_all_in_flight_came_back(struct drbd_peer_device *peer_device, int r
 		interval = 0;
 	/* interval holds the ideal pace in which we should request max_bio_size */
 
-	if (peer_device->repl_state[NOW] == L_SYNC_TARGET) {
-		bool progress;
-		mutex_lock(&peer_device->resync_next_bit_mutex);
-		/* Only run resync_work early if we are definitely making
-		 * progress. Otherwise we might continually lock a resync
-		 * extent even when all the requests are canceled. This can
-		 * cause application IO to be blocked for an indefinitely long
-		 * time. */
-		progress = peer_device->resync_next_bit > peer_device->last_resync_next_bit;
-		mutex_unlock(&peer_device->resync_next_bit_mutex);
-		if (!progress)
-			return;
-	}
+	if (!rs_making_progress(peer_device))
+		return;
 
 	amount_kb = c_max_rate / (HZ / RS_MAKE_REQS_INTV);
 	kickstart = rs_kib_in < amount_kb / 2 && latency < RS_MAKE_REQS_INTV / 2;
@@ -807,13 +1127,22 @@ static bool adjacent(sector_t sector1, int size, sector_t sector2)
 	return sector1 + (size >> SECTOR_SHIFT) == sector2;
 }
 
+/* Were any of the bits first..last requested by a detour to a hot area? */
+static bool rs_hot_requested(struct drbd_peer_device *peer_device,
+			     unsigned long first, unsigned long last)
+{
+	return peer_device->rs_hot_start < peer_device->rs_hot_end &&
+		first < peer_device->rs_hot_end && last >= peer_device->rs_hot_start;
+}
+
 static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 {
 	int optimal_bits_alignment, optimal_bits_rate, discard_granularity = 0;
 	int max_bio_bits, number, rollback_i, i, err, optimal_bits, size = 0;
 	struct drbd_device *device = peer_device->device;
 	const sector_t capacity = get_capacity(device->vdisk);
-	unsigned long bit;
+	unsigned long bit, hot_bit, resume_bit = DRBD_END_OF_BITMAP;
+	unsigned int bridge_gap;
 	sector_t sector, prev_sector = 0;
 
 	if (unlikely(cancel))
@@ -843,6 +1172,8 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 		return 0;
 	}
 
+	bridge_gap = READ_ONCE(drbd_resync_bridge_gap);
+
 	if (peer_device->connection->agreed_features & DRBD_FF_THIN_RESYNC) {
 		rcu_read_lock();
 		discard_granularity = rcu_dereference(device->ldev->disk_conf)->rs_discard_granularity;
@@ -866,6 +1197,33 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 
 	peer_device->last_resync_next_bit = peer_device->resync_next_bit;
 
+	/* If an application read had to go to the peer for an out-of-sync
+	 * block ahead of us, resync that area in this turn, so the working
+	 * set becomes locally readable early.  Then continue the scan where
+	 * it was.  The requested area is remembered in rs_hot_start/rs_hot_end
+	 * and skipped when the scan gets there.  While an earlier area is still
+	 * ahead of the scan, a detour may only extend it. */
+	hot_bit = xchg(&peer_device->rs_hot_bit, DRBD_END_OF_BITMAP);
+	if (hot_bit != DRBD_END_OF_BITMAP && hot_bit > peer_device->resync_next_bit) {
+		unsigned long hot_start = max(peer_device->resync_next_bit,
+					      hot_bit & ~((unsigned long)max_bio_bits - 1));
+
+		if (peer_device->rs_hot_end <= peer_device->resync_next_bit) {
+			peer_device->rs_hot_start = hot_start;
+			peer_device->rs_hot_end = hot_start;
+		} else if (hot_start <= peer_device->rs_hot_end &&
+			   hot_bit >= peer_device->rs_hot_end) {
+			hot_start = peer_device->rs_hot_end;
+		} else {
+			hot_start = DRBD_END_OF_BITMAP;
+		}
+
+		if (hot_start != DRBD_END_OF_BITMAP) {
+			resume_bit = peer_device->resync_next_bit;
+			peer_device->resync_next_bit = hot_start;
+		}
+	}
+
 	for (i = 0; i < number; i++) {
 		if ((number - i) << BM_BLOCK_SHIFT < discard_granularity)
 			goto request_done;
@@ -880,6 +1238,12 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 				goto request_done;
 			}
 
+			if (rs_hot_requested(peer_device, bit, bit)) {
+				/* requested by an earlier detour, see above */
+				peer_device->resync_next_bit = peer_device->rs_hot_end;
+				continue;
+			}
+
 			sector = BM_BIT_TO_SECT(bit);
 			err = drbd_try_rs_begin_io(peer_device, sector, true);
 			if (err) {
@@ -917,8 +1281,30 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 			if (discard_granularity && size == discard_granularity)
 				break;
 
-			if (drbd_bm_test_bit(peer_device, bit + 1) != 1)
+			if (rs_hot_requested(peer_device, bit + 1, bit + 1))
 				break;
+
+			if (drbd_bm_test_bit(peer_device, bit + 1) != 1) {
+				/* Re-transferring a few in-sync blocks is cheaper
+				 * than another request.  They count against the
+				 * rate, as their data is transferred as well. */
+				unsigned long next, gap;
+
+				if (!bridge_gap || discard_granularity)
+					break;
+				next = drbd_bm_find_next(peer_device, bit + 1);
+				if (next == DRBD_END_OF_BITMAP)
+					break;
+				gap = next - bit - 1;
+				if (gap > bridge_gap || gap > optimal_bits)
+					break;
+				if (rs_hot_requested(peer_device, bit + 1, next))
+					break;
+				size += gap * BM_BLOCK_SIZE;
+				bit += gap;
+				i += gap;
+				optimal_bits -= gap;
+			}
 			size += BM_BLOCK_SIZE;
 			bit++;
 			i++;
@@ -934,6 +1320,8 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 		if (peer_device->use_csums) {
 			switch (read_for_csum(peer_device, sector, size)) {
 			case -EIO: /* Disk failure */
+				if (resume_bit != DRBD_END_OF_BITMAP)
+					peer_device->resync_next_bit = resume_bit;
 				put_ldev(device);
 				return -EIO;
 			case -EAGAIN: /* allocation failed, or ldev busy */
@@ -957,9 +1345,12 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 			if (err) {
 				drbd_err(device, "drbd_send_drequest() failed, aborting...\n");
 				dec_rs_pending(peer_device);
+				if (resume_bit != DRBD_END_OF_BITMAP)
+					peer_device->resync_next_bit = resume_bit;
 				put_ldev(device);
 				return err;
 			}
+			rs_rtt_probe_start(peer_device, sector);
 		}
 	}
 
@@ -967,6 +1358,11 @@ request_done:
 	/* ... but do a correction, in case we had to break/goto request_done; */
 	peer_device->rs_in_flight -= (number - i) * BM_SECT_PER_BIT;
 
+	if (resume_bit != DRBD_END_OF_BITMAP) {
+		peer_device->rs_hot_end = peer_device->resync_next_bit;
+		peer_device->resync_next_bit = resume_bit;
+	}
+
 	if (peer_device->resync_next_bit >= drbd_bm_bits(device)) {
 		/* last syncer _request_ was sent,
 		 * but the P_RS_DATA_REPLY not yet received.  sync will end (and
@@ -990,6 +1386,16 @@ request_done:
 	return 0;
 }
 
+/* Let online verify run as a background scrub that yields to applications */
+static bool verify_should_yield(struct drbd_device *device)
+{
+	unsigned int threshold = READ_ONCE(drbd_verify_busy_threshold);
+
+	return threshold &&
+		atomic_read(&device->ap_bio_cnt[READ]) +
+		atomic_read(&device->ap_bio_cnt[WRITE]) >= threshold;
+}
+
 static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 {
 	struct drbd_device *device = peer_device->device;
@@ -1001,6 +1407,11 @@ static int make_ov_request(struct drbd_peer_device *peer_device, int cancel)
 	if (unlikely(cancel))
 		return 1;
 
+	if (verify_should_yield(device)) {
+		mod_timer(&peer_device->resync_timer, jiffies + RS_MAKE_REQS_INTV);
+		return 1;
+	}
+
 	number = drbd_rs_number_requests(peer_device);
 	sector = peer_device->ov_position;
 
@@ -1514,24 +1925,23 @@ int w_e_end_data_req(struct drbd_work *w, int cancel)
 	return err;
 }
 
-static bool all_zero(struct drbd_peer_request *peer_req)
+/* memchr_inv() compares a word at a time, and uses the architecture's
+ * optimized implementation where there is one. */
+bool drbd_peer_req_all_zero(struct drbd_peer_request *peer_req)
 {
 	struct page *page = peer_req->page_chain.head;
 	unsigned int len = peer_req->i.size;
 
 	page_chain_for_each(page) {
 		unsigned int l = min_t(unsigned int, len, PAGE_SIZE);
-		unsigned int i, words = l / sizeof(long);
-		unsigned long *d;
+		void *d;
+		bool zero;
 
 		d = kmap_atomic(page);
-		for (i = 0; i < words; i++) {
-			if (d[i]) {
-				kunmap_atomic(d);
-				return false;
-			}
-		}
+		zero = !memchr_inv(d, 0, l);
 		kunmap_atomic(d);
+		if (!zero)
+			return false;
 		len -= l;
 	}
 
@@ -1581,7 +1991,7 @@ static int drbd_rs_reply(struct drbd_peer_device *peer_device, struct drbd_peer_
 		 * But needed to be properly balanced with
 		 * the atomic_sub() in got_BlockAck. */
 		atomic_add(peer_req->i.size >> 9, &connection->rs_in_flight);
-		if (peer_req->flags & EE_RS_THIN_REQ && all_zero(peer_req)) {
+		if (peer_req->flags & EE_RS_THIN_REQ && drbd_peer_req_all_zero(peer_req)) {
 			err = drbd_send_rs_deallocated(peer_device, peer_req);
 		} else {
 			err = drbd_send_block(peer_device, P_RS_DATA_REPLY, peer_req);
@@ -1609,6 +2019,9 @@ int w_e_end_rsdata_req(struct drbd_work *w, int cancel)
 	struct drbd_device *device = peer_device->device;
 	int err;
 
+	/* before drbd_rs_complete_io() lets writes in again */
+	drbd_rs_share_read_done(peer_req);
+
 	if (get_ldev(device)) {
 		drbd_rs_complete_io(peer_device, peer_req->i.sector);
 		put_ldev(device);
@@ -2044,6 +2457,9 @@ void drbd_rs_controller_reset(struct drbd_peer_device *peer_device)
 	atomic_set(&peer_device->device->rs_sect_ev, 0);  /* FIXME: ??? */
 	peer_device->rs_last_mk_req_kt = ktime_get();
 	peer_device->rs_in_flight = 0;
+	peer_device->rs_bw_est = 0;
+	peer_device->rs_min_rtt_ns = 0;
+	peer_device->rs_rtt_probe_kt = 0;
 	peer_device->rs_last_events = (int)part_stat_read_accum(disk->part0, sectors);
 
 	/* Updating the RCU protected object in place is necessary since
@@ -2474,10 +2890,22 @@ static void make_new_current_uuid(struct drbd_device *device)
 	wake_up(&device->misc_wait);
 }
 
+/* With the sparse_bitmap module parameter, setting bits may need a new bitmap
+ * page, allocated with GFP_ATOMIC.  Catch up from process context. */
+static void bm_alloc_failed(struct drbd_device *device)
+{
+	if (get_ldev(device)) {
+		drbd_bm_alloc_failed(device);
+		put_ldev(device);
+	}
+}
+
 static void do_device_work(struct drbd_device *device, const unsigned long todo)
 {
 	if (test_bit(MD_SYNC, &todo))
 		do_md_sync(device);
+	if (test_bit(BM_ALLOC_FAILED, &todo))
+		bm_alloc_failed(device);
 	if (test_bit(GO_DISKLESS, &todo))
 		go_diskless(device);
 	if (test_bit(MAKE_NEW_CUR_UUID, &todo))
@@ -2503,6 +2931,7 @@ static void do_peer_device_work(struct drbd_peer_device *peer_device, const unsi
 #define DRBD_DEVICE_WORK_MASK	\
 	((1UL << GO_DISKLESS)	\
 	|(1UL << MD_SYNC)	\
+	|(1UL << BM_ALLOC_FAILED)\
 	|(1UL << MAKE_NEW_CUR_UUID)\
 	)
 
@@ -2582,20 +3011,39 @@ static void do_unqueued_resource_work(struct drbd_resource *resource)
 		try_become_up_to_date(resource);
 }
 
+/* Moves all queued work to work_list, in the order it was queued. */
 static bool dequeue_work_batch(struct drbd_work_queue *queue, struct list_head *work_list)
 {
-	spin_lock_irq(&queue->q_lock);
-	list_splice_tail_init(&queue->q, work_list);
-	spin_unlock_irq(&queue->q_lock);
+	struct llist_node *first = llist_reverse_order(llist_del_all(&queue->q));
+	struct drbd_work *w, *tmp;
+
+	llist_for_each_entry_safe(w, tmp, first, node)
+		list_add_tail(&w->list, work_list);
 	return !list_empty(work_list);
 }
 
+/*
+ * Everything queued for this peer is at or after req_not_net_done, which is
+ * set as soon as a request gets RQ_NET_QUEUED.  Start there instead of at
+ * the head of the transfer log, which may be long because some other, slower
+ * peer still holds on to older requests.  Without such a request, walk only
+ * if something was submitted since we last looked, to keep
+ * send.seen_dagtag_sector up to date.
+ */
 static struct drbd_request *__next_request_for_connection(
 		struct drbd_connection *connection)
 {
-	struct drbd_request *req;
+	struct drbd_resource *resource = connection->resource;
+	struct drbd_request *req = READ_ONCE(connection->req_not_net_done);
 
-	list_for_each_entry_rcu(req, &connection->resource->transfer_log, tl_requests) {
+	if (!req) {
+		if (dagtag_newer_eq(connection->send.seen_dagtag_sector,
+				    READ_ONCE(resource->dagtag_sector)))
+			return NULL;
+		req = list_entry_rcu(resource->transfer_log.next, struct drbd_request, tl_requests);
+	}
+
+	list_for_each_entry_from_rcu(req, &resource->transfer_log, tl_requests) {
 		unsigned s = req->net_rq_state[connection->peer_node_id];
 		/* Found a request which is for this peer but not yet queued.
 		 * Do not skip past it. */
@@ -2649,10 +3097,7 @@ static bool check_sender_todo(struct drbd_connection *connection)
 	rcu_read_lock();
 	tl_next_request_for_connection(connection);
 
-	/* FIXME can we get rid of this additional lock? */
-	spin_lock_irq(&connection->sender_work.q_lock);
-	list_splice_tail_init(&connection->sender_work.q, &connection->todo.work_list);
-	spin_unlock_irq(&connection->sender_work.q_lock);
+	dequeue_work_batch(&connection->sender_work, &connection->todo.work_list);
 	rcu_read_unlock();
 
 	return connection->todo.req
@@ -2660,6 +3105,26 @@ static bool check_sender_todo(struct drbd_connection *connection)
 		|| !list_empty(&connection->todo.work_list);
 }
 
+/* Do we already know of more than one thing to send?  Only then corking
+ * pays off; a single request is better sent right away. */
+static bool sender_expects_more(struct drbd_connection *connection)
+{
+	struct drbd_request *req = connection->todo.req;
+	struct list_head *work_list = &connection->todo.work_list;
+	bool more;
+
+	if (!req)
+		return !list_empty(work_list) && !list_is_singular(work_list);
+	if (!list_empty(work_list))
+		return true;
+
+	rcu_read_lock();
+	more = list_next_or_null_rcu(&connection->resource->transfer_log,
+			&req->tl_requests, struct drbd_request, tl_requests) != NULL;
+	rcu_read_unlock();
+	return more;
+}
+
 static void wait_for_sender_todo(struct drbd_connection *connection)
 {
 	struct drbd_resource *resource = connection->resource;
@@ -2669,8 +3134,20 @@ static void wait_for_sender_todo(struct drbd_connection *connection)
 	bool got_something = 0;
 
 	got_something = check_sender_todo(connection);
-	if (got_something)
+	if (got_something) {
+		/* We did not cork when we woke up with a single request,
+		 * but more piled up meanwhile. */
+		if (!test_bit(CORKED + DATA_STREAM, &connection->flags) &&
+		    sender_expects_more(connection)) {
+			rcu_read_lock();
+			nc = rcu_dereference(connection->transport.net_conf);
+			cork = nc ? nc->tcp_cork : 0;
+			rcu_read_unlock();
+			if (cork)
+				drbd_cork(connection, DATA_STREAM);
+		}
 		return;
+	}
 
 	/* Still nothing to do?
 	 * Maybe we still need to close the current epoch,
@@ -2745,9 +3222,10 @@ static void wait_for_sender_todo(struct drbd_connection *connection)
 	cork = nc ? nc->tcp_cork : 0;
 	rcu_read_unlock();
 
-	if (cork)
-		drbd_cork(connection, DATA_STREAM);
-	else if (!uncork)
+	if (cork) {
+		if (sender_expects_more(connection))
+			drbd_cork(connection, DATA_STREAM);
+	} else if (!uncork)
 		drbd_uncork(connection, DATA_STREAM);
 }
 
@@ -2769,12 +3247,49 @@ static bool should_send_barrier(struct drbd_connection *connection, unsigned int
 		return false;
 	return connection->send.current_epoch_nr != epoch;
 }
+/* In Ahead mode, writes are only announced to the peer with P_OUT_OF_SYNC.
+ * Adjacent ranges of one volume are merged into one packet, up to
+ * DRBD_MAX_BIO_SIZE, which any peer accepts as P_OUT_OF_SYNC size.
+ * The pending range is sent before anything else the sender sends,
+ * and before the sender waits for more to do. */
+static int flush_out_of_sync(struct drbd_connection *connection)
+{
+	struct drbd_peer_device *peer_device = connection->todo.oos_peer_device;
+
+	if (!peer_device)
+		return 0;
+	connection->todo.oos_peer_device = NULL;
+	return drbd_send_out_of_sync(peer_device, peer_device->todo.oos_sector,
+				     peer_device->todo.oos_size);
+}
+
+static int queue_out_of_sync(struct drbd_peer_device *peer_device, sector_t sector, unsigned int size)
+{
+	struct drbd_connection *connection = peer_device->connection;
+	int err;
+
+	if (connection->todo.oos_peer_device == peer_device &&
+	    peer_device->todo.oos_sector + (peer_device->todo.oos_size >> 9) == sector &&
+	    peer_device->todo.oos_size + size <= DRBD_MAX_BIO_SIZE) {
+		peer_device->todo.oos_size += size;
+		return 0;
+	}
+
+	err = flush_out_of_sync(connection);
+	peer_device->todo.oos_sector = sector;
+	peer_device->todo.oos_size = size;
+	connection->todo.oos_peer_device = peer_device;
+	return err;
+}
+
 static void maybe_send_barrier(struct drbd_connection *connection, unsigned int epoch)
 {
 	/* re-init if first write on this connection */
 	if (should_send_barrier(connection, epoch)) {
-		if (connection->send.current_epoch_writes)
+		if (connection->send.current_epoch_writes) {
+			flush_out_of_sync(connection);
 			drbd_send_barrier(connection);
+		}
 		connection->send.current_epoch_nr = epoch;
 	}
 }
@@ -2840,6 +3355,7 @@ static int process_one_request(struct drbd_connection *connection)
 			u64 current_dagtag_sector =
 				req->dagtag_sector - (req->i.size >> 9);
 
+			flush_out_of_sync(connection);
 			re_init_if_first_write(connection, req->epoch);
 			maybe_send_barrier(connection, req->epoch);
 			if (current_dagtag_sector != connection->send.current_dagtag_sector)
@@ -2902,10 +3418,11 @@ static int process_one_request(struct drbd_connection *connection)
 			 */
 			if (drbd_set_out_of_sync(peer_device, req->i.sector, req->i.size) ||
 			    is_write_in_flight(peer_device, &req->i))
-				err = drbd_send_out_of_sync(peer_device, req->i.sector, req->i.size);
+				err = queue_out_of_sync(peer_device, req->i.sector, req->i.size);
 			what = OOS_HANDED_TO_NETWORK; /* Well, most of the time, anyways. */
 		}
 	} else {
+		flush_out_of_sync(connection);
 		maybe_send_barrier(connection, req->epoch);
 		err = drbd_send_drequest(peer_device, P_DATA_REQUEST,
 				req->i.sector, req->i.size, (unsigned long)req);
@@ -2927,6 +3444,11 @@ static int process_one_request(struct drbd_connection *connection)
 	return err;
 }
 
+/* Requests sent after each work item, before the next work item is done.
+ * Resync and verify replies are work items of up to 1MiB each; sending the
+ * requests first keeps application writes from queueing behind them. */
+#define SENDER_REQUESTS_PER_WORK 16
+
 static int process_sender_todo(struct drbd_connection *connection)
 {
 	struct drbd_work *w = NULL;
@@ -2935,7 +3457,8 @@ static int process_sender_todo(struct drbd_connection *connection)
 	 * or requests from the transfer log.
 	 *
 	 * Right now, work items do not require any strict ordering wrt. the
-	 * request stream, so lets just do simple interleaved processing.
+	 * request stream, so lets just do interleaved processing, with
+	 * requests taking precedence.
 	 *
 	 * Stop processing as soon as an error is encountered.
 	 */
@@ -2949,8 +3472,13 @@ static int process_sender_todo(struct drbd_connection *connection)
 	}
 
 	while (!list_empty(&connection->todo.work_list)) {
+		int n = 0;
 		int err;
 
+		err = flush_out_of_sync(connection);
+		if (err)
+			return err;
+
 		w = list_first_entry(&connection->todo.work_list, struct drbd_work, list);
 		list_del_init(&w->list);
 		update_sender_timing_details(connection, w->cb);
@@ -2962,12 +3490,12 @@ static int process_sender_todo(struct drbd_connection *connection)
 		 * add a dagtag member to struct drbd_work, and serialize based on that.
 		 * && !dagtag_newer(connection->todo.req->dagtag_sector, w->dagtag_sector))
 		 * to the following condition. */
-		if (connection->todo.req) {
+		while (connection->todo.req && n++ < SENDER_REQUESTS_PER_WORK) {
 			update_sender_timing_details(connection, process_one_request);
 			err = process_one_request(connection);
+			if (err)
+				return err;
 		}
-		if (err)
-			return err;
 	}
 
 	return 0;
@@ -2994,6 +3522,8 @@ int drbd_sender(struct drbd_thread *thi)
 
 		if (list_empty(&connection->todo.work_list) &&
 		    connection->todo.req == NULL) {
+			if (flush_out_of_sync(connection))
+				change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
 			update_sender_timing_details(connection, wait_for_sender_todo);
 			wait_for_sender_todo(connection);
 		}
@@ -3015,6 +3545,9 @@ int drbd_sender(struct drbd_thread *thi)
 			change_cstate(connection, C_NETWORK_FAILURE, CS_HARD);
 	}
 
+	/* a merged out-of-sync range is covered by our bitmap anyways */
+	connection->todo.oos_peer_device = NULL;
+
 	/* cleanup all currently unprocessed requests */
 	if (!connection->todo.req) {
 		rcu_read_lock();
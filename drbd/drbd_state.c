@@ -280,7 +280,11 @@ static void count_objects(struct drbd_resource *resource,
 	}
 }
 
-static struct drbd_state_change *alloc_state_change(struct drbd_state_change_object_count *ocnt, gfp_t flags)
+/* Reuses the state change forgotten last, unless the number of objects
+ * changed since; see forget_state_change(). */
+static struct drbd_state_change *alloc_state_change(struct drbd_resource *resource,
+						    struct drbd_state_change_object_count *ocnt,
+						    gfp_t flags)
 {
 	struct drbd_state_change *state_change;
 	unsigned int size;
@@ -290,9 +294,18 @@ static struct drbd_state_change *alloc_state_change(struct drbd_state_change_obj
 	       ocnt->n_connections * sizeof(struct drbd_connection_state_change) +
 	       ocnt->n_devices * ocnt->n_connections * sizeof(struct drbd_peer_device_state_change) +
 	       ocnt->n_paths * sizeof(struct drbd_path_state);
-	state_change = kzalloc(size, flags);
-	if (!state_change)
-		return NULL;
+	state_change = xchg(&resource->spare_state_change, NULL);
+	if (state_change &&
+	    state_change->n_devices == ocnt->n_devices &&
+	    state_change->n_connections == ocnt->n_connections &&
+	    state_change->n_paths == ocnt->n_paths) {
+		memset(state_change, 0, size);
+	} else {
+		kfree(state_change);
+		state_change = kzalloc(size, flags);
+		if (!state_change)
+			return NULL;
+	}
 	state_change->n_connections = ocnt->n_connections;
 	state_change->n_devices = ocnt->n_devices;
 	state_change->n_paths = ocnt->n_paths;
@@ -319,7 +332,7 @@ struct drbd_state_change *remember_state_change(struct drbd_resource *resource,
 	lockdep_assert_held(&resource->state_rwlock);
 
 	count_objects(resource, &ocnt);
-	state_change = alloc_state_change(&ocnt, gfp);
+	state_change = alloc_state_change(resource, &ocnt, gfp);
 	if (!state_change)
 		return NULL;
 
@@ -466,15 +479,13 @@ void copy_old_to_new_state_change(struct drbd_state_change *state_change)
 
 void forget_state_change(struct drbd_state_change *state_change)
 {
+	struct drbd_resource *resource;
 	unsigned int n;
 
 	if (!state_change)
 		return;
 
-	if (state_change->resource->resource) {
-		kref_debug_put(&state_change->resource->resource->kref_debug, 5);
-		kref_put(&state_change->resource->resource->kref, drbd_destroy_resource);
-	}
+	resource = state_change->resource->resource;
 	for (n = 0; n < state_change->n_devices; n++) {
 		struct drbd_device *device = state_change->devices[n].device;
 
@@ -498,7 +509,15 @@ void forget_state_change(struct drbd_state_change *state_change)
 			kref_put(&path->kref, drbd_destroy_path);
 		}
 	}
-	kfree(state_change);
+	if (resource) {
+		/* Keep one for the next state change; our resource reference
+		 * guarantees that drbd_destroy_resource() sees it. */
+		kfree(xchg(&resource->spare_state_change, state_change));
+		kref_debug_put(&resource->kref_debug, 5);
+		kref_put(&resource->kref, drbd_destroy_resource);
+	} else {
+		kfree(state_change);
+	}
 }
 
 static bool state_has_changed(struct drbd_resource *resource)
@@ -1328,14 +1347,20 @@ static void __calc_quorum_with_disk(struct drbd_device *device, struct quorum_de
 	struct drbd_resource *resource = device->resource;
 	const u64 quorumless_nodes = device->have_quorum[NOW] ? ~resource->members : 0;
 	const int my_node_id = resource->res_opts.node_id;
+	struct drbd_peer_device *peer_devices[DRBD_NODE_ID_MAX] = {};
+	struct drbd_peer_device *peer_device;
 	int node_id;
 
 	check_wrongly_set_mdf_exists(device);
 
 	rcu_read_lock();
+	/* One pass over the peer devices, instead of a peer_device_by_node_id()
+	 * walk for each node id; this runs for every device in every state change. */
+	for_each_peer_device_rcu(peer_device, device)
+		peer_devices[peer_device->node_id] = peer_device;
+
 	for (node_id = 0; node_id < DRBD_NODE_ID_MAX; node_id++) {
 		struct drbd_peer_md *peer_md = &device->ldev->md.peers[node_id];
-		struct drbd_peer_device *peer_device;
 		enum drbd_disk_state disk_state;
 		enum drbd_repl_state repl_state;
 		bool is_intentional_diskless;
@@ -1359,7 +1384,7 @@ static void __calc_quorum_with_disk(struct drbd_device *device, struct quorum_de
 		if (!(peer_md->flags & (MDF_HAVE_BITMAP | MDF_NODE_EXISTS | MDF_PEER_DEVICE_SEEN)))
 			continue;
 
-		peer_device = peer_device_by_node_id(device, node_id);
+		peer_device = peer_devices[node_id];
 
 		if (peer_device) {
 			is_intentional_diskless = !want_bitmap(peer_device);
@@ -2455,6 +2480,9 @@ static void initialize_resync(struct drbd_peer_device *peer_device)
 
 	peer_device->resync_next_bit = 0;
 	peer_device->last_resync_next_bit = 0;
+	peer_device->rs_hot_bit = DRBD_END_OF_BITMAP;
+	peer_device->rs_hot_start = 0;
+	peer_device->rs_hot_end = 0;
 	peer_device->rs_failed = 0;
 	peer_device->rs_paused = 0;
 	peer_device->rs_same_csum = 0;
@@ -2641,6 +2669,8 @@ static void finish_state_change(struct drbd_resource *resource)
 				initialize_resync_progress_marks(peer_device);
 				peer_device->resync_next_bit = 0;
 				peer_device->last_resync_next_bit = 0;
+				peer_device->rs_hot_start = 0;
+				peer_device->rs_hot_end = 0;
 			}
 
 			if ((repl_state[OLD] == L_SYNC_TARGET  || repl_state[OLD] == L_SYNC_SOURCE) &&
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+   drbd_trace.h
+
+   This file is part of DRBD.
+
+   Tracepoints along the life of application requests, peer requests and
+   resync requests.  Enable them with e.g.
+     echo 1 > /sys/kernel/tracing/events/drbd/enable
+   and match begin and end of one request by its req or peer_req pointer.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM drbd
+
+#if !defined(_DRBD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DRBD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(drbd_request_class,
+	TP_PROTO(struct drbd_request *req),
+	TP_ARGS(req),
+	TP_STRUCT__entry(
+		__field(const void *, req)
+		__field(unsigned int, minor)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(unsigned int, local_rq_state)
+	),
+	TP_fast_assign(
+		__entry->req = req;
+		__entry->minor = req->device->minor;
+		__entry->sector = req->i.sector;
+		__entry->size = req->i.size;
+		__entry->local_rq_state = req->local_rq_state;
+	),
+	TP_printk("minor=%u req=%p sector=%llu size=%u rq_state=0x%x",
+		  __entry->minor, __entry->req, (unsigned long long)__entry->sector,
+		  __entry->size, __entry->local_rq_state)
+);
+
+DEFINE_EVENT(drbd_request_class, drbd_request_submit,
+	TP_PROTO(struct drbd_request *req), TP_ARGS(req));
+DEFINE_EVENT(drbd_request_class, drbd_request_complete,
+	TP_PROTO(struct drbd_request *req), TP_ARGS(req));
+
+TRACE_EVENT(drbd_send_dblock,
+	TP_PROTO(struct drbd_peer_device *peer_device, struct drbd_request *req),
+	TP_ARGS(peer_device, req),
+	TP_STRUCT__entry(
+		__field(const void *, req)
+		__field(unsigned int, minor)
+		__field(int, peer_node_id)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+	),
+	TP_fast_assign(
+		__entry->req = req;
+		__entry->minor = peer_device->device->minor;
+		__entry->peer_node_id = peer_device->node_id;
+		__entry->sector = req->i.sector;
+		__entry->size = req->i.size;
+	),
+	TP_printk("minor=%u peer=%d req=%p sector=%llu size=%u",
+		  __entry->minor, __entry->peer_node_id, __entry->req,
+		  (unsigned long long)__entry->sector, __entry->size)
+);
+
+TRACE_EVENT(drbd_request_ack,
+	TP_PROTO(struct drbd_peer_device *peer_device, int cmd, u64 block_id, sector_t sector),
+	TP_ARGS(peer_device, cmd, block_id, sector),
+	TP_STRUCT__entry(
+		__field(u64, block_id)
+		__field(unsigned int, minor)
+		__field(int, peer_node_id)
+		__field(int, cmd)
+		__field(sector_t, sector)
+	),
+	TP_fast_assign(
+		__entry->block_id = block_id;
+		__entry->minor = peer_device->device->minor;
+		__entry->peer_node_id = peer_device->node_id;
+		__entry->cmd = cmd;
+		__entry->sector = sector;
+	),
+	TP_printk("minor=%u peer=%d req=0x%llx sector=%llu cmd=%d",
+		  __entry->minor, __entry->peer_node_id,
+		  (unsigned long long)__entry->block_id,
+		  (unsigned long long)__entry->sector, __entry->cmd)
+);
+
+DECLARE_EVENT_CLASS(drbd_peer_request_class,
+	TP_PROTO(struct drbd_peer_request *peer_req),
+	TP_ARGS(peer_req),
+	TP_STRUCT__entry(
+		__field(const void *, peer_req)
+		__field(unsigned int, minor)
+		__field(int, peer_node_id)
+		__field(sector_t, sector)
+		__field(unsigned int, size)
+		__field(unsigned long, flags)
+	),
+	TP_fast_assign(
+		__entry->peer_req = peer_req;
+		__entry->minor = peer_req->peer_device->device->minor;
+		__entry->peer_node_id = peer_req->peer_device->node_id;
+		__entry->sector = peer_req->i.sector;
+		__entry->size = peer_req->i.size;
+		__entry->flags = peer_req->flags;
+	),
+	TP_printk("minor=%u peer=%d peer_req=%p sector=%llu size=%u flags=0x%lx",
+		  __entry->minor, __entry->peer_node_id, __entry->peer_req,
+		  (unsigned long long)__entry->sector, __entry->size, __entry->flags)
+);
+
+DEFINE_EVENT(drbd_peer_request_class, drbd_receive_data,
+	TP_PROTO(struct drbd_peer_request *peer_req), TP_ARGS(peer_req));
+DEFINE_EVENT(drbd_peer_request_class, drbd_receive_resync_data,
+	TP_PROTO(struct drbd_peer_request *peer_req), TP_ARGS(peer_req));
+DEFINE_EVENT(drbd_peer_request_class, drbd_submit_peer_request,
+	TP_PROTO(struct drbd_peer_request *peer_req), TP_ARGS(peer_req));
+
+TRACE_EVENT(drbd_resync_request,
+	TP_PROTO(struct drbd_peer_device *peer_device, int cmd, sector_t sector, int size),
+	TP_ARGS(peer_device, cmd, sector, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, peer_node_id)
+		__field(int, cmd)
+		__field(sector_t, sector)
+		__field(int, size)
+	),
+	TP_fast_assign(
+		__entry->minor = peer_device->device->minor;
+		__entry->peer_node_id = peer_device->node_id;
+		__entry->cmd = cmd;
+		__entry->sector = sector;
+		__entry->size = size;
+	),
+	TP_printk("minor=%u peer=%d sector=%llu size=%d cmd=%d",
+		  __entry->minor, __entry->peer_node_id,
+		  (unsigned long long)__entry->sector, __entry->size, __entry->cmd)
+);
+
+DECLARE_EVENT_CLASS(drbd_al_class,
+	TP_PROTO(struct drbd_device *device),
+	TP_ARGS(device),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, pending_changes)
+	),
+	TP_fast_assign(
+		__entry->minor = device->minor;
+		__entry->pending_changes = device->act_log->pending_changes;
+	),
+	TP_printk("minor=%u pending_changes=%u",
+		  __entry->minor, __entry->pending_changes)
+);
+
+DEFINE_EVENT(drbd_al_class, drbd_al_begin_commit,
+	TP_PROTO(struct drbd_device *device), TP_ARGS(device));
+DEFINE_EVENT(drbd_al_class, drbd_al_end_commit,
+	TP_PROTO(struct drbd_device *device), TP_ARGS(device));
+
+#endif /* _DRBD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE drbd_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,740 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+   drbd_transport_loopback.c
+
+   This file is part of DRBD.
+
+   Connects two DRBD connections on the same host through memory, without
+   a network stack in between. Meant for measuring DRBD itself: the
+   request pipeline, the activity log, acks and resync, at full speed and
+   without network noise. A latency and a bandwidth limit can be injected.
+
+   Two connections pair up if a path of the one has the my_addr and
+   peer_addr of a path of the other, swapped. The addresses are only
+   compared, nothing ever listens on them.
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include "drbd_transport.h"
+
+
+MODULE_DESCRIPTION("In-memory loopback transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+static unsigned int dtl_latency_us;
+module_param_named(latency_us, dtl_latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "One-way delay added to everything sent, in microseconds");
+
+static unsigned int dtl_bandwidth_kib;
+module_param_named(bandwidth_kib, dtl_bandwidth_kib, uint, 0644);
+MODULE_PARM_DESC(bandwidth_kib, "Bandwidth limit per stream and direction in KiB/s (0 = unlimited)");
+
+static unsigned int dtl_queue_kib = 4096;
+module_param_named(queue_kib, dtl_queue_kib, uint, 0644);
+MODULE_PARM_DESC(queue_kib, "Data queued per stream and direction before a sender blocks, in KiB");
+
+/* One unit as handed to send, copied */
+struct dtl_chunk {
+	struct list_head list;
+	ktime_t deliver_kt;	/* not visible to the receiver before */
+	unsigned int len;
+	unsigned int pos;	/* consumed by the receiver */
+	char data[];
+};
+
+/* One direction of one stream */
+struct dtl_stream {
+	spinlock_t lock;
+	wait_queue_head_t wait;	/* receiver for data, sender for space */
+	struct list_head chunks;
+	size_t queued;		/* bytes in chunks, not yet received */
+	ktime_t busy_until_kt;	/* bandwidth limit: end of the last chunk */
+	bool closed;
+};
+
+/* Shared by two connected transports; stream[side][stream] carries what
+ * the transport on that side sends. */
+struct dtl_pair {
+	struct kref kref;
+	struct dtl_stream stream[2][2];
+};
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+struct drbd_loopback_transport {
+	struct drbd_transport transport; /* Must be first! */
+	struct list_head waiting;	/* on dtl_waiting while connecting */
+	wait_queue_head_t connect_wait;
+	struct dtl_pair *pair;
+	struct drbd_path *path;		/* the path we got connected by */
+	int side;
+	long rcvtimeo[2];
+	struct buffer rbuf[2];
+	u64 bytes_sent[2];
+	u64 bytes_received[2];
+};
+
+/* Transports in dtl_connect() without a partner. Also protects the path
+ * lists against changes while dtl_connect() looks for a partner. */
+static DEFINE_MUTEX(dtl_lock);
+static LIST_HEAD(dtl_waiting);
+
+static int dtl_init(struct drbd_transport *transport);
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtl_connect(struct drbd_transport *transport);
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtl_net_conf_change(struct drbd_transport *transport, struct net_conf *new_net_conf);
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtl_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtl_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtl_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class loopback_transport_class = {
+	.name = "loopback",
+	.instance_size = sizeof(struct drbd_loopback_transport),
+	.path_instance_size = sizeof(struct drbd_path),
+	.listener_instance_size = sizeof(struct drbd_listener),
+	.module = THIS_MODULE,
+	.init = dtl_init,
+	.list = LIST_HEAD_INIT(loopback_transport_class.list),
+};
+
+static struct drbd_transport_ops dtl_ops = {
+	.free = dtl_free,
+	.connect = dtl_connect,
+	.recv = dtl_recv,
+	.recv_pages = dtl_recv_pages,
+	.stats = dtl_stats,
+	.net_conf_change = dtl_net_conf_change,
+	.set_rcvtimeo = dtl_set_rcvtimeo,
+	.get_rcvtimeo = dtl_get_rcvtimeo,
+	.send_page = dtl_send_page,
+	.send_zc_bio = dtl_send_zc_bio,
+	.stream_ok = dtl_stream_ok,
+	.hint = dtl_hint,
+	.debugfs_show = dtl_debugfs_show,
+	.add_path = dtl_add_path,
+	.remove_path = dtl_remove_path,
+};
+
+static struct dtl_stream *dtl_tx(struct drbd_loopback_transport *lo_transport, enum drbd_stream stream)
+{
+	return &lo_transport->pair->stream[lo_transport->side][stream];
+}
+
+static struct dtl_stream *dtl_rx(struct drbd_loopback_transport *lo_transport, enum drbd_stream stream)
+{
+	return &lo_transport->pair->stream[!lo_transport->side][stream];
+}
+
+static int dtl_init(struct drbd_transport *transport)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+	enum drbd_stream i;
+
+	INIT_LIST_HEAD(&lo_transport->waiting);
+	init_waitqueue_head(&lo_transport->connect_wait);
+	lo_transport->transport.ops = &dtl_ops;
+	lo_transport->transport.class = &loopback_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		lo_transport->rbuf[i].base = buffer;
+		lo_transport->rbuf[i].pos = buffer;
+		lo_transport->rcvtimeo[i] = MAX_SCHEDULE_TIMEOUT;
+	}
+
+	return 0;
+fail:
+	free_page((unsigned long)lo_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static struct dtl_pair *dtl_alloc_pair(void)
+{
+	struct dtl_pair *pair;
+	int side, stream;
+
+	pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+	if (!pair)
+		return NULL;
+
+	kref_init(&pair->kref);
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_stream *s = &pair->stream[side][stream];
+
+			spin_lock_init(&s->lock);
+			init_waitqueue_head(&s->wait);
+			INIT_LIST_HEAD(&s->chunks);
+		}
+	}
+	return pair;
+}
+
+static void dtl_destroy_pair(struct kref *kref)
+{
+	struct dtl_pair *pair = container_of(kref, struct dtl_pair, kref);
+	struct dtl_chunk *chunk, *tmp;
+	int side, stream;
+
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			list_for_each_entry_safe(chunk, tmp, &pair->stream[side][stream].chunks, list)
+				kfree(chunk);
+		}
+	}
+	kfree(pair);
+}
+
+/* Both directions of both streams; the peer then receives EOF */
+static void dtl_close_pair(struct dtl_pair *pair)
+{
+	int side, stream;
+
+	for (side = 0; side < 2; side++) {
+		for (stream = DATA_STREAM; stream <= CONTROL_STREAM; stream++) {
+			struct dtl_stream *s = &pair->stream[side][stream];
+
+			spin_lock(&s->lock);
+			s->closed = true;
+			spin_unlock(&s->lock);
+			wake_up(&s->wait);
+		}
+	}
+}
+
+static void dtl_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+	struct drbd_path *drbd_path, *tmp;
+	enum drbd_stream i;
+
+	/* mutexes are handled by caller */
+
+	if (lo_transport->pair) {
+		dtl_close_pair(lo_transport->pair);
+		kref_put(&lo_transport->pair->kref, dtl_destroy_pair);
+		lo_transport->pair = NULL;
+	}
+
+	mutex_lock(&dtl_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		bool was_established = drbd_path->established;
+		drbd_path->established = false;
+		if (free_op == DESTROY_TRANSPORT)
+			drbd_path_event(transport, drbd_path, true);
+		else if (was_established)
+			drbd_path_event(transport, drbd_path, false);
+	}
+	lo_transport->path = NULL;
+
+	if (free_op == DESTROY_TRANSPORT) {
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)lo_transport->rbuf[i].base);
+			lo_transport->rbuf[i].base = NULL;
+		}
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+	}
+	mutex_unlock(&dtl_lock);
+}
+
+static bool dtl_addr_equal(const struct sockaddr_storage *a1, int len1,
+			   const struct sockaddr_storage *a2, int len2)
+{
+	return len1 == len2 && !memcmp(a1, a2, len1);
+}
+
+/* Called with dtl_lock held */
+static struct drbd_path *dtl_find_peer_path(struct drbd_transport *transport,
+					    struct drbd_transport *other, struct drbd_path **ret_path)
+{
+	struct drbd_path *path, *other_path;
+
+	list_for_each_entry(path, &transport->paths, list) {
+		list_for_each_entry(other_path, &other->paths, list) {
+			if (dtl_addr_equal(&path->my_addr, path->my_addr_len,
+					   &other_path->peer_addr, other_path->peer_addr_len) &&
+			    dtl_addr_equal(&path->peer_addr, path->peer_addr_len,
+					   &other_path->my_addr, other_path->my_addr_len)) {
+				*ret_path = path;
+				return other_path;
+			}
+		}
+	}
+	return NULL;
+}
+
+static int dtl_connect(struct drbd_transport *transport)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+	struct drbd_loopback_transport *other;
+	struct drbd_path *path = NULL;
+	struct net_conf *nc;
+	int connect_int;
+	long timeo;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	mutex_lock(&dtl_lock);
+	if (list_empty(&transport->paths)) {
+		mutex_unlock(&dtl_lock);
+		return -EDESTADDRREQ;
+	}
+
+	list_for_each_entry(other, &dtl_waiting, waiting) {
+		struct drbd_path *other_path =
+			dtl_find_peer_path(transport, &other->transport, &path);
+		struct dtl_pair *pair;
+
+		if (!other_path)
+			continue;
+
+		pair = dtl_alloc_pair();
+		if (!pair) {
+			mutex_unlock(&dtl_lock);
+			return -ENOMEM;
+		}
+		kref_get(&pair->kref);
+		other->pair = pair;
+		other->side = 0;
+		other->path = other_path;
+		list_del_init(&other->waiting);
+		wake_up(&other->connect_wait);
+
+		lo_transport->pair = pair;
+		lo_transport->side = 1;
+		lo_transport->path = path;
+		/* As if the peer had accepted our control socket */
+		set_bit(RESOLVE_CONFLICTS, &transport->flags);
+		goto connected;
+	}
+
+	list_add_tail(&lo_transport->waiting, &dtl_waiting);
+	mutex_unlock(&dtl_lock);
+
+	timeo = connect_int * HZ;
+	while (!READ_ONCE(lo_transport->pair)) {
+		timeo = wait_event_interruptible_timeout(lo_transport->connect_wait,
+				READ_ONCE(lo_transport->pair), timeo);
+		if (timeo <= 0 || drbd_should_abort_listening(transport))
+			break;
+	}
+
+	mutex_lock(&dtl_lock);
+	if (!lo_transport->pair) {
+		list_del_init(&lo_transport->waiting);
+		mutex_unlock(&dtl_lock);
+		return -EAGAIN;
+	}
+	clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+
+connected:
+	lo_transport->path->established = true;
+	drbd_path_event(transport, lo_transport->path, false);
+	mutex_unlock(&dtl_lock);
+
+	return 0;
+}
+
+static bool dtl_rx_ready(struct dtl_stream *s)
+{
+	bool ready;
+
+	spin_lock(&s->lock);
+	ready = !list_empty(&s->chunks) || s->closed;
+	spin_unlock(&s->lock);
+	return ready;
+}
+
+/* Like sock_recvmsg() with MSG_WAITALL: returns less than size only on
+ * EOF, timeout, a signal or with MSG_DONTWAIT. */
+static int dtl_recv_copy(struct drbd_loopback_transport *lo_transport, enum drbd_stream stream,
+			 void *buf, size_t size, int flags)
+{
+	struct dtl_stream *s = dtl_rx(lo_transport, stream);
+	long timeo = flags & MSG_DONTWAIT ? 0 : lo_transport->rcvtimeo[stream];
+	size_t copied = 0;
+
+	while (copied < size) {
+		struct dtl_chunk *chunk, *done = NULL;
+		s64 delay_ns = 0;
+		bool closed;
+
+		spin_lock(&s->lock);
+		chunk = list_first_entry_or_null(&s->chunks, struct dtl_chunk, list);
+		if (chunk)
+			delay_ns = ktime_to_ns(ktime_sub(chunk->deliver_kt, ktime_get()));
+		if (chunk && delay_ns <= 0) {
+			size_t len = min_t(size_t, chunk->len - chunk->pos, size - copied);
+
+			memcpy(buf + copied, chunk->data + chunk->pos, len);
+			chunk->pos += len;
+			s->queued -= len;
+			copied += len;
+			if (chunk->pos == chunk->len) {
+				list_del(&chunk->list);
+				done = chunk;
+			}
+			spin_unlock(&s->lock);
+			kfree(done);
+			wake_up(&s->wait);
+			continue;
+		}
+		closed = s->closed;
+		spin_unlock(&s->lock);
+
+		if (closed || (copied && !timeo))
+			break;
+		if (!timeo)
+			return -EAGAIN;
+
+		if (chunk) {
+			/* Injected latency; does not count against rcvtimeo */
+			int err = wait_event_interruptible_hrtimeout(s->wait,
+					READ_ONCE(s->closed), ns_to_ktime(delay_ns));
+			if (err == -ERESTARTSYS)
+				goto interrupted;
+			continue;
+		}
+
+		timeo = wait_event_interruptible_timeout(s->wait, dtl_rx_ready(s), timeo);
+		if (timeo < 0)
+			goto interrupted;
+		if (timeo == 0)
+			return copied ?: -EAGAIN;
+	}
+	lo_transport->bytes_received[stream] += copied;
+	return copied;
+
+interrupted:
+	if (copied)
+		return copied;
+	return lo_transport->rcvtimeo[stream] == MAX_SCHEDULE_TIMEOUT ? -ERESTARTSYS : -EINTR;
+}
+
+static int dtl_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+	void *buffer;
+	int rv;
+
+	if (!lo_transport->pair)
+		return -ENOTCONN;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtl_recv_copy(lo_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == lo_transport->rbuf[stream].base);
+		buffer = lo_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtl_recv_copy(lo_transport, stream, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = lo_transport->rbuf[stream].base;
+
+		rv = dtl_recv_copy(lo_transport, stream, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		lo_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+static int dtl_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+	struct page *page;
+	int err;
+
+	if (!lo_transport->pair)
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = dtl_recv_copy(lo_transport, DATA_STREAM, data, len, 0);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err < 0)
+			goto fail;
+		size -= err;
+		if (err != len)
+			break;
+	}
+	if (unlikely(size)) {
+		tr_warn(transport, "Not enough data received; missing %lu bytes\n", size);
+		err = -ENODATA;
+		goto fail;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtl_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+	struct dtl_stream *tx, *rx;
+
+	if (!lo_transport->pair)
+		return;
+
+	tx = dtl_tx(lo_transport, DATA_STREAM);
+	rx = dtl_rx(lo_transport, DATA_STREAM);
+	stats->unread_received = READ_ONCE(rx->queued);
+	stats->unacked_send = READ_ONCE(tx->queued);
+	stats->send_buffer_size = READ_ONCE(dtl_queue_kib) << 10;
+	stats->send_buffer_used = READ_ONCE(tx->queued);
+}
+
+static void dtl_net_conf_change(struct drbd_transport *transport, struct net_conf *new_net_conf)
+{
+}
+
+static void dtl_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+
+	lo_transport->rcvtimeo[stream] = timeout;
+}
+
+static long dtl_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+
+	if (!lo_transport->pair)
+		return -ENOTCONN;
+
+	return lo_transport->rcvtimeo[stream];
+}
+
+static bool dtl_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+
+	return lo_transport->pair && !READ_ONCE(dtl_tx(lo_transport, stream)->closed);
+}
+
+static bool dtl_tx_space(struct dtl_stream *s, size_t size, size_t limit)
+{
+	bool ok;
+
+	spin_lock(&s->lock);
+	ok = s->queued + size <= limit || !s->queued || s->closed;
+	spin_unlock(&s->lock);
+	return ok;
+}
+
+/* Queue a copy of the data for the peer, blocking while too much is queued
+ * already, like a full socket send buffer.  NET_CONGESTED is set above 4/5
+ * of the limit, and stays set until the peer drained the queue to half of
+ * it, so drbd_should_do_remote() gets to see it. */
+static int dtl_send(struct drbd_loopback_transport *lo_transport, enum drbd_stream stream,
+		    struct page *page, int offset, size_t size)
+{
+	struct drbd_transport *transport = &lo_transport->transport;
+	struct dtl_stream *s = dtl_tx(lo_transport, stream);
+	size_t limit = (size_t)max(READ_ONCE(dtl_queue_kib), 1U) << 10;
+	unsigned int bandwidth_kib = READ_ONCE(dtl_bandwidth_kib);
+	struct dtl_chunk *chunk;
+	struct net_conf *nc;
+	ktime_t now, deliver_kt;
+	long timeout;
+	void *data;
+
+	chunk = kmalloc(struct_size(chunk, data, size), GFP_NOIO);
+	if (!chunk)
+		return -ENOMEM;
+	data = kmap_atomic(page);
+	memcpy(chunk->data, data + offset, size);
+	kunmap_atomic(data);
+	chunk->len = size;
+	chunk->pos = 0;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	timeout = nc ? nc->timeout * HZ / 10 : MAX_SCHEDULE_TIMEOUT;
+	rcu_read_unlock();
+
+	if (s->queued + size > limit / 5 * 4)
+		set_bit(NET_CONGESTED, &transport->flags);
+	while (!wait_event_timeout(s->wait, dtl_tx_space(s, size, limit), timeout)) {
+		if (drbd_stream_send_timed_out(transport, stream)) {
+			kfree(chunk);
+			return -EAGAIN;
+		}
+	}
+
+	spin_lock(&s->lock);
+	if (s->closed) {
+		spin_unlock(&s->lock);
+		kfree(chunk);
+		return -ECONNRESET;
+	}
+	now = ktime_get();
+	deliver_kt = ktime_add_us(now, READ_ONCE(dtl_latency_us));
+	if (bandwidth_kib) {
+		s->busy_until_kt = ktime_add_ns(ktime_after(s->busy_until_kt, now) ? s->busy_until_kt : now,
+						div_u64((u64)size * NSEC_PER_SEC, (u64)bandwidth_kib << 10));
+		if (ktime_after(s->busy_until_kt, deliver_kt))
+			deliver_kt = s->busy_until_kt;
+	}
+	chunk->deliver_kt = deliver_kt;
+	list_add_tail(&chunk->list, &s->chunks);
+	s->queued += size;
+	if (s->queued <= limit / 2)
+		clear_bit(NET_CONGESTED, &transport->flags);
+	spin_unlock(&s->lock);
+	wake_up(&s->wait);
+
+	lo_transport->bytes_sent[stream] += size;
+	return 0;
+}
+
+static int dtl_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+
+	if (!lo_transport->pair)
+		return -ENOTCONN;
+
+	return dtl_send(lo_transport, stream, page, offset, size);
+}
+
+static int dtl_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtl_send_page(transport, DATA_STREAM, bvec.bv_page,
+				    bvec.bv_offset, bvec.bv_len, 0);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static bool dtl_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+
+	/* Nothing is held back, so there is nothing to cork or push */
+	return lo_transport->pair != NULL;
+}
+
+static void dtl_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_loopback_transport *lo_transport =
+		container_of(transport, struct drbd_loopback_transport, transport);
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	if (!lo_transport->pair)
+		return;
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+		seq_printf(m, "sent: %llu Byte, queued: %zu Byte\n",
+			   lo_transport->bytes_sent[i], READ_ONCE(dtl_tx(lo_transport, i)->queued));
+		seq_printf(m, "received: %llu Byte, queued: %zu Byte\n",
+			   lo_transport->bytes_received[i], READ_ONCE(dtl_rx(lo_transport, i)->queued));
+	}
+}
+
+static int dtl_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	drbd_path->established = false;
+
+	mutex_lock(&dtl_lock);
+	list_add_tail(&drbd_path->list, &transport->paths);
+	mutex_unlock(&dtl_lock);
+
+	return 0;
+}
+
+static int dtl_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	if (drbd_path->established)
+		return -EBUSY;
+
+	mutex_lock(&dtl_lock);
+	list_del_init(&drbd_path->list);
+	mutex_unlock(&dtl_lock);
+
+	return 0;
+}
+
+static int __init dtl_initialize(void)
+{
+	return drbd_register_transport_class(&loopback_transport_class,
+					     DRBD_TRANSPORT_API_VERSION,
+					     sizeof(struct drbd_transport));
+}
+
+static void __exit dtl_cleanup(void)
+{
+	drbd_unregister_transport_class(&loopback_transport_class);
+}
+
+module_init(dtl_initialize)
+module_exit(dtl_cleanup)
@@ -0,0 +1,1622 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+   drbd_transport_rdma.c
+
+   This file is part of DRBD.
+
+   Copyright (C) 2014-2017, LINBIT HA-Solutions GmbH.
+
+
+*/
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/socket.h>
+#include <linux/sched/signal.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <rdma/ib_verbs.h>
+#include <rdma/rdma_cm.h>
+#include <linux/drbd_genl_api.h>
+#include <linux/drbd_config.h>
+#include "drbd_protocol.h"
+#include "drbd_transport.h"
+#include "drbd_wrappers.h"
+
+
+MODULE_AUTHOR("Philipp Reisner <philipp.reisner@linbit.com>");
+MODULE_AUTHOR("Lars Ellenberg <lars.ellenberg@linbit.com>");
+MODULE_AUTHOR("Roland Kammerer <roland.kammerer@linbit.com>");
+MODULE_DESCRIPTION("RDMA transport layer for DRBD");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(REL_VERSION);
+
+/* Each stream is a reliable connected queue pair. Both sides pre-post page
+ * sized receive buffers; every message fills exactly one of them. The number
+ * of buffers follows the configured rcvbuf-size/sndbuf-size. */
+#define DTR_MIN_RX_DESCS 32
+#define DTR_DEF_RX_DESCS 256
+#define DTR_MAX_RX_DESCS 4096
+#define DTR_MIN_TX_DESCS 32
+#define DTR_DEF_TX_DESCS 256
+#define DTR_MAX_TX_DESCS 4096
+
+/* A sender never uses the last receive credit of its peer for data, that one
+ * is reserved for returning credits. Otherwise both sides could end up
+ * waiting for each other with all credits sitting on the wire. */
+#define DTR_CREDIT_RESERVE 1
+
+#define DTR_CM_TIMEOUT_MS 2000
+
+/* Carried in the private data of the connect request and reply */
+#define DTR_MAGIC ((u32)0x44525244) /* "DRRD" */
+
+struct dtr_cm_private_data {
+	__be32 magic;
+	__be32 stream;
+	__be32 rx_descs;
+} __packed;
+
+enum dtr_cm_state {
+	DTR_CM_IDLE,
+	DTR_CM_ADDR_RESOLVED,
+	DTR_CM_ROUTE_RESOLVED,
+	DTR_CM_CONNECTED,
+	DTR_CM_DISCONNECTED,
+	DTR_CM_ERROR,
+};
+
+/* Stream flags */
+#define DTR_CREDIT_MSG_PENDING 0
+
+struct dtr_rx_desc {
+	struct list_head list;	/* on rx_ready while holding unread data */
+	struct page *page;
+	u64 dma_addr;
+	unsigned int size;	/* bytes received into page */
+	unsigned int pos;	/* bytes already consumed */
+};
+
+struct dtr_tx_desc {
+	struct list_head list;	/* on tx_pending until its completion */
+	struct page *page;
+	u64 dma_addr;
+	unsigned int size;
+};
+
+struct dtr_stream {
+	struct drbd_rdma_transport *rdma_transport;
+	enum drbd_stream nr;
+	struct rdma_cm_id *cm_id;
+	struct ib_pd *pd;
+	struct ib_cq *cq;
+	enum dtr_cm_state cm_state;
+	int cm_error;
+	wait_queue_head_t cm_wait;	/* woken on connection manager events */
+	unsigned long flags;
+
+	unsigned int rx_max;
+	struct dtr_rx_desc *rx_descs;
+	spinlock_t rx_lock;		/* protects rx_ready */
+	struct list_head rx_ready;
+	wait_queue_head_t recv_wait;
+	atomic_t rx_unreported;		/* reposted buffers not yet told to the peer */
+	long rcvtimeo;
+
+	unsigned int tx_max;
+	spinlock_t tx_lock;		/* protects tx_pending */
+	struct list_head tx_pending;
+	wait_queue_head_t send_wait;
+	atomic_t tx_in_flight;
+	atomic_t tx_bytes_in_flight;
+	atomic_t peer_rx_credits;
+	long sndtimeo;
+};
+
+struct buffer {
+	void *base;
+	void *pos;
+};
+
+struct drbd_rdma_transport {
+	struct drbd_transport transport; /* Must be first! */
+	spinlock_t paths_lock;
+	unsigned long flags;
+	struct dtr_stream stream[2];
+	struct buffer rbuf[2];
+};
+
+#define DTR_CONNECTING 1
+
+struct dtr_listener {
+	struct drbd_listener listener;
+	struct rdma_cm_id *cm_id;
+
+	wait_queue_head_t wait; /* woken if a connection request came in */
+};
+
+/* A connect request that arrived on a listener, waiting for dtr_connect()
+ * of the transport owning the path to pick it up. */
+struct dtr_accept {
+	struct list_head list;
+	struct rdma_cm_id *cm_id;
+	enum drbd_stream stream;
+	unsigned int peer_rx_descs;
+};
+
+struct dtr_path {
+	struct drbd_path path;
+
+	struct list_head accepts; /* connect requests, protected by listener->waiters_lock */
+};
+
+static int dtr_init(struct drbd_transport *transport);
+static void dtr_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op);
+static int dtr_connect(struct drbd_transport *transport);
+static int dtr_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags);
+static int dtr_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size);
+static void dtr_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats);
+static void dtr_net_conf_change(struct drbd_transport *transport, struct net_conf *new_net_conf);
+static void dtr_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout);
+static long dtr_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream);
+static int dtr_send_page(struct drbd_transport *transport, enum drbd_stream, struct page *page,
+		int offset, size_t size, unsigned msg_flags);
+static int dtr_send_zc_bio(struct drbd_transport *, struct bio *bio);
+static bool dtr_stream_ok(struct drbd_transport *transport, enum drbd_stream stream);
+static bool dtr_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
+static void dtr_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
+static int dtr_add_path(struct drbd_transport *, struct drbd_path *path);
+static int dtr_remove_path(struct drbd_transport *, struct drbd_path *);
+
+static struct drbd_transport_class rdma_transport_class = {
+	.name = "rdma",
+	.instance_size = sizeof(struct drbd_rdma_transport),
+	.path_instance_size = sizeof(struct dtr_path),
+	.listener_instance_size = sizeof(struct dtr_listener),
+	.module = THIS_MODULE,
+	.init = dtr_init,
+	.list = LIST_HEAD_INIT(rdma_transport_class.list),
+};
+
+static struct drbd_transport_ops dtr_ops = {
+	.free = dtr_free,
+	.connect = dtr_connect,
+	.recv = dtr_recv,
+	.recv_pages = dtr_recv_pages,
+	.stats = dtr_stats,
+	.net_conf_change = dtr_net_conf_change,
+	.set_rcvtimeo = dtr_set_rcvtimeo,
+	.get_rcvtimeo = dtr_get_rcvtimeo,
+	.send_page = dtr_send_page,
+	.send_zc_bio = dtr_send_zc_bio,
+	.stream_ok = dtr_stream_ok,
+	.hint = dtr_hint,
+	.debugfs_show = dtr_debugfs_show,
+	.add_path = dtr_add_path,
+	.remove_path = dtr_remove_path,
+};
+
+#define for_each_path_ref(path, transport)			\
+	for (path = __drbd_next_path_ref(NULL, transport);	\
+	     path;						\
+	     path = __drbd_next_path_ref(path, transport))
+
+/* This is save as long you use list_del_init() everytime something is removed
+   from the list. */
+static struct drbd_path *__drbd_next_path_ref(struct drbd_path *drbd_path,
+					      struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	spin_lock(&rdma_transport->paths_lock);
+	if (!drbd_path) {
+		drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+	} else {
+		bool in_list = !list_empty(&drbd_path->list);
+		kref_put(&drbd_path->kref, drbd_destroy_path);
+		if (in_list) {
+			/* Element still on the list, ref count can not drop to zero! */
+			if (list_is_last(&drbd_path->list, &transport->paths))
+				drbd_path = NULL;
+			else
+				drbd_path = list_next_entry(drbd_path, list);
+		} else {
+			/* No longer on the list, element might be freed already, restart from the start */
+			drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+		}
+	}
+	if (drbd_path)
+		kref_get(&drbd_path->kref);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	return drbd_path;
+}
+
+static int dtr_init(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+
+	spin_lock_init(&rdma_transport->paths_lock);
+	rdma_transport->transport.ops = &dtr_ops;
+	rdma_transport->transport.class = &rdma_transport_class;
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		struct dtr_stream *rs = &rdma_transport->stream[i];
+		void *buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		rdma_transport->rbuf[i].base = buffer;
+		rdma_transport->rbuf[i].pos = buffer;
+
+		rs->rdma_transport = rdma_transport;
+		rs->nr = i;
+		init_waitqueue_head(&rs->cm_wait);
+		spin_lock_init(&rs->rx_lock);
+		INIT_LIST_HEAD(&rs->rx_ready);
+		init_waitqueue_head(&rs->recv_wait);
+		spin_lock_init(&rs->tx_lock);
+		INIT_LIST_HEAD(&rs->tx_pending);
+		init_waitqueue_head(&rs->send_wait);
+		rs->rcvtimeo = MAX_SCHEDULE_TIMEOUT;
+		rs->sndtimeo = MAX_SCHEDULE_TIMEOUT;
+	}
+
+	return 0;
+fail:
+	free_page((unsigned long)rdma_transport->rbuf[0].base);
+	return -ENOMEM;
+}
+
+static bool dtr_stream_connected(struct dtr_stream *rs)
+{
+	return rs->cm_id && READ_ONCE(rs->cm_state) == DTR_CM_CONNECTED;
+}
+
+static void dtr_stream_failed(struct dtr_stream *rs, enum dtr_cm_state state, int err)
+{
+	if (rs->cm_state < state) {
+		rs->cm_error = err;
+		WRITE_ONCE(rs->cm_state, state);
+	}
+	wake_up_all(&rs->cm_wait);
+	wake_up_all(&rs->recv_wait);
+	wake_up_all(&rs->send_wait);
+}
+
+static bool dtr_take_credit(struct dtr_stream *rs, int reserve)
+{
+	int c;
+
+	do {
+		c = atomic_read(&rs->peer_rx_credits);
+		if (c <= reserve)
+			return false;
+	} while (atomic_cmpxchg(&rs->peer_rx_credits, c, c - 1) != c);
+
+	return true;
+}
+
+/* Returns the credits for reposted receive buffers to the peer in a message
+ * without payload, in case there was no data to piggyback them on. At most
+ * one of these is in flight, it does not need a tx_desc. */
+static void dtr_maybe_send_credits(struct dtr_stream *rs)
+{
+	const struct ib_send_wr *bad_wr;
+	struct ib_send_wr send_wr = {};
+	int credits, err;
+
+	if (!dtr_stream_connected(rs))
+		return;
+	if (atomic_read(&rs->rx_unreported) < rs->rx_max / 2)
+		return;
+	if (test_and_set_bit(DTR_CREDIT_MSG_PENDING, &rs->flags))
+		return;
+	if (!dtr_take_credit(rs, 0)) {
+		/* retried when the peer returns credits to us */
+		clear_bit(DTR_CREDIT_MSG_PENDING, &rs->flags);
+		return;
+	}
+
+	credits = atomic_xchg(&rs->rx_unreported, 0);
+	send_wr.wr_id = 0;
+	send_wr.opcode = IB_WR_SEND_WITH_IMM;
+	send_wr.ex.imm_data = cpu_to_be32(credits);
+	send_wr.send_flags = IB_SEND_SIGNALED;
+	send_wr.num_sge = 0;
+
+	atomic_inc(&rs->tx_in_flight);
+	err = ib_post_send(rs->cm_id->qp, &send_wr, &bad_wr);
+	if (err) {
+		atomic_dec(&rs->tx_in_flight);
+		atomic_add(credits, &rs->rx_unreported);
+		atomic_inc(&rs->peer_rx_credits);
+		clear_bit(DTR_CREDIT_MSG_PENDING, &rs->flags);
+	}
+}
+
+/* Send and receive queue share one CQ, and wc->opcode is undefined for
+ * completions with an error status (e.g. flushed on disconnect). So the
+ * kind of work request is encoded in the low bit of wr_id instead.
+ * Descriptors are at least 8 byte aligned. A wr_id of 0 is a credit-only
+ * send. */
+#define DTR_WR_ID_RX	1UL
+
+static int dtr_post_rx_desc(struct dtr_stream *rs, struct dtr_rx_desc *desc)
+{
+	struct ib_device *device = rs->cm_id->device;
+	const struct ib_recv_wr *bad_wr;
+	struct ib_recv_wr recv_wr;
+	struct ib_sge sge;
+
+	ib_dma_sync_single_for_device(device, desc->dma_addr, PAGE_SIZE, DMA_FROM_DEVICE);
+	desc->size = 0;
+	desc->pos = 0;
+
+	sge.addr = desc->dma_addr;
+	sge.length = PAGE_SIZE;
+	sge.lkey = rs->pd->local_dma_lkey;
+
+	recv_wr.next = NULL;
+	recv_wr.wr_id = (unsigned long)desc | DTR_WR_ID_RX;
+	recv_wr.sg_list = &sge;
+	recv_wr.num_sge = 1;
+
+	return ib_post_recv(rs->cm_id->qp, &recv_wr, &bad_wr);
+}
+
+static void dtr_repost_rx_desc(struct dtr_stream *rs, struct dtr_rx_desc *desc)
+{
+	if (!dtr_stream_connected(rs))
+		return;
+
+	if (dtr_post_rx_desc(rs, desc)) {
+		dtr_stream_failed(rs, DTR_CM_ERROR, -EIO);
+		return;
+	}
+	atomic_inc(&rs->rx_unreported);
+	dtr_maybe_send_credits(rs);
+}
+
+static void dtr_handle_wc(struct dtr_stream *rs, struct ib_wc *wc)
+{
+	struct drbd_transport *transport = &rs->rdma_transport->transport;
+	struct ib_device *device = rs->cm_id->device;
+	unsigned long irq_flags;
+
+	if (wc->wr_id & DTR_WR_ID_RX) {
+		struct dtr_rx_desc *desc =
+			(struct dtr_rx_desc *)(unsigned long)(wc->wr_id & ~DTR_WR_ID_RX);
+
+		if (wc->status != IB_WC_SUCCESS)
+			goto failed;
+
+		if (wc->wc_flags & IB_WC_WITH_IMM) {
+			atomic_add(be32_to_cpu(wc->ex.imm_data), &rs->peer_rx_credits);
+			wake_up(&rs->send_wait);
+			dtr_maybe_send_credits(rs);
+		}
+
+		if (wc->byte_len == 0) {
+			/* credits only */
+			dtr_repost_rx_desc(rs, desc);
+			return;
+		}
+
+		ib_dma_sync_single_for_cpu(device, desc->dma_addr, PAGE_SIZE, DMA_FROM_DEVICE);
+		desc->size = wc->byte_len;
+		desc->pos = 0;
+		spin_lock_irqsave(&rs->rx_lock, irq_flags);
+		list_add_tail(&desc->list, &rs->rx_ready);
+		spin_unlock_irqrestore(&rs->rx_lock, irq_flags);
+		wake_up(&rs->recv_wait);
+		return;
+	}
+
+	if (wc->wr_id) {
+		struct dtr_tx_desc *desc = (struct dtr_tx_desc *)(unsigned long)wc->wr_id;
+
+		spin_lock_irqsave(&rs->tx_lock, irq_flags);
+		list_del(&desc->list);
+		spin_unlock_irqrestore(&rs->tx_lock, irq_flags);
+
+		ib_dma_unmap_page(device, desc->dma_addr, desc->size, DMA_TO_DEVICE);
+		put_page(desc->page);
+		atomic_sub(desc->size, &rs->tx_bytes_in_flight);
+		kfree(desc);
+	} else {
+		clear_bit(DTR_CREDIT_MSG_PENDING, &rs->flags);
+	}
+	atomic_dec(&rs->tx_in_flight);
+	wake_up(&rs->send_wait);
+
+	if (wc->status != IB_WC_SUCCESS)
+		goto failed;
+
+	dtr_maybe_send_credits(rs);
+	return;
+
+failed:
+	if (wc->status != IB_WC_WR_FLUSH_ERR)
+		tr_err(transport, "%s stream: work completion error %d\n",
+		       rs->nr == DATA_STREAM ? "data" : "control", wc->status);
+	dtr_stream_failed(rs, DTR_CM_ERROR, -EIO);
+}
+
+static void dtr_cq_event(struct ib_cq *cq, void *ctx)
+{
+	struct dtr_stream *rs = ctx;
+	struct ib_wc wc;
+
+	do {
+		while (ib_poll_cq(cq, 1, &wc) == 1)
+			dtr_handle_wc(rs, &wc);
+	} while (ib_req_notify_cq(cq, IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS) > 0);
+}
+
+static void dtr_free_tx_pending(struct dtr_stream *rs)
+{
+	struct ib_device *device = rs->cm_id->device;
+	struct dtr_tx_desc *desc, *tmp;
+
+	/* The QP and CQ are gone, no completions can race with us */
+	list_for_each_entry_safe(desc, tmp, &rs->tx_pending, list) {
+		list_del(&desc->list);
+		ib_dma_unmap_page(device, desc->dma_addr, desc->size, DMA_TO_DEVICE);
+		put_page(desc->page);
+		kfree(desc);
+	}
+}
+
+static void dtr_free_rx_descs(struct dtr_stream *rs)
+{
+	struct ib_device *device = rs->cm_id->device;
+	unsigned int i;
+
+	if (!rs->rx_descs)
+		return;
+
+	for (i = 0; i < rs->rx_max; i++) {
+		struct dtr_rx_desc *desc = &rs->rx_descs[i];
+
+		if (!desc->page)
+			continue;
+		ib_dma_unmap_page(device, desc->dma_addr, PAGE_SIZE, DMA_FROM_DEVICE);
+		__free_page(desc->page);
+	}
+	kfree(rs->rx_descs);
+	rs->rx_descs = NULL;
+	INIT_LIST_HEAD(&rs->rx_ready);
+}
+
+static void dtr_free_stream(struct dtr_stream *rs)
+{
+	struct rdma_cm_id *cm_id = rs->cm_id;
+
+	if (!cm_id)
+		return;
+
+	if (rs->cm_state < DTR_CM_DISCONNECTED)
+		WRITE_ONCE(rs->cm_state, DTR_CM_DISCONNECTED);
+	wake_up_all(&rs->recv_wait);
+	wake_up_all(&rs->send_wait);
+
+	if (cm_id->qp) {
+		rdma_disconnect(cm_id);
+		/* The disconnect moves the QP into the error state, that
+		 * flushes all posted work requests through the CQ. */
+		wait_event_timeout(rs->send_wait, atomic_read(&rs->tx_in_flight) == 0, HZ);
+		rdma_destroy_qp(cm_id);
+	}
+	if (rs->cq) {
+		ib_destroy_cq(rs->cq);
+		rs->cq = NULL;
+	}
+	dtr_free_tx_pending(rs);
+	dtr_free_rx_descs(rs);
+	if (rs->pd) {
+		ib_dealloc_pd(rs->pd);
+		rs->pd = NULL;
+	}
+
+	rs->cm_id = NULL;
+	rdma_destroy_id(cm_id);
+
+	rs->cm_state = DTR_CM_IDLE;
+	rs->cm_error = 0;
+	rs->flags = 0;
+	atomic_set(&rs->rx_unreported, 0);
+	atomic_set(&rs->tx_in_flight, 0);
+	atomic_set(&rs->tx_bytes_in_flight, 0);
+	atomic_set(&rs->peer_rx_credits, 0);
+}
+
+static void dtr_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+	struct drbd_path *drbd_path;
+	/* free the RDMA specific stuff,
+	 * mutexes are handled by caller */
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+		dtr_free_stream(&rdma_transport->stream[i]);
+
+	for_each_path_ref(drbd_path, transport) {
+		bool was_established = drbd_path->established;
+		drbd_path->established = false;
+		if (free_op == DESTROY_TRANSPORT)
+			drbd_path_event(transport, drbd_path, true);
+		else if (was_established)
+			drbd_path_event(transport, drbd_path, false);
+	}
+
+	if (free_op == DESTROY_TRANSPORT) {
+		struct drbd_path *tmp;
+
+		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
+			free_page((unsigned long)rdma_transport->rbuf[i].base);
+			rdma_transport->rbuf[i].base = NULL;
+		}
+		spin_lock(&rdma_transport->paths_lock);
+		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
+			list_del_init(&drbd_path->list);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+		}
+		spin_unlock(&rdma_transport->paths_lock);
+	}
+}
+
+/* Wait for the next received buffer holding unread data. Returns 0 if one is
+ * there, -EAGAIN if none arrived in time, < 0 if the stream went down. */
+static int dtr_wait_rx_ready(struct dtr_stream *rs, int flags)
+{
+	long t;
+
+	if (!list_empty(&rs->rx_ready))
+		return 0;
+
+	if (!dtr_stream_connected(rs))
+		return rs->cm_state == DTR_CM_DISCONNECTED ? -ESHUTDOWN : -ECONNRESET;
+
+	if (flags & MSG_DONTWAIT)
+		return -EAGAIN;
+
+	t = wait_event_interruptible_timeout(rs->recv_wait,
+			!list_empty(&rs->rx_ready) || !dtr_stream_connected(rs),
+			rs->rcvtimeo);
+	if (t == 0)
+		return -EAGAIN;
+	if (t < 0)
+		return -EINTR;
+	if (list_empty(&rs->rx_ready))
+		return rs->cm_state == DTR_CM_DISCONNECTED ? -ESHUTDOWN : -ECONNRESET;
+
+	return 0;
+}
+
+/* Copies size bytes out of the received buffers, like
+ * kernel_recvmsg(MSG_WAITALL) does for the TCP transport. With MSG_DONTWAIT
+ * in flags it returns what is there without waiting. */
+static int dtr_recv_copy(struct dtr_stream *rs, void *buf, size_t size, int flags)
+{
+	size_t copied = 0;
+	int err = 0;
+
+	while (copied < size) {
+		struct dtr_rx_desc *desc;
+		unsigned long irq_flags;
+		size_t len;
+
+		err = dtr_wait_rx_ready(rs, flags);
+		if (err)
+			break;
+
+		/* Only the receiving thread of the stream removes entries */
+		desc = list_first_entry(&rs->rx_ready, struct dtr_rx_desc, list);
+		len = min_t(size_t, size - copied, desc->size - desc->pos);
+		memcpy(buf + copied, page_address(desc->page) + desc->pos, len);
+		desc->pos += len;
+		copied += len;
+
+		if (desc->pos == desc->size) {
+			spin_lock_irqsave(&rs->rx_lock, irq_flags);
+			list_del(&desc->list);
+			spin_unlock_irqrestore(&rs->rx_lock, irq_flags);
+			dtr_repost_rx_desc(rs, desc);
+		}
+	}
+
+	if (copied)
+		return copied;
+	if (err == -ESHUTDOWN)
+		return 0; /* orderly shutdown by the peer */
+	return err;
+}
+
+static int dtr_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *rs = &rdma_transport->stream[stream];
+	void *buffer;
+	int rv;
+
+	if (!rs->cm_id)
+		return -ENOTCONN;
+
+	if (flags & CALLER_BUFFER) {
+		buffer = *buf;
+		rv = dtr_recv_copy(rs, buffer, size, flags & ~CALLER_BUFFER);
+	} else if (flags & GROW_BUFFER) {
+		TR_ASSERT(transport, *buf == rdma_transport->rbuf[stream].base);
+		buffer = rdma_transport->rbuf[stream].pos;
+		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
+
+		rv = dtr_recv_copy(rs, buffer, size, flags & ~GROW_BUFFER);
+	} else {
+		buffer = rdma_transport->rbuf[stream].base;
+
+		rv = dtr_recv_copy(rs, buffer, size, flags);
+		if (rv > 0)
+			*buf = buffer;
+	}
+
+	if (rv > 0)
+		rdma_transport->rbuf[stream].pos = buffer + rv;
+
+	return rv;
+}
+
+static int dtr_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *rs = &rdma_transport->stream[DATA_STREAM];
+	struct page *page;
+	int err;
+
+	if (!rs->cm_id)
+		return -ENOTCONN;
+
+	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
+	page = chain->head;
+	if (!page)
+		return -ENOMEM;
+
+	page_chain_for_each(page) {
+		size_t len = min_t(int, size, PAGE_SIZE);
+		void *data = kmap(page);
+		err = dtr_recv_copy(rs, data, len, 0);
+		kunmap(page);
+		set_page_chain_offset(page, 0);
+		set_page_chain_size(page, len);
+		if (err < 0)
+			goto fail;
+		size -= err;
+	}
+	if (unlikely(size)) {
+		tr_warn(transport, "Not enough data received; missing %lu bytes\n", size);
+		err = -ENODATA;
+		goto fail;
+	}
+	return 0;
+fail:
+	drbd_free_page_chain(transport, chain, 0);
+	return err;
+}
+
+static void dtr_stats(struct drbd_transport *transport, struct drbd_transport_stats *stats)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *rs = &rdma_transport->stream[DATA_STREAM];
+	struct dtr_rx_desc *desc;
+	unsigned long irq_flags;
+
+	if (!rs->cm_id)
+		return;
+
+	stats->unread_received = 0;
+	spin_lock_irqsave(&rs->rx_lock, irq_flags);
+	list_for_each_entry(desc, &rs->rx_ready, list)
+		stats->unread_received += desc->size - desc->pos;
+	spin_unlock_irqrestore(&rs->rx_lock, irq_flags);
+
+	stats->unacked_send = atomic_read(&rs->tx_bytes_in_flight);
+	stats->send_buffer_size = rs->tx_max * PAGE_SIZE;
+	stats->send_buffer_used = atomic_read(&rs->tx_bytes_in_flight);
+}
+
+static unsigned int dtr_descs_for_bufsize(unsigned int bufsize, unsigned int def,
+					  unsigned int min, unsigned int max)
+{
+	if (!bufsize)
+		return def;
+	return clamp_t(unsigned int, bufsize / PAGE_SIZE, min, max);
+}
+
+static int dtr_create_qp(struct dtr_stream *rs, unsigned int rx_max, unsigned int tx_max)
+{
+	struct drbd_transport *transport = &rs->rdma_transport->transport;
+	struct ib_device *device = rs->cm_id->device;
+	const struct ib_device_attr *dev_attr = &device->attrs;
+	struct ib_cq_init_attr cq_attr = {};
+	struct ib_qp_init_attr qp_attr = {};
+	const char *what;
+	unsigned int i;
+	int err;
+
+	rs->rx_max = min_t(unsigned int, rx_max, dev_attr->max_qp_wr);
+	rs->tx_max = min_t(unsigned int, tx_max, dev_attr->max_qp_wr - 1);
+	if (MAX_SGE(*dev_attr) < 1 || rs->tx_max < DTR_MIN_TX_DESCS) {
+		what = "device limits";
+		err = -EINVAL;
+		goto out;
+	}
+
+	what = "ib_alloc_pd";
+	rs->pd = ib_alloc_pd(device, 0);
+	if (IS_ERR(rs->pd)) {
+		err = PTR_ERR(rs->pd);
+		rs->pd = NULL;
+		goto out;
+	}
+
+	what = "ib_create_cq";
+	cq_attr.cqe = rs->rx_max + rs->tx_max + 1;
+	rs->cq = ib_create_cq(device, dtr_cq_event, NULL, rs, &cq_attr);
+	if (IS_ERR(rs->cq)) {
+		err = PTR_ERR(rs->cq);
+		rs->cq = NULL;
+		goto out;
+	}
+
+	what = "rdma_create_qp";
+	qp_attr.qp_context = rs;
+	qp_attr.send_cq = rs->cq;
+	qp_attr.recv_cq = rs->cq;
+	qp_attr.cap.max_send_wr = rs->tx_max + 1; /* + 1 for the credit message */
+	qp_attr.cap.max_recv_wr = rs->rx_max;
+	qp_attr.cap.max_send_sge = 1;
+	qp_attr.cap.max_recv_sge = 1;
+	qp_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
+	qp_attr.qp_type = IB_QPT_RC;
+	err = rdma_create_qp(rs->cm_id, rs->pd, &qp_attr);
+	if (err)
+		goto out;
+
+	what = "rx buffers";
+	err = -ENOMEM;
+	rs->rx_descs = kcalloc(rs->rx_max, sizeof(struct dtr_rx_desc), GFP_KERNEL);
+	if (!rs->rx_descs)
+		goto out;
+
+	for (i = 0; i < rs->rx_max; i++) {
+		struct dtr_rx_desc *desc = &rs->rx_descs[i];
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		err = -ENOMEM;
+		if (!page)
+			goto out;
+		desc->dma_addr = ib_dma_map_page(device, page, 0, PAGE_SIZE, DMA_FROM_DEVICE);
+		if (ib_dma_mapping_error(device, desc->dma_addr)) {
+			__free_page(page);
+			goto out;
+		}
+		desc->page = page;
+
+		what = "ib_post_recv";
+		err = dtr_post_rx_desc(rs, desc);
+		if (err)
+			goto out;
+	}
+
+	ib_req_notify_cq(rs->cq, IB_CQ_NEXT_COMP);
+	return 0;
+out:
+	tr_err(transport, "%s failed, err = %d\n", what, err);
+	return err;
+}
+
+static void dtr_conn_param(struct dtr_stream *rs, struct rdma_conn_param *conn_param,
+			   struct dtr_cm_private_data *pd)
+{
+	pd->magic = cpu_to_be32(DTR_MAGIC);
+	pd->stream = cpu_to_be32(rs->nr);
+	pd->rx_descs = cpu_to_be32(rs->rx_max);
+
+	memset(conn_param, 0, sizeof(*conn_param));
+	conn_param->private_data = pd;
+	conn_param->private_data_len = sizeof(*pd);
+	conn_param->responder_resources = 1;
+	conn_param->initiator_depth = 1;
+	conn_param->retry_count = 7;
+	conn_param->rnr_retry_count = 7;
+}
+
+static bool dtr_private_data_ok(const void *data, u8 len)
+{
+	const struct dtr_cm_private_data *pd = data;
+
+	return pd && len >= sizeof(*pd) && pd->magic == cpu_to_be32(DTR_MAGIC);
+}
+
+static int dtr_cma_connect_request(struct rdma_cm_id *cm_id, struct rdma_cm_event *event)
+{
+	struct dtr_listener *listener = cm_id->context;
+	const struct dtr_cm_private_data *pd = event->param.conn.private_data;
+	struct drbd_path *drbd_path;
+	struct dtr_accept *accept;
+	enum drbd_stream stream;
+
+	/* the new cm_id inherited the context of the listening one */
+	cm_id->context = NULL;
+
+	if (!dtr_private_data_ok(pd, event->param.conn.private_data_len))
+		return -EINVAL;
+	stream = be32_to_cpu(pd->stream);
+	if (stream != DATA_STREAM && stream != CONTROL_STREAM)
+		return -EINVAL;
+
+	accept = kmalloc(sizeof(*accept), GFP_KERNEL);
+	if (!accept)
+		return -ENOMEM;
+	accept->cm_id = cm_id;
+	accept->stream = stream;
+	accept->peer_rx_descs = be32_to_cpu(pd->rx_descs);
+
+	spin_lock_bh(&listener->listener.waiters_lock);
+	drbd_path = drbd_find_path_by_addr(&listener->listener, &cm_id->route.addr.dst_addr);
+	if (drbd_path) {
+		struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+		list_add_tail(&accept->list, &path->accepts);
+	}
+	spin_unlock_bh(&listener->listener.waiters_lock);
+
+	if (!drbd_path) {
+		kfree(accept);
+		return -ECONNREFUSED; /* rdma_cm rejects and destroys cm_id */
+	}
+
+	wake_up(&listener->wait);
+	return 0;
+}
+
+static int dtr_cma_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event *event)
+{
+	struct dtr_stream *rs;
+
+	if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
+		return dtr_cma_connect_request(cm_id, event);
+
+	rs = cm_id->context;
+	if (!rs)
+		return 0; /* not yet picked up request, or the listener */
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		rs->cm_state = DTR_CM_ADDR_RESOLVED;
+		break;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		rs->cm_state = DTR_CM_ROUTE_RESOLVED;
+		break;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		if (dtr_private_data_ok(event->param.conn.private_data,
+					event->param.conn.private_data_len)) {
+			const struct dtr_cm_private_data *pd = event->param.conn.private_data;
+
+			atomic_set(&rs->peer_rx_credits, be32_to_cpu(pd->rx_descs));
+		} else if (!atomic_read(&rs->peer_rx_credits)) {
+			/* the peer posts at least that many */
+			atomic_set(&rs->peer_rx_credits, DTR_MIN_RX_DESCS);
+		}
+		WRITE_ONCE(rs->cm_state, DTR_CM_CONNECTED);
+		break;
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_TIMEWAIT_EXIT:
+		dtr_stream_failed(rs, DTR_CM_DISCONNECTED, -ECONNRESET);
+		return 0;
+	case RDMA_CM_EVENT_ADDR_ERROR:
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+		dtr_stream_failed(rs, DTR_CM_ERROR, -EADDRNOTAVAIL);
+		return 0;
+	case RDMA_CM_EVENT_REJECTED:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+	case RDMA_CM_EVENT_ADDR_CHANGE:
+		dtr_stream_failed(rs, DTR_CM_ERROR, -EAGAIN);
+		return 0;
+	default:
+		return 0;
+	}
+
+	wake_up_all(&rs->cm_wait);
+	return 0;
+}
+
+static int dtr_wait_cm_state(struct dtr_stream *rs, enum dtr_cm_state state, long timeout)
+{
+	long t;
+
+	t = wait_event_interruptible_timeout(rs->cm_wait,
+			rs->cm_state == state || rs->cm_state >= DTR_CM_DISCONNECTED,
+			timeout);
+	if (t < 0)
+		return -EAGAIN; /* drbd_should_abort_listening() decides */
+	if (rs->cm_state == state)
+		return 0;
+	if (rs->cm_state == DTR_CM_ERROR && rs->cm_error == -EADDRNOTAVAIL)
+		return -EADDRNOTAVAIL;
+
+	return -EAGAIN;
+}
+
+static bool dtr_path_cmp_addr(struct dtr_path *path)
+{
+	struct drbd_path *drbd_path = &path->path;
+	int addr_size;
+
+	addr_size = min(drbd_path->my_addr_len, drbd_path->peer_addr_len);
+	return memcmp(&drbd_path->my_addr, &drbd_path->peer_addr, addr_size) > 0;
+}
+
+static int dtr_try_connect(struct dtr_stream *rs, struct dtr_path *path,
+			   unsigned int rx_max, unsigned int tx_max, long timeout)
+{
+	struct dtr_cm_private_data pd;
+	struct rdma_conn_param conn_param;
+	struct sockaddr_storage my_addr, peer_addr;
+	struct rdma_cm_id *cm_id;
+	int err;
+
+	my_addr = path->path.my_addr;
+	if (my_addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&my_addr)->sin6_port = 0;
+	else
+		((struct sockaddr_in *)&my_addr)->sin_port = 0;
+	peer_addr = path->path.peer_addr;
+
+	cm_id = rdma_create_id(&init_net, dtr_cma_event_handler, rs, RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(cm_id))
+		return PTR_ERR(cm_id);
+	rs->cm_id = cm_id;
+	rs->cm_state = DTR_CM_IDLE;
+
+	err = rdma_resolve_addr(cm_id, (struct sockaddr *)&my_addr,
+				(struct sockaddr *)&peer_addr, DTR_CM_TIMEOUT_MS);
+	if (err)
+		return err == -EADDRNOTAVAIL ? err : -EAGAIN;
+	err = dtr_wait_cm_state(rs, DTR_CM_ADDR_RESOLVED, timeout);
+	if (err)
+		return err;
+
+	err = rdma_resolve_route(cm_id, DTR_CM_TIMEOUT_MS);
+	if (err)
+		return -EAGAIN;
+	err = dtr_wait_cm_state(rs, DTR_CM_ROUTE_RESOLVED, timeout);
+	if (err)
+		return err;
+
+	err = dtr_create_qp(rs, rx_max, tx_max);
+	if (err)
+		return err;
+
+	/* peer_rx_credits get set from the reply's private data */
+	dtr_conn_param(rs, &conn_param, &pd);
+	err = rdma_connect(cm_id, &conn_param);
+	if (err)
+		return -EAGAIN;
+
+	return dtr_wait_cm_state(rs, DTR_CM_CONNECTED, timeout);
+}
+
+static int dtr_accept(struct dtr_stream *rs, struct dtr_accept *accept,
+		      unsigned int rx_max, unsigned int tx_max, long timeout)
+{
+	struct dtr_cm_private_data pd;
+	struct rdma_conn_param conn_param;
+	int err;
+
+	rs->cm_id = accept->cm_id;
+	rs->cm_state = DTR_CM_IDLE;
+	accept->cm_id->context = rs;
+	atomic_set(&rs->peer_rx_credits, accept->peer_rx_descs);
+
+	err = dtr_create_qp(rs, rx_max, tx_max);
+	if (err)
+		return err;
+
+	dtr_conn_param(rs, &conn_param, &pd);
+	err = rdma_accept(rs->cm_id, &conn_param);
+	if (err)
+		return -EAGAIN;
+
+	return dtr_wait_cm_state(rs, DTR_CM_CONNECTED, timeout);
+}
+
+static struct dtr_accept *dtr_next_accept(struct dtr_path *path)
+{
+	struct drbd_listener *listener = path->path.listener;
+	struct dtr_accept *accept;
+
+	spin_lock_bh(&listener->waiters_lock);
+	accept = list_first_entry_or_null(&path->accepts, struct dtr_accept, list);
+	if (accept)
+		list_del(&accept->list);
+	spin_unlock_bh(&listener->waiters_lock);
+
+	return accept;
+}
+
+static void dtr_cleanup_accepts(struct dtr_path *path)
+{
+	struct dtr_accept *accept;
+
+	if (!path->path.listener)
+		return;
+
+	while ((accept = dtr_next_accept(path))) {
+		rdma_reject(accept->cm_id, NULL, 0);
+		rdma_destroy_id(accept->cm_id);
+		kfree(accept);
+	}
+}
+
+static int dtr_wait_for_accepts(struct drbd_rdma_transport *rdma_transport, struct dtr_path *path,
+				unsigned int rx_max, unsigned int tx_max, long timeout)
+{
+	struct drbd_transport *transport = &rdma_transport->transport;
+	struct dtr_listener *listener =
+		container_of(path->path.listener, struct dtr_listener, listener);
+	int err;
+
+	while (!dtr_stream_connected(&rdma_transport->stream[DATA_STREAM]) ||
+	       !dtr_stream_connected(&rdma_transport->stream[CONTROL_STREAM])) {
+		struct dtr_accept *accept;
+		struct dtr_stream *rs;
+		long t;
+
+		t = wait_event_interruptible_timeout(listener->wait,
+				!list_empty_careful(&path->accepts), timeout);
+		if (t <= 0)
+			return -EAGAIN;
+		timeout = t;
+
+		accept = dtr_next_accept(path);
+		if (!accept)
+			continue;
+
+		rs = &rdma_transport->stream[accept->stream];
+		if (rs->cm_id) {
+			/* the peer started over */
+			tr_warn(transport, "initial %s connection crossed\n",
+				accept->stream == DATA_STREAM ? "data" : "control");
+			dtr_free_stream(&rdma_transport->stream[DATA_STREAM]);
+			dtr_free_stream(&rdma_transport->stream[CONTROL_STREAM]);
+		}
+		err = dtr_accept(rs, accept, rx_max, tx_max, timeout);
+		kfree(accept);
+		if (err)
+			return err;
+
+		if (drbd_should_abort_listening(transport))
+			return -EAGAIN;
+	}
+
+	return 0;
+}
+
+static void dtr_destroy_listener(struct drbd_listener *generic_listener)
+{
+	struct dtr_listener *listener =
+		container_of(generic_listener, struct dtr_listener, listener);
+
+	rdma_destroy_id(listener->cm_id);
+	kfree(listener);
+}
+
+static int dtr_init_listener(struct drbd_transport *transport,
+			     const struct sockaddr *addr,
+			     struct net *net,
+			     struct drbd_listener *drbd_listener)
+{
+	struct dtr_listener *listener = container_of(drbd_listener, struct dtr_listener, listener);
+	struct sockaddr_storage my_addr;
+	struct rdma_cm_id *cm_id;
+	const char *what = "";
+	int err;
+
+	if (net != &init_net) {
+		tr_err(transport, "Network namespaces not supported\n");
+		return -EINVAL;
+	}
+
+	my_addr = *(struct sockaddr_storage *)addr;
+
+	cm_id = rdma_create_id(&init_net, dtr_cma_event_handler, listener, RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(cm_id)) {
+		err = PTR_ERR(cm_id);
+		cm_id = NULL;
+		what = "rdma_create_id";
+		goto out;
+	}
+
+	err = rdma_bind_addr(cm_id, (struct sockaddr *)&my_addr);
+	if (err) {
+		what = "rdma_bind_addr";
+		goto out;
+	}
+
+	err = rdma_listen(cm_id, DRBD_PEERS_MAX * 2);
+	if (err) {
+		what = "rdma_listen";
+		goto out;
+	}
+
+	listener->cm_id = cm_id;
+	listener->listener.listen_addr = my_addr;
+	listener->listener.destroy = dtr_destroy_listener;
+	init_waitqueue_head(&listener->wait);
+
+	return 0;
+out:
+	if (cm_id)
+		rdma_destroy_id(cm_id);
+
+	if (err < 0 &&
+	    err != -EAGAIN && err != -EINTR && err != -ERESTARTSYS && err != -EADDRINUSE &&
+	    err != -EADDRNOTAVAIL)
+		tr_err(transport, "%s failed, err = %d\n", what, err);
+
+	return err;
+}
+
+static void dtr_put_listeners(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct drbd_path *drbd_path;
+
+	spin_lock(&rdma_transport->paths_lock);
+	clear_bit(DTR_CONNECTING, &rdma_transport->flags);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	for_each_path_ref(drbd_path, transport) {
+		struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+		dtr_cleanup_accepts(path);
+		drbd_put_listener(drbd_path);
+	}
+}
+
+static struct dtr_path *dtr_next_path(struct drbd_rdma_transport *rdma_transport, struct dtr_path *path)
+{
+	struct drbd_transport *transport = &rdma_transport->transport;
+	struct drbd_path *drbd_path;
+
+	spin_lock(&rdma_transport->paths_lock);
+	if (list_is_last(&path->path.list, &transport->paths))
+		drbd_path = list_first_entry(&transport->paths, struct drbd_path, list);
+	else
+		drbd_path = list_next_entry(&path->path, list);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	return container_of(drbd_path, struct dtr_path, path);
+}
+
+/* The roles are fixed by the addresses of a path: the node with the "bigger"
+ * address connects both streams, the other one accepts them. */
+static int dtr_connect(struct drbd_transport *transport)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct drbd_path *drbd_path;
+	struct dtr_path *path;
+	struct net_conf *nc;
+	unsigned int rx_max, tx_max;
+	long connect_timeo, timeout;
+	int err;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	rx_max = dtr_descs_for_bufsize(nc->rcvbuf_size, DTR_DEF_RX_DESCS,
+				       DTR_MIN_RX_DESCS, DTR_MAX_RX_DESCS);
+	tx_max = dtr_descs_for_bufsize(nc->sndbuf_size, DTR_DEF_TX_DESCS,
+				       DTR_MIN_TX_DESCS, DTR_MAX_TX_DESCS);
+	connect_timeo = nc->connect_int * HZ;
+	timeout = nc->timeout * HZ / 10;
+	rcu_read_unlock();
+
+	spin_lock(&rdma_transport->paths_lock);
+	set_bit(DTR_CONNECTING, &rdma_transport->flags);
+
+	err = -EDESTADDRREQ;
+	if (list_empty(&transport->paths)) {
+		spin_unlock(&rdma_transport->paths_lock);
+		goto out;
+	}
+
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		if (!drbd_path->listener) {
+			kref_get(&drbd_path->kref);
+			spin_unlock(&rdma_transport->paths_lock);
+			err = drbd_get_listener(transport, drbd_path, dtr_init_listener);
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+			if (err)
+				goto out;
+			spin_lock(&rdma_transport->paths_lock);
+			drbd_path = list_first_entry_or_null(&transport->paths, struct drbd_path, list);
+			if (drbd_path)
+				continue;
+			else
+				break;
+		}
+	}
+
+	drbd_path = list_first_entry(&transport->paths, struct drbd_path, list);
+	path = container_of(drbd_path, struct dtr_path, path);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	for (;;) {
+		if (dtr_path_cmp_addr(path)) {
+			err = dtr_try_connect(&rdma_transport->stream[DATA_STREAM], path,
+					      rx_max, tx_max, connect_timeo);
+			if (!err)
+				err = dtr_try_connect(&rdma_transport->stream[CONTROL_STREAM], path,
+						      rx_max, tx_max, connect_timeo);
+			if (!err)
+				clear_bit(RESOLVE_CONFLICTS, &transport->flags);
+		} else {
+			long t = connect_timeo;
+
+			t += get_random_u32_below(2) ? t / 7 : -t / 7; /* 28.5% random jitter */
+			err = dtr_wait_for_accepts(rdma_transport, path, rx_max, tx_max, t);
+			if (!err)
+				set_bit(RESOLVE_CONFLICTS, &transport->flags);
+		}
+		if (!err)
+			break;
+
+		dtr_free_stream(&rdma_transport->stream[DATA_STREAM]);
+		dtr_free_stream(&rdma_transport->stream[CONTROL_STREAM]);
+		if (err != -EAGAIN)
+			goto out;
+
+		if (drbd_should_abort_listening(transport))
+			goto out_eagain;
+
+		/* peer not there yet, do not hammer it with connect requests */
+		if (dtr_path_cmp_addr(path))
+			schedule_timeout_interruptible(HZ);
+		path = dtr_next_path(rdma_transport, path);
+	}
+
+	rdma_transport->stream[DATA_STREAM].sndtimeo = timeout;
+	rdma_transport->stream[CONTROL_STREAM].sndtimeo = timeout;
+
+	path->path.established = true;
+	drbd_path_event(transport, &path->path, false);
+	dtr_put_listeners(transport);
+
+	return 0;
+
+out_eagain:
+	err = -EAGAIN;
+
+out:
+	dtr_put_listeners(transport);
+
+	return err;
+}
+
+static void dtr_net_conf_change(struct drbd_transport *transport, struct net_conf *new_net_conf)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+
+	/* The number of buffers is fixed while connected, changed buffer
+	 * sizes take effect with the next connect. */
+	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++)
+		rdma_transport->stream[i].sndtimeo = new_net_conf->timeout * HZ / 10;
+}
+
+static void dtr_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	rdma_transport->stream[stream].rcvtimeo = timeout;
+}
+
+static long dtr_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *rs = &rdma_transport->stream[stream];
+
+	if (!rs->cm_id)
+		return -ENOTCONN;
+
+	return rs->rcvtimeo;
+}
+
+static bool dtr_stream_ok(struct drbd_transport *transport, enum drbd_stream stream)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	return dtr_stream_connected(&rdma_transport->stream[stream]);
+}
+
+static bool dtr_send_possible(struct dtr_stream *rs)
+{
+	return !dtr_stream_connected(rs) ||
+		(atomic_read(&rs->tx_in_flight) < rs->tx_max &&
+		 atomic_read(&rs->peer_rx_credits) > DTR_CREDIT_RESERVE);
+}
+
+static int dtr_wait_for_send_credit(struct dtr_stream *rs, unsigned msg_flags)
+{
+	struct drbd_transport *transport = &rs->rdma_transport->transport;
+	long t;
+
+	for (;;) {
+		if (!dtr_stream_connected(rs))
+			return -ECONNRESET;
+		/* Senders of one stream are serialized by the caller's mutex,
+		 * only the credit message competes for credits here. */
+		if (atomic_read(&rs->tx_in_flight) < rs->tx_max &&
+		    dtr_take_credit(rs, DTR_CREDIT_RESERVE))
+			return 0;
+		if (msg_flags & MSG_DONTWAIT)
+			return -EAGAIN;
+
+		if (atomic_read(&rs->tx_in_flight) >= rs->tx_max * 4 / 5)
+			set_bit(NET_CONGESTED, &transport->flags);
+
+		t = wait_event_interruptible_timeout(rs->send_wait, dtr_send_possible(rs),
+						     rs->sndtimeo);
+		if (t == 0) {
+			if (drbd_stream_send_timed_out(transport, rs->nr))
+				return -EAGAIN;
+		} else if (t < 0) {
+			flush_signals(current);
+		}
+	}
+}
+
+static int dtr_post_send_page(struct dtr_stream *rs, struct page *page, int offset,
+			      size_t size)
+{
+	struct ib_device *device = rs->cm_id->device;
+	const struct ib_send_wr *bad_wr;
+	struct ib_send_wr send_wr = {};
+	struct dtr_tx_desc *desc;
+	unsigned long irq_flags;
+	struct ib_sge sge;
+	int err;
+
+	desc = kmalloc(sizeof(*desc), GFP_NOIO);
+	if (!desc)
+		return -ENOMEM;
+
+	desc->dma_addr = ib_dma_map_page(device, page, offset, size, DMA_TO_DEVICE);
+	if (ib_dma_mapping_error(device, desc->dma_addr)) {
+		kfree(desc);
+		return -ENOMEM;
+	}
+	/* The page has to stay until the send completed, as with sendpage() */
+	get_page(page);
+	desc->page = page;
+	desc->size = size;
+
+	sge.addr = desc->dma_addr;
+	sge.length = size;
+	sge.lkey = rs->pd->local_dma_lkey;
+
+	send_wr.wr_id = (unsigned long)desc;
+	send_wr.sg_list = &sge;
+	send_wr.num_sge = 1;
+	send_wr.opcode = IB_WR_SEND_WITH_IMM;
+	send_wr.ex.imm_data = cpu_to_be32(atomic_xchg(&rs->rx_unreported, 0));
+	send_wr.send_flags = IB_SEND_SIGNALED;
+
+	spin_lock_irqsave(&rs->tx_lock, irq_flags);
+	list_add_tail(&desc->list, &rs->tx_pending);
+	spin_unlock_irqrestore(&rs->tx_lock, irq_flags);
+	atomic_inc(&rs->tx_in_flight);
+	atomic_add(size, &rs->tx_bytes_in_flight);
+
+	err = ib_post_send(rs->cm_id->qp, &send_wr, &bad_wr);
+	if (err) {
+		atomic_add(be32_to_cpu(send_wr.ex.imm_data), &rs->rx_unreported);
+		atomic_sub(size, &rs->tx_bytes_in_flight);
+		atomic_dec(&rs->tx_in_flight);
+		spin_lock_irqsave(&rs->tx_lock, irq_flags);
+		list_del(&desc->list);
+		spin_unlock_irqrestore(&rs->tx_lock, irq_flags);
+		ib_dma_unmap_page(device, desc->dma_addr, size, DMA_TO_DEVICE);
+		put_page(page);
+		kfree(desc);
+	}
+
+	return err;
+}
+
+static int dtr_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_stream *rs = &rdma_transport->stream[stream];
+	int err = 0;
+
+	if (!rs->cm_id)
+		return -ENOTCONN;
+
+	/* Each message has to fit into one receive buffer of the peer */
+	while (size) {
+		size_t len = min_t(size_t, size, PAGE_SIZE);
+
+		err = dtr_wait_for_send_credit(rs, msg_flags);
+		if (err)
+			break;
+
+		err = dtr_post_send_page(rs, page, offset, len);
+		if (err) {
+			atomic_inc(&rs->peer_rx_credits);
+			tr_warn(transport, "%s: size=%d err=%d\n", __func__, (int)len, err);
+			break;
+		}
+		offset += len;
+		size -= len;
+	}
+	clear_bit(NET_CONGESTED, &transport->flags);
+
+	return err;
+}
+
+static int dtr_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		int err;
+
+		err = dtr_send_page(transport, DATA_STREAM, bvec.bv_page,
+				      bvec.bv_offset, bvec.bv_len,
+				      bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static bool dtr_hint(struct drbd_transport *transport, enum drbd_stream stream,
+		enum drbd_tr_hints hint)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+
+	if (!rdma_transport->stream[stream].cm_id)
+		return false;
+
+	/* Every send is posted immediately; there is nothing to cork,
+	 * and completion events are not delayed. */
+	return true;
+}
+
+static void dtr_debugfs_show_stream(struct seq_file *m, struct dtr_stream *rs)
+{
+	struct dtr_rx_desc *desc;
+	unsigned long irq_flags;
+	unsigned int unread = 0;
+
+	spin_lock_irqsave(&rs->rx_lock, irq_flags);
+	list_for_each_entry(desc, &rs->rx_ready, list)
+		unread += desc->size - desc->pos;
+	spin_unlock_irqrestore(&rs->rx_lock, irq_flags);
+
+	seq_printf(m, "unread receive buffer: %u Byte\n", unread);
+	seq_printf(m, "rx descriptors: %u, unreported credits: %d\n",
+		   rs->rx_max, atomic_read(&rs->rx_unreported));
+	seq_printf(m, "tx descriptors: %u, in flight: %d (%d Byte)\n",
+		   rs->tx_max, atomic_read(&rs->tx_in_flight),
+		   atomic_read(&rs->tx_bytes_in_flight));
+	seq_printf(m, "peer rx credits: %d\n", atomic_read(&rs->peer_rx_credits));
+}
+
+static void dtr_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	enum drbd_stream i;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		struct dtr_stream *rs = &rdma_transport->stream[i];
+
+		if (rs->cm_id) {
+			seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
+			dtr_debugfs_show_stream(m, rs);
+		}
+	}
+}
+
+static int dtr_add_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+	bool active;
+
+	drbd_path->established = false;
+	INIT_LIST_HEAD(&path->accepts);
+retry:
+	active = test_bit(DTR_CONNECTING, &rdma_transport->flags);
+	if (!active && drbd_path->listener)
+		drbd_put_listener(drbd_path);
+
+	if (active && !drbd_path->listener) {
+		int err = drbd_get_listener(transport, drbd_path, dtr_init_listener);
+		if (err)
+			return err;
+	}
+
+	spin_lock(&rdma_transport->paths_lock);
+	if (active != test_bit(DTR_CONNECTING, &rdma_transport->flags)) {
+		spin_unlock(&rdma_transport->paths_lock);
+		goto retry;
+	}
+	list_add_tail(&drbd_path->list, &transport->paths);
+	spin_unlock(&rdma_transport->paths_lock);
+
+	return 0;
+}
+
+static int dtr_remove_path(struct drbd_transport *transport, struct drbd_path *drbd_path)
+{
+	struct drbd_rdma_transport *rdma_transport =
+		container_of(transport, struct drbd_rdma_transport, transport);
+	struct dtr_path *path = container_of(drbd_path, struct dtr_path, path);
+
+	if (drbd_path->established)
+		return -EBUSY;
+
+	spin_lock(&rdma_transport->paths_lock);
+	list_del_init(&drbd_path->list);
+	spin_unlock(&rdma_transport->paths_lock);
+	dtr_cleanup_accepts(path);
+	drbd_put_listener(&path->path);
+
+	return 0;
+}
+
+static int __init dtr_initialize(void)
+{
+	return drbd_register_transport_class(&rdma_transport_class,
+					     DRBD_TRANSPORT_API_VERSION,
+					     sizeof(struct drbd_transport));
+}
+
+static void __exit dtr_cleanup(void)
+{
+	drbd_unregister_transport_class(&rdma_transport_class);
+}
+
+module_init(dtr_initialize)
+module_exit(dtr_cleanup)
@@ -17,6 +17,9 @@
 #include <linux/net.h>
 #include <linux/tcp.h>
 #include <linux/highmem.h>
+#include <linux/file.h>
+#include <net/handshake.h>
+#include <net/mptcp.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd_config.h>
 #include "drbd_protocol.h"
@@ -30,19 +33,164 @@ MODULE_DESCRIPTION("TCP (SDP, SSOCKS) transport layer for DRBD");
 MODULE_LICENSE("GPL");
 MODULE_VERSION(REL_VERSION);
 
+/* Number of TCP connections the DATA_STREAM is striped across.
+ * Both nodes must be configured with the same value. */
+#define DTT_MAX_STRIPES 8
+static unsigned int dtt_data_stripes = 1;
+module_param_named(data_stripes, dtt_data_stripes, uint, 0644);
+MODULE_PARM_DESC(data_stripes, "Number of sockets the data stream is striped across (1-"
+		 __stringify(DTT_MAX_STRIPES) "), has to be equal on both nodes");
+
+/* Busy poll the control socket for up to this many microseconds in a
+ * blocking receive before sleeping, like SO_BUSY_POLL.  The ack receiver
+ * then does not need a wakeup for acks that arrive shortly after it
+ * started to wait. */
+static unsigned int dtt_control_busy_poll;
+module_param_named(control_busy_poll, dtt_control_busy_poll, uint, 0644);
+MODULE_PARM_DESC(control_busy_poll, "Microseconds to busy poll the control socket (0 = off), "
+		 "needs CONFIG_NET_RX_BUSY_POLL; applies to new connections");
+
+/* While no path has a socket yet, connect via all paths at once instead of one
+ * after the other. A path that does not answer then no longer delays the
+ * connection via a path that does. */
+static bool dtt_parallel_connect;
+module_param_named(parallel_connect, dtt_parallel_connect, bool, 0644);
+MODULE_PARM_DESC(parallel_connect, "Connect via all paths concurrently, the first one established wins");
+#define DTT_MAX_PARALLEL_CONNECTS 8
+
+/* Run a TLS handshake on each socket once connected, through the kernel's
+ * handshake upcall (tlshd). It installs kTLS on the socket, which NICs with
+ * TLS offload then encrypt in hardware. Both nodes must agree, the first
+ * packets carry the setting so that a mismatch is refused right away. */
+static bool dtt_tls;
+module_param_named(tls, dtt_tls, bool, 0644);
+MODULE_PARM_DESC(tls, "Encrypt connections with kTLS, the handshake is done by tlshd "
+		 "(needs CONFIG_NET_HANDSHAKE); applies to new connections");
+static int dtt_tls_keyring;
+module_param_named(tls_keyring, dtt_tls_keyring, int, 0644);
+MODULE_PARM_DESC(tls_keyring, "Serial of the keyring holding the TLS keys (0 = tlshd default)");
+static int dtt_tls_certificate;
+module_param_named(tls_certificate, dtt_tls_certificate, int, 0644);
+MODULE_PARM_DESC(tls_certificate, "Serial of the key with the own x.509 certificate (0 = tlshd default)");
+static int dtt_tls_privkey;
+module_param_named(tls_privkey, dtt_tls_privkey, int, 0644);
+MODULE_PARM_DESC(tls_privkey, "Serial of the key with the own private key (0 = tlshd default)");
+
+/* When sndbuf-size or rcvbuf-size is 0 (autotuning), size the buffers of the
+ * data sockets by the measured bandwidth-delay product instead, bounded by
+ * these values in KiB. Fixed buffers pin the window, the kernel's autotuning
+ * grows it up to tcp_wmem/tcp_rmem regardless of the RTT; neither fits both
+ * LAN and WAN peers. */
+static unsigned int dtt_auto_bufsize_min = 128;
+module_param_named(auto_bufsize_min, dtt_auto_bufsize_min, uint, 0644);
+MODULE_PARM_DESC(auto_bufsize_min, "Lower bound in KiB of socket buffers sized by the bandwidth-delay product");
+static unsigned int dtt_auto_bufsize_max;
+module_param_named(auto_bufsize_max, dtt_auto_bufsize_max, uint, 0644);
+MODULE_PARM_DESC(auto_bufsize_max, "Upper bound in KiB of socket buffers sized by the bandwidth-delay product "
+		 "(0 = off, leave unconfigured buffers to the kernel's autotuning)");
+#define DTT_INTERVAL HZ
+
+/* Reconnect via another path once the RTT of the established one is this
+ * many times that of the best other path, for DTT_PATH_SWITCH_INTERVALS in a
+ * row. The RTT of other paths is the one last measured on them. */
+static unsigned int dtt_path_switch_factor;
+module_param_named(path_switch_factor, dtt_path_switch_factor, uint, 0644);
+MODULE_PARM_DESC(path_switch_factor, "Reconnect via a better path when the RTT of the current one "
+		 "is this many times worse (0 = off)");
+#define DTT_PATH_SWITCH_INTERVALS 10
+
+/* Create MPTCP instead of TCP sockets. The kernel's path manager then adds
+ * subflows via the endpoints configured with "ip mptcp endpoint", and falls
+ * back to plain TCP if the peer does not speak MPTCP. */
+static bool dtt_mptcp;
+module_param_named(mptcp, dtt_mptcp, bool, 0644);
+MODULE_PARM_DESC(mptcp, "Use MPTCP sockets, subflows as configured with \"ip mptcp endpoint\" "
+		 "(needs CONFIG_MPTCP); applies to new connections and listeners");
+
+/* Limit what may sit unsent in the data sockets. Large send buffers are for
+ * the window of in-flight data; unsent data queued behind it only adds
+ * latency to whatever DRBD sends next. With this, the sender blocks until the
+ * socket drained below the mark, and requests wait in the transfer log. */
+static unsigned int dtt_notsent_lowat;
+module_param_named(notsent_lowat, dtt_notsent_lowat, uint, 0644);
+MODULE_PARM_DESC(notsent_lowat, "TCP_NOTSENT_LOWAT in KiB for the data stream sockets "
+		 "(0 = off); applies to new connections");
+
+/* Stripe index and the number of stripes, as carried in the length field of
+ * the P_INITIAL_DATA first packet. Older peers send 0 there. */
+#define DTT_STRIPE_INFO(idx, nr) (((idx) << 8) | (nr))
+#define DTT_STRIPE_NR_MASK 0x7f
+/* Set in the first packets of the data and control socket if tls is on */
+#define DTT_TLS_INFO 0x80
+
+/* Pages received with one sock_recvmsg() call in dtt_recv_pages() */
+#define DTT_RECV_BVECS 16
+
 struct buffer {
 	void *base;
 	void *pos;
 };
 
+/* Headers and small packets are received through a page sized read-ahead
+ * buffer, so that a stream of them needs one recvmsg() per batch instead of
+ * one per header and one per payload. Reads of DTT_READAHEAD_BELOW bytes or
+ * more, and the pages of dtt_recv_pages(), go to the socket directly. */
+#define DTT_READAHEAD_BELOW (PAGE_SIZE / 2)
+
+struct dtt_readahead {
+	void *base;
+	unsigned int start;
+	unsigned int len;
+};
+
 #define DTT_CONNECTING 1
 
+/* Time spent in one send call, in power of two microsecond buckets */
+#define DTT_SEND_HIST_BUCKETS 16
+
+struct dtt_send_stats {
+	u64 calls;
+	u64 bytes;
+	u64 blocked_ns;
+	unsigned int hist[DTT_SEND_HIST_BUCKETS];
+};
+
+/* With data_stripes > 1 the DATA_STREAM is sent as a sequence of units, each
+ * prefixed by its length as be32. Units are placed round-robin on the stripe
+ * sockets, so the receiver can restore the order without sequence numbers. */
+struct dtt_stripes {
+	unsigned int nr;	/* 1 if not striped */
+	struct socket *socket[DTT_MAX_STRIPES]; /* [0] is stream[DATA_STREAM] */
+	unsigned int tx_idx;	/* socket for the next unit to send */
+	unsigned int rx_idx;	/* socket of the unit currently received */
+	u32 rx_left;		/* bytes left in the current unit */
+	unsigned int rx_hdr_have;
+	__be32 rx_hdr;
+};
+
+/* Byte counters of a data socket at the last dtt_tune_bufsize() */
+struct dtt_bufsize_sample {
+	u64 bytes_acked;
+	u64 bytes_received;
+};
+
 struct drbd_tcp_transport {
 	struct drbd_transport transport; /* Must be first! */
 	spinlock_t paths_lock;
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	struct dtt_readahead ra[2]; /* not used for a striped DATA_STREAM */
+	struct dtt_stripes stripes;
+	/* Updated under the send mutex of the stream */
+	struct dtt_send_stats send_stats[2];
+	unsigned long congested_count;
+	/* Size buffers of the data sockets by the bandwidth-delay product */
+	bool auto_sndbuf, auto_rcvbuf;
+	unsigned long interval_start; /* jiffies of the last dtt_per_interval() */
+	struct dtt_bufsize_sample bufsize_sample[DTT_MAX_STRIPES];
+	struct dtt_path *data_path; /* the established one */
+	unsigned int path_degraded; /* intervals in a row */
 };
 
 struct dtt_listener {
@@ -66,6 +214,18 @@ struct dtt_path {
 	struct drbd_path path;
 
 	struct list_head sockets; /* sockets passed to me by other receiver threads */
+
+	/* Health, kept across connections */
+	u32 rtt_us;		/* last measured, 0 if never */
+	unsigned int failures;	/* network errors since it last worked */
+};
+
+struct dtt_parallel_connect {
+	wait_queue_head_t wait; /* woken if one of the sockets changed state */
+	void (*original_sk_state_change)(struct sock *sk);
+	unsigned int nr;
+	struct socket *socket[DTT_MAX_PARALLEL_CONNECTS];
+	struct dtt_path *path[DTT_MAX_PARALLEL_CONNECTS];
 };
 
 static int dtt_init(struct drbd_transport *transport);
@@ -160,6 +320,7 @@ static int dtt_init(struct drbd_transport *transport)
 	enum drbd_stream i;
 
 	spin_lock_init(&tcp_transport->paths_lock);
+	tcp_transport->stripes.nr = 1;
 	tcp_transport->transport.ops = &dtt_ops;
 	tcp_transport->transport.class = &tcp_transport_class;
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
@@ -168,23 +329,119 @@ static int dtt_init(struct drbd_transport *transport)
 			goto fail;
 		tcp_transport->rbuf[i].base = buffer;
 		tcp_transport->rbuf[i].pos = buffer;
+
+		buffer = (void *)__get_free_page(GFP_KERNEL);
+		if (!buffer)
+			goto fail;
+		tcp_transport->ra[i].base = buffer;
 	}
 
 	return 0;
 fail:
-	free_page((unsigned long)tcp_transport->rbuf[0].base);
+	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		free_page((unsigned long)tcp_transport->rbuf[i].base);
+		free_page((unsigned long)tcp_transport->ra[i].base);
+	}
 	return -ENOMEM;
 }
 
+/* A socket that went through the TLS handshake got a file, it goes with the file */
+static void dtt_sock_release(struct socket *socket)
+{
+	if (socket->file)
+		fput(socket->file);
+	else
+		sock_release(socket);
+}
+
 static void dtt_free_one_sock(struct socket *socket)
 {
 	if (socket) {
 		synchronize_rcu();
 		kernel_sock_shutdown(socket, SHUT_RDWR);
-		sock_release(socket);
+		dtt_sock_release(socket);
 	}
 }
 
+static void dtt_free_stripes(struct drbd_tcp_transport *tcp_transport)
+{
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
+	unsigned int i;
+
+	for (i = 1; i < stripes->nr; i++) {
+		dtt_free_one_sock(stripes->socket[i]);
+		stripes->socket[i] = NULL;
+	}
+	stripes->socket[0] = NULL;
+	stripes->nr = 1;
+}
+
+static int dtt_ipproto(void)
+{
+	if (IS_ENABLED(CONFIG_MPTCP) && READ_ONCE(dtt_mptcp))
+		return IPPROTO_MPTCP;
+	return IPPROTO_TCP;
+}
+
+/* The sock of an MPTCP socket is no tcp_sock, only its subflows are */
+static bool dtt_sk_is_tcp(struct sock *sk)
+{
+	return sk->sk_protocol == IPPROTO_TCP;
+}
+
+static u32 dtt_sk_srtt_us(struct sock *sk)
+{
+	return dtt_sk_is_tcp(sk) ? tcp_sk(sk)->srtt_us >> 3 : 0;
+}
+
+static void dtt_set_tcp_sockopt(struct sock *sk, int optname, int val)
+{
+	struct socket *socket = sk->sk_socket;
+
+	if (socket)
+		socket->ops->setsockopt(socket, SOL_TCP, optname,
+					KERNEL_SOCKPTR(&val), sizeof(val));
+}
+
+static void dtt_set_cork(struct sock *sk, bool on)
+{
+	if (dtt_sk_is_tcp(sk))
+		tcp_sock_set_cork(sk, on);
+	else
+		dtt_set_tcp_sockopt(sk, TCP_CORK, on);
+}
+
+static void dtt_set_nodelay(struct sock *sk)
+{
+	if (dtt_sk_is_tcp(sk))
+		tcp_sock_set_nodelay(sk);
+	else
+		dtt_set_tcp_sockopt(sk, TCP_NODELAY, 1);
+}
+
+static void dtt_set_notsent_lowat(struct sock *sk)
+{
+	unsigned int kib = READ_ONCE(dtt_notsent_lowat);
+
+	if (kib)
+		dtt_set_tcp_sockopt(sk, TCP_NOTSENT_LOWAT, min(kib, INT_MAX / 1024) * 1024);
+}
+
+static void dtt_set_quickack(struct sock *sk)
+{
+	/* MPTCP does not pass TCP_QUICKACK on to its subflows */
+	if (dtt_sk_is_tcp(sk))
+		tcp_sock_set_quickack(sk, 2);
+}
+
+static void dtt_path_record_rtt(struct dtt_path *path, struct sock *sk)
+{
+	u32 rtt_us = dtt_sk_srtt_us(sk);
+
+	if (rtt_us)
+		WRITE_ONCE(path->rtt_us, rtt_us);
+}
+
 static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free_op)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -194,12 +451,18 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 	/* free the socket specific stuff,
 	 * mutexes are handled by caller */
 
+	if (tcp_transport->data_path && tcp_transport->stream[DATA_STREAM])
+		dtt_path_record_rtt(tcp_transport->data_path, tcp_transport->stream[DATA_STREAM]->sk);
+	tcp_transport->data_path = NULL;
+
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		if (tcp_transport->stream[i]) {
 			dtt_free_one_sock(tcp_transport->stream[i]);
 			tcp_transport->stream[i] = NULL;
 		}
+		tcp_transport->ra[i].len = 0;
 	}
+	dtt_free_stripes(tcp_transport);
 
 	for_each_path_ref(drbd_path, transport) {
 		bool was_established = drbd_path->established;
@@ -216,6 +479,8 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 		for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 			free_page((unsigned long)tcp_transport->rbuf[i].base);
 			tcp_transport->rbuf[i].base = NULL;
+			free_page((unsigned long)tcp_transport->ra[i].base);
+			tcp_transport->ra[i].base = NULL;
 		}
 		spin_lock(&tcp_transport->paths_lock);
 		list_for_each_entry_safe(drbd_path, tmp, &transport->paths, list) {
@@ -226,11 +491,26 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 	}
 }
 
+static void dtt_account_send(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream,
+			     int sent, ktime_t start_kt)
+{
+	struct dtt_send_stats *stats = &tcp_transport->send_stats[stream];
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start_kt));
+	u64 us = ns / NSEC_PER_USEC;
+
+	stats->calls++;
+	if (sent > 0)
+		stats->bytes += sent;
+	stats->blocked_ns += ns;
+	stats->hist[us ? min_t(int, ilog2(us) + 1, DTT_SEND_HIST_BUCKETS - 1) : 0]++;
+}
+
 static int _dtt_send(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
-		      void *buf, size_t size, unsigned msg_flags)
+		     enum drbd_stream stream, void *buf, size_t size, unsigned msg_flags)
 {
 	struct kvec iov;
 	struct msghdr msg;
+	ktime_t start_kt = ktime_get();
 	int rv, sent = 0;
 
 	/* THINK  if (signal_pending) return ... ? */
@@ -248,9 +528,6 @@ static int _dtt_send(struct drbd_tcp_transport *tcp_transport, struct socket *so
 		rv = kernel_sendmsg(socket, &msg, &iov, 1, iov.iov_len);
 		if (rv == -EAGAIN) {
 			struct drbd_transport *transport = &tcp_transport->transport;
-			enum drbd_stream stream =
-				tcp_transport->stream[DATA_STREAM] == socket ?
-					DATA_STREAM : CONTROL_STREAM;
 
 			if (drbd_stream_send_timed_out(transport, stream))
 				break;
@@ -268,6 +545,8 @@ static int _dtt_send(struct drbd_tcp_transport *tcp_transport, struct socket *so
 		iov.iov_len  -= rv;
 	} while (sent < size);
 
+	dtt_account_send(tcp_transport, stream, sent, start_kt);
+
 	if (rv <= 0)
 		return rv;
 
@@ -287,6 +566,92 @@ static int dtt_recv_short(struct socket *socket, void *buf, size_t size, int fla
 	return kernel_recvmsg(socket, &msg, &iov, 1, size, msg.msg_flags);
 }
 
+static int dtt_recv_striped(struct drbd_tcp_transport *tcp_transport, void *buf, size_t size, int flags)
+{
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
+	size_t received = 0;
+	int rv = 0;
+
+	while (received < size) {
+		struct socket *socket = stripes->socket[stripes->rx_idx];
+
+		if (!stripes->rx_left) {
+			rv = dtt_recv_short(socket, (char *)&stripes->rx_hdr + stripes->rx_hdr_have,
+					    sizeof(stripes->rx_hdr) - stripes->rx_hdr_have, flags);
+			if (rv <= 0)
+				break;
+			stripes->rx_hdr_have += rv;
+			if (stripes->rx_hdr_have < sizeof(stripes->rx_hdr))
+				continue;
+			stripes->rx_hdr_have = 0;
+			stripes->rx_left = be32_to_cpu(stripes->rx_hdr);
+			if (!stripes->rx_left) {
+				rv = -EPROTO;
+				break;
+			}
+			continue;
+		}
+
+		rv = dtt_recv_short(socket, buf + received,
+				    min_t(size_t, stripes->rx_left, size - received), flags);
+		if (rv <= 0)
+			break;
+		received += rv;
+		stripes->rx_left -= rv;
+		if (!stripes->rx_left)
+			stripes->rx_idx = (stripes->rx_idx + 1) % stripes->nr;
+	}
+
+	return received ? received : rv;
+}
+
+static size_t dtt_ra_consume(struct dtt_readahead *ra, void *buf, size_t size)
+{
+	size_t len = min_t(size_t, size, ra->len);
+
+	memcpy(buf, ra->base + ra->start, len);
+	ra->start += len;
+	ra->len -= len;
+	return len;
+}
+
+static bool dtt_sk_readable(struct sock *sk)
+{
+	if (dtt_sk_is_tcp(sk))
+		return tcp_inq(sk) > 0;
+	return !skb_queue_empty_lockless(&sk->sk_receive_queue);
+}
+
+static int dtt_recv_stream(struct drbd_tcp_transport *tcp_transport, enum drbd_stream stream,
+			   void *buf, size_t size, int flags)
+{
+	struct socket *socket = tcp_transport->stream[stream];
+	struct dtt_readahead *ra = &tcp_transport->ra[stream];
+	size_t got;
+	int rv;
+
+	if (stream == DATA_STREAM && tcp_transport->stripes.nr > 1)
+		return dtt_recv_striped(tcp_transport, buf, size, flags);
+
+	got = dtt_ra_consume(ra, buf, size);
+	/* Only if there is something, an empty recvmsg() would cost a syscall */
+	if (got < size && size - got < DTT_READAHEAD_BELOW && dtt_sk_readable(socket->sk)) {
+		rv = dtt_recv_short(socket, ra->base, PAGE_SIZE, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rv > 0) {
+			ra->start = 0;
+			ra->len = rv;
+			got += dtt_ra_consume(ra, buf + got, size - got);
+		}
+	}
+	if (got == size)
+		return got;
+
+	rv = dtt_recv_short(socket, buf + got, size - got, flags);
+	if (!got)
+		return rv;
+	return got + max(rv, 0);
+}
+
 static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, void **buf, size_t size, int flags)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -300,17 +665,17 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 
 	if (flags & CALLER_BUFFER) {
 		buffer = *buf;
-		rv = dtt_recv_short(socket, buffer, size, flags & ~CALLER_BUFFER);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags & ~CALLER_BUFFER);
 	} else if (flags & GROW_BUFFER) {
 		TR_ASSERT(transport, *buf == tcp_transport->rbuf[stream].base);
 		buffer = tcp_transport->rbuf[stream].pos;
 		TR_ASSERT(transport, (buffer - *buf) + size <= PAGE_SIZE);
 
-		rv = dtt_recv_short(socket, buffer, size, flags & ~GROW_BUFFER);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags & ~GROW_BUFFER);
 	} else {
 		buffer = tcp_transport->rbuf[stream].base;
 
-		rv = dtt_recv_short(socket, buffer, size, flags);
+		rv = dtt_recv_stream(tcp_transport, stream, buffer, size, flags);
 		if (rv > 0)
 			*buf = buffer;
 	}
@@ -321,33 +686,98 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	return rv;
 }
 
+/* Receives straight into the pages of a bvec array, without kmap()ing them */
+static int dtt_recv_bvec(struct socket *socket, struct bio_vec *bvec, unsigned int nr, size_t size)
+{
+	struct msghdr msg = {
+		.msg_flags = MSG_WAITALL | MSG_NOSIGNAL
+	};
+
+	iov_iter_bvec(&msg.msg_iter, ITER_DEST, bvec, nr, size);
+	return sock_recvmsg(socket, &msg, msg.msg_flags);
+}
+
 static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct dtt_readahead *ra = &tcp_transport->ra[DATA_STREAM];
+	struct bio_vec bvec[DTT_RECV_BVECS];
 	struct page *page;
+	size_t off = 0;
 	int err;
 
 	if (!socket)
 		return -ENOTCONN;
 
+	dtt_per_interval(tcp_transport);
 	drbd_alloc_page_chain(transport, chain, DIV_ROUND_UP(size, PAGE_SIZE), GFP_TRY);
 	page = chain->head;
 	if (!page)
 		return -ENOMEM;
 
-	page_chain_for_each(page) {
-		size_t len = min_t(int, size, PAGE_SIZE);
-		void *data = kmap(page);
-		err = dtt_recv_short(socket, data, len, 0);
-		kunmap(page);
+	if (tcp_transport->stripes.nr > 1) {
+		page_chain_for_each(page) {
+			size_t len = min_t(int, size, PAGE_SIZE);
+			void *data = kmap(page);
+			err = dtt_recv_stream(tcp_transport, DATA_STREAM, data, len, 0);
+			kunmap(page);
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, len);
+			if (err < 0)
+				goto fail;
+			size -= err;
+		}
+		goto check_size;
+	}
+
+	/* The start of the payload may have been read ahead with a header,
+	 * off is what the current page holds already */
+	while (page && size && ra->len) {
+		size_t len = min_t(size_t, size + off, PAGE_SIZE);
+		size_t have = min_t(size_t, len - off, ra->len);
+
+		memcpy_to_page(page, off, ra->base + ra->start, have);
+		ra->start += have;
+		ra->len -= have;
+		size -= have;
+		off += have;
 		set_page_chain_offset(page, 0);
 		set_page_chain_size(page, len);
+		if (off == len) {
+			off = 0;
+			page = page_chain_next(page);
+		}
+	}
+
+	/* Up to DTT_RECV_BVECS pages per sock_recvmsg() call */
+	while (page && size) {
+		unsigned int nr = 0;
+		size_t batch = 0;
+
+		do {
+			size_t len = min_t(size_t, size - batch + off, PAGE_SIZE);
+
+			bvec[nr].bv_page = page;
+			bvec[nr].bv_offset = off;
+			bvec[nr].bv_len = len - off;
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, len);
+			batch += len - off;
+			off = 0;
+			nr++;
+			page = page_chain_next(page);
+		} while (page && nr < DTT_RECV_BVECS && batch < size);
+
+		err = dtt_recv_bvec(socket, bvec, nr, batch);
 		if (err < 0)
 			goto fail;
 		size -= err;
+		if (err != batch)
+			break;
 	}
+check_size:
 	if (unlikely(size)) {
 		tr_warn(transport, "Not enough data received; missing %lu bytes\n", size);
 		err = -ENODATA;
@@ -364,16 +794,27 @@ static void dtt_stats(struct drbd_transport *transport, struct drbd_transport_st
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 
-	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
+	unsigned int i;
 
-	if (socket) {
-		struct sock *sk = socket->sk;
-		struct tcp_sock *tp = tcp_sk(sk);
+	if (!tcp_transport->stream[DATA_STREAM])
+		return;
+
+	stats->unread_received = tcp_transport->ra[DATA_STREAM].len;
+	stats->unacked_send = 0;
+	stats->send_buffer_size = 0;
+	stats->send_buffer_used = 0;
+	for (i = 0; i < stripes->nr; i++) {
+		struct sock *sk = stripes->socket[i]->sk;
 
-		stats->unread_received = tp->rcv_nxt - tp->copied_seq;
-		stats->unacked_send = tp->write_seq - tp->snd_una;
-		stats->send_buffer_size = sk->sk_sndbuf;
-		stats->send_buffer_used = sk->sk_wmem_queued;
+		if (dtt_sk_is_tcp(sk)) {
+			struct tcp_sock *tp = tcp_sk(sk);
+
+			stats->unread_received += tp->rcv_nxt - tp->copied_seq;
+			stats->unacked_send += tp->write_seq - tp->snd_una;
+		}
+		stats->send_buffer_size += sk->sk_sndbuf;
+		stats->send_buffer_used += sk->sk_wmem_queued;
 	}
 }
 
@@ -400,6 +841,153 @@ static void dtt_setbufsize(struct socket *socket, unsigned int snd,
 	}
 }
 
+static void dtt_set_auto_bufsize(struct drbd_tcp_transport *tcp_transport, struct net_conf *nc)
+{
+	bool on = READ_ONCE(dtt_auto_bufsize_max) != 0;
+
+	tcp_transport->auto_sndbuf = on && !nc->sndbuf_size;
+	tcp_transport->auto_rcvbuf = on && !nc->rcvbuf_size;
+}
+
+static u32 dtt_bdp_bufsize(u64 bytes, u32 rtt_us, unsigned long elapsed, u32 cur, bool full,
+			   unsigned int factor)
+{
+	u32 lo = READ_ONCE(dtt_auto_bufsize_min) << 10;
+	u32 hi = READ_ONCE(dtt_auto_bufsize_max) << 10;
+	u64 size;
+
+	size = div64_u64(bytes * rtt_us * factor, max(jiffies_to_usecs(elapsed), 1U));
+	/* While the buffer is the limit, the measured rate is too. Probe upwards. */
+	if (full)
+		size = max_t(u64, size, (u64)cur * 2);
+
+	return clamp_t(u64, size, lo, max(lo, hi));
+}
+
+/* The throughput is what TCP got acked or received in the last interval,
+ * the RTT is TCP's own estimate. */
+static void dtt_tune_bufsize(struct drbd_tcp_transport *tcp_transport, unsigned long elapsed)
+{
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
+	unsigned int i;
+
+	if (!(tcp_transport->auto_sndbuf || tcp_transport->auto_rcvbuf))
+		return;
+
+	for (i = 0; i < stripes->nr; i++) {
+		struct dtt_bufsize_sample *sample = &tcp_transport->bufsize_sample[i];
+		struct sock *sk = stripes->socket[i]->sk;
+		struct tcp_sock *tp;
+		u64 acked, received;
+
+		if (!dtt_sk_is_tcp(sk))
+			continue;
+		tp = tcp_sk(sk);
+		acked = READ_ONCE(tp->bytes_acked);
+		received = READ_ONCE(tp->bytes_received);
+
+		if (tcp_transport->auto_sndbuf) {
+			u32 cur = READ_ONCE(sk->sk_sndbuf);
+			u32 snd;
+
+			/* Twice the BDP: one in flight, one queued behind it */
+			snd = dtt_bdp_bufsize(acked - sample->bytes_acked, tp->srtt_us >> 3,
+					      elapsed, cur,
+					      READ_ONCE(sk->sk_wmem_queued) > cur * 4 / 5, 2);
+			WRITE_ONCE(sk->sk_sndbuf, snd);
+			sk->sk_userlocks |= SOCK_SNDBUF_LOCK;
+			if (snd > cur)
+				sk->sk_write_space(sk);
+		}
+
+		if (tcp_transport->auto_rcvbuf) {
+			u32 cur = READ_ONCE(sk->sk_rcvbuf);
+			u32 rtt_us = tp->rcv_rtt_est.rtt_us >> 3 ?: tp->srtt_us >> 3;
+
+			/* TCP advertises about half of sk_rcvbuf as window */
+			WRITE_ONCE(sk->sk_rcvbuf,
+				   dtt_bdp_bufsize(received - sample->bytes_received, rtt_us,
+						   elapsed, cur,
+						   tp->rcv_nxt - tp->copied_seq > cur / 2, 4));
+			sk->sk_userlocks |= SOCK_RCVBUF_LOCK;
+		}
+
+		sample->bytes_acked = acked;
+		sample->bytes_received = received;
+	}
+}
+
+/* Returns the path with the fewest failures, and of those the one with the
+ * lowest RTT. Paths never measured come after measured ones. */
+static struct dtt_path *dtt_best_path(struct drbd_tcp_transport *tcp_transport,
+				      struct dtt_path *except)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct dtt_path *best = NULL;
+	struct drbd_path *drbd_path;
+
+	spin_lock(&tcp_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
+
+		if (path == except)
+			continue;
+		if (!best || path->failures < best->failures ||
+		    (path->failures == best->failures &&
+		     (path->rtt_us ?: U32_MAX) < (best->rtt_us ?: U32_MAX)))
+			best = path;
+	}
+	spin_unlock(&tcp_transport->paths_lock);
+
+	return best;
+}
+
+static void dtt_check_path(struct drbd_tcp_transport *tcp_transport)
+{
+	unsigned int factor = READ_ONCE(dtt_path_switch_factor);
+	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct dtt_path *path = tcp_transport->data_path;
+	struct dtt_path *other;
+
+	if (!path || !socket)
+		return;
+	dtt_path_record_rtt(path, socket->sk);
+
+	other = factor ? dtt_best_path(tcp_transport, path) : NULL;
+	if (!other || other->failures || !other->rtt_us ||
+	    path->rtt_us <= (u64)other->rtt_us * factor) {
+		tcp_transport->path_degraded = 0;
+		return;
+	}
+
+	if (++tcp_transport->path_degraded < DTT_PATH_SWITCH_INTERVALS)
+		return;
+	tcp_transport->path_degraded = 0;
+	tr_warn(&tcp_transport->transport,
+		"Path RTT %u us, another one had %u us, reconnecting\n",
+		path->rtt_us, other->rtt_us);
+	/* The receiver sees the connection break, dtt_connect() then starts
+	 * with the better path */
+	kernel_sock_shutdown(socket, SHUT_RDWR);
+}
+
+/* Called from the send and receive paths, does its work at most once per
+ * DTT_INTERVAL. */
+static void dtt_per_interval(struct drbd_tcp_transport *tcp_transport)
+{
+	unsigned long last = READ_ONCE(tcp_transport->interval_start);
+	unsigned long now = jiffies;
+
+	if (time_before(now, last + DTT_INTERVAL))
+		return;
+	/* The receiver and the sender may both get here */
+	if (cmpxchg(&tcp_transport->interval_start, last, now) != last)
+		return;
+
+	dtt_tune_bufsize(tcp_transport, now - last);
+	dtt_check_path(tcp_transport);
+}
+
 static bool dtt_path_cmp_addr(struct dtt_path *path)
 {
 	struct drbd_path *drbd_path = &path->path;
@@ -409,7 +997,8 @@ static bool dtt_path_cmp_addr(struct dtt_path *path)
 	return memcmp(&drbd_path->my_addr, &drbd_path->peer_addr, addr_size) > 0;
 }
 
-static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *path, struct socket **ret_socket)
+static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *path,
+			   struct socket **ret_socket, int flags)
 {
 	const char *what;
 	struct socket *socket;
@@ -440,7 +1029,7 @@ static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *pa
 	peer_addr = path->path.peer_addr;
 
 	what = "sock_create_kern";
-	err = sock_create_kern(&init_net, my_addr.ss_family, SOCK_STREAM, IPPROTO_TCP, &socket);
+	err = sock_create_kern(&init_net, my_addr.ss_family, SOCK_STREAM, dtt_ipproto(), &socket);
 	if (err < 0) {
 		socket = NULL;
 		goto out;
@@ -466,8 +1055,15 @@ static int dtt_try_connect(struct drbd_transport *transport, struct dtt_path *pa
 	 * stay C_CONNECTING, don't go Disconnecting! */
 	what = "connect";
 	err = socket->ops->connect(socket, (struct sockaddr *) &peer_addr,
-				   path->path.peer_addr_len, 0);
-	if (err < 0) {
+				   path->path.peer_addr_len, flags);
+	if (err == -EINPROGRESS && (flags & O_NONBLOCK)) {
+		/* the caller waits for the connection to get established */
+		err = 0;
+	} else if (err < 0) {
+		/* Refused or reset means the peer is not listening yet */
+		if (err == -ETIMEDOUT || err == -ENETUNREACH ||
+		    err == -EHOSTDOWN || err == -EHOSTUNREACH)
+			path->failures++;
 		switch (err) {
 		case -ETIMEDOUT:
 		case -EINPROGRESS:
@@ -493,14 +1089,141 @@ out:
 		if (err != -EAGAIN && err != -EADDRNOTAVAIL)
 			tr_err(transport, "%s failed, err = %d\n", what, err);
 	} else {
+		if (!(flags & O_NONBLOCK)) {
+			/* The RTT of the SYN */
+			dtt_path_record_rtt(path, socket->sk);
+			path->failures = 0;
+		}
 		*ret_socket = socket;
 	}
 
 	return err;
 }
 
+static void dtt_parallel_connect_state_change(struct sock *sk)
+{
+	struct dtt_parallel_connect *pc = sk->sk_user_data;
+
+	pc->original_sk_state_change(sk);
+	wake_up(&pc->wait);
+}
+
+static bool dtt_parallel_connect_done(struct dtt_parallel_connect *pc, int *winner)
+{
+	unsigned int i, pending = 0;
+
+	for (i = 0; i < pc->nr; i++) {
+		int state = READ_ONCE(pc->socket[i]->sk->sk_state);
+
+		if (state == TCP_ESTABLISHED) {
+			*winner = i;
+			return true;
+		}
+		if (state == TCP_SYN_SENT)
+			pending++;
+	}
+
+	return pending == 0;
+}
+
+/**
+ * dtt_try_connect_parallel() - Connect via all paths at once
+ * @transport:	The transport.
+ * @ret_path:	Set to the path of the returned socket.
+ * @ret_socket:	The socket that got established first.
+ *
+ * Starts a non blocking dtt_try_connect() on each path, then waits up to
+ * connect-int for the first connection to get established, and closes the
+ * others.
+ */
+static int dtt_try_connect_parallel(struct drbd_transport *transport, struct dtt_path **ret_path,
+				    struct socket **ret_socket)
+{
+	struct dtt_parallel_connect pc;
+	struct drbd_path *drbd_path;
+	struct net_conf *nc;
+	int connect_int, winner = -1, err = -EAGAIN;
+	unsigned int i;
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	if (!nc) {
+		rcu_read_unlock();
+		return -EIO;
+	}
+	connect_int = nc->connect_int;
+	rcu_read_unlock();
+
+	init_waitqueue_head(&pc.wait);
+	pc.nr = 0;
+
+	for_each_path_ref(drbd_path, transport) {
+		struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
+		struct socket *s = NULL;
+		struct sock *sk;
+		int err2;
+
+		if (pc.nr == DTT_MAX_PARALLEL_CONNECTS) {
+			kref_put(&drbd_path->kref, drbd_destroy_path);
+			break;
+		}
+
+		err2 = dtt_try_connect(transport, path, &s, O_NONBLOCK);
+		if (err2 < 0) {
+			if (err2 != -EAGAIN)
+				err = err2;
+			continue;
+		}
+
+		/* All TCP sockets start with the same sk_state_change callback.
+		 * The state gets checked after installing ours, so a connection
+		 * established before that is not missed. */
+		sk = s->sk;
+		write_lock_bh(&sk->sk_callback_lock);
+		pc.original_sk_state_change = sk->sk_state_change;
+		sk->sk_state_change = dtt_parallel_connect_state_change;
+		sk->sk_user_data = &pc;
+		write_unlock_bh(&sk->sk_callback_lock);
+
+		pc.socket[pc.nr] = s;
+		pc.path[pc.nr] = path;
+		pc.nr++;
+	}
+
+	wait_event_interruptible_timeout(pc.wait,
+			dtt_parallel_connect_done(&pc, &winner),
+			connect_int * HZ);
+
+	for (i = 0; i < pc.nr; i++) {
+		struct sock *sk = pc.socket[i]->sk;
+
+		/* lock_sock() keeps the softirq side out of the callback */
+		lock_sock(sk);
+		write_lock_bh(&sk->sk_callback_lock);
+		sk->sk_state_change = pc.original_sk_state_change;
+		sk->sk_user_data = NULL;
+		write_unlock_bh(&sk->sk_callback_lock);
+		release_sock(sk);
+
+		if (i != winner)
+			sock_release(pc.socket[i]);
+	}
+
+	if (winner < 0)
+		return err;
+
+	tr_info(transport, "Connected first via %pISpc, rtt %u us\n",
+		&pc.path[winner]->path.peer_addr, dtt_sk_srtt_us(pc.socket[winner]->sk));
+	dtt_path_record_rtt(pc.path[winner], pc.socket[winner]->sk);
+	pc.path[winner]->failures = 0;
+
+	*ret_path = pc.path[winner];
+	*ret_socket = pc.socket[winner];
+	return 0;
+}
+
 static int dtt_send_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
-			     enum drbd_packet cmd, enum drbd_stream stream)
+			     enum drbd_packet cmd, enum drbd_stream stream, u16 stripe_info)
 {
 	struct p_header80 h;
 	int msg_flags = 0;
@@ -511,9 +1234,9 @@ static int dtt_send_first_packet(struct drbd_tcp_transport *tcp_transport, struc
 
 	h.magic = cpu_to_be32(DRBD_MAGIC);
 	h.command = cpu_to_be16(cmd);
-	h.length = 0;
+	h.length = cpu_to_be16(stripe_info);
 
-	err = _dtt_send(tcp_transport, socket, &h, sizeof(h), msg_flags);
+	err = _dtt_send(tcp_transport, socket, stream, &h, sizeof(h), msg_flags);
 
 	return err;
 }
@@ -528,7 +1251,7 @@ static void dtt_socket_free(struct socket **socket)
 		return;
 
 	kernel_sock_shutdown(*socket, SHUT_RDWR);
-	sock_release(*socket);
+	dtt_sock_release(*socket);
 	*socket = NULL;
 }
 
@@ -718,7 +1441,8 @@ retry_locked:
 	goto retry;
 }
 
-static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+				    u16 *stripe_info)
 {
 	struct drbd_transport *transport = &tcp_transport->transport;
 	struct p_header80 *h = tcp_transport->rbuf[DATA_STREAM].base;
@@ -746,6 +1470,8 @@ static int dtt_receive_first_packet(struct drbd_tcp_transport *tcp_transport, st
 			 be32_to_cpu(h->magic));
 		return -EINVAL;
 	}
+	if (stripe_info)
+		*stripe_info = be16_to_cpu(h->length);
 	return be16_to_cpu(h->command);
 }
 
@@ -802,7 +1528,7 @@ static int dtt_init_listener(struct drbd_transport *transport,
 
 	my_addr = *(struct sockaddr_storage *)addr;
 
-	err = sock_create_kern(&init_net, my_addr.ss_family, SOCK_STREAM, IPPROTO_TCP, &s_listen);
+	err = sock_create_kern(&init_net, my_addr.ss_family, SOCK_STREAM, dtt_ipproto(), &s_listen);
 	if (err) {
 		s_listen = NULL;
 		what = "sock_create_kern";
@@ -897,6 +1623,172 @@ static struct dtt_path *dtt_next_path(struct drbd_tcp_transport *tcp_transport,
 	return container_of(drbd_path, struct dtt_path, path);
 }
 
+/**
+ * dtt_connect_stripes() - Establish the additional sockets of a striped DATA_STREAM
+ * @tcp_transport:	The transport, with stripes.socket[0] already established.
+ * @path:		The established path; all stripes use it.
+ * @nr:			Number of stripes, including stream[DATA_STREAM].
+ * @outgoing:		True if this node connected the data socket.
+ *
+ * The node that connected the data socket also connects the stripes, each
+ * one announces its index in the first packet, and the peer confirms it by
+ * echoing that first packet back.
+ */
+struct dtt_tls_wait {
+	struct completion done;
+	int status;
+	key_serial_t peerid;
+};
+
+static void dtt_tls_done(void *data, int status, key_serial_t peerid)
+{
+	struct dtt_tls_wait *wait = data;
+
+	wait->status = status;
+	wait->peerid = peerid;
+	complete(&wait->done);
+}
+
+/* The side that connected is the TLS client. On failure of
+ * sock_alloc_file() the socket is gone already, *socket is NULL then.
+ * tlshd checks the peer's certificate against the connection name, which
+ * is the peer's host name, and the peer has to present a certificate. */
+static int dtt_tls_handshake(struct drbd_transport *transport, struct socket **socket,
+			     bool client)
+{
+	struct tls_handshake_args args = {
+		.ta_done = dtt_tls_done,
+		.ta_keyring = READ_ONCE(dtt_tls_keyring),
+		.ta_my_cert = READ_ONCE(dtt_tls_certificate),
+		.ta_my_privkey = READ_ONCE(dtt_tls_privkey),
+	};
+	struct dtt_tls_wait wait;
+	struct net_conf *nc;
+	struct file *file;
+	char *peername;
+	long timeout;
+	int err;
+
+	if (!IS_ENABLED(CONFIG_NET_HANDSHAKE)) {
+		tr_err(transport, "tls is set, but the kernel lacks CONFIG_NET_HANDSHAKE\n");
+		return -EOPNOTSUPP;
+	}
+
+	if (!dtt_sk_is_tcp((*socket)->sk)) {
+		tr_err(transport, "tls needs TCP sockets, unset mptcp\n");
+		return -EOPNOTSUPP;
+	}
+
+	rcu_read_lock();
+	nc = rcu_dereference(transport->net_conf);
+	timeout = nc->connect_int * HZ;
+	peername = kstrdup(nc->name, GFP_ATOMIC);
+	rcu_read_unlock();
+	if (!peername)
+		return -ENOMEM;
+
+	file = sock_alloc_file(*socket, O_CLOEXEC, NULL);
+	if (IS_ERR(file)) {
+		*socket = NULL;
+		err = PTR_ERR(file);
+		goto out;
+	}
+
+	init_completion(&wait.done);
+	wait.status = -ETIMEDOUT;
+	wait.peerid = TLS_NO_PEERID;
+	args.ta_sock = *socket;
+	args.ta_data = &wait;
+	args.ta_timeout_ms = jiffies_to_msecs(timeout);
+	args.ta_peername = peername;
+	err = client ? tls_client_hello_x509(&args, GFP_KERNEL) :
+		tls_server_hello_x509(&args, GFP_KERNEL);
+	if (err) {
+		tr_err(transport, "TLS handshake request failed: %d\n", err);
+		goto out;
+	}
+
+	if (!wait_for_completion_timeout(&wait.done, timeout)) {
+		/* If it cannot be canceled, dtt_tls_done() runs right now */
+		if (!tls_handshake_cancel((*socket)->sk))
+			wait_for_completion(&wait.done);
+	}
+	err = wait.status;
+	if (err) {
+		tr_err(transport, "TLS handshake failed: %d\n", err);
+	} else if (wait.peerid == TLS_NO_PEERID) {
+		tr_err(transport, "TLS handshake: %s did not authenticate\n", peername);
+		err = -EKEYREJECTED;
+	}
+out:
+	kfree(peername);
+	return err;
+}
+
+static int dtt_connect_stripes(struct drbd_tcp_transport *tcp_transport, struct dtt_path *path,
+			       unsigned int nr, bool outgoing)
+{
+	struct drbd_transport *transport = &tcp_transport->transport;
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 1; i < nr; i++) {
+		struct dtt_path *accepted_path = path;
+		struct socket *s = NULL;
+		u16 info = 0;
+		int fp;
+
+		if (outgoing) {
+			err = dtt_try_connect(transport, path, &s, 0);
+			if (err < 0)
+				goto fail;
+			err = dtt_send_first_packet(tcp_transport, s, P_INITIAL_DATA, DATA_STREAM,
+						    DTT_STRIPE_INFO(i, nr));
+			if (err < 0)
+				goto fail_sock;
+			fp = dtt_receive_first_packet(tcp_transport, s, &info);
+		} else {
+			err = dtt_wait_for_connect(transport, path->path.listener, &s, &accepted_path);
+			if (err < 0)
+				goto fail;
+			fp = dtt_receive_first_packet(tcp_transport, s, &info);
+			if (fp == P_INITIAL_DATA && info == DTT_STRIPE_INFO(i, nr))
+				err = dtt_send_first_packet(tcp_transport, s, P_INITIAL_DATA,
+							    DATA_STREAM, info);
+		}
+		if (err < 0)
+			goto fail_sock;
+		if (fp != P_INITIAL_DATA || info != DTT_STRIPE_INFO(i, nr) ||
+		    accepted_path != path) {
+			tr_warn(transport, "Failed to establish data stripe %u of %u\n", i, nr);
+			err = -EAGAIN;
+			goto fail_sock;
+		}
+
+		if (READ_ONCE(dtt_tls)) {
+			err = dtt_tls_handshake(transport, &s, outgoing);
+			if (err < 0)
+				goto fail_sock;
+		}
+
+		stripes->socket[i] = s;
+		stripes->nr = i + 1;
+	}
+
+	stripes->tx_idx = 0;
+	stripes->rx_idx = 0;
+	stripes->rx_left = 0;
+	stripes->rx_hdr_have = 0;
+	return 0;
+
+fail_sock:
+	dtt_socket_free(&s);
+fail:
+	dtt_free_stripes(tcp_transport);
+	return err;
+}
+
 static int dtt_connect(struct drbd_transport *transport)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -905,6 +1797,11 @@ static int dtt_connect(struct drbd_transport *transport)
 	struct dtt_path *connect_to_path, *first_path = NULL;
 	struct socket *dsocket, *csocket;
 	struct net_conf *nc;
+	unsigned int i, nr_stripes = clamp_t(unsigned int, READ_ONCE(dtt_data_stripes), 1, DTT_MAX_STRIPES);
+	u16 peer_stripe_info = 0;
+	u16 tls_info = READ_ONCE(dtt_tls) ? DTT_TLS_INFO : 0;
+	int peer_tls = -1;
+	bool dsocket_outgoing = false, csocket_outgoing = false;
 	int timeout, err;
 	bool ok;
 
@@ -944,14 +1841,19 @@ static int dtt_connect(struct drbd_transport *transport)
 		}
 	}
 
-	drbd_path = list_first_entry(&transport->paths, struct drbd_path, list);
-	connect_to_path = container_of(drbd_path, struct dtt_path, path);
 	spin_unlock(&tcp_transport->paths_lock);
+	connect_to_path = dtt_best_path(tcp_transport, NULL);
+	err = -EDESTADDRREQ;
+	if (!connect_to_path)
+		goto out;
 
 	do {
 		struct socket *s = NULL;
 
-		err = dtt_try_connect(transport, connect_to_path, &s);
+		if (!first_path && READ_ONCE(dtt_parallel_connect))
+			err = dtt_try_connect_parallel(transport, &connect_to_path, &s);
+		else
+			err = dtt_try_connect(transport, connect_to_path, &s, 0);
 		if (err < 0 && err != -EAGAIN)
 			goto out;
 
@@ -980,11 +1882,15 @@ static int dtt_connect(struct drbd_transport *transport)
 
 			if (use_for_data) {
 				dsocket = s;
-				dtt_send_first_packet(tcp_transport, dsocket, P_INITIAL_DATA, DATA_STREAM);
+				dsocket_outgoing = true;
+				dtt_send_first_packet(tcp_transport, dsocket, P_INITIAL_DATA, DATA_STREAM,
+					(nr_stripes > 1 ? DTT_STRIPE_INFO(0, nr_stripes) : 0) | tls_info);
 			} else {
 				clear_bit(RESOLVE_CONFLICTS, &transport->flags);
 				csocket = s;
-				dtt_send_first_packet(tcp_transport, csocket, P_INITIAL_META, CONTROL_STREAM);
+				csocket_outgoing = true;
+				dtt_send_first_packet(tcp_transport, csocket, P_INITIAL_META, CONTROL_STREAM,
+						      tls_info);
 			}
 		} else if (!first_path)
 			connect_to_path = dtt_next_path(tcp_transport, connect_to_path);
@@ -999,7 +1905,14 @@ retry:
 			goto out;
 
 		if (s) {
-			int fp = dtt_receive_first_packet(tcp_transport, s);
+			u16 stripe_info = 0;
+			int fp = dtt_receive_first_packet(tcp_transport, s, &stripe_info);
+
+			/* A stripe of a connection the peer considers established already */
+			if (fp == P_INITIAL_DATA && stripe_info >> 8)
+				fp = -EPROTO;
+			if (fp == P_INITIAL_DATA || fp == P_INITIAL_META)
+				peer_tls = !!(stripe_info & DTT_TLS_INFO);
 
 			if (first_path && first_path != connect_to_path) {
 				tr_info(transport, "initial paths crossed P - fail over\n");
@@ -1018,9 +1931,13 @@ retry:
 					kernel_sock_shutdown(dsocket, SHUT_RDWR);
 					sock_release(dsocket);
 					dsocket = s;
+					dsocket_outgoing = false;
+					peer_stripe_info = stripe_info;
 					goto randomize;
 				}
 				dsocket = s;
+				dsocket_outgoing = false;
+				peer_stripe_info = stripe_info;
 				break;
 			case P_INITIAL_META:
 				set_bit(RESOLVE_CONFLICTS, &transport->flags);
@@ -1029,9 +1946,11 @@ retry:
 					kernel_sock_shutdown(csocket, SHUT_RDWR);
 					sock_release(csocket);
 					csocket = s;
+					csocket_outgoing = false;
 					goto randomize;
 				}
 				csocket = s;
+				csocket_outgoing = false;
 				break;
 			default:
 				tr_warn(transport, "Error receiving initial packet\n");
@@ -1050,7 +1969,36 @@ randomize:
 	} while (!ok);
 
 	TR_ASSERT(transport, first_path == connect_to_path);
+
+	if (peer_tls != -1 && peer_tls != !!tls_info) {
+		tr_err(transport, "tls mismatch: peer %s, local %s\n",
+		       peer_tls ? "yes" : "no", tls_info ? "yes" : "no");
+		goto out_eagain;
+	}
+	if (!dsocket_outgoing &&
+	    max_t(unsigned int, peer_stripe_info & DTT_STRIPE_NR_MASK, 1) != nr_stripes) {
+		tr_err(transport, "data_stripes mismatch: peer %u, local %u\n",
+		       max_t(unsigned int, peer_stripe_info & DTT_STRIPE_NR_MASK, 1), nr_stripes);
+		goto out_eagain;
+	}
+	if (READ_ONCE(dtt_tls)) {
+		err = dtt_tls_handshake(transport, &dsocket, dsocket_outgoing);
+		if (!err)
+			err = dtt_tls_handshake(transport, &csocket, csocket_outgoing);
+		if (err < 0)
+			goto out;
+	}
+
+	tcp_transport->stripes.socket[0] = dsocket;
+	if (nr_stripes > 1) {
+		err = dtt_connect_stripes(tcp_transport, connect_to_path, nr_stripes, dsocket_outgoing);
+		if (err < 0)
+			goto out;
+	}
+
 	connect_to_path->path.established = true;
+	connect_to_path->failures = 0;
+	tcp_transport->data_path = connect_to_path;
 	drbd_path_event(transport, &connect_to_path->path, false);
 	dtt_put_listeners(transport);
 
@@ -1066,6 +2014,10 @@ randomize:
 	dsocket->sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
 	csocket->sk->sk_priority = TC_PRIO_INTERACTIVE;
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	WRITE_ONCE(csocket->sk->sk_ll_usec, dtt_control_busy_poll);
+#endif
+
 	/* NOT YET ...
 	 * sock.socket->sk->sk_sndtimeo = transport->net_conf->timeout*HZ/10;
 	 * sock.socket->sk->sk_rcvtimeo = MAX_SCHEDULE_TIMEOUT;
@@ -1074,8 +2026,9 @@ randomize:
 
 	/* we don't want delays.
 	 * we use tcp_sock_set_cork where appropriate, though */
-	tcp_sock_set_nodelay(dsocket->sk);
-	tcp_sock_set_nodelay(csocket->sk);
+	dtt_set_nodelay(dsocket->sk);
+	dtt_set_nodelay(csocket->sk);
+	dtt_set_notsent_lowat(dsocket->sk);
 
 	tcp_transport->stream[DATA_STREAM] = dsocket;
 	tcp_transport->stream[CONTROL_STREAM] = csocket;
@@ -1084,13 +2037,31 @@ randomize:
 	nc = rcu_dereference(transport->net_conf);
 
 	timeout = nc->timeout * HZ / 10;
+	dtt_set_auto_bufsize(tcp_transport, nc);
 	rcu_read_unlock();
 
+	memset(tcp_transport->bufsize_sample, 0, sizeof(tcp_transport->bufsize_sample));
+	tcp_transport->interval_start = jiffies;
+	tcp_transport->path_degraded = 0;
+
 	dsocket->sk->sk_sndtimeo = timeout;
 	csocket->sk->sk_sndtimeo = timeout;
 
 	sock_set_keepalive(dsocket->sk);
 
+	for (i = 1; i < tcp_transport->stripes.nr; i++) {
+		struct sock *sk = tcp_transport->stripes.socket[i]->sk;
+
+		sk->sk_reuse = SK_CAN_REUSE;
+		sk->sk_allocation = GFP_NOIO;
+		sk->sk_use_task_frag = false;
+		sk->sk_priority = TC_PRIO_INTERACTIVE_BULK;
+		dtt_set_nodelay(sk);
+		dtt_set_notsent_lowat(sk);
+		sk->sk_sndtimeo = timeout;
+		sock_set_keepalive(sk);
+	}
+
 	return 0;
 
 out_eagain:
@@ -1099,14 +2070,8 @@ out_eagain:
 out:
 	dtt_put_listeners(transport);
 
-	if (dsocket) {
-		kernel_sock_shutdown(dsocket, SHUT_RDWR);
-		sock_release(dsocket);
-	}
-	if (csocket) {
-		kernel_sock_shutdown(csocket, SHUT_RDWR);
-		sock_release(csocket);
-	}
+	dtt_socket_free(&dsocket);
+	dtt_socket_free(&csocket);
 
 	return err;
 }
@@ -1119,12 +2084,20 @@ static void dtt_net_conf_change(struct drbd_transport *transport, struct net_con
 	struct socket *control_socket = tcp_transport->stream[CONTROL_STREAM];
 
 	if (data_socket) {
+		unsigned int i;
+
 		dtt_setbufsize(data_socket, new_net_conf->sndbuf_size, new_net_conf->rcvbuf_size);
+		for (i = 1; i < tcp_transport->stripes.nr; i++)
+			dtt_setbufsize(tcp_transport->stripes.socket[i],
+				       new_net_conf->sndbuf_size, new_net_conf->rcvbuf_size);
 	}
 
 	if (control_socket) {
 		dtt_setbufsize(control_socket, new_net_conf->sndbuf_size, new_net_conf->rcvbuf_size);
 	}
+
+	/* Unconfigured buffers get sized by the BDP again at the next interval */
+	dtt_set_auto_bufsize(tcp_transport, new_net_conf);
 }
 
 static void dtt_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream, long timeout)
@@ -1132,11 +2105,16 @@ static void dtt_set_rcvtimeo(struct drbd_transport *transport, enum drbd_stream
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int i;
 
 	if (!socket)
 		return;
 
 	socket->sk->sk_rcvtimeo = timeout;
+	if (stream == DATA_STREAM) {
+		for (i = 1; i < tcp_transport->stripes.nr; i++)
+			tcp_transport->stripes.socket[i]->sk->sk_rcvtimeo = timeout;
+	}
 }
 
 static long dtt_get_rcvtimeo(struct drbd_transport *transport, enum drbd_stream stream)
@@ -1155,42 +2133,58 @@ static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream str
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
 	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int i;
+
+	if (!socket || !socket->sk)
+		return false;
 
-	return socket && socket->sk;
+	/* Units are placed round-robin, so the DATA_STREAM is broken as
+	 * soon as any one of its stripes is. */
+	if (stream == DATA_STREAM && stripes->nr > 1) {
+		for (i = 0; i < stripes->nr; i++) {
+			socket = stripes->socket[i];
+			if (!socket || !socket->sk ||
+			    READ_ONCE(socket->sk->sk_state) != TCP_ESTABLISHED)
+				return false;
+		}
+	}
+
+	return true;
 }
 
 static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
 {
-	struct socket *socket = tcp_transport->stream[DATA_STREAM];
-	struct sock *sock;
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
+	unsigned int i;
 
-	if (!socket)
+	if (!tcp_transport->stream[DATA_STREAM])
 		return;
 
-	sock = socket->sk;
-	if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5)
-		set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+	for (i = 0; i < stripes->nr; i++) {
+		struct sock *sock = stripes->socket[i]->sk;
+
+		if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5 &&
+		    !test_and_set_bit(NET_CONGESTED, &tcp_transport->transport.flags))
+			tcp_transport->congested_count++;
+	}
 }
 
-static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
-			 struct page *page, int offset, size_t size, unsigned msg_flags)
+/* Calls sock_sendmsg() until all of msg_iter is sent. With MSG_SPLICE_PAGES the
+ * socket takes references on the pages, as sendpage() did, instead of copying. */
+static int dtt_send_msg_pages(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+			      enum drbd_stream stream, struct msghdr *msg)
 {
-	struct drbd_tcp_transport *tcp_transport =
-		container_of(transport, struct drbd_tcp_transport, transport);
-	struct socket *socket = tcp_transport->stream[stream];
-	int len = size;
+	struct drbd_transport *transport = &tcp_transport->transport;
+	size_t size = msg_data_left(msg);
+	ktime_t start_kt = ktime_get();
 	int err = -EIO;
 
-	if (!socket)
-		return -ENOTCONN;
-
-	msg_flags |= MSG_NOSIGNAL;
-	dtt_update_congested(tcp_transport);
 	do {
 		int sent;
 
-		sent = socket->ops->sendpage(socket, page, offset, len, msg_flags);
+		sent = sock_sendmsg(socket, msg);
 		if (sent <= 0) {
 			if (sent == -EAGAIN) {
 				if (drbd_stream_send_timed_out(transport, stream))
@@ -1198,29 +2192,76 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 				continue;
 			}
 			tr_warn(transport, "%s: size=%d len=%d sent=%d\n",
-			     __func__, (int)size, len, sent);
+			     __func__, (int)size, (int)msg_data_left(msg), sent);
 			if (sent < 0)
 				err = sent;
 			break;
 		}
-		len    -= sent;
-		offset += sent;
 		/* NOTE: it may take up to twice the socket timeout to have it
 		 * return -EAGAIN, the first timeout will likely happen with a
 		 * partial send, masking the timeout.  Maybe we want to export
 		 * drbd_stream_should_continue_after_partial_send(transport, stream)
 		 * and add that to the while() condition below.
 		 */
-	} while (len > 0 /* THINK && peer_device->repl_state[NOW] >= L_ESTABLISHED */);
-	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+	} while (msg_data_left(msg) /* THINK && peer_device->repl_state[NOW] >= L_ESTABLISHED */);
 
-	if (len == 0)
+	dtt_account_send(tcp_transport, stream, size - msg_data_left(msg), start_kt);
+
+	if (!msg_data_left(msg))
 		err = 0;
 
 	return err;
 }
 
-static int dtt_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+static int dtt_send_page_sock(struct drbd_tcp_transport *tcp_transport, struct socket *socket,
+			      enum drbd_stream stream, struct page *page, int offset, size_t size,
+			      unsigned msg_flags)
+{
+	struct msghdr msg = { .msg_flags = msg_flags | MSG_SPLICE_PAGES };
+	struct bio_vec bvec;
+
+	bvec_set_page(&bvec, page, size, offset);
+	iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, &bvec, 1, size);
+
+	return dtt_send_msg_pages(tcp_transport, socket, stream, &msg);
+}
+
+static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct dtt_stripes *stripes = &tcp_transport->stripes;
+	struct socket *socket = tcp_transport->stream[stream];
+	int err;
+
+	if (!socket)
+		return -ENOTCONN;
+
+	msg_flags |= MSG_NOSIGNAL;
+	dtt_update_congested(tcp_transport);
+	dtt_per_interval(tcp_transport);
+	if (stream == DATA_STREAM && stripes->nr > 1) {
+		__be32 unit = cpu_to_be32(size);
+
+		/* Serialized by the DATA_STREAM send mutex of the caller */
+		socket = stripes->socket[stripes->tx_idx];
+		stripes->tx_idx = (stripes->tx_idx + 1) % stripes->nr;
+		err = _dtt_send(tcp_transport, socket, stream, &unit, sizeof(unit),
+				msg_flags | MSG_MORE);
+		if (err != sizeof(unit)) {
+			err = err < 0 ? err : -EIO;
+			goto out;
+		}
+	}
+	err = dtt_send_page_sock(tcp_transport, socket, stream, page, offset, size, msg_flags);
+out:
+	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+
+	return err;
+}
+
+static int dtt_send_zc_bio_pages(struct drbd_transport *transport, struct bio *bio)
 {
 	struct bio_vec bvec;
 	struct bvec_iter iter;
@@ -1237,6 +2278,60 @@ static int dtt_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
 	return 0;
 }
 
+static int dtt_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct msghdr msg = { .msg_flags = MSG_NOSIGNAL | MSG_SPLICE_PAGES };
+	struct bio_vec bvec, *bvecs;
+	struct bvec_iter iter;
+	unsigned int nr_bvec = 0;
+	int err;
+
+	if (!socket)
+		return -ENOTCONN;
+
+	/* A striped DATA_STREAM sends every page as a unit of its own */
+	if (tcp_transport->stripes.nr > 1)
+		return dtt_send_zc_bio_pages(transport, bio);
+
+	/* Hand the whole bio to the socket in one iov_iter, the same way
+	 * the loop driver does it for its requests. */
+	bio_for_each_bvec(bvec, bio, iter)
+		nr_bvec++;
+	bvecs = __bvec_iter_bvec(bio->bi_io_vec, bio->bi_iter);
+	iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, bvecs, nr_bvec, bio->bi_iter.bi_size);
+	msg.msg_iter.iov_offset = bio->bi_iter.bi_bvec_done;
+
+	dtt_update_congested(tcp_transport);
+	dtt_per_interval(tcp_transport);
+	err = dtt_send_msg_pages(tcp_transport, socket, DATA_STREAM, &msg);
+	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+
+	return err;
+}
+
+static void dtt_sock_hint(struct socket *socket, enum drbd_tr_hints hint)
+{
+	switch (hint) {
+	case CORK:
+		dtt_set_cork(socket->sk, true);
+		break;
+	case UNCORK:
+		dtt_set_cork(socket->sk, false);
+		break;
+	case NODELAY:
+		dtt_set_nodelay(socket->sk);
+		break;
+	case QUICKACK:
+		dtt_set_quickack(socket->sk);
+		break;
+	default:
+		break;
+	}
+}
+
 static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
 		enum drbd_tr_hints hint)
 {
@@ -1244,26 +2339,32 @@ static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
 		container_of(transport, struct drbd_tcp_transport, transport);
 	bool rv = true;
 	struct socket *socket = tcp_transport->stream[stream];
+	unsigned int i;
 
 	if (!socket)
 		return false;
 
+	if (stream == DATA_STREAM) {
+		for (i = 1; i < tcp_transport->stripes.nr; i++)
+			dtt_sock_hint(tcp_transport->stripes.socket[i], hint);
+	}
+
 	switch (hint) {
 	case CORK:
-		tcp_sock_set_cork(socket->sk, true);
+		dtt_set_cork(socket->sk, true);
 		break;
 	case UNCORK:
-		tcp_sock_set_cork(socket->sk, false);
+		dtt_set_cork(socket->sk, false);
 		break;
 	case NODELAY:
-		tcp_sock_set_nodelay(socket->sk);
+		dtt_set_nodelay(socket->sk);
 		break;
 	case NOSPACE:
 		if (socket->sk->sk_socket)
 			set_bit(SOCK_NOSPACE, &socket->sk->sk_socket->flags);
 		break;
 	case QUICKACK:
-		tcp_sock_set_quickack(socket->sk, 2);
+		dtt_set_quickack(socket->sk);
 		break;
 	default: /* not implemented, but should not trigger error handling */
 		return true;
@@ -1272,10 +2373,35 @@ static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream,
 	return rv;
 }
 
+static void dtt_debugfs_show_mptcp(struct seq_file *m, struct sock *sk)
+{
+	struct mptcp_info info;
+
+	if (!IS_ENABLED(CONFIG_MPTCP))
+		return;
+
+	/* The mptcp_sock is opaque outside of net/mptcp */
+	mptcp_diag_fill_info((struct mptcp_sock *)sk, &info);
+	seq_printf(m, "mptcp subflows: %u (max %u), local addresses used: %u\n",
+		   info.mptcpi_subflows, info.mptcpi_subflows_max, info.mptcpi_local_addr_used);
+	seq_printf(m, "mptcp addresses signalled: %u, accepted: %u%s\n",
+		   info.mptcpi_add_addr_signal, info.mptcpi_add_addr_accepted,
+		   info.mptcpi_flags & MPTCP_INFO_FLAG_FALLBACK ? ", fell back to TCP" : "");
+}
+
 static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
 {
 	struct sock *sk = socket->sk;
-	struct tcp_sock *tp = tcp_sk(sk);
+	struct tcp_sock *tp;
+
+	if (!dtt_sk_is_tcp(sk)) {
+		seq_printf(m, "send buffer size: %u Byte\n", sk->sk_sndbuf);
+		seq_printf(m, "send buffer used: %u Byte\n", sk->sk_wmem_queued);
+		seq_printf(m, "receive buffer size: %u Byte\n", sk->sk_rcvbuf);
+		dtt_debugfs_show_mptcp(m, sk);
+		return;
+	}
+	tp = tcp_sk(sk);
 
 	seq_printf(m, "unread receive buffer: %u Byte\n",
 		   tp->rcv_nxt - tp->copied_seq);
@@ -1283,16 +2409,50 @@ static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
 		   tp->write_seq - tp->snd_una);
 	seq_printf(m, "send buffer size: %u Byte\n", sk->sk_sndbuf);
 	seq_printf(m, "send buffer used: %u Byte\n", sk->sk_wmem_queued);
+	seq_printf(m, "receive buffer size: %u Byte\n", sk->sk_rcvbuf);
+	seq_printf(m, "srtt: %u us (mdev %u us)\n", tp->srtt_us >> 3, tp->mdev_us >> 2);
+	seq_printf(m, "cwnd: %u, retransmits: %u\n", tp->snd_cwnd, tp->total_retrans);
+}
+
+static void dtt_debugfs_show_send_stats(struct seq_file *m, struct dtt_send_stats *stats)
+{
+	int b;
+
+	seq_printf(m, "sends: %llu (%llu Byte), in send: %llu us\n",
+		   stats->calls, stats->bytes, stats->blocked_ns / NSEC_PER_USEC);
+	seq_puts(m, "send time histogram (us):");
+	for (b = 0; b < DTT_SEND_HIST_BUCKETS - 1; b++)
+		seq_printf(m, " <%u:%u", 1U << b, stats->hist[b]);
+	seq_printf(m, " >=%u:%u", 1U << (b - 1), stats->hist[b]);
+	seq_putc(m, '\n');
 }
 
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
+	struct drbd_path *drbd_path;
 	enum drbd_stream i;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 4);
+
+	seq_printf(m, "congested: %lu times\n", tcp_transport->congested_count);
+	seq_printf(m, "data buffers sized by BDP: send %s, receive %s\n",
+		   tcp_transport->auto_sndbuf ? "yes" : "no",
+		   tcp_transport->auto_rcvbuf ? "yes" : "no");
+
+	spin_lock(&tcp_transport->paths_lock);
+	list_for_each_entry(drbd_path, &transport->paths, list) {
+		struct dtt_path *path = container_of(drbd_path, struct dtt_path, path);
+
+		seq_printf(m, "path %pISpc -> %pISpc%s: rtt %u us, failures %u\n",
+			   &drbd_path->my_addr, &drbd_path->peer_addr,
+			   path == tcp_transport->data_path ? " (established)" : "",
+			   path->rtt_us, path->failures);
+	}
+	spin_unlock(&tcp_transport->paths_lock);
+	seq_putc(m, '\n');
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
 		struct socket *socket = tcp_transport->stream[i];
@@ -1300,6 +2460,16 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 		if (socket) {
 			seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
 			dtt_debugfs_show_stream(m, socket);
+			dtt_debugfs_show_send_stats(m, &tcp_transport->send_stats[i]);
+		}
+	}
+
+	if (tcp_transport->stream[DATA_STREAM]) {
+		unsigned int s;
+
+		for (s = 1; s < tcp_transport->stripes.nr; s++) {
+			seq_printf(m, "data stripe %u\n", s);
+			dtt_debugfs_show_stream(m, tcp_transport->stripes.socket[s]);
 		}
 	}
 
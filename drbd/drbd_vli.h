@@ -13,6 +13,8 @@
 #ifndef _DRBD_VLI_H
 #define _DRBD_VLI_H
 
+#include <asm/unaligned.h>
+
 /*
  * At a granularity of 4KiB storage represented per bit,
  * and stroage sizes of several TiB,
@@ -260,6 +262,13 @@ static inline int bitstream_put_bits(struct bitstream *bs, u64 val, const unsign
 	if (bits < 64)
 		val &= ~0ULL >> (64 - bits);
 
+	/* common case: fits into one (unaligned) 64bit word */
+	if (bs->cur.bit + bits <= 64 && (b + 8) - bs->buf <= bs->buf_len) {
+		put_unaligned_le64(get_unaligned_le64(b) | (val << bs->cur.bit), b);
+		bitstream_cursor_advance(&bs->cur, bits);
+		return bits;
+	}
+
 	*b++ |= (val & 0xff) << bs->cur.bit;
 
 	for (tmp = 8 - bs->cur.bit; tmp < bits; tmp += 8)
@@ -295,6 +304,16 @@ static inline int bitstream_get_bits(struct bitstream *bs, u64 *out, int bits)
 		return 0;
 	}
 
+	/* common case: at least 8 bytes left in the buffer.
+	 * A ninth byte is only needed, and then known to be valid,
+	 * if the requested bits span it. */
+	if ((bs->cur.b + 8) - bs->buf <= bs->buf_len) {
+		val = get_unaligned_le64(bs->cur.b) >> bs->cur.bit;
+		if (bs->cur.bit + bits > 64)
+			val |= (u64)bs->cur.b[8] << (64 - bs->cur.bit);
+		goto mask;
+	}
+
 	/* get the high bits */
 	val = 0;
 	n = (bs->cur.bit + bits + 7) >> 3;
@@ -308,6 +327,7 @@ static inline int bitstream_get_bits(struct bitstream *bs, u64 *out, int bits)
 	/* we still need the low bits */
 	val |= bs->cur.b[0] >> bs->cur.bit;
 
+mask:
 	/* and mask out bits we don't want */
 	val &= ~0ULL >> (64 - bits);
 